@@ -0,0 +1,34 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <ebpf_vm_functions.h>
+
+uint64_t vm_main(void)
+{
+	struct remote_thread threads[2] = {
+		{
+			.target_node = {
+				.access_key = 0,
+				.url = {192, 168, 100, 10, 7, 89}
+			},
+		},
+		{
+			.target_node = {
+				.access_key = 0,
+				.url = {192, 168, 100, 20, 7, 89}
+			},
+		},
+	};
+	
+	start_remote_thread(threads, 2) {
+		/* I am the remote thread with index result */
+		debug_print(result);
+		result = (result + 1) * 1000;
+	}
+	
+	/* I am the parent, wait for both results */
+	fork_join(threads, 2);
+	debug_print(threads[0].result);
+	debug_print(threads[1].result);
+	
+	return 0;
+}
@@ -0,0 +1,25 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <ebpf_vm_functions.h>
+
+VM_MAP(visits, VM_MAP_TYPE_HASH, sizeof(uint64_t), sizeof(uint64_t), 1024);
+VM_MAP(hops, VM_MAP_TYPE_PERCPU_ARRAY, sizeof(uint32_t), sizeof(uint64_t), 1);
+
+uint64_t vm_main(uint64_t key)
+{
+	uint64_t count = 0;
+	uint32_t idx = 0;
+	
+	/* node local counters, every executor the vm visits has its own copy */
+	map_lookup(&visits, &key, &count);
+	count++;
+	map_update(&visits, &key, &count, VM_MAP_ANY);
+	debug_print(count);
+	
+	count = 0;
+	map_lookup(&hops, &idx, &count);
+	count++;
+	map_update(&hops, &idx, &count, VM_MAP_ANY);
+	
+	return 0;
+}
@@ -0,0 +1,25 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <ebpf_vm_functions.h>
+
+uint64_t vm_main(uint64_t local_buf, uint64_t remote_buf, uint64_t len)
+{
+	struct ub_address dst = {
+		.access_key = local_buf,
+		.url = {192, 168, 100, 20, 7, 89}
+	};
+
+	struct ub_address src = {
+		.access_key = remote_buf,
+		.url = {192, 168, 100, 10, 7, 89}
+	};
+	uint64_t done = 0;
+	
+	/* read len bytes from 192.168.100.10 into the local buffer */
+	memcpy(&dst, &src, len, &done, 1);
+	monitor_address(MONITOR_T_NOT_EQUAL_VALUE, (uint64_t)&done, 0, 0);
+	wait_for_address_event();
+	debug_print(done);
+	
+	return 0;
+}
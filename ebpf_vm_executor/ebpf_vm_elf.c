@@ -9,7 +9,10 @@
 #include <fcntl.h>
 #include <libelf.h>
 
+#define PKT_VM_EXECUTOR 1
+
 #include "ebpf_vm_simulator.h"
+#include "ebpf_vm_functions.h"
 
 enum {
 	MP_ELF_SCN_SYMB,
@@ -18,6 +21,31 @@ enum {
 	MP_ELF_SCN_MAX
 };
 
+#define MP_ELF_MAX_DATA_SCN 16
+#define MP_ELF_DATA_ALIGN 8
+#define MP_ELF_STACK_SIZE_SYMB "vm_stack_size"
+#define MP_ELF_MAPS_SCN ".maps"
+
+#ifndef R_BPF_64_ABS64
+#define R_BPF_64_ABS64 2
+#endif
+#ifndef R_BPF_64_ABS32
+#define R_BPF_64_ABS32 3
+#endif
+
+/*
+ * .rodata, .data and .bss sections are laid out back to back at the start of
+ * the data region of every instance, so their addresses are vm addresses of
+ * the first page table entry and stay valid when the vm migrates.
+ */
+struct mp_elf_data_scn {
+	Elf_Scn *scn;
+	Elf64_Shdr *hdr;
+	const Elf_Data *data;
+	const Elf_Data *rel;
+	uint32_t offset;
+};
+
 struct mp_elf_context {
 	Elf *elf;
 	Elf64_Ehdr *elf_hdr;
@@ -26,41 +54,83 @@ struct mp_elf_context {
 		Elf64_Shdr *hdr;
 		const Elf_Data *data;
 	} scn[MP_ELF_SCN_MAX];
+	/* open addressing table of symbol index + 1, keyed by name */
+	uint32_t *symb_hash;
+	uint32_t symb_hash_size;
+	struct ebpf_helper_table *helpers;
+	struct mp_elf_data_scn data_scn[MP_ELF_MAX_DATA_SCN];
+	int data_scn_num;
+	uint32_t globals_size;
 };
 
-static Elf64_Sym *get_symbol_by_name(struct mp_elf_context *ctx, const char *name)
+static uint32_t hash_symbol_name(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	
+	while (*name != '\0') {
+		hash = (hash ^ (uint8_t)*name++) * 16777619u;
+	}
+	
+	return hash;
+}
+
+static const char *get_symbol_name(struct mp_elf_context *ctx, Elf64_Sym *symb)
+{
+	return elf_strptr(ctx->elf, ctx->elf_hdr->e_shstrndx, symb->st_name);
+}
+
+static int build_symbol_hash(struct mp_elf_context *ctx)
 {
 	Elf64_Sym *symbs = ctx->scn[MP_ELF_SCN_SYMB].data->d_buf;
 	int symbs_num = ctx->scn[MP_ELF_SCN_SYMB].hdr->sh_size / ctx->scn[MP_ELF_SCN_SYMB].hdr->sh_entsize;
+	uint32_t size = 16;
+	
+	while (size < 2 * symbs_num) {
+		size <<= 1;
+	}
+	
+	ctx->symb_hash = calloc(size, sizeof(*ctx->symb_hash));
+	if (ctx->symb_hash == NULL) {
+		return -1;
+	}
+	ctx->symb_hash_size = size;
 	
 	for (int idx = 0; idx < symbs_num; idx++) {
-		const char *symb_name = elf_strptr(ctx->elf, ctx->elf_hdr->e_shstrndx, symbs[idx].st_name);
-		if (strcmp(symb_name, name) == 0) {
-			return &symbs[idx];
+		const char *symb_name = get_symbol_name(ctx, &symbs[idx]);
+		uint32_t slot;
+		
+		if ((symb_name == NULL) || (symb_name[0] == '\0')) {
+			continue;
+		}
+		
+		/* the first definition of a name wins, as with the linear scan */
+		for (slot = hash_symbol_name(symb_name) & (size - 1); ctx->symb_hash[slot] != 0; slot = (slot + 1) & (size - 1)) {
+			if (strcmp(get_symbol_name(ctx, &symbs[ctx->symb_hash[slot] - 1]), symb_name) == 0) {
+				break;
+			}
+		}
+		
+		if (ctx->symb_hash[slot] == 0) {
+			ctx->symb_hash[slot] = idx + 1;
 		}
 	}
 	
-	return NULL;
+	return 0;
 }
 
-static uint32_t get_func_idx_by_name(struct ebpf_vm *vm, const char *symb_name)
+static Elf64_Sym *get_symbol_by_name(struct mp_elf_context *ctx, const char *name)
 {
-	struct ebpf_symbol *symb = NULL;
-	int idx;
-	
-	if (vm->rd.symbols == NULL) {
-		return PKT_VM_INVALID_FUNC_IDX;
-	}
+	Elf64_Sym *symbs = ctx->scn[MP_ELF_SCN_SYMB].data->d_buf;
+	uint32_t mask = ctx->symb_hash_size - 1;
 	
-	for (idx = 0, symb = &vm->rd.symbols[idx];
-		 (symb->name != NULL) && (idx < PKT_VM_MAX_SYMBS);
-		 symb = &vm->rd.symbols[++idx]) {
-		if (strcmp(symb->name, symb_name) == 0) {
-			return idx;
+	for (uint32_t slot = hash_symbol_name(name) & mask; ctx->symb_hash[slot] != 0; slot = (slot + 1) & mask) {
+		Elf64_Sym *symb = &symbs[ctx->symb_hash[slot] - 1];
+		if (strcmp(get_symbol_name(ctx, symb), name) == 0) {
+			return symb;
 		}
 	}
 	
-	return PKT_VM_INVALID_FUNC_IDX;
+	return NULL;
 }
 
 static int32_t get_function_offset(struct mp_elf_context *ctx, const char *func_name)
@@ -74,27 +144,269 @@ static int32_t get_function_offset(struct mp_elf_context *ctx, const char *func_
 	return symb->st_value / sizeof(struct ebpf_instruction);
 }
 
-static void do_relocation(struct ebpf_vm *vm, struct mp_elf_context *ctx)
+/* functions of .text, named in profiles of the program */
+static int set_func_symbols(struct mp_elf_context *ctx, struct vm_code_segment *seg)
+{
+	Elf64_Sym *symbs = ctx->scn[MP_ELF_SCN_SYMB].data->d_buf;
+	int symbs_num = ctx->scn[MP_ELF_SCN_SYMB].hdr->sh_size / ctx->scn[MP_ELF_SCN_SYMB].hdr->sh_entsize;
+	uint32_t code_shndx = elf_ndxscn(ctx->scn[MP_ELF_SCN_CODE].scn);
+	struct vm_func_symbol *funcs = NULL;
+	uint32_t num = 0;
+	int ret;
+	
+	funcs = calloc(symbs_num, sizeof(*funcs));
+	if (funcs == NULL) {
+		return -1;
+	}
+	
+	for (int idx = 0; idx < symbs_num; idx++) {
+		const char *name = get_symbol_name(ctx, &symbs[idx]);
+		
+		if ((ELF64_ST_TYPE(symbs[idx].st_info) != STT_FUNC) || (symbs[idx].st_shndx != code_shndx) ||
+			(name == NULL) || (name[0] == '\0')) {
+			continue;
+		}
+		
+		snprintf(funcs[num].name, sizeof(funcs[num].name), "%s", name);
+		funcs[num].start = symbs[idx].st_value / sizeof(struct ebpf_instruction);
+		funcs[num].size = symbs[idx].st_size / sizeof(struct ebpf_instruction);
+		num++;
+	}
+	
+	ret = vm_code_set_symbols(seg, funcs, num);
+	free(funcs);
+	return ret;
+}
+
+static struct mp_elf_data_scn *get_data_scn(struct mp_elf_context *ctx, uint32_t shndx)
+{
+	for (int idx = 0; idx < ctx->data_scn_num; idx++) {
+		if (elf_ndxscn(ctx->data_scn[idx].scn) == shndx) {
+			return &ctx->data_scn[idx];
+		}
+	}
+	
+	return NULL;
+}
+
+static int get_data_address(struct mp_elf_context *ctx, Elf64_Sym *symb, uint64_t *va)
+{
+	struct mp_elf_data_scn *data_scn = get_data_scn(ctx, symb->st_shndx);
+	
+	if (data_scn == NULL) {
+		return -1;
+	}
+	
+	*va = data_scn->offset + symb->st_value;
+	return 0;
+}
+
+static int do_relocation(struct ebpf_instruction *code, uint32_t code_size, struct mp_elf_context *ctx)
 {
 	Elf64_Sym *symbs = ctx->scn[MP_ELF_SCN_SYMB].data->d_buf;
 	Elf64_Rel *reloc_entry = ctx->scn[MP_ELF_SCN_CODE_REL].data->d_buf;
 	int num_reloc_entry = ctx->scn[MP_ELF_SCN_CODE_REL].data->d_size / sizeof(Elf64_Rel);
+	uint32_t num = code_size / sizeof(struct ebpf_instruction);
 	
 	for (int idx = 0; idx < num_reloc_entry; idx++) {
 		int32_t ins_offset = reloc_entry[idx].r_offset / sizeof(struct ebpf_instruction);
 		int sym_idx = ELF64_R_SYM(reloc_entry[idx].r_info);
-		const char *symb_name = elf_strptr(ctx->elf, ctx->elf_hdr->e_shstrndx, symbs[sym_idx].st_name);
+		const char *symb_name = get_symbol_name(ctx, &symbs[sym_idx]);
+		
+		if (ins_offset >= num) {
+			printf("Relocation out of code, offset = %d\n", ins_offset);
+			return -1;
+		}
+		
+		if (ELF64_R_TYPE(reloc_entry[idx].r_info) == R_BPF_64_64) {
+			/* lddw of a global, the instruction already holds the addend */
+			uint64_t va;
+			
+			if ((ins_offset + 1 >= num) || (code[ins_offset].opcode != (EBPF_CLS_LD | EBPF_IMM | EBPF_DW)) ||
+				(get_data_address(ctx, &symbs[sym_idx], &va) != 0)) {
+				printf("Failed to relocate %s at instruction %d\n", symb_name, ins_offset);
+				return -1;
+			}
+			
+			va += (uint32_t)code[ins_offset].immediate;
+			code[ins_offset].immediate = (uint32_t)va;
+			code[ins_offset + 1].immediate = (uint32_t)(va >> 32);
+			continue;
+		}
+		
         int32_t func_offset = get_function_offset(ctx, symb_name);
         if (func_offset >= 0) {
             /*Local function call has higher priority*/
-            (ebpf_vm_code(vm))[ins_offset].immediate = (func_offset - ins_offset - 1);
+            code[ins_offset].immediate = (func_offset - ins_offset - 1);
         } else {
-            uint32_t func_idx = get_func_idx_by_name(vm, symb_name);
+            uint32_t func_idx = ebpf_helper_lookup(ctx->helpers, symb_name);
             if (func_idx != PKT_VM_INVALID_FUNC_IDX) {
-                (ebpf_vm_code(vm))[ins_offset].immediate = func_idx;
+                /* extern calls are emitted as pseudo calls */
+                code[ins_offset].src_reg = 0;
+                code[ins_offset].immediate = func_idx;
+            } else {
+                printf("Unresolved function %s at instruction %d\n", symb_name, ins_offset);
+                return -1;
             }
         }
 	}
+	
+	return 0;
+}
+
+/* pointers stored in initialized data, e.g. tables of strings */
+static int do_data_relocation(uint8_t *globals, struct mp_elf_data_scn *data_scn, struct mp_elf_context *ctx)
+{
+	Elf64_Sym *symbs = ctx->scn[MP_ELF_SCN_SYMB].data->d_buf;
+	Elf64_Rel *reloc_entry = data_scn->rel->d_buf;
+	int num_reloc_entry = data_scn->rel->d_size / sizeof(Elf64_Rel);
+	
+	for (int idx = 0; idx < num_reloc_entry; idx++) {
+		uint64_t offset = reloc_entry[idx].r_offset;
+		int type = ELF64_R_TYPE(reloc_entry[idx].r_info);
+		uint8_t *loc = globals + data_scn->offset + offset;
+		uint64_t va;
+		
+		if ((get_data_address(ctx, &symbs[ELF64_R_SYM(reloc_entry[idx].r_info)], &va) != 0) ||
+			(offset + ((type == R_BPF_64_ABS32) ? 4 : 8) > data_scn->hdr->sh_size)) {
+			printf("Failed to relocate data at offset %lu\n", offset);
+			return -1;
+		}
+		
+		if (type == R_BPF_64_ABS64) {
+			uint64_t addend;
+			
+			memcpy(&addend, loc, sizeof(addend));
+			va += addend;
+			memcpy(loc, &va, sizeof(va));
+		} else if (type == R_BPF_64_ABS32) {
+			uint32_t addend, va32;
+			
+			memcpy(&addend, loc, sizeof(addend));
+			va32 = (uint32_t)(va + addend);
+			memcpy(loc, &va32, sizeof(va32));
+		} else {
+			printf("Unsupported data relocation type %d\n", type);
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+static int is_data_section(const char *name)
+{
+	const char *prefixes[] = {".rodata", ".data", ".bss", MP_ELF_MAPS_SCN};
+	
+	for (int idx = 0; idx < sizeof(prefixes) / sizeof(prefixes[0]); idx++) {
+		size_t len = strlen(prefixes[idx]);
+		
+		if ((strncmp(name, prefixes[idx], len) == 0) && ((name[len] == '\0') || (name[len] == '.'))) {
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+static int add_data_section(struct mp_elf_context *ctx, Elf_Scn *scn, Elf64_Shdr *hdr)
+{
+	struct mp_elf_data_scn *data_scn = NULL;
+	uint64_t align = (hdr->sh_addralign > MP_ELF_DATA_ALIGN) ? hdr->sh_addralign : MP_ELF_DATA_ALIGN;
+	uint64_t offset = (ctx->globals_size + align - 1) & ~(align - 1);
+	
+	if ((ctx->data_scn_num >= MP_ELF_MAX_DATA_SCN) || (offset + hdr->sh_size > UINT16_MAX)) {
+		printf("Too many or too large data sections\n");
+		return -1;
+	}
+	
+	data_scn = &ctx->data_scn[ctx->data_scn_num++];
+	data_scn->scn = scn;
+	data_scn->hdr = hdr;
+	data_scn->data = (hdr->sh_type == SHT_NOBITS) ? NULL : elf_getdata(scn, NULL);
+	data_scn->offset = (uint32_t)offset;
+	ctx->globals_size = (uint32_t)(offset + hdr->sh_size);
+	return 0;
+}
+
+/* initial contents of all data sections, .bss and the padding stay zero */
+static uint8_t *load_globals(struct mp_elf_context *ctx)
+{
+	uint8_t *globals = calloc(1, ctx->globals_size);
+	
+	if (globals == NULL) {
+		printf("Failed to allocate globals\n");
+		return NULL;
+	}
+	
+	for (int idx = 0; idx < ctx->data_scn_num; idx++) {
+		struct mp_elf_data_scn *data_scn = &ctx->data_scn[idx];
+		
+		if ((data_scn->data != NULL) && (data_scn->data->d_buf != NULL)) {
+			memcpy(globals + data_scn->offset, data_scn->data->d_buf, data_scn->data->d_size);
+		}
+		
+		if ((data_scn->rel != NULL) && (do_data_relocation(globals, data_scn, ctx) != 0)) {
+			free(globals);
+			return NULL;
+		}
+	}
+	
+	return globals;
+}
+
+/*
+ * Map definitions in .maps are globals like any other, the loader only
+ * stamps each of them with the id of its name for the executor to find it.
+ */
+static int setup_maps(struct mp_elf_context *ctx, uint8_t *globals)
+{
+	Elf64_Sym *symbs = ctx->scn[MP_ELF_SCN_SYMB].data->d_buf;
+	int symbs_num = ctx->scn[MP_ELF_SCN_SYMB].hdr->sh_size / ctx->scn[MP_ELF_SCN_SYMB].hdr->sh_entsize;
+	
+	for (int idx = 0; idx < symbs_num; idx++) {
+		struct mp_elf_data_scn *data_scn = get_data_scn(ctx, symbs[idx].st_shndx);
+		const char *name = get_symbol_name(ctx, &symbs[idx]);
+		struct vm_map_def def;
+		uint64_t va;
+		
+		if ((data_scn == NULL) || (ELF64_ST_TYPE(symbs[idx].st_info) != STT_OBJECT) ||
+			(strcmp(elf_strptr(ctx->elf, ctx->elf_hdr->e_shstrndx, data_scn->hdr->sh_name), MP_ELF_MAPS_SCN) != 0)) {
+			continue;
+		}
+		
+		if ((symbs[idx].st_size != sizeof(def)) || (get_data_address(ctx, &symbs[idx], &va) != 0) ||
+			(symbs[idx].st_value + sizeof(def) > data_scn->hdr->sh_size)) {
+			printf("Invalid map definition %s\n", name);
+			return -1;
+		}
+		
+		memcpy(&def, globals + va, sizeof(def));
+		if ((def.type >= VM_MAP_TYPE_MAX) || (def.key_size == 0) || (def.value_size == 0) || (def.max_entries == 0)) {
+			printf("Invalid map definition %s\n", name);
+			return -1;
+		}
+		
+		def.id = vm_map_id(name);
+		memcpy(globals + va, &def, sizeof(def));
+	}
+	
+	return 0;
+}
+
+/* a program may ask for a bigger stack with "const uint32_t vm_stack_size = ...;" */
+static uint32_t get_stack_size(struct mp_elf_context *ctx, const uint8_t *globals)
+{
+	Elf64_Sym *symb = get_symbol_by_name(ctx, MP_ELF_STACK_SIZE_SYMB);
+	uint32_t stack_size = 0;
+	uint64_t va;
+	
+	if ((symb == NULL) || (symb->st_size != sizeof(stack_size)) || (get_data_address(ctx, symb, &va) != 0)) {
+		return 0;
+	}
+	
+	memcpy(&stack_size, globals + va, sizeof(stack_size));
+	return stack_size;
 }
 
 static int setup_elf_context(struct mp_elf_context *ctx, int32_t fd)
@@ -120,6 +432,25 @@ static int setup_elf_context(struct mp_elf_context *ctx, int32_t fd)
 				ctx->scn[idx].data = elf_getdata(scn, NULL);
 			}
 		}
+		
+		if ((section_hdr->sh_flags & SHF_ALLOC) && !(section_hdr->sh_flags & SHF_EXECINSTR) &&
+			is_data_section(section_name) && (add_data_section(ctx, scn, section_hdr) != 0)) {
+			return -1;
+		}
+	}
+	
+	/* relocations of data sections, found once all of them are known */
+	scn = NULL;
+	while ((scn = elf_nextscn(ctx->elf, scn)) != NULL) {
+		Elf64_Shdr *section_hdr = elf64_getshdr(scn);
+		struct mp_elf_data_scn *data_scn = NULL;
+		
+		if (section_hdr->sh_type == SHT_REL) {
+			data_scn = get_data_scn(ctx, section_hdr->sh_info);
+			if (data_scn != NULL) {
+				data_scn->rel = elf_getdata(scn, NULL);
+			}
+		}
 	}
 	
 	if (ctx->scn[MP_ELF_SCN_SYMB].scn == NULL || ctx->scn[MP_ELF_SCN_CODE].scn == NULL ||
@@ -129,13 +460,17 @@ static int setup_elf_context(struct mp_elf_context *ctx, int32_t fd)
 		return -1;
 	}
 	
-	return 0;
+	return build_symbol_hash(ctx);
 }
 
-struct ebpf_vm *create_vm_from_elf(const char *elf_file_name)
+/* helper calls are linked against helpers, NULL for the global table */
+struct ebpf_vm_program *create_program_from_elf_with_helpers(const char *elf_file_name, struct ebpf_helper_table *helpers)
 {
-	struct ebpf_vm *vm = NULL;
-	struct mp_elf_context ctx = {0};
+	struct ebpf_vm_program *prog = NULL;
+	struct mp_elf_context ctx = {.helpers = helpers};
+	struct ebpf_instruction *code = NULL;
+	uint8_t *globals = NULL;
+	uint32_t code_size, stack_size;
 	int32_t fd, main_offset;
 	
 	fd = open(elf_file_name, O_RDONLY);
@@ -155,23 +490,71 @@ struct ebpf_vm *create_vm_from_elf(const char *elf_file_name)
 		goto exit_clean;
 	}
 	
-	vm = create_vm((uint8_t *)ctx.scn[MP_ELF_SCN_CODE].data->d_buf, (uint32_t)ctx.scn[MP_ELF_SCN_CODE].data->d_size);
-	if (vm == NULL) {
-		printf("Failed to create vm\n");
+	/* relocate a private copy, libelf owns the section data */
+	code_size = (uint32_t)ctx.scn[MP_ELF_SCN_CODE].data->d_size;
+	code = malloc(code_size);
+	if (code == NULL) {
+		printf("Failed to allocate code\n");
 		goto exit_clean;
 	}
+	memcpy(code, ctx.scn[MP_ELF_SCN_CODE].data->d_buf, code_size);
+	
+	if ((ctx.scn[MP_ELF_SCN_CODE_REL].scn != NULL) && (do_relocation(code, code_size, &ctx) != 0)) {
+		goto exit_clean;
+	}
+	
+	if (ctx.globals_size != 0) {
+		globals = load_globals(&ctx);
+		if ((globals == NULL) || (setup_maps(&ctx, globals) != 0)) {
+			goto exit_clean;
+		}
+	}
 	
-	vm->sys_reg[EBPF_SYS_REG_PC] = main_offset;
+	prog = create_program((uint8_t *)code, code_size, main_offset);
+	if (prog == NULL) {
+		printf("Failed to create program\n");
+		goto exit_clean;
+	}
 	
-	if (ctx.scn[MP_ELF_SCN_CODE_REL].scn != NULL) {
-		do_relocation(vm, &ctx);
+	stack_size = (globals != NULL) ? get_stack_size(&ctx, globals) : 0;
+	if ((set_func_symbols(&ctx, prog->code_seg) != 0) ||
+		((globals != NULL) && (program_set_globals(prog, globals, ctx.globals_size) != 0)) ||
+		((stack_size != 0) && (program_set_stack_size(prog, stack_size) != 0))) {
+		destroy_program(prog);
+		prog = NULL;
 	}
 	
 exit_clean:
+	free(globals);
+	free(code);
+	free(ctx.symb_hash);
 	if (ctx.elf != NULL) {
 		elf_end(ctx.elf);
 	}
 	
 	close(fd);
+	return prog;
+}
+
+struct ebpf_vm_program *create_program_from_elf(const char *elf_file_name)
+{
+	return create_program_from_elf_with_helpers(elf_file_name, NULL);
+}
+
+struct ebpf_vm *create_vm_from_elf(const char *elf_file_name)
+{
+	struct ebpf_vm_program *prog = create_program_from_elf(elf_file_name);
+	struct ebpf_vm *vm = NULL;
+	
+	if (prog == NULL) {
+		return NULL;
+	}
+	
+	if (vm_instantiate(prog, 1, &vm, NULL) != 1) {
+		printf("Failed to create vm\n");
+		vm = NULL;
+	}
+	
+	destroy_program(prog);
 	return vm;
-}
\ No newline at end of file
+}
@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "ebpf_vm_simulator.h"
+#include "ebpf_vm_flow.h"
+
+#define ETH_HLEN 14
+#define ETH_P_IPV4 0x0800
+#define ETH_P_IPV6 0x86dd
+#define ETH_P_8021Q 0x8100
+#define ETH_P_8021AD 0x88a8
+
+static uint16_t read_be16(const uint8_t *p)
+{
+	return ((uint16_t)p[0] << 8) | p[1];
+}
+
+/*
+ * Ethernet with up to one vlan tag, IPv4 or IPv6, ports of TCP, UDP and
+ * SCTP. Fragments after the first and other protocols are keyed on the
+ * addresses only. Returns -1 for packets without an IP header.
+ */
+int vm_flow_parse(const struct vm_packet *pkt, struct vm_flow_key *key, uint32_t *reverse)
+{
+	const uint8_t *p = pkt->data;
+	uint32_t len = pkt->len;
+	uint32_t off = ETH_HLEN;
+	uint32_t l4 = 0;
+	uint16_t type, port;
+	uint8_t addr[16];
+	int cmp;
+	
+	if (len < ETH_HLEN) {
+		return -1;
+	}
+	
+	type = read_be16(p + 12);
+	if ((type == ETH_P_8021Q) || (type == ETH_P_8021AD)) {
+		if (len < ETH_HLEN + 4) {
+			return -1;
+		}
+		type = read_be16(p + 16);
+		off += 4;
+	}
+	
+	memset(key, 0, sizeof(*key));
+	if (type == ETH_P_IPV4) {
+		if ((len < off + 20) || ((p[off] & 0xf) < 5)) {
+			return -1;
+		}
+		key->family = 4;
+		key->proto = p[off + 9];
+		memcpy(key->addr[0], p + off + 12, 4);
+		memcpy(key->addr[1], p + off + 16, 4);
+		/* only the first fragment carries the ports */
+		if ((read_be16(p + off + 6) & 0x1fff) == 0) {
+			l4 = off + (p[off] & 0xf) * 4;
+		}
+	} else if (type == ETH_P_IPV6) {
+		if (len < off + 40) {
+			return -1;
+		}
+		key->family = 6;
+		key->proto = p[off + 6];
+		memcpy(key->addr[0], p + off + 8, 16);
+		memcpy(key->addr[1], p + off + 24, 16);
+		l4 = off + 40;
+	} else {
+		return -1;
+	}
+	
+	if ((l4 != 0) && (len >= l4 + 4) && ((key->proto == 6) || (key->proto == 17) || (key->proto == 132))) {
+		key->port[0] = read_be16(p + l4);
+		key->port[1] = read_be16(p + l4 + 2);
+	}
+	
+	cmp = memcmp(key->addr[0], key->addr[1], sizeof(addr));
+	*reverse = (cmp > 0) || ((cmp == 0) && (key->port[0] > key->port[1]));
+	if (*reverse) {
+		memcpy(addr, key->addr[0], sizeof(addr));
+		memcpy(key->addr[0], key->addr[1], sizeof(addr));
+		memcpy(key->addr[1], addr, sizeof(addr));
+		port = key->port[0];
+		key->port[0] = key->port[1];
+		key->port[1] = port;
+	}
+	
+	return 0;
+}
+
+/* 0 and 1 mark empty slots and tombstones */
+static uint32_t flow_hash(const struct vm_flow_key *key)
+{
+	uint32_t hash = (uint32_t)vm_xxhash64(0, key, sizeof(*key));
+	
+	return (hash > VM_FLOW_TOMBSTONE) ? hash : hash + 2;
+}
+
+static struct vm_flow_entry *alloc_entries(uint32_t slots)
+{
+	struct vm_flow_entry *entries = aligned_alloc(sizeof(struct vm_flow_entry), (size_t)slots * sizeof(*entries));
+	
+	if (entries != NULL) {
+		memset(entries, 0, (size_t)slots * sizeof(*entries));
+	}
+	
+	return entries;
+}
+
+static void reset_wheel(struct vm_flow_table *table)
+{
+	for (uint32_t idx = 0; idx < VM_FLOW_WHEEL_SLOTS; idx++) {
+		table->wheel[idx] = VM_FLOW_NONE;
+	}
+}
+
+/* the bucket of the flow's deadline, never one the wheel has already passed */
+static void wheel_insert(struct vm_flow_table *table, uint32_t idx)
+{
+	struct vm_flow_entry *entry = &table->entries[idx];
+	uint64_t tick = (entry->last_ns + table->timeout_ns) / table->tick_ns;
+	uint32_t bucket;
+	
+	if (tick <= table->wheel_tick) {
+		tick = table->wheel_tick + 1;
+	}
+	
+	bucket = tick % VM_FLOW_WHEEL_SLOTS;
+	entry->wheel_next = table->wheel[bucket];
+	table->wheel[bucket] = idx;
+}
+
+struct vm_flow_table *vm_flow_table_create(uint32_t slots, uint32_t timeout_ms)
+{
+	struct vm_flow_table *table = NULL;
+	
+	if (slots == 0) {
+		slots = VM_FLOW_DEFAULT_SLOTS;
+	}
+	if ((slots & (slots - 1)) != 0) {
+		printf("Invalid flow table size %u, it must be a power of 2.\n", slots);
+		return NULL;
+	}
+	if (timeout_ms == 0) {
+		timeout_ms = VM_FLOW_DEFAULT_TIMEOUT_MS;
+	}
+	
+	table = calloc(1, sizeof(*table));
+	if (table == NULL) {
+		printf("Failed to allocate flow table.\n");
+		return NULL;
+	}
+	
+	table->entries = alloc_entries(slots);
+	if (table->entries == NULL) {
+		printf("Failed to allocate %u flow table slots.\n", slots);
+		free(table);
+		return NULL;
+	}
+	
+	table->mask = slots - 1;
+	table->timeout_ns = (uint64_t)timeout_ms * 1000000ULL;
+	table->tick_ns = table->timeout_ns / VM_FLOW_WHEEL_TICKS;
+	if (table->tick_ns == 0) {
+		table->tick_ns = 1;
+	}
+	reset_wheel(table);
+	return table;
+}
+
+void vm_flow_table_destroy(struct vm_flow_table *table)
+{
+	if (table == NULL) {
+		return;
+	}
+	
+	free(table->entries);
+	free(table);
+}
+
+/* drops the tombstones, entries move so the wheel is rebuilt with them */
+static int rebuild(struct vm_flow_table *table)
+{
+	struct vm_flow_entry *old = table->entries;
+	uint32_t slots = table->mask + 1;
+	uint32_t idx;
+	
+	table->entries = alloc_entries(slots);
+	if (table->entries == NULL) {
+		table->entries = old;
+		return -1;
+	}
+	
+	reset_wheel(table);
+	for (uint32_t pos = 0; pos < slots; pos++) {
+		if (old[pos].hash <= VM_FLOW_TOMBSTONE) {
+			continue;
+		}
+	
+		idx = old[pos].hash & table->mask;
+		while (table->entries[idx].hash != VM_FLOW_EMPTY) {
+			idx = (idx + 1) & table->mask;
+		}
+		table->entries[idx] = old[pos];
+		wheel_insert(table, idx);
+	}
+	
+	table->tombstones = 0;
+	free(old);
+	return 0;
+}
+
+/*
+ * Returns the entry of the flow, a new one with no vm yet when created is
+ * set, or NULL when the table is full. The entry is only valid until the
+ * next call.
+ */
+struct vm_flow_entry *vm_flow_find(struct vm_flow_table *table, const struct vm_flow_key *key, uint64_t now_ns,
+	int *created)
+{
+	uint32_t hash = flow_hash(key);
+	uint32_t idx = hash & table->mask;
+	uint32_t free_idx = VM_FLOW_NONE;
+	struct vm_flow_entry *entry = NULL;
+	
+	while (1) {
+		entry = &table->entries[idx];
+		if (entry->hash == VM_FLOW_EMPTY) {
+			break;
+		}
+		if (entry->hash == VM_FLOW_TOMBSTONE) {
+			if (free_idx == VM_FLOW_NONE) {
+				free_idx = idx;
+			}
+		} else if ((entry->hash == hash) && (memcmp(&entry->key, key, sizeof(*key)) == 0)) {
+			*created = 0;
+			return entry;
+		}
+		idx = (idx + 1) & table->mask;
+	}
+	
+	if (table->used >= VM_FLOW_MAX_LOAD(table->mask + 1)) {
+		return NULL;
+	}
+	
+	/* evicted entries are off the wheel already, their slots can be taken again */
+	if (free_idx != VM_FLOW_NONE) {
+		idx = free_idx;
+		entry = &table->entries[idx];
+		table->tombstones--;
+	} else if (table->tombstones >= VM_FLOW_MAX_TOMBSTONES(table->mask + 1)) {
+		if (rebuild(table) != 0) {
+			return NULL;
+		}
+		return vm_flow_find(table, key, now_ns, created);
+	}
+	
+	entry->key = *key;
+	entry->hash = hash;
+	entry->last_ns = now_ns;
+	entry->vm = NULL;
+	wheel_insert(table, idx);
+	table->used++;
+	*created = 1;
+	return entry;
+}
+
+static void evict_entry(struct vm_flow_table *table, struct vm_flow_entry *entry, vm_flow_evict_fn evict, void *arg)
+{
+	evict(arg, entry);
+	entry->hash = VM_FLOW_TOMBSTONE;
+	entry->vm = NULL;
+	table->used--;
+	table->tombstones++;
+}
+
+static void expire_bucket(struct vm_flow_table *table, uint32_t bucket, uint64_t now_ns, vm_flow_evict_fn evict,
+	void *arg)
+{
+	uint32_t idx = table->wheel[bucket];
+	struct vm_flow_entry *entry = NULL;
+	
+	/* flows that saw packets meanwhile go to a later bucket, never back into this one */
+	table->wheel[bucket] = VM_FLOW_NONE;
+	while (idx != VM_FLOW_NONE) {
+		entry = &table->entries[idx];
+		idx = entry->wheel_next;
+		if (entry->last_ns + table->timeout_ns <= now_ns) {
+			evict_entry(table, entry, evict, arg);
+		} else {
+			wheel_insert(table, entry - table->entries);
+		}
+	}
+}
+
+/* turns the wheel to now_ns, a clock that jumped ahead turns it once around */
+void vm_flow_expire(struct vm_flow_table *table, uint64_t now_ns, vm_flow_evict_fn evict, void *arg)
+{
+	uint64_t target = now_ns / table->tick_ns;
+	uint64_t tick;
+	
+	if (target <= table->wheel_tick) {
+		return;
+	}
+	
+	tick = table->wheel_tick + 1;
+	if ((table->wheel_tick == 0) || (target - table->wheel_tick > VM_FLOW_WHEEL_SLOTS)) {
+		tick = target - VM_FLOW_WHEEL_SLOTS + 1;
+	}
+	
+	for (; tick <= target; tick++) {
+		table->wheel_tick = tick;
+		expire_bucket(table, tick % VM_FLOW_WHEEL_SLOTS, now_ns, evict, arg);
+	}
+}
+
+/* evicts every flow, the table is empty afterwards */
+void vm_flow_flush(struct vm_flow_table *table, vm_flow_evict_fn evict, void *arg)
+{
+	for (uint32_t idx = 0; idx <= table->mask; idx++) {
+		if (table->entries[idx].hash > VM_FLOW_TOMBSTONE) {
+			evict_entry(table, &table->entries[idx], evict, arg);
+		}
+		table->entries[idx].hash = VM_FLOW_EMPTY;
+	}
+	
+	table->tombstones = 0;
+	reset_wheel(table);
+}
@@ -0,0 +1,68 @@
+#ifndef _EBPF_VM_FLOW_H_
+#define _EBPF_VM_FLOW_H_
+
+#include <stdint.h>
+#include "ebpf_vm_simulator.h"
+#include "ebpf_vm_packet.h"
+
+/*
+ * Open addressed flow table with linear probing. An entry fills one cache
+ * line, a lookup usually touches one. Evicted entries leave tombstones that
+ * new flows take over or the next rebuild drops.
+ */
+#define VM_FLOW_DEFAULT_SLOTS 65536
+#define VM_FLOW_DEFAULT_TIMEOUT_MS 30000
+/* flows are kept below 3/4 of the slots, tombstones trigger a rebuild at 1/8 */
+#define VM_FLOW_MAX_LOAD(slots) ((slots) / 4 * 3)
+#define VM_FLOW_MAX_TOMBSTONES(slots) ((slots) / 8)
+#define VM_FLOW_EMPTY 0
+#define VM_FLOW_TOMBSTONE 1
+#define VM_FLOW_NONE UINT32_MAX
+/*
+ * Timer wheel with VM_FLOW_WHEEL_TICKS ticks per timeout, so flows expire at
+ * most 1/64 of the timeout late. An entry stays in its bucket when it sees
+ * packets and is only moved when the bucket comes due.
+ */
+#define VM_FLOW_WHEEL_SLOTS 256
+#define VM_FLOW_WHEEL_TICKS 64
+
+/* endpoints are ordered, both directions of a connection share the key */
+struct vm_flow_key {
+	uint8_t addr[2][16];
+	uint16_t port[2];
+	uint8_t proto;
+	uint8_t family;
+	uint16_t reserved;
+};
+
+struct vm_flow_entry {
+	struct vm_flow_key key;
+	uint32_t hash;
+	uint32_t wheel_next;
+	uint64_t last_ns;
+	struct ebpf_vm *vm;
+} __attribute__((aligned(64)));
+
+struct vm_flow_table {
+	struct vm_flow_entry *entries;
+	uint32_t mask;
+	uint32_t used;
+	uint32_t tombstones;
+	uint64_t timeout_ns;
+	uint64_t tick_ns;
+	/* last tick the wheel has been turned to, 0 before the first packet */
+	uint64_t wheel_tick;
+	uint32_t wheel[VM_FLOW_WHEEL_SLOTS];
+};
+
+typedef void (*vm_flow_evict_fn)(void *arg, struct vm_flow_entry *entry);
+
+int vm_flow_parse(const struct vm_packet *pkt, struct vm_flow_key *key, uint32_t *reverse);
+struct vm_flow_table *vm_flow_table_create(uint32_t slots, uint32_t timeout_ms);
+void vm_flow_table_destroy(struct vm_flow_table *table);
+struct vm_flow_entry *vm_flow_find(struct vm_flow_table *table, const struct vm_flow_key *key, uint64_t now_ns,
+	int *created);
+void vm_flow_expire(struct vm_flow_table *table, uint64_t now_ns, vm_flow_evict_fn evict, void *arg);
+void vm_flow_flush(struct vm_flow_table *table, vm_flow_evict_fn evict, void *arg);
+
+#endif
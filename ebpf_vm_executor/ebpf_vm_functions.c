@@ -9,11 +9,12 @@
 
 #include "ebpf_vm_simulator.h"
 #include "ebpf_vm_functions.h"
+#include "ebpf_vm_log.h"
 
 static void address_monitor_list_add(uint64_t type, uint64_t monitor_address, uint64_t value, uint64_t tag, struct ebpf_vm *vm)
 {
 	struct address_monitor_entry *new_entry = NULL;
-	new_entry = calloc(1, sizeof(*new_entry));
+	new_entry = vm_monitor_entry_alloc(vm);
 	if (new_entry == NULL) {
 		return;
 	}
@@ -39,15 +40,28 @@ static struct address_monitor_entry *address_monitor_list_find(struct ebpf_vm *v
 	return NULL;
 }
 
+static int resolve_destination(struct ebpf_vm *vm, struct node_url *dst)
+{
+	struct ebpf_vm_executor *executor = vm->rd.executor;
+	int ret = executor->transport->resolve(executor->transport_ctx, dst);
+	
+	if (ret == PKT_VM_PEER_PENDING) {
+		/* park the vm, the helper is called again once the executor reschedules it */
+		update_vm_state(vm, VM_STATE_WAIT_FOR_PEER);
+	}
+	
+	return ret;
+}
+
 static uint64_t ebpf_func_empty(ARG_NOT_USED_5, struct ebpf_vm *vm)
 {
-	printf("Warning: function is not resolved\n");
+	vm_log_vm(vm, "Warning: function is not resolved");
 	return 0;
 }
 
 static uint64_t ebpf_func_debug_print(uint64_t s, ARG_NOT_USED_4, struct ebpf_vm *vm)
 {
-	printf("vm debug: %ld\n", s);
+	vm_log_vm(vm, "debug: %ld", s);
 	return 0;
 }
 
@@ -56,7 +70,7 @@ static uint64_t ebpf_func_mmap(uint64_t va, uint64_t size, ARG_NOT_USED_3, struc
 	int idx = vm->sys_reg[EBPF_SYS_REG_PAGE_TABLE_IDX];
 	
 	for (uint64_t index = 1; index < BUCKET_ENTRIES; index++) {
-		if (vm->page_table[idx].entries[index].size == 0) {
+		if ((vm->page_table[idx].entries[index].size == 0) && !(vm->rd.reserved_ptes & (1U << index))) {
 			vm->page_table[idx].entries[index].va = va;
 			vm->page_table[idx].entries[index].size = size;
 			return (index << INDEX_SHIFT);
@@ -79,11 +93,21 @@ static uint64_t ebpf_func_wait_for_address_event(ARG_NOT_USED_5, struct ebpf_vm
 			 ((e->type == MONITOR_T_NOT_EQUAL_VALUE) && (*host_va == e->value))) {
 			continue;
 		}
-
+	
+		if ((vm->state.vm_state == VM_STATE_WAIT_FOR_ADDRESS) && (vm->rd.worker != NULL)) {
+			vm->rd.worker->stats.monitor_wakeups++;
+			if (vm->rd.worker->latency != NULL) {
+				vm_hist_record(&vm->rd.worker->latency->hists[VM_LAT_WAKE], vm_now_ns() - vm->rd.wait_start_ns);
+			}
+		}
 		update_vm_state(vm, VM_STATE_RUNNING);
 		return e->tag;
 	}
 	
+	/* the wake latency counts from the first poll that found nothing */
+	if ((vm->state.vm_state != VM_STATE_WAIT_FOR_ADDRESS) && (vm->rd.worker != NULL) && (vm->rd.worker->latency != NULL)) {
+		vm->rd.wait_start_ns = vm_now_ns();
+	}
 	update_vm_state(vm, VM_STATE_WAIT_FOR_ADDRESS);
 	return 0;
 }
@@ -96,13 +120,13 @@ static uint64_t ebpf_func_monitor_address(uint64_t type, uint64_t target_address
 		if (target_address == 0x0) {
 			UB_LIST_FOR_EACH_SAFE(entry, tmp, list, &vm->address_monitor_list) {
 				ub_list_remove(&entry->list);
-				free(entry);
+				vm_monitor_entry_free(vm, entry);
 			}
 			return 0;
 		}
 		if (entry != NULL) {
 			ub_list_remove(&entry->list);
-			free(entry);
+			vm_monitor_entry_free(vm, entry);
 		}
 	} else {
 		if (target_address == 0x0) {
@@ -122,52 +146,97 @@ static uint64_t ebpf_func_monitor_address(uint64_t type, uint64_t target_address
 
 static uint64_t ebpf_func_migrate_to(uint64_t dst, ARG_NOT_USED_4, struct ebpf_vm *vm)
 {
-	struct ebpf_vm_executor *executor = vm->rd.executor;
-	struct transport_message send_msg;
 	struct ub_address *addr = NULL;
-	int ret;
+	struct vm_msg_part parts[2];
+	int num_parts, ret;
+	
+	if ((vm->rd.worker == NULL) || vm->rd.pinned) {
+		vm_log_vm(vm, "This vm cannot migrate.");
+		return (uint64_t)-1;
+	}
 	
-	send_msg.buf = vm;
-	send_msg.buf_size = sizeof(struct ebpf_vm) + vm->code_size + vm->stack_size + vm->data_size;
+	num_parts = vm_image_parts(vm, parts);
 	addr = (struct ub_address *)vm_mmu(dst, vm);
 	
-	ret = executor->transport->send(executor->transport_ctx, (struct node_url *)addr->url, &send_msg);
-	if (ret != send_msg.buf_size) {
-		printf("Failed to migrate vm.");
+	ret = resolve_destination(vm, (struct node_url *)addr->url);
+	if (ret == PKT_VM_PEER_PENDING) {
+		return 0;
+	}
+	
+	if (ret == PKT_VM_PEER_FAILED) {
+		vm_log_vm(vm, "Failed to resolve migration destination.");
+		update_vm_state(vm, VM_STATE_EXIT);
+		return 0;
+	}
+	
+	/* migrated vms are spread over the workers of the destination, the image carries the new hop */
+	vm->rd.hops++;
+	ret = vm_send_msg(vm->rd.worker, (struct node_url *)addr->url, (uint32_t)(vm->rd.id >> VM_ID_WORKER_SHIFT),
+					VM_MSG_MIGRATE, parts, num_parts);
+	if (ret == VM_SEND_BUSY) {
+		/* the vm waits like for an unresolved peer and migrates once the batch is gone */
+		vm->rd.hops--;
+		update_vm_state(vm, VM_STATE_WAIT_FOR_PEER);
+		return 0;
+	}
+	if (ret != 0) {
+		vm_log_vm(vm, "Failed to migrate vm.");
+		vm->rd.hops--;
+	} else {
+		vm->rd.worker->stats.migrations_out++;
+		vm->rd.migrated = 1;
 	}
 	
 	update_vm_state(vm, VM_STATE_EXIT);
+	return 0;
 }
 
 static uint64_t ebpf_func_clone_to(uint64_t dst_list, uint64_t len, ARG_NOT_USED_3, struct ebpf_vm *vm)
 {
-	struct ebpf_vm_executor *executor = vm->rd.executor;
-	struct transport_message send_msg;
 	struct ub_address *target_list = NULL;
+	struct node_url *targets = NULL;
+	int ret;
 	
-	send_msg.buf = vm;
-	send_msg.buf_size = sizeof(struct ebpf_vm) + vm->code_size + vm->stack_size + vm->data_size;
-	target_list = (struct ub_address *)vm_mmu(dst_list, vm);
+	if (len == 0) {
+		return 0;
+	}
+	if (len > VM_MAX_REMOTE_TARGETS) {
+		vm_log_vm(vm, "Cannot clone to %lu targets.", len);
+		return 0;
+	}
 	
-	for (int idx = 0; idx < len; idx++) {
-		struct node_url *dst;
-		int ret;
-		
-		dst = (struct node_url *)target_list[idx].url;
-		vm->reg[0] = idx;
-		ret = executor->transport->send(executor->transport_ctx, dst, &send_msg);
-		if (ret != send_msg.buf_size) {
-			printf("Failed to migrate vm.");
-		}
+	target_list = (struct ub_address *)vm_mmu_range(dst_list, len * sizeof(struct ub_address), vm);
+	if (target_list == (struct ub_address *)PAGE_TABLE_ERROR) {
+		return 0;
+	}
+	
+	targets = malloc(len * sizeof(*targets));
+	if (targets == NULL) {
+		vm_log_vm(vm, "Failed to allocate clone target list.");
+		return 0;
 	}
 	
+	for (uint64_t idx = 0; idx < len; idx++) {
+		memcpy(&targets[idx], target_list[idx].url, sizeof(*targets));
+	}
+	
+	ret = vm_clone_fanout(vm, targets, 0, len);
+	free(targets);
+	
+	if ((ret == PKT_VM_PEER_PENDING) || (ret == VM_SEND_BUSY)) {
+		/* the call is replayed, sub-trees sent already are skipped then */
+		update_vm_state(vm, VM_STATE_WAIT_FOR_PEER);
+		return 0;
+	}
+	
+	update_vm_state(vm, VM_STATE_RUNNING);
 	return len;
 }
 
 static uint64_t ebpf_func_switch_to_address_space(uint64_t asid, ARG_NOT_USED_4, struct ebpf_vm *vm)
 {
-	if (asid >= BUCKET_ENTRIES) {
-		printf("Only 2 address space are supported.");
+	if (asid >= PAGE_TABLE_NUM) {
+		vm_log_vm(vm, "Only %lu address spaces are supported.", (uint64_t)PAGE_TABLE_NUM);
 		return 0;
 	}
 	
@@ -177,19 +246,387 @@ static uint64_t ebpf_func_switch_to_address_space(uint64_t asid, ARG_NOT_USED_4,
 
 static uint64_t ebpf_func_memcpy(uint64_t dst, uint64_t src, uint64_t len, uint64_t completion_addr, uint64_t result, struct ebpf_vm *vm)
 {
-	/*TBD*/
+	struct ub_address *dst_addr = (struct ub_address *)vm_mmu(dst, vm);
+	struct ub_address *src_addr = (struct ub_address *)vm_mmu(src, vm);
+	
+	if ((dst_addr == (struct ub_address *)PAGE_TABLE_ERROR) || (src_addr == (struct ub_address *)PAGE_TABLE_ERROR)) {
+		return -1;
+	}
+	
+	/* the copy completes asynchronously by storing result into completion_addr */
+	return vm_remote_memcpy(vm, dst_addr, src_addr, len, completion_addr, result);
+}
+
+static uint64_t ebpf_func_fork_to(uint64_t thread_list, uint64_t len, ARG_NOT_USED_3, struct ebpf_vm *vm)
+{
+	struct ebpf_vm_executor *executor = vm->rd.executor;
+	struct remote_thread *threads = NULL;
+	struct vm_fork_context fork;
+	struct vm_msg_part parts[3];
+	int num_parts, ret;
+	
+	if (len == 0) {
+		return 0;
+	}
+	if (len > VM_MAX_REMOTE_TARGETS) {
+		vm_log_vm(vm, "Cannot fork to %lu threads.", len);
+		return 0;
+	}
+	
+	/* the whole list is read and written below, not only its first entry */
+	threads = (struct remote_thread *)vm_mmu_range(thread_list, len * sizeof(struct remote_thread), vm);
+	if (threads == (struct remote_thread *)PAGE_TABLE_ERROR) {
+		return 0;
+	}
+	
+	/* resolve every target first so that a parked vm never forks a child twice */
+	for (uint64_t idx = 0; idx < len; idx++) {
+		if (resolve_destination(vm, (struct node_url *)threads[idx].target_node.url) == PKT_VM_PEER_PENDING) {
+			return 0;
+		}
+	}
+	
+	/* a replayed call continues with the children it did not send yet */
+	if (vm->rd.sends_done == 0) {
+		vm->rd.fork_count = len;
+		vm->rd.join_count = 0;
+		vm->rd.join_deadline_ns = 0;
+	}
+	
+	fork.parent = executor->self_url;
+	fork.parent_id = vm->rd.id;
+	fork.parent_worker = vm->rd.worker->index;
+	fork.reserved = 0;
+	fork.thread_list = thread_list;
+	parts[0].buf = &fork;
+	parts[0].size = sizeof(fork);
+	num_parts = 1 + vm_image_parts(vm, &parts[1]);
+	
+	for (uint64_t idx = vm->rd.sends_done; idx < len; idx++) {
+		threads[idx].id = idx;
+		threads[idx].result = 0;
+		fork.index = idx;
+		vm->reg[0] = idx;
+	
+		ret = vm_send_msg(vm->rd.worker, (struct node_url *)threads[idx].target_node.url, idx, VM_MSG_FORK, parts,
+						num_parts);
+		if (ret == VM_SEND_BUSY) {
+			vm->rd.sends_done = idx;
+			update_vm_state(vm, VM_STATE_WAIT_FOR_PEER);
+			return 0;
+		}
+		if (ret != 0) {
+			/* a child that never left counts as returned, fork_join() need not wait for it */
+			vm_log_vm(vm, "Failed to fork vm.");
+			threads[idx].result = (uint64_t)-1;
+			vm->rd.join_count++;
+		} else {
+			vm->rd.worker->stats.forks_out++;
+		}
+	}
+	
+	vm->rd.sends_done = 0;
+	update_vm_state(vm, VM_STATE_RUNNING);
+	return len;
+}
+
+static uint64_t ebpf_func_fork_return(uint64_t result, ARG_NOT_USED_4, struct ebpf_vm *vm)
+{
+	struct vm_fork_context *fork = &vm->rd.fork;
+	struct vm_fork_return ret;
+	struct vm_msg_part part;
+	
+	if (fork->parent.ip == 0) {
+		/* not a forked vm, there is nobody to return to */
+		update_vm_state(vm, VM_STATE_EXIT);
+		return 0;
+	}
+	
+	switch (resolve_destination(vm, &fork->parent)) {
+	case PKT_VM_PEER_PENDING:
+		return 0;
+	case PKT_VM_PEER_FAILED:
+		vm_log_vm(vm, "Failed to resolve fork parent.");
+		update_vm_state(vm, VM_STATE_EXIT);
+		return 0;
+	default:
+		break;
+	}
+	
+	ret.parent_id = fork->parent_id;
+	ret.thread_list = fork->thread_list;
+	ret.index = fork->index;
+	ret.result = result;
+	ret.parent_worker = fork->parent_worker;
+	ret.reserved = 0;
+	part.buf = &ret;
+	part.size = sizeof(ret);
+	
+	/* the parent vm cannot move while it waits, its worker gets the result */
+	switch (vm_send_msg(vm->rd.worker, &fork->parent, fork->parent_worker, VM_MSG_FORK_RETURN, &part, 1)) {
+	case 0:
+		break;
+	case VM_SEND_BUSY:
+		update_vm_state(vm, VM_STATE_WAIT_FOR_PEER);
+		return 0;
+	default:
+		vm_log_vm(vm, "Failed to return fork result.");
+		break;
+	}
+	
+	update_vm_state(vm, VM_STATE_EXIT);
 	return 0;
 }
 
+/* -1 when not every child returned within VM_FORK_JOIN_TIMEOUT_MS, the results of those stay 0 */
+static uint64_t ebpf_func_fork_join(uint64_t thread_list, uint64_t len, ARG_NOT_USED_3, struct ebpf_vm *vm)
+{
+	uint64_t now_ns;
+	
+	/* results are written into the thread list by the executor as they arrive */
+	if (vm->rd.join_count < len) {
+		now_ns = vm_now_ns();
+		if (vm->rd.join_deadline_ns == 0) {
+			vm->rd.join_deadline_ns = now_ns + VM_FORK_JOIN_TIMEOUT_MS * 1000000ULL;
+		} else if (now_ns >= vm->rd.join_deadline_ns) {
+			vm_log_vm(vm, "Fork join timed out, %lu of %lu children returned.", vm->rd.join_count, len);
+			/* late results would count towards the next join */
+			vm->rd.fork_count = 0;
+			vm->rd.join_deadline_ns = 0;
+			update_vm_state(vm, VM_STATE_RUNNING);
+			return (uint64_t)-1;
+		}
+		update_vm_state(vm, VM_STATE_WAIT_FOR_JOIN);
+		return 0;
+	}
+	
+	vm->rd.join_deadline_ns = 0;
+	update_vm_state(vm, VM_STATE_RUNNING);
+	return len;
+}
+
+/* host address of len bytes of vm memory, NULL unless all of them are mapped */
+static void *vm_buffer(struct ebpf_vm *vm, uint64_t va, uint64_t len)
+{
+	uint64_t start = vm_mmu_range(va, len, vm);
+	
+	if (start == PAGE_TABLE_ERROR) {
+		return NULL;
+	}
+	
+	return (void *)start;
+}
+
+static struct vm_map *get_vm_map(struct ebpf_vm *vm, uint64_t map_def)
+{
+	struct vm_map_def *def = vm_buffer(vm, map_def, sizeof(*def));
+	
+	if ((def == NULL) || (vm->rd.executor == NULL)) {
+		return NULL;
+	}
+	
+	return vm_executor_map(vm->rd.executor, def);
+}
+
+static uint32_t vm_cpu(struct ebpf_vm *vm)
+{
+	return (vm->rd.worker != NULL) ? vm->rd.worker->index : 0;
+}
+
+static uint64_t ebpf_func_map_lookup(uint64_t map_def, uint64_t key, uint64_t value, ARG_NOT_USED_2, struct ebpf_vm *vm)
+{
+	struct vm_map *map = get_vm_map(vm, map_def);
+	void *key_buf, *value_buf;
+	
+	if (map == NULL) {
+		return VM_MAP_FAILED;
+	}
+	
+	key_buf = vm_buffer(vm, key, map->key_size);
+	value_buf = vm_buffer(vm, value, map->value_size);
+	if ((key_buf == NULL) || (value_buf == NULL)) {
+		return VM_MAP_FAILED;
+	}
+	
+	return (vm_map_lookup(map, key_buf, value_buf, vm_cpu(vm)) == 0) ? 0 : VM_MAP_FAILED;
+}
+
+static uint64_t ebpf_func_map_update(uint64_t map_def, uint64_t key, uint64_t value, uint64_t flags, ARG_NOT_USED_1, struct ebpf_vm *vm)
+{
+	struct vm_map *map = get_vm_map(vm, map_def);
+	void *key_buf, *value_buf;
+	
+	if (map == NULL) {
+		return VM_MAP_FAILED;
+	}
+	
+	key_buf = vm_buffer(vm, key, map->key_size);
+	value_buf = vm_buffer(vm, value, map->value_size);
+	if ((key_buf == NULL) || (value_buf == NULL)) {
+		return VM_MAP_FAILED;
+	}
+	
+	return (vm_map_update(map, key_buf, value_buf, flags, vm_cpu(vm)) == 0) ? 0 : VM_MAP_FAILED;
+}
+
+static uint64_t ebpf_func_map_delete(uint64_t map_def, uint64_t key, ARG_NOT_USED_3, struct ebpf_vm *vm)
+{
+	struct vm_map *map = get_vm_map(vm, map_def);
+	void *key_buf = NULL;
+	
+	if (map == NULL) {
+		return VM_MAP_FAILED;
+	}
+	
+	key_buf = vm_buffer(vm, key, map->key_size);
+	if (key_buf == NULL) {
+		return VM_MAP_FAILED;
+	}
+	
+	return (vm_map_delete(map, key_buf) == 0) ? 0 : VM_MAP_FAILED;
+}
+
+static uint64_t ebpf_func_mem_cmp(uint64_t a, uint64_t b, uint64_t len, ARG_NOT_USED_2, struct ebpf_vm *vm)
+{
+	void *a_buf, *b_buf;
+	int ret;
+	
+	if (len == 0) {
+		return 0;
+	}
+	
+	a_buf = vm_buffer(vm, a, len);
+	b_buf = vm_buffer(vm, b, len);
+	if ((a_buf == NULL) || (b_buf == NULL)) {
+		return VM_MEM_FAULT;
+	}
+	
+	/* libc already dispatches to the widest vector unit available */
+	ret = memcmp(a_buf, b_buf, len);
+	return (int64_t)((ret > 0) - (ret < 0));
+}
+
+static uint64_t ebpf_func_mem_set(uint64_t dst, uint64_t c, uint64_t len, ARG_NOT_USED_2, struct ebpf_vm *vm)
+{
+	void *dst_buf = NULL;
+	
+	if (len == 0) {
+		return 0;
+	}
+	
+	dst_buf = vm_buffer(vm, dst, len);
+	if (dst_buf == NULL) {
+		return VM_MEM_FAULT;
+	}
+	
+	memset(dst_buf, (int)c, len);
+	return 0;
+}
+
+static uint64_t ebpf_func_mem_copy(uint64_t dst, uint64_t src, uint64_t len, ARG_NOT_USED_2, struct ebpf_vm *vm)
+{
+	void *dst_buf, *src_buf;
+	
+	if (len == 0) {
+		return 0;
+	}
+	
+	dst_buf = vm_buffer(vm, dst, len);
+	src_buf = vm_buffer(vm, src, len);
+	if ((dst_buf == NULL) || (src_buf == NULL)) {
+		return VM_MEM_FAULT;
+	}
+	
+	memmove(dst_buf, src_buf, len);
+	return 0;
+}
+
+static uint64_t ebpf_func_crc32c(uint64_t buf, uint64_t len, uint64_t seed, ARG_NOT_USED_2, struct ebpf_vm *vm)
+{
+	void *host_buf = NULL;
+	
+	if (len == 0) {
+		return (uint32_t)seed;
+	}
+	
+	host_buf = vm_buffer(vm, buf, len);
+	if (host_buf == NULL) {
+		return VM_MEM_FAULT;
+	}
+	
+	return vm_crc32c((uint32_t)seed, host_buf, len);
+}
+
+static uint64_t ebpf_func_xxhash64(uint64_t buf, uint64_t len, uint64_t seed, ARG_NOT_USED_2, struct ebpf_vm *vm)
+{
+	void *host_buf = NULL;
+	
+	if (len == 0) {
+		return vm_xxhash64(seed, NULL, 0);
+	}
+	
+	host_buf = vm_buffer(vm, buf, len);
+	if (host_buf == NULL) {
+		return VM_MEM_FAULT;
+	}
+	
+	return vm_xxhash64(seed, host_buf, len);
+}
+
+static uint64_t ebpf_func_mem_search(uint64_t buf, uint64_t len, uint64_t patterns, uint64_t num, uint64_t match,
+	struct ebpf_vm *vm)
+{
+	struct vm_search_pattern *host_patterns = NULL;
+	uint32_t *host_match = NULL;
+	void *host_buf = NULL;
+	int64_t ret;
+	
+	if ((len == 0) || (num == 0)) {
+		return VM_SEARCH_NOT_FOUND;
+	}
+	
+	if (num > VM_SEARCH_MAX_PATTERNS) {
+		return VM_MEM_FAULT;
+	}
+	
+	host_buf = vm_buffer(vm, buf, len);
+	host_patterns = vm_buffer(vm, patterns, num * sizeof(*host_patterns));
+	host_match = vm_buffer(vm, match, sizeof(*host_match));
+	if ((host_buf == NULL) || (host_patterns == NULL) || (host_match == NULL)) {
+		return VM_MEM_FAULT;
+	}
+	
+	ret = vm_mem_search(host_buf, len, host_patterns, num, host_match);
+	return (ret < 0) ? VM_SEARCH_NOT_FOUND : (uint64_t)ret;
+}
+
+#define ARGS(...) (sizeof((uint8_t[]){__VA_ARGS__})), {__VA_ARGS__}
+#define SCALAR EBPF_ARG_SCALAR
+#define PTR EBPF_ARG_PTR
+#define SIZE EBPF_ARG_SIZE
+#define NO_ARGS 0, {0}
+
 struct ebpf_symbol ebpf_global_symbs[PKT_VM_MAX_SYMBS] = {
-	{"bug", ebpf_func_empty},
-	{"debug_print", ebpf_func_debug_print},
-	{"mmap", ebpf_func_mmap},
-	{"monitor_address", ebpf_func_monitor_address},
-	{"wait_for_address_event", ebpf_func_wait_for_address_event},
-	{"migrate_to", ebpf_func_migrate_to},
-	{"clone_to", ebpf_func_clone_to},
-	{"switch_to_address_space", ebpf_func_switch_to_address_space},
-	{"memcpy", ebpf_func_memcpy},
-	{NULL, NULL}
+	{"bug", ebpf_func_empty, NO_ARGS},
+	{"debug_print", ebpf_func_debug_print, ARGS(SCALAR)},
+	{"mmap", ebpf_func_mmap, ARGS(SCALAR, SCALAR)},
+	{"monitor_address", ebpf_func_monitor_address, ARGS(SCALAR, SCALAR, SCALAR, SCALAR)},
+	{"wait_for_address_event", ebpf_func_wait_for_address_event, NO_ARGS},
+	{"migrate_to", ebpf_func_migrate_to, ARGS(PTR)},
+	{"clone_to", ebpf_func_clone_to, ARGS(PTR, SCALAR)},
+	{"switch_to_address_space", ebpf_func_switch_to_address_space, ARGS(SCALAR)},
+	{"memcpy", ebpf_func_memcpy, ARGS(PTR, PTR, SCALAR, PTR, SCALAR)},
+	{"fork_to", ebpf_func_fork_to, ARGS(PTR, SCALAR)},
+	{"fork_return", ebpf_func_fork_return, ARGS(SCALAR)},
+	{"fork_join", ebpf_func_fork_join, ARGS(PTR, SCALAR)},
+	{"map_lookup", ebpf_func_map_lookup, ARGS(PTR, PTR, PTR)},
+	{"map_update", ebpf_func_map_update, ARGS(PTR, PTR, PTR, SCALAR)},
+	{"map_delete", ebpf_func_map_delete, ARGS(PTR, PTR)},
+	{"mem_cmp", ebpf_func_mem_cmp, ARGS(PTR, PTR, SIZE)},
+	{"mem_set", ebpf_func_mem_set, ARGS(PTR, SCALAR, SIZE)},
+	{"mem_copy", ebpf_func_mem_copy, ARGS(PTR, PTR, SIZE)},
+	{"crc32c", ebpf_func_crc32c, ARGS(PTR, SIZE, SCALAR)},
+	{"xxhash64", ebpf_func_xxhash64, ARGS(PTR, SIZE, SCALAR)},
+	{"mem_search", ebpf_func_mem_search, ARGS(PTR, SIZE, PTR, SCALAR, PTR)},
+	{NULL, NULL, NO_ARGS}
 };
\ No newline at end of file
@@ -10,6 +10,7 @@
 
 #define VM_URL_SIZE 24
 #define INVALID_MMAP_ADDR ((void *)-1)
+#define MEMCPY_FAILED ((uint64_t)-1)
 
 #define join_thread fork_join
 
@@ -32,9 +33,60 @@ enum {
 	EBPF_FUNC_memcpy,
 	EBPF_FUNC_fork_to,
 	EBPF_FUNC_fork_return,
-	EBPF_FUNC_fork_join
+	EBPF_FUNC_fork_join,
+	EBPF_FUNC_map_lookup,
+	EBPF_FUNC_map_update,
+	EBPF_FUNC_map_delete,
+	EBPF_FUNC_mem_cmp,
+	EBPF_FUNC_mem_set,
+	EBPF_FUNC_mem_copy,
+	EBPF_FUNC_crc32c,
+	EBPF_FUNC_xxhash64,
+	EBPF_FUNC_mem_search
 };
 
+enum {
+	VM_MAP_TYPE_ARRAY,
+	VM_MAP_TYPE_HASH,
+	VM_MAP_TYPE_LRU_HASH,
+	VM_MAP_TYPE_PERCPU_ARRAY,
+	VM_MAP_TYPE_MAX
+};
+
+enum {
+	VM_MAP_ANY,
+	VM_MAP_NOEXIST,
+	VM_MAP_EXIST
+};
+
+#define VM_MAP_FAILED ((uint64_t)-1)
+
+/*
+ * Maps are owned by the executor and found by name, so a vm reaching another
+ * node uses that node's instance of the map. The loader fills in id.
+ */
+struct vm_map_def {
+	uint32_t type;
+	uint32_t key_size;
+	uint32_t value_size;
+	uint32_t max_entries;
+	uint64_t id;
+};
+
+/* returned by the bulk memory helpers when a range is not mapped into the vm */
+#define VM_MEM_FAULT ((uint64_t)1 << 63)
+#define VM_SEARCH_NOT_FOUND ((uint64_t)-1)
+#define VM_SEARCH_MAX_PATTERNS 16
+#define VM_SEARCH_PATTERN_SIZE 32
+
+struct vm_search_pattern {
+	uint32_t len;
+	uint8_t bytes[VM_SEARCH_PATTERN_SIZE];
+};
+
+#define VM_MAP(NAME, TYPE, KEY_SIZE, VALUE_SIZE, MAX_ENTRIES) \
+	struct vm_map_def NAME __attribute__((section(".maps"), used)) = {TYPE, KEY_SIZE, VALUE_SIZE, MAX_ENTRIES, 0}
+
 struct ub_address {
 	uint64_t access_key;
 	uint8_t url[VM_URL_SIZE];
@@ -59,6 +111,18 @@ static uint64_t (*fork_return)(uint64_t result) = (void *)EBPF_FUNC_fork_return;
 static uint64_t (*fork_join)(struct remote_thread *thread_list, int len) = (void *)EBPF_FUNC_fork_join;
 static uint64_t (*switch_to_address_space)(int asid) = (void *)EBPF_FUNC_switch_to_address_space;
 static uint64_t (*memcpy)(struct ub_address *dst, struct ub_address *src, int len, void *completion_addr, int result) = (void *)EBPF_FUNC_memcpy;
+/* values are copied between the map and vm memory, the vm never sees map memory directly */
+static uint64_t (*map_lookup)(struct vm_map_def *map, const void *key, void *value) = (void *)EBPF_FUNC_map_lookup;
+static uint64_t (*map_update)(struct vm_map_def *map, const void *key, const void *value, uint64_t flags) = (void *)EBPF_FUNC_map_update;
+static uint64_t (*map_delete)(struct vm_map_def *map, const void *key) = (void *)EBPF_FUNC_map_delete;
+/* local memory, each range is checked once instead of on every byte access */
+static int64_t (*mem_cmp)(const void *a, const void *b, uint64_t len) = (void *)EBPF_FUNC_mem_cmp;
+static uint64_t (*mem_set)(void *dst, int c, uint64_t len) = (void *)EBPF_FUNC_mem_set;
+static uint64_t (*mem_copy)(void *dst, const void *src, uint64_t len) = (void *)EBPF_FUNC_mem_copy;
+static uint64_t (*crc32c)(const void *buf, uint64_t len, uint32_t seed) = (void *)EBPF_FUNC_crc32c;
+static uint64_t (*xxhash64)(const void *buf, uint64_t len, uint64_t seed) = (void *)EBPF_FUNC_xxhash64;
+static uint64_t (*mem_search)(const void *buf, uint64_t len, const struct vm_search_pattern *patterns, uint32_t num,
+	uint32_t *match) = (void *)EBPF_FUNC_mem_search;
 
 #define start_remote_thread(THREAD_LIST, LEN) for(uint64_t result = fork_to(THREAD_LIST, LEN); \
 													result < (LEN); \
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "ebpf_vm_simulator.h"
+
+static struct ebpf_helper_table global_helpers = {
+	.symbols = ebpf_global_symbs,
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static uint32_t hash_helper_name(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	
+	while (*name != '\0') {
+		hash = (hash ^ (uint8_t)*name++) * 16777619u;
+	}
+	
+	return hash;
+}
+
+/* called with the table lock held */
+static void hash_insert_locked(struct ebpf_helper_table *table, uint32_t idx)
+{
+	const char *name = table->symbols[idx].name;
+	uint32_t mask = EBPF_HELPER_HASH_SIZE - 1;
+	uint32_t slot;
+	
+	for (slot = hash_helper_name(name) & mask; table->hash[slot] != 0; slot = (slot + 1) & mask) {
+		if (strcmp(table->symbols[table->hash[slot] - 1].name, name) == 0) {
+			/* a name re-registered at another index moves there */
+			break;
+		}
+	}
+	
+	table->hash[slot] = idx + 1;
+}
+
+/* called with the table lock held */
+static void hash_build_locked(struct ebpf_helper_table *table)
+{
+	if (table->hash_ready) {
+		return;
+	}
+	
+	for (uint32_t idx = 0; idx < PKT_VM_MAX_SYMBS; idx++) {
+		if (table->symbols[idx].name != NULL) {
+			hash_insert_locked(table, idx);
+		}
+	}
+	table->hash_ready = 1;
+}
+
+/* a size needs a pointer since the previous size to apply to */
+static int check_arg_types(const struct ebpf_symbol *helper)
+{
+	int pointers = 0;
+	
+	if (helper->num_args > EBPF_HELPER_MAX_ARGS) {
+		return -1;
+	}
+	
+	for (uint32_t idx = 0; idx < helper->num_args; idx++) {
+		if ((helper->arg_types[idx] == EBPF_ARG_UNUSED) || (helper->arg_types[idx] > EBPF_ARG_SIZE)) {
+			return -1;
+		}
+	
+		if (helper->arg_types[idx] == EBPF_ARG_PTR) {
+			pointers++;
+		} else if (helper->arg_types[idx] == EBPF_ARG_SIZE) {
+			if (pointers == 0) {
+				return -1;
+			}
+			pointers = 0;
+		}
+	}
+	
+	return 0;
+}
+
+struct ebpf_helper_table *ebpf_global_helpers(void)
+{
+	return &global_helpers;
+}
+
+/* a private table starting with the built-in helpers at their usual indexes */
+struct ebpf_helper_table *ebpf_helper_table_create(void)
+{
+	struct ebpf_helper_table *table = calloc(1, sizeof(*table));
+	
+	if (table == NULL) {
+		return NULL;
+	}
+	
+	table->symbols = calloc(PKT_VM_MAX_SYMBS, sizeof(*table->symbols));
+	if (table->symbols == NULL) {
+		free(table);
+		return NULL;
+	}
+	
+	pthread_mutex_init(&table->lock, NULL);
+	pthread_mutex_lock(&global_helpers.lock);
+	memcpy(table->symbols, global_helpers.symbols, PKT_VM_MAX_SYMBS * sizeof(*table->symbols));
+	pthread_mutex_unlock(&global_helpers.lock);
+	return table;
+}
+
+void ebpf_helper_table_destroy(struct ebpf_helper_table *table)
+{
+	if ((table == NULL) || (table == &global_helpers)) {
+		return;
+	}
+	
+	pthread_mutex_destroy(&table->lock);
+	free(table->symbols);
+	free(table);
+}
+
+/*
+ * Registers helper at idx, or at the first free index when idx is
+ * PKT_VM_INVALID_FUNC_IDX. Programs are linked by name, but the index ends up
+ * in their code, so nodes a vm migrates between should agree on it.
+ * Returns the index or -1.
+ */
+int ebpf_helper_register(struct ebpf_helper_table *table, uint32_t idx, const struct ebpf_symbol *helper)
+{
+	struct ebpf_symbol *symb = NULL;
+	
+	if (table == NULL) {
+		table = &global_helpers;
+	}
+	
+	if ((helper->name == NULL) || (helper->func == NULL) || (check_arg_types(helper) != 0)) {
+		printf("Invalid helper %s.\n", (helper->name != NULL) ? helper->name : "");
+		return -1;
+	}
+	
+	pthread_mutex_lock(&table->lock);
+	hash_build_locked(table);
+	if (idx == PKT_VM_INVALID_FUNC_IDX) {
+		/* index 0 is never called, it catches unresolved calls */
+		idx = 1;
+		while ((idx < PKT_VM_MAX_SYMBS) && (table->symbols[idx].func != NULL)) {
+			idx++;
+		}
+	}
+	
+	if ((idx == 0) || (idx >= PKT_VM_MAX_SYMBS) || (table->symbols[idx].func != NULL)) {
+		pthread_mutex_unlock(&table->lock);
+		printf("No free helper index for %s.\n", helper->name);
+		return -1;
+	}
+	
+	symb = &table->symbols[idx];
+	symb->name = helper->name;
+	symb->num_args = helper->num_args;
+	memcpy(symb->arg_types, helper->arg_types, sizeof(symb->arg_types));
+	/* running vms read func without the lock, publish it last */
+	__atomic_store_n(&symb->func, helper->func, __ATOMIC_RELEASE);
+	hash_insert_locked(table, idx);
+	pthread_mutex_unlock(&table->lock);
+	return idx;
+}
+
+uint32_t ebpf_helper_lookup(struct ebpf_helper_table *table, const char *name)
+{
+	uint32_t mask = EBPF_HELPER_HASH_SIZE - 1;
+	uint32_t idx = PKT_VM_INVALID_FUNC_IDX;
+	
+	if (table == NULL) {
+		table = &global_helpers;
+	}
+	
+	pthread_mutex_lock(&table->lock);
+	hash_build_locked(table);
+	for (uint32_t slot = hash_helper_name(name) & mask; table->hash[slot] != 0; slot = (slot + 1) & mask) {
+		if (strcmp(table->symbols[table->hash[slot] - 1].name, name) == 0) {
+			idx = table->hash[slot] - 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&table->lock);
+	return idx;
+}
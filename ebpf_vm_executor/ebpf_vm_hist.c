@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "ebpf_vm_simulator.h"
+#include "ebpf_vm_hist.h"
+
+int vm_latency_active;
+
+static const char *latency_names[VM_LAT_HELPER] = {
+	"slice", "transport send", "transport recv", "address wake",
+};
+
+static uint64_t bucket_upper(uint32_t bucket)
+{
+	uint32_t exp, sub;
+	
+	if (bucket < VM_HIST_SUB_BUCKETS) {
+		return bucket;
+	}
+	
+	exp = (bucket >> VM_HIST_SUB_BITS) + VM_HIST_SUB_BITS - 1;
+	sub = bucket & (VM_HIST_SUB_BUCKETS - 1);
+	return (((uint64_t)VM_HIST_SUB_BUCKETS + sub + 1) << (exp - VM_HIST_SUB_BITS)) - 1;
+}
+
+/* histograms of several workers, or several nodes, add up bucket by bucket */
+void vm_hist_merge(struct vm_hist *dst, const struct vm_hist *src)
+{
+	if (src->count == 0) {
+		return;
+	}
+	
+	if ((dst->count == 0) || (src->min < dst->min)) {
+		dst->min = src->min;
+	}
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+	dst->count += src->count;
+	dst->sum += src->sum;
+	for (uint32_t idx = 0; idx < VM_HIST_BUCKETS; idx++) {
+		dst->buckets[idx] += src->buckets[idx];
+	}
+}
+
+/* highest value of the bucket holding the percentile, never above the exact max */
+uint64_t vm_hist_value_at(const struct vm_hist *hist, double percentile)
+{
+	uint64_t rank, seen = 0, value;
+	
+	if (hist->count == 0) {
+		return 0;
+	}
+	
+	rank = (uint64_t)(percentile / 100.0 * hist->count + 0.5);
+	if (rank == 0) {
+		rank = 1;
+	}
+	
+	for (uint32_t idx = 0; idx < VM_HIST_BUCKETS; idx++) {
+		seen += hist->buckets[idx];
+		if (seen >= rank) {
+			value = bucket_upper(idx);
+			return (value < hist->max) ? value : hist->max;
+		}
+	}
+	
+	return hist->max;
+}
+
+/* one line in microseconds */
+void vm_hist_print(FILE *out, const char *name, const struct vm_hist *hist)
+{
+	fprintf(out, "%-24s %10lu %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n", name, hist->count,
+		(hist->count != 0) ? (double)hist->min / 1e3 : 0.0,
+		(hist->count != 0) ? (double)hist->sum / hist->count / 1e3 : 0.0,
+		vm_hist_value_at(hist, 50) / 1e3, vm_hist_value_at(hist, 90) / 1e3,
+		vm_hist_value_at(hist, 99) / 1e3, vm_hist_value_at(hist, 99.9) / 1e3, hist->max / 1e3);
+}
+
+/* called from the interpreter with the time the helper was entered */
+void vm_latency_helper(struct ebpf_vm *vm, uint32_t idx, uint64_t start_ns)
+{
+	struct vm_worker_latency *latency = NULL;
+	struct vm_hist *hist = NULL;
+	
+	if ((vm->rd.worker == NULL) || ((latency = vm->rd.worker->latency) == NULL) || (idx >= PKT_VM_MAX_SYMBS)) {
+		return;
+	}
+	
+	hist = latency->helpers[idx];
+	if (hist == NULL) {
+		hist = calloc(1, sizeof(*hist));
+		if (hist == NULL) {
+			return;
+		}
+		/* readers merge concurrently, publish the zeroed histogram first */
+		__atomic_store_n(&latency->helpers[idx], hist, __ATOMIC_RELEASE);
+	}
+	
+	vm_hist_record(hist, vm_now_ns() - start_ns);
+}
+
+int vm_latency_init(struct ebpf_vm_executor *executor, uint32_t enable)
+{
+	executor->state.latency = 0;
+	for (uint32_t idx = 0; idx < executor->num_workers; idx++) {
+		executor->workers[idx].latency = NULL;
+	}
+	
+	if (!enable) {
+		return 0;
+	}
+	
+	for (uint32_t idx = 0; idx < executor->num_workers; idx++) {
+		executor->workers[idx].latency = calloc(1, sizeof(struct vm_worker_latency));
+		if (executor->workers[idx].latency == NULL) {
+			printf("Failed to allocate latency histograms.\n");
+			vm_latency_exit(executor);
+			return -1;
+		}
+	}
+	
+	executor->state.latency = 1;
+	__atomic_fetch_add(&vm_latency_active, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void vm_latency_exit(struct ebpf_vm_executor *executor)
+{
+	struct vm_worker_latency *latency = NULL;
+	
+	if (executor->state.latency) {
+		executor->state.latency = 0;
+		__atomic_fetch_sub(&vm_latency_active, 1, __ATOMIC_RELAXED);
+	}
+	
+	for (uint32_t idx = 0; idx < executor->num_workers; idx++) {
+		latency = executor->workers[idx].latency;
+		if (latency == NULL) {
+			continue;
+		}
+	
+		for (uint32_t helper = 0; helper < PKT_VM_MAX_SYMBS; helper++) {
+			free(latency->helpers[helper]);
+		}
+		free(latency);
+		executor->workers[idx].latency = NULL;
+	}
+}
+
+/*
+ * Merges the histogram of every worker. helper selects the helper index for
+ * VM_LAT_HELPER and is ignored otherwise. Workers may keep running.
+ */
+int vm_executor_latency(struct ebpf_vm_executor *executor, uint32_t type, uint32_t helper, struct vm_hist *sum)
+{
+	struct vm_worker_latency *latency = NULL;
+	const struct vm_hist *hist = NULL;
+	
+	memset(sum, 0, sizeof(*sum));
+	if ((executor->state.latency == 0) || (type >= VM_LAT_MAX) ||
+		((type == VM_LAT_HELPER) && (helper >= PKT_VM_MAX_SYMBS))) {
+		return -1;
+	}
+	
+	for (uint32_t idx = 0; idx < executor->num_workers; idx++) {
+		latency = executor->workers[idx].latency;
+		hist = (type == VM_LAT_HELPER) ? __atomic_load_n(&latency->helpers[helper], __ATOMIC_ACQUIRE) :
+			&latency->hists[type];
+		if (hist != NULL) {
+			vm_hist_merge(sum, hist);
+		}
+	}
+	
+	return 0;
+}
+
+void vm_executor_latency_report(struct ebpf_vm_executor *executor, FILE *out)
+{
+	struct ebpf_symbol *symbols = executor->helpers->symbols;
+	struct vm_hist *sum = NULL;
+	char name[32];
+	
+	if (executor->state.latency == 0) {
+		fprintf(out, "Latency histograms are not enabled.\n");
+		return;
+	}
+	
+	sum = malloc(sizeof(*sum));
+	if (sum == NULL) {
+		return;
+	}
+	
+	fprintf(out, "%-24s %10s %9s %9s %9s %9s %9s %9s %9s\n", "latency (us)", "count", "min", "mean", "p50", "p90",
+		"p99", "p99.9", "max");
+	for (uint32_t type = 0; type < VM_LAT_HELPER; type++) {
+		(void)vm_executor_latency(executor, type, 0, sum);
+		vm_hist_print(out, latency_names[type], sum);
+	}
+	
+	for (uint32_t idx = 0; idx < PKT_VM_MAX_SYMBS; idx++) {
+		(void)vm_executor_latency(executor, VM_LAT_HELPER, idx, sum);
+		if (sum->count == 0) {
+			continue;
+		}
+	
+		snprintf(name, sizeof(name), "helper %s", (symbols[idx].name != NULL) ? symbols[idx].name : "?");
+		vm_hist_print(out, name, sum);
+	}
+	
+	free(sum);
+}
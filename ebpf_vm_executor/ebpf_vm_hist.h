@@ -0,0 +1,87 @@
+#ifndef _EBPF_VM_HIST_H_
+#define _EBPF_VM_HIST_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Log bucketed latency histogram in nanoseconds. Values below 2^SUB_BITS
+ * have a bucket each, above that every power of 2 is split into 2^SUB_BITS
+ * linear buckets, so a bucket is at most 1/16 of its value wide. Values of
+ * 2^MAX_EXP and more land in the last bucket, max keeps the exact value.
+ */
+#define VM_HIST_SUB_BITS 4
+#define VM_HIST_SUB_BUCKETS (1 << VM_HIST_SUB_BITS)
+#define VM_HIST_MAX_EXP 40
+#define VM_HIST_BUCKETS ((VM_HIST_MAX_EXP - VM_HIST_SUB_BITS + 1) * VM_HIST_SUB_BUCKETS)
+
+struct vm_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[VM_HIST_BUCKETS];
+};
+
+enum {
+	VM_LAT_SLICE,
+	VM_LAT_SEND,
+	VM_LAT_RECV,
+	VM_LAT_WAKE,
+	VM_LAT_HELPER,
+	VM_LAT_MAX
+};
+
+static inline uint32_t vm_hist_bucket(uint64_t value)
+{
+	uint32_t exp;
+	
+	if (value < VM_HIST_SUB_BUCKETS) {
+		return (uint32_t)value;
+	}
+	
+	exp = 63 - __builtin_clzll(value);
+	if (exp >= VM_HIST_MAX_EXP) {
+		return VM_HIST_BUCKETS - 1;
+	}
+	
+	return ((exp - VM_HIST_SUB_BITS + 1) << VM_HIST_SUB_BITS) |
+		(uint32_t)((value >> (exp - VM_HIST_SUB_BITS)) & (VM_HIST_SUB_BUCKETS - 1));
+}
+
+/* single writer, readers may see a sample half way in and catch up on the next read */
+static inline void vm_hist_record(struct vm_hist *hist, uint64_t value)
+{
+	if ((hist->count == 0) || (value < hist->min)) {
+		hist->min = value;
+	}
+	if (value > hist->max) {
+		hist->max = value;
+	}
+	hist->count++;
+	hist->sum += value;
+	hist->buckets[vm_hist_bucket(value)]++;
+}
+
+struct ebpf_vm;
+
+extern int vm_latency_active;
+
+void vm_hist_merge(struct vm_hist *dst, const struct vm_hist *src);
+uint64_t vm_hist_value_at(const struct vm_hist *hist, double percentile);
+void vm_hist_print(FILE *out, const char *name, const struct vm_hist *hist);
+void vm_latency_helper(struct ebpf_vm *vm, uint32_t idx, uint64_t start_ns);
+
+/*
+ * Helper calls are timed only while some executor records latencies, 0 means
+ * not timed. The call polled by a waiting vm is not a sample.
+ */
+#define VM_LAT_HELPER_START(vm) \
+	((__builtin_expect(vm_latency_active, 0) && ((vm)->state.vm_state == VM_STATE_RUNNING)) ? vm_now_ns() : 0)
+#define VM_LAT_HELPER_END(vm, idx, start_ns) do { \
+	if (__builtin_expect((start_ns) != 0, 0)) { \
+		vm_latency_helper((vm), (idx), (start_ns)); \
+	} \
+} while (0)
+
+#endif
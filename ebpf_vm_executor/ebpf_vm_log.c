@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ub_list.h"
+#include "ebpf_vm_simulator.h"
+#include "ebpf_vm_log.h"
+
+/*
+ * Every thread that logs gets a single producer ring, the drainer thread is
+ * the only consumer. Producers never wait, a record that finds the ring full
+ * is counted and thrown away. Rings of exited threads are freed once drained.
+ */
+struct vm_log_ring {
+	struct ub_list node;
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t dropped;
+	uint64_t tail __attribute__((aligned(64)));
+	uint32_t closed;
+	struct vm_log_record records[VM_LOG_RING_SIZE];
+};
+
+static struct ub_list vm_log_rings = {&vm_log_rings, &vm_log_rings};
+static pthread_mutex_t vm_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t vm_log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t vm_log_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vm_log_wake = PTHREAD_COND_INITIALIZER;
+static pthread_once_t vm_log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t vm_log_key;
+static __thread struct vm_log_ring *vm_log_ring;
+static FILE *vm_log_out;
+/* totals of freed rings, and what the drainer already reported */
+static uint64_t vm_log_freed_written;
+static uint64_t vm_log_freed_dropped;
+static uint64_t vm_log_reported_dropped;
+static uint64_t vm_log_no_ring_dropped;
+
+static void format_record(FILE *out, const struct vm_log_record *rec)
+{
+	char msg[256];
+	
+	snprintf(msg, sizeof(msg), rec->fmt, rec->args[0], rec->args[1], rec->args[2], rec->args[3]);
+	fprintf(out, "[%" PRIu64 ".%06" PRIu64 "] ", (uint64_t)(rec->ts_ns / 1000000000ULL),
+		(uint64_t)((rec->ts_ns % 1000000000ULL) / 1000));
+	if (rec->vm_id != VM_LOG_NO_VM) {
+		fprintf(out, "vm %" PRIu64 " pc %u: ", rec->vm_id, rec->pc);
+	}
+	
+	if (rec->type == VM_LOG_T_ERRNO) {
+		fprintf(out, "%s: %s\n", msg, strerror((int)rec->args[0]));
+	} else {
+		fprintf(out, "%s%s", msg, ((msg[0] != '\0') && (msg[strlen(msg) - 1] == '\n')) ? "" : "\n");
+	}
+}
+
+/* consumers are serialized, the drainer and explicit flushes may race. Returns whether anything was written */
+static int drain_rings(void)
+{
+	struct vm_log_ring *ring = NULL, *tmp = NULL;
+	FILE *out = NULL;
+	uint64_t dropped = 0;
+	int wrote = 0;
+	
+	pthread_mutex_lock(&vm_log_drain_lock);
+	out = (vm_log_out != NULL) ? vm_log_out : stdout;
+	pthread_mutex_lock(&vm_log_lock);
+	UB_LIST_FOR_EACH_SAFE(ring, tmp, node, &vm_log_rings) {
+		uint32_t closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = ring->tail;
+	
+		for (; tail != head; tail++) {
+			format_record(out, &ring->records[tail & (VM_LOG_RING_SIZE - 1)]);
+			wrote = 1;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	
+		if (closed) {
+			vm_log_freed_written += head;
+			vm_log_freed_dropped += ring->dropped;
+			ub_list_remove(&ring->node);
+			free(ring);
+			continue;
+		}
+	
+		dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	}
+	
+	dropped += vm_log_freed_dropped + __atomic_load_n(&vm_log_no_ring_dropped, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&vm_log_lock);
+	
+	if (dropped != vm_log_reported_dropped) {
+		fprintf(out, "vm log: %" PRIu64 " records dropped\n", dropped - vm_log_reported_dropped);
+		vm_log_reported_dropped = dropped;
+		wrote = 1;
+	}
+	
+	if (wrote) {
+		fflush(out);
+	}
+	pthread_mutex_unlock(&vm_log_drain_lock);
+	return wrote;
+}
+
+/*
+ * The interval doubles while nothing is logged, up to VM_LOG_DRAIN_MAX_INTERVAL_US.
+ * A producer whose ring fills up to half wakes the drainer early.
+ */
+static void *drainer_main(void *arg)
+{
+	uint64_t interval_us = VM_LOG_DRAIN_INTERVAL_US;
+	struct timespec deadline;
+	uint64_t ns;
+	
+	while (1) {
+		if (drain_rings()) {
+			interval_us = VM_LOG_DRAIN_INTERVAL_US;
+		} else if (interval_us < VM_LOG_DRAIN_MAX_INTERVAL_US) {
+			interval_us *= 2;
+		}
+	
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		ns = (uint64_t)deadline.tv_nsec + interval_us * 1000;
+		deadline.tv_sec += ns / 1000000000ULL;
+		deadline.tv_nsec = ns % 1000000000ULL;
+		pthread_mutex_lock(&vm_log_wake_lock);
+		(void)pthread_cond_timedwait(&vm_log_wake, &vm_log_wake_lock, &deadline);
+		pthread_mutex_unlock(&vm_log_wake_lock);
+	}
+	
+	return NULL;
+}
+
+/* the thread is gone, its ring is freed by the next drain */
+static void close_ring(void *arg)
+{
+	struct vm_log_ring *ring = arg;
+	
+	__atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+static void start_drainer(void)
+{
+	pthread_t thread;
+	
+	(void)pthread_key_create(&vm_log_key, close_ring);
+	if (pthread_create(&thread, NULL, drainer_main, NULL) != 0) {
+		perror("Failed to create log drainer");
+		return;
+	}
+	
+	pthread_detach(thread);
+	/* whatever is still queued at exit goes out synchronously */
+	atexit(vm_log_flush);
+}
+
+static struct vm_log_ring *open_ring(void)
+{
+	struct vm_log_ring *ring = NULL;
+	
+	pthread_once(&vm_log_once, start_drainer);
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL) {
+		return NULL;
+	}
+	
+	pthread_mutex_lock(&vm_log_lock);
+	ub_list_push_back(&vm_log_rings, &ring->node);
+	pthread_mutex_unlock(&vm_log_lock);
+	(void)pthread_setspecific(vm_log_key, ring);
+	vm_log_ring = ring;
+	return ring;
+}
+
+void vm_log_write(uint32_t type, uint64_t vm_id, uint32_t pc, const char *fmt,
+	uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3)
+{
+	struct vm_log_ring *ring = vm_log_ring;
+	struct vm_log_record *rec = NULL;
+	uint64_t head, used;
+	
+	if ((ring == NULL) && ((ring = open_ring()) == NULL)) {
+		__atomic_fetch_add(&vm_log_no_ring_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	
+	head = ring->head;
+	used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (used >= VM_LOG_RING_SIZE) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	
+	rec = &ring->records[head & (VM_LOG_RING_SIZE - 1)];
+	rec->ts_ns = vm_wall_ns();
+	rec->vm_id = vm_id;
+	rec->pc = pc;
+	rec->type = type;
+	rec->fmt = fmt;
+	rec->args[0] = a0;
+	rec->args[1] = a1;
+	rec->args[2] = a2;
+	rec->args[3] = a3;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	
+	/* a backed off drainer would let a burst overrun the ring */
+	if (used == VM_LOG_RING_SIZE / 2) {
+		pthread_mutex_lock(&vm_log_wake_lock);
+		pthread_cond_signal(&vm_log_wake);
+		pthread_mutex_unlock(&vm_log_wake_lock);
+	}
+}
+
+/* writes out everything logged so far, from any thread */
+void vm_log_flush(void)
+{
+	(void)drain_rings();
+}
+
+/* NULL goes back to stdout */
+void vm_log_set_output(FILE *out)
+{
+	pthread_mutex_lock(&vm_log_drain_lock);
+	vm_log_out = out;
+	pthread_mutex_unlock(&vm_log_drain_lock);
+}
+
+void vm_log_get_stats(struct vm_log_stats *stats)
+{
+	struct vm_log_ring *ring = NULL;
+	
+	pthread_mutex_lock(&vm_log_lock);
+	stats->written = vm_log_freed_written;
+	stats->dropped = vm_log_freed_dropped + __atomic_load_n(&vm_log_no_ring_dropped, __ATOMIC_RELAXED);
+	stats->rings = 0;
+	UB_LIST_FOR_EACH(ring, node, &vm_log_rings) {
+		stats->written += __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		stats->dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		stats->rings++;
+	}
+	pthread_mutex_unlock(&vm_log_lock);
+}
@@ -0,0 +1,76 @@
+#ifndef _EBPF_VM_LOG_H_
+#define _EBPF_VM_LOG_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* records per thread, a power of 2 */
+#define VM_LOG_RING_SIZE 4096
+#define VM_LOG_DRAIN_INTERVAL_US 1000
+#define VM_LOG_DRAIN_MAX_INTERVAL_US 128000
+#define VM_LOG_NO_VM UINT64_MAX
+#define VM_LOG_MAX_ARGS 4
+
+enum {
+	VM_LOG_T_MSG,
+	/* args[0] is errno, printed after the message like perror() */
+	VM_LOG_T_ERRNO
+};
+
+/*
+ * One fixed size record. The format is not copied, it must be a string
+ * literal. Arguments are stored as 64 bit values, formats take %lu, %ld,
+ * %lx or %s for static strings.
+ */
+struct vm_log_record {
+	uint64_t ts_ns;
+	uint64_t vm_id;
+	uint32_t pc;
+	uint32_t type;
+	const char *fmt;
+	uint64_t args[VM_LOG_MAX_ARGS];
+};
+
+struct vm_log_stats {
+	uint64_t written;
+	uint64_t dropped;
+	uint32_t rings;
+};
+
+void vm_log_write(uint32_t type, uint64_t vm_id, uint32_t pc, const char *fmt,
+	uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3);
+void vm_log_flush(void);
+void vm_log_set_output(FILE *out);
+void vm_log_get_stats(struct vm_log_stats *stats);
+
+/*
+ * Never called, lets the compiler check every call site's arguments against
+ * its format. Arguments are still stored as 64 bit values, so the format must
+ * match what the argument is cast to, casting at the call site when needed.
+ */
+static inline void __attribute__((format(printf, 1, 2))) vm_log_check_format(const char *fmt, ...)
+{
+}
+
+/* pads the arguments with zeros so that every call site passes four */
+#define VM_LOG_ARGS(...) VM_LOG_ARGS_(0, ##__VA_ARGS__, 0, 0, 0, 0)
+#define VM_LOG_ARGS_(d, a0, a1, a2, a3, ...) (uint64_t)(a0), (uint64_t)(a1), (uint64_t)(a2), (uint64_t)(a3)
+
+/* never blocks, a full ring counts the record as dropped */
+#define vm_log_at(type, vm_id, pc, fmt, ...) do { \
+	if (0) { \
+		vm_log_check_format(fmt, ##__VA_ARGS__); \
+	} \
+	vm_log_write((type), (vm_id), (pc), (fmt), VM_LOG_ARGS(__VA_ARGS__)); \
+} while (0)
+#define vm_log(fmt, ...) vm_log_at(VM_LOG_T_MSG, VM_LOG_NO_VM, 0, fmt, ##__VA_ARGS__)
+#define vm_log_errno(fmt) do { \
+	if (0) { \
+		vm_log_check_format(fmt); \
+	} \
+	vm_log_write(VM_LOG_T_ERRNO, VM_LOG_NO_VM, 0, (fmt), VM_LOG_ARGS(errno)); \
+} while (0)
+#define vm_log_vm(vm, fmt, ...) vm_log_at(VM_LOG_T_MSG, (vm)->rd.id, (uint32_t)(vm)->sys_reg[EBPF_SYS_REG_PC], \
+	fmt, ##__VA_ARGS__)
+
+#endif
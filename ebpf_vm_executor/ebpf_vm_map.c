@@ -0,0 +1,571 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define PKT_VM_EXECUTOR 1
+
+#include "ebpf_vm_simulator.h"
+#include "ebpf_vm_functions.h"
+
+#define VM_MAP_ALIGN 8
+#define VM_MAP_LRU_SAMPLE 16
+/* deleted slots lengthen every probe that crosses them, a rebuild drops them at 1/8 of the slots */
+#define VM_MAP_MAX_TOMBSTONES(capacity) ((capacity) / 8)
+#define VM_MAP_ROUND(size) (((size) + VM_MAP_ALIGN - 1) & ~(uint32_t)(VM_MAP_ALIGN - 1))
+
+enum {
+	VM_MAP_SLOT_EMPTY,
+	VM_MAP_SLOT_USED,
+	VM_MAP_SLOT_DELETED
+};
+
+/*
+ * Hash slots are guarded by a sequence count: writers serialize on the map
+ * lock and make seq odd while they change a slot, readers never lock and
+ * retry when seq moved under them. The key and value follow the header.
+ */
+struct vm_map_slot {
+	uint32_t seq;
+	uint32_t state;
+	uint32_t hash;
+	uint32_t reserved;
+	uint64_t atime;
+	uint8_t key[];
+};
+
+uint64_t vm_map_id(const char *name)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	
+	while (*name != '\0') {
+		hash = (hash ^ (uint8_t)*name++) * 1099511628211ULL;
+	}
+	
+	return hash;
+}
+
+static uint32_t hash_key(const void *key, uint32_t size)
+{
+	const uint8_t *p = key;
+	uint32_t hash = 2166136261u;
+	
+	for (uint32_t idx = 0; idx < size; idx++) {
+		hash = (hash ^ p[idx]) * 16777619u;
+	}
+	
+	return hash;
+}
+
+static struct vm_map_slot *get_slot(struct vm_map *map, uint32_t idx)
+{
+	return (struct vm_map_slot *)(map->values + (uint64_t)idx * map->slot_size);
+}
+
+static uint8_t *slot_value(struct vm_map *map, struct vm_map_slot *slot)
+{
+	return slot->key + VM_MAP_ROUND(map->key_size);
+}
+
+static int is_hash(struct vm_map *map)
+{
+	return (map->type == VM_MAP_TYPE_HASH) || (map->type == VM_MAP_TYPE_LRU_HASH);
+}
+
+/* the definition comes from vm memory, the map is charged to the executor's budget */
+static struct vm_map *create_map(const struct vm_map_def *def, uint32_t num_cpus, uint64_t *budget)
+{
+	struct vm_map *map = NULL;
+	uint64_t size;
+	
+	if ((def->type >= VM_MAP_TYPE_MAX) || (def->key_size == 0) || (def->value_size == 0) || (def->max_entries == 0) ||
+		(def->max_entries > (1U << 30)) ||
+		(!((def->type == VM_MAP_TYPE_HASH) || (def->type == VM_MAP_TYPE_LRU_HASH)) && (def->key_size != sizeof(uint32_t)))) {
+		printf("Invalid map definition, type = %u.\n", def->type);
+		return NULL;
+	}
+	
+	map = calloc(1, sizeof(*map));
+	if (map == NULL) {
+		return NULL;
+	}
+	
+	map->id = def->id;
+	map->type = def->type;
+	map->key_size = def->key_size;
+	map->value_size = def->value_size;
+	map->max_entries = def->max_entries;
+	map->num_cpus = (def->type == VM_MAP_TYPE_PERCPU_ARRAY) ? num_cpus : 1;
+	pthread_mutex_init(&map->lock, NULL);
+	
+	if (is_hash(map)) {
+		/* at most half full, so probe sequences stay short and always end */
+		map->capacity = 2;
+		while (map->capacity < 2 * map->max_entries) {
+			map->capacity <<= 1;
+		}
+		map->slot_size = sizeof(struct vm_map_slot) + VM_MAP_ROUND(map->key_size) + VM_MAP_ROUND(map->value_size);
+		size = (uint64_t)map->capacity * map->slot_size;
+	} else {
+		map->capacity = map->max_entries;
+		map->slot_size = VM_MAP_ROUND(map->value_size);
+		size = (uint64_t)map->capacity * map->slot_size * map->num_cpus;
+	}
+	
+	if (size > *budget) {
+		printf("Map of %lu bytes exceeds the map memory left, %lu bytes.\n", size, *budget);
+		pthread_mutex_destroy(&map->lock);
+		free(map);
+		return NULL;
+	}
+	
+	map->values = calloc(1, size);
+	if (map->values == NULL) {
+		printf("Failed to allocate map, size = %lu.\n", size);
+		pthread_mutex_destroy(&map->lock);
+		free(map);
+		return NULL;
+	}
+	
+	*budget -= size;
+	return map;
+}
+
+static void destroy_map(struct vm_map *map)
+{
+	pthread_mutex_destroy(&map->lock);
+	free(map->values);
+	free(map);
+}
+
+static int same_def(struct vm_map *map, const struct vm_map_def *def)
+{
+	return (map->type == def->type) && (map->key_size == def->key_size) &&
+		(map->value_size == def->value_size) && (map->max_entries == def->max_entries);
+}
+
+/* readers go without the lock, entries are only ever added */
+struct vm_map *vm_executor_find_map(struct ebpf_vm_executor *executor, uint64_t id)
+{
+	for (uint32_t idx = 0; idx < VM_MAX_MAPS; idx++) {
+		struct vm_map *map = __atomic_load_n(&executor->maps[(id + idx) & (VM_MAX_MAPS - 1)], __ATOMIC_ACQUIRE);
+	
+		if ((map == NULL) || (map->id == id)) {
+			return map;
+		}
+	}
+	
+	return NULL;
+}
+
+struct vm_map *vm_executor_get_map(struct ebpf_vm_executor *executor, const char *name)
+{
+	return vm_executor_find_map(executor, vm_map_id(name));
+}
+
+/* returns the executor's instance of the map, creating it on first use */
+struct vm_map *vm_executor_map(struct ebpf_vm_executor *executor, const struct vm_map_def *def)
+{
+	struct vm_map *map = vm_executor_find_map(executor, def->id);
+	uint32_t idx, slot;
+	
+	if (map == NULL) {
+		pthread_mutex_lock(&executor->maps_lock);
+		for (idx = 0; idx < VM_MAX_MAPS; idx++) {
+			slot = (def->id + idx) & (VM_MAX_MAPS - 1);
+			map = executor->maps[slot];
+			if ((map == NULL) || (map->id == def->id)) {
+				break;
+			}
+		}
+	
+		if ((idx < VM_MAX_MAPS) && (map == NULL)) {
+			map = create_map(def, executor->num_workers, &executor->map_memory_left);
+			if (map != NULL) {
+				__atomic_store_n(&executor->maps[slot], map, __ATOMIC_RELEASE);
+			}
+		} else if (idx == VM_MAX_MAPS) {
+			printf("Too many maps.\n");
+		}
+		pthread_mutex_unlock(&executor->maps_lock);
+	}
+	
+	if ((map != NULL) && !same_def(map, def)) {
+		printf("Map definition does not match the existing map.\n");
+		return NULL;
+	}
+	
+	return map;
+}
+
+void vm_executor_destroy_maps(struct ebpf_vm_executor *executor)
+{
+	for (uint32_t idx = 0; idx < VM_MAX_MAPS; idx++) {
+		if (executor->maps[idx] != NULL) {
+			destroy_map(executor->maps[idx]);
+			executor->maps[idx] = NULL;
+		}
+	}
+}
+
+static int read_slot(struct vm_map *map, struct vm_map_slot *slot, const void *key, uint32_t hash, void *value)
+{
+	uint32_t seq, state;
+	int found;
+	
+	while (1) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			continue;
+		}
+	
+		state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+		found = (state == VM_MAP_SLOT_USED) && (slot->hash == hash) && (memcmp(slot->key, key, map->key_size) == 0);
+		if (found && (value != NULL)) {
+			memcpy(value, slot_value(map, slot), map->value_size);
+		}
+	
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+			break;
+		}
+	}
+	
+	if (state == VM_MAP_SLOT_EMPTY) {
+		return -1;
+	}
+	
+	return found ? 1 : 0;
+}
+
+static struct vm_map_slot *hash_probe(struct vm_map *map, const void *key, uint32_t hash, void *value)
+{
+	uint32_t mask = map->capacity - 1;
+	
+	for (uint32_t idx = 0; idx < map->capacity; idx++) {
+		struct vm_map_slot *slot = get_slot(map, (hash + idx) & mask);
+		int ret = read_slot(map, slot, key, hash, value);
+	
+		if (ret < 0) {
+			break;
+		}
+	
+		if (ret > 0) {
+			return slot;
+		}
+	}
+	
+	return NULL;
+}
+
+/* a rebuild moves entries between slots, so the whole probe is retried when map->seq moved */
+static int hash_lookup(struct vm_map *map, const void *key, void *value)
+{
+	uint32_t hash = hash_key(key, map->key_size);
+	struct vm_map_slot *slot = NULL;
+	uint32_t seq;
+	
+	while (1) {
+		seq = __atomic_load_n(&map->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			continue;
+		}
+	
+		slot = hash_probe(map, key, hash, value);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&map->seq, __ATOMIC_RELAXED) == seq) {
+			break;
+		}
+	}
+	
+	if (slot == NULL) {
+		return -1;
+	}
+	
+	if (map->type == VM_MAP_TYPE_LRU_HASH) {
+		__atomic_store_n(&slot->atime, __atomic_add_fetch(&map->clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+static void slot_write_begin(struct vm_map_slot *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void slot_write_end(struct vm_map_slot *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* called with the map lock held */
+static struct vm_map_slot *hash_find_locked(struct vm_map *map, const void *key, uint32_t hash, struct vm_map_slot **free_slot)
+{
+	uint32_t mask = map->capacity - 1;
+	
+	*free_slot = NULL;
+	for (uint32_t idx = 0; idx < map->capacity; idx++) {
+		struct vm_map_slot *slot = get_slot(map, (hash + idx) & mask);
+	
+		if (slot->state == VM_MAP_SLOT_EMPTY) {
+			if (*free_slot == NULL) {
+				*free_slot = slot;
+			}
+			break;
+		}
+	
+		if (slot->state == VM_MAP_SLOT_DELETED) {
+			if (*free_slot == NULL) {
+				*free_slot = slot;
+			}
+			continue;
+		}
+	
+		if ((slot->hash == hash) && (memcmp(slot->key, key, map->key_size) == 0)) {
+			return slot;
+		}
+	}
+	
+	return NULL;
+}
+
+static void hash_remove_locked(struct vm_map *map, struct vm_map_slot *slot)
+{
+	slot_write_begin(slot);
+	__atomic_store_n(&slot->state, VM_MAP_SLOT_DELETED, __ATOMIC_RELAXED);
+	slot_write_end(slot);
+	map->count--;
+	map->tombstones++;
+}
+
+/*
+ * Drops the tombstones in place, the slots stay where readers may look at
+ * them. Readers retry while map->seq is odd, writers hold the map lock.
+ */
+static int hash_rebuild_locked(struct vm_map *map)
+{
+	uint32_t mask = map->capacity - 1;
+	uint32_t num = 0, idx;
+	struct vm_map_slot *slot, *entry;
+	uint8_t *saved = NULL;
+	
+	saved = malloc((uint64_t)(map->count + 1) * map->slot_size);
+	if (saved == NULL) {
+		return -1;
+	}
+	
+	for (idx = 0; idx < map->capacity; idx++) {
+		slot = get_slot(map, idx);
+		if (slot->state == VM_MAP_SLOT_USED) {
+			memcpy(saved + (uint64_t)num++ * map->slot_size, slot, map->slot_size);
+		}
+	}
+	
+	__atomic_store_n(&map->seq, map->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (idx = 0; idx < map->capacity; idx++) {
+		slot = get_slot(map, idx);
+		if (slot->state != VM_MAP_SLOT_EMPTY) {
+			slot_write_begin(slot);
+			__atomic_store_n(&slot->state, VM_MAP_SLOT_EMPTY, __ATOMIC_RELAXED);
+			slot_write_end(slot);
+		}
+	}
+	
+	for (uint32_t pos = 0; pos < num; pos++) {
+		entry = (struct vm_map_slot *)(saved + (uint64_t)pos * map->slot_size);
+		idx = entry->hash & mask;
+		while (get_slot(map, idx)->state != VM_MAP_SLOT_EMPTY) {
+			idx = (idx + 1) & mask;
+		}
+	
+		slot = get_slot(map, idx);
+		slot_write_begin(slot);
+		slot->hash = entry->hash;
+		slot->atime = entry->atime;
+		memcpy(slot->key, entry->key, map->slot_size - sizeof(*slot));
+		__atomic_store_n(&slot->state, VM_MAP_SLOT_USED, __ATOMIC_RELAXED);
+		slot_write_end(slot);
+	}
+	map->tombstones = 0;
+	__atomic_store_n(&map->seq, map->seq + 1, __ATOMIC_RELEASE);
+	
+	free(saved);
+	return 0;
+}
+
+/* a failed rebuild leaves the tombstones, lookups stay correct only slower */
+static void hash_compact_locked(struct vm_map *map)
+{
+	if (map->tombstones >= VM_MAP_MAX_TOMBSTONES(map->capacity)) {
+		(void)hash_rebuild_locked(map);
+	}
+}
+
+/* approximate lru: the oldest of the used slots following the one being inserted */
+static void lru_evict_locked(struct vm_map *map, uint32_t hash)
+{
+	struct vm_map_slot *victim = NULL;
+	uint32_t mask = map->capacity - 1;
+	uint32_t sampled = 0;
+	
+	for (uint32_t idx = 0; (idx < map->capacity) && (sampled < VM_MAP_LRU_SAMPLE); idx++) {
+		struct vm_map_slot *slot = get_slot(map, (hash + idx) & mask);
+	
+		if (slot->state != VM_MAP_SLOT_USED) {
+			continue;
+		}
+	
+		if ((victim == NULL) || (slot->atime < victim->atime)) {
+			victim = slot;
+		}
+		sampled++;
+	}
+	
+	if (victim != NULL) {
+		hash_remove_locked(map, victim);
+	}
+}
+
+static int hash_update(struct vm_map *map, const void *key, const void *value, uint64_t flags)
+{
+	uint32_t hash = hash_key(key, map->key_size);
+	struct vm_map_slot *slot, *free_slot;
+	int ret = 0;
+	
+	pthread_mutex_lock(&map->lock);
+	hash_compact_locked(map);
+	slot = hash_find_locked(map, key, hash, &free_slot);
+	if (slot != NULL) {
+		if (flags == VM_MAP_NOEXIST) {
+			ret = -1;
+		} else {
+			slot_write_begin(slot);
+			memcpy(slot_value(map, slot), value, map->value_size);
+			slot_write_end(slot);
+		}
+	} else if (flags == VM_MAP_EXIST) {
+		ret = -1;
+	} else {
+		if (map->count >= map->max_entries) {
+			if (map->type == VM_MAP_TYPE_LRU_HASH) {
+				lru_evict_locked(map, hash);
+				(void)hash_find_locked(map, key, hash, &free_slot);
+			} else {
+				free_slot = NULL;
+			}
+		}
+	
+		if ((free_slot == NULL) || (map->count >= map->max_entries)) {
+			ret = -1;
+		} else {
+			slot = free_slot;
+			if (slot->state == VM_MAP_SLOT_DELETED) {
+				map->tombstones--;
+			}
+			slot_write_begin(slot);
+			slot->hash = hash;
+			slot->atime = __atomic_add_fetch(&map->clock, 1, __ATOMIC_RELAXED);
+			memcpy(slot->key, key, map->key_size);
+			memcpy(slot_value(map, slot), value, map->value_size);
+			__atomic_store_n(&slot->state, VM_MAP_SLOT_USED, __ATOMIC_RELAXED);
+			slot_write_end(slot);
+			map->count++;
+		}
+	}
+	pthread_mutex_unlock(&map->lock);
+	return ret;
+}
+
+static int hash_delete(struct vm_map *map, const void *key)
+{
+	uint32_t hash = hash_key(key, map->key_size);
+	struct vm_map_slot *slot, *free_slot;
+	
+	pthread_mutex_lock(&map->lock);
+	slot = hash_find_locked(map, key, hash, &free_slot);
+	if (slot != NULL) {
+		hash_remove_locked(map, slot);
+		hash_compact_locked(map);
+	}
+	pthread_mutex_unlock(&map->lock);
+	return (slot != NULL) ? 0 : -1;
+}
+
+static uint8_t *array_value(struct vm_map *map, const void *key, uint32_t cpu)
+{
+	uint32_t idx;
+	
+	memcpy(&idx, key, sizeof(idx));
+	if ((idx >= map->max_entries) || (cpu >= map->num_cpus)) {
+		return NULL;
+	}
+	
+	return map->values + ((uint64_t)cpu * map->capacity + idx) * map->slot_size;
+}
+
+/*
+ * cpu selects the slot of per-cpu arrays and is the index of the calling
+ * worker; VM_MAP_ALL_CPUS reads the values of every worker back to back.
+ */
+int vm_map_lookup(struct vm_map *map, const void *key, void *value, uint32_t cpu)
+{
+	uint8_t *elem = NULL;
+	
+	if (is_hash(map)) {
+		return hash_lookup(map, key, value);
+	}
+	
+	if ((cpu == VM_MAP_ALL_CPUS) && (map->type == VM_MAP_TYPE_PERCPU_ARRAY)) {
+		for (uint32_t idx = 0; idx < map->num_cpus; idx++) {
+			elem = array_value(map, key, idx);
+			if (elem == NULL) {
+				return -1;
+			}
+			memcpy((uint8_t *)value + idx * map->value_size, elem, map->value_size);
+		}
+		return 0;
+	}
+	
+	elem = array_value(map, key, (map->type == VM_MAP_TYPE_PERCPU_ARRAY) ? cpu : 0);
+	if (elem == NULL) {
+		return -1;
+	}
+	
+	memcpy(value, elem, map->value_size);
+	return 0;
+}
+
+int vm_map_update(struct vm_map *map, const void *key, const void *value, uint64_t flags, uint32_t cpu)
+{
+	uint8_t *elem = NULL;
+	
+	if (flags > VM_MAP_EXIST) {
+		return -1;
+	}
+	
+	if (is_hash(map)) {
+		return hash_update(map, key, value, flags);
+	}
+	
+	/* array elements always exist */
+	elem = array_value(map, key, (map->type == VM_MAP_TYPE_PERCPU_ARRAY) ? cpu : 0);
+	if ((elem == NULL) || (flags == VM_MAP_NOEXIST)) {
+		return -1;
+	}
+	
+	memcpy(elem, value, map->value_size);
+	return 0;
+}
+
+int vm_map_delete(struct vm_map *map, const void *key)
+{
+	if (is_hash(map)) {
+		return hash_delete(map, key);
+	}
+	
+	return -1;
+}
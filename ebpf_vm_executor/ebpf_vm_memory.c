@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+
+#define PKT_VM_EXECUTOR 1
+
+#include "ebpf_vm_simulator.h"
+#include "ebpf_vm_functions.h"
+#include "ebpf_vm_log.h"
+
+static int is_local_node(struct ebpf_vm_executor *executor, struct node_url *n)
+{
+	return (n->ip == executor->self_url.ip) && (n->port == executor->self_url.port);
+}
+
+static uint32_t mem_chunk_size(struct ebpf_vm_executor *executor)
+{
+	uint32_t size = executor->max_msg_size - sizeof(struct vm_msg_header) - sizeof(struct vm_mem_msg);
+	
+	return size & ~(VM_MSG_ALIGN - 1);
+}
+
+/* replies carry the op id as hash, which routes them to the worker owning the operation */
+static int send_mem_msg(struct ebpf_vm_worker *worker, struct node_url *dst, uint16_t type,
+	struct vm_mem_msg *msg, const void *data)
+{
+	struct vm_msg_part parts[2];
+	
+	parts[0].buf = msg;
+	parts[0].size = sizeof(*msg);
+	parts[1].buf = data;
+	parts[1].size = (data != NULL) ? msg->len : 0;
+	
+	return vm_send_msg(worker, dst, (uint32_t)msg->op_id, type, parts, 2);
+}
+
+static void complete_mem_op(struct ebpf_vm_worker *worker, struct vm_mem_op *op, uint64_t status)
+{
+	struct ebpf_vm *vm = vm_worker_find_vm(worker, op->vm_id);
+	uint64_t *completion = NULL;
+	
+	if (vm != NULL) {
+		completion = (uint64_t *)vm_mmu(op->completion_addr, vm);
+		if (completion != (uint64_t *)PAGE_TABLE_ERROR) {
+			__atomic_store_n(completion, status, __ATOMIC_RELEASE);
+		}
+	}
+	
+	ub_list_remove(&op->list);
+	free(op);
+}
+
+static struct vm_mem_op *find_mem_op(struct ebpf_vm_worker *worker, uint64_t id)
+{
+	struct vm_mem_op *op = NULL;
+	
+	UB_LIST_FOR_EACH(op, list, &worker->mem_op_list) {
+		if (op->id == id) {
+			return op;
+		}
+	}
+	
+	return NULL;
+}
+
+static int write_completion(struct ebpf_vm *vm, uint64_t completion_addr, uint64_t status)
+{
+	uint64_t *completion = (uint64_t *)vm_mmu(completion_addr, vm);
+	
+	if (completion == (uint64_t *)PAGE_TABLE_ERROR) {
+		return -1;
+	}
+	
+	__atomic_store_n(completion, status, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int vm_remote_memcpy(struct ebpf_vm *vm, struct ub_address *dst, struct ub_address *src, uint64_t len,
+	uint64_t completion_addr, uint64_t result)
+{
+	struct ebpf_vm_executor *executor = vm->rd.executor;
+	struct ebpf_vm_worker *worker = vm->rd.worker;
+	struct node_url *dst_node = (struct node_url *)dst->url;
+	struct node_url *src_node = (struct node_url *)src->url;
+	struct node_url *remote = NULL;
+	struct vm_mem_op *op = NULL;
+	struct vm_mem_msg msg;
+	uint32_t chunk;
+	
+	/* offsets and lengths of the messages are 32 bits */
+	if (len > UINT32_MAX) {
+		vm_log("Copy of %lu bytes is too large.", len);
+		return write_completion(vm, completion_addr, MEMCPY_FAILED);
+	}
+	
+	if (is_local_node(executor, dst_node) && is_local_node(executor, src_node)) {
+		/* both ends are on this node, no message is needed at all */
+		memcpy((void *)dst->access_key, (void *)src->access_key, len);
+		return write_completion(vm, completion_addr, result);
+	}
+	
+	if (!is_local_node(executor, dst_node) && !is_local_node(executor, src_node)) {
+		vm_log("Copy between two remote nodes is not supported.");
+		return write_completion(vm, completion_addr, MEMCPY_FAILED);
+	}
+	
+	remote = is_local_node(executor, src_node) ? dst_node : src_node;
+	switch (executor->transport->resolve(executor->transport_ctx, remote)) {
+	case PKT_VM_PEER_PENDING:
+		/* nothing is issued yet, the helper is called again once the peer is resolved */
+		update_vm_state(vm, VM_STATE_WAIT_FOR_PEER);
+		return 0;
+	case PKT_VM_PEER_FAILED:
+		return write_completion(vm, completion_addr, MEMCPY_FAILED);
+	default:
+		update_vm_state(vm, VM_STATE_RUNNING);
+		break;
+	}
+	
+	op = calloc(1, sizeof(*op));
+	if (op == NULL) {
+		vm_log("Failed to allocate memory operation.");
+		return write_completion(vm, completion_addr, MEMCPY_FAILED);
+	}
+	
+	op->id = (worker->next_mem_op_id++ << VM_ID_WORKER_SHIFT) | worker->index;
+	op->vm_id = vm->rd.id;
+	op->local_addr = dst->access_key;
+	op->completion_addr = completion_addr;
+	op->result = result;
+	op->len = len;
+	op->remaining = len;
+	ub_list_push_back(&worker->mem_op_list, &op->list);
+	
+	if (len == 0) {
+		complete_mem_op(worker, op, result);
+		return 0;
+	}
+	
+	msg.requester = executor->self_url;
+	msg.op_id = op->id;
+	
+	if (remote == src_node) {
+		/* one read request, the owner of the memory streams the data back in chunks */
+		msg.addr = src->access_key;
+		msg.offset = 0;
+		msg.len = len;
+		if (send_mem_msg(worker, remote, VM_MSG_MEM_READ, &msg, NULL) != 0) {
+			complete_mem_op(worker, op, MEMCPY_FAILED);
+		}
+		return 0;
+	}
+	
+	chunk = mem_chunk_size(executor);
+	msg.addr = dst->access_key;
+	for (msg.offset = 0; msg.offset < len; msg.offset += msg.len) {
+		msg.len = ((len - msg.offset) < chunk) ? (len - msg.offset) : chunk;
+		if (send_mem_msg(worker, remote, VM_MSG_MEM_WRITE, &msg, (uint8_t *)src->access_key + msg.offset) != 0) {
+			complete_mem_op(worker, op, MEMCPY_FAILED);
+			return 0;
+		}
+	}
+	
+	return 0;
+}
+
+static void serve_mem_read(struct ebpf_vm_worker *worker, struct vm_mem_msg *req)
+{
+	struct vm_mem_msg msg = *req;
+	uint32_t chunk = mem_chunk_size(worker->executor);
+	uint32_t total = req->len;
+	
+	for (msg.offset = 0; msg.offset < total; msg.offset += msg.len) {
+		msg.len = ((total - msg.offset) < chunk) ? (total - msg.offset) : chunk;
+		if (send_mem_msg(worker, &req->requester, VM_MSG_MEM_READ_DATA, &msg,
+						 (uint8_t *)req->addr + msg.offset) != 0) {
+			vm_log("Failed to send memory read data.");
+			return;
+		}
+	}
+}
+
+static void serve_mem_msg(struct ebpf_vm_worker *worker, uint16_t type, struct vm_mem_msg *msg)
+{
+	if (type == VM_MSG_MEM_READ) {
+		serve_mem_read(worker, msg);
+	} else if (send_mem_msg(worker, &msg->requester, VM_MSG_MEM_WRITE_ACK, msg, NULL) != 0) {
+		vm_log("Failed to acknowledge memory write.");
+	}
+}
+
+static void reply_mem_msg(struct ebpf_vm_worker *worker, uint16_t type, struct vm_mem_msg *msg)
+{
+	struct ebpf_vm_executor *executor = worker->executor;
+	struct vm_deferred_mem_msg *deferred = NULL;
+	
+	switch (executor->transport->resolve(executor->transport_ctx, &msg->requester)) {
+	case PKT_VM_PEER_READY:
+		serve_mem_msg(worker, type, msg);
+		return;
+	case PKT_VM_PEER_FAILED:
+		vm_log("Failed to resolve memory requester.");
+		return;
+	default:
+		break;
+	}
+	
+	/* the requester is not resolved yet, keep the request until it is */
+	deferred = malloc(sizeof(*deferred));
+	if (deferred == NULL) {
+		vm_log("Failed to defer memory request.");
+		return;
+	}
+	
+	deferred->type = type;
+	deferred->msg = *msg;
+	ub_list_push_back(&worker->deferred_mem_list, &deferred->list);
+}
+
+void vm_receive_mem_msg(struct ebpf_vm_worker *worker, uint16_t type, void *buf, int buf_size)
+{
+	struct vm_mem_msg *msg = buf;
+	struct vm_mem_op *op = NULL;
+	
+	if ((buf_size < sizeof(*msg)) ||
+		(((type == VM_MSG_MEM_READ_DATA) || (type == VM_MSG_MEM_WRITE)) && (buf_size - sizeof(*msg) < msg->len))) {
+		vm_log("Invalid memory message, buf_size = %lu.", (uint64_t)buf_size);
+		return;
+	}
+	
+	switch (type) {
+	case VM_MSG_MEM_READ:
+		reply_mem_msg(worker, type, msg);
+		break;
+	case VM_MSG_MEM_WRITE:
+		memcpy((uint8_t *)msg->addr + msg->offset, msg + 1, msg->len);
+		reply_mem_msg(worker, type, msg);
+		break;
+	case VM_MSG_MEM_READ_DATA:
+	case VM_MSG_MEM_WRITE_ACK:
+		op = find_mem_op(worker, msg->op_id);
+		if (op == NULL) {
+			return;
+		}
+	
+		if (type == VM_MSG_MEM_READ_DATA) {
+			/* the id may be known to any peer, the data has to fall into the op */
+			if ((uint64_t)msg->offset + msg->len > op->len) {
+				vm_log("Memory read data out of range, offset = %u, len = %u.", msg->offset, msg->len);
+				return;
+			}
+			memcpy((uint8_t *)op->local_addr + msg->offset, msg + 1, msg->len);
+		}
+	
+		op->remaining -= (msg->len < op->remaining) ? msg->len : op->remaining;
+		if (op->remaining == 0) {
+			complete_mem_op(worker, op, op->result);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void vm_mem_op_poll(struct ebpf_vm_worker *worker)
+{
+	struct ebpf_vm_executor *executor = worker->executor;
+	struct vm_deferred_mem_msg *deferred, *tmp;
+	
+	UB_LIST_FOR_EACH_SAFE(deferred, tmp, list, &worker->deferred_mem_list) {
+		int ret = executor->transport->resolve(executor->transport_ctx, &deferred->msg.requester);
+		if (ret == PKT_VM_PEER_PENDING) {
+			continue;
+		}
+	
+		if (ret == PKT_VM_PEER_READY) {
+			serve_mem_msg(worker, deferred->type, &deferred->msg);
+		}
+	
+		ub_list_remove(&deferred->list);
+		free(deferred);
+	}
+}
+
+void vm_mem_op_cleanup(struct ebpf_vm_worker *worker)
+{
+	struct vm_deferred_mem_msg *deferred, *tmp_deferred;
+	struct vm_mem_op *op, *tmp_op;
+	
+	UB_LIST_FOR_EACH_SAFE(deferred, tmp_deferred, list, &worker->deferred_mem_list) {
+		ub_list_remove(&deferred->list);
+		free(deferred);
+	}
+	
+	UB_LIST_FOR_EACH_SAFE(op, tmp_op, list, &worker->mem_op_list) {
+		ub_list_remove(&op->list);
+		free(op);
+	}
+}
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "ebpf_vm_simulator.h"
+#include "ebpf_vm_log.h"
+
+static uint32_t outbound_hash_url(struct node_url *n, uint32_t route)
+{
+	uint64_t key = ((uint64_t)n->ip << 16) | n->port;
+	
+	key = (key << 4) | route;
+	return (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & (VM_OUTBOUND_HASH_SIZE - 1);
+}
+
+/*
+ * A batch travels as one transport message to one queue of the peer, so
+ * records are batched per destination and per route to the peer's workers.
+ */
+static struct vm_outbound *get_outbound(struct ebpf_vm_worker *worker, struct node_url *dst, uint32_t route)
+{
+	struct ub_list *bucket = &worker->outbound_hash[outbound_hash_url(dst, route)];
+	struct vm_outbound *out = NULL;
+	
+	UB_LIST_FOR_EACH(out, node, bucket) {
+		if ((out->dst.ip == dst->ip) && (out->dst.port == dst->port) && (out->route == route)) {
+			return out;
+		}
+	}
+	
+	out = malloc(sizeof(*out) + worker->executor->max_msg_size);
+	if (out == NULL) {
+		return NULL;
+	}
+	
+	out->dst.ip = dst->ip;
+	out->dst.port = dst->port;
+	out->dst.reserved = 0;
+	out->route = route;
+	out->len = 0;
+	out->start_ns = 0;
+	out->fail_ns = 0;
+	ub_list_push_back(bucket, &out->node);
+	return out;
+}
+
+/* a failed batch stays queued and -1 is returned, it is only dropped once VM_OUTBOUND_RETRY_MS passed */
+static int flush_outbound(struct ebpf_vm_worker *worker, struct vm_outbound *out)
+{
+	struct ebpf_vm_executor *executor = worker->executor;
+	struct transport_message send_msg;
+	uint64_t send_ns = executor->state.latency ? vm_now_ns() : 0;
+	int ret = 0, len;
+	
+	send_msg.buf = out->buf;
+	send_msg.buf_size = out->len;
+	send_msg.queue = worker->index;
+	send_msg.hash = out->route;
+	len = executor->transport->send(executor->transport_ctx, &out->dst, &send_msg);
+	if (executor->state.latency) {
+		vm_hist_record(&worker->latency->hists[VM_LAT_SEND], vm_now_ns() - send_ns);
+	}
+	
+	if (len != send_msg.buf_size) {
+		worker->stats.send_failures++;
+		send_ns = vm_now_ns();
+		if (out->fail_ns == 0) {
+			out->fail_ns = send_ns;
+		}
+		if (send_ns - out->fail_ns < VM_OUTBOUND_RETRY_MS * 1000000ULL) {
+			return -1;
+		}
+		vm_log("Failed to send %lu bytes of batched messages for %u ms, dropping them.", (uint64_t)send_msg.buf_size,
+			VM_OUTBOUND_RETRY_MS);
+		ret = -1;
+	} else {
+		worker->stats.msgs_sent++;
+		worker->stats.bytes_sent += send_msg.buf_size;
+	}
+	
+	out->len = 0;
+	out->fail_ns = 0;
+	ub_list_remove(&out->list);
+	return ret;
+}
+
+int vm_send_msg(struct ebpf_vm_worker *worker, struct node_url *dst, uint32_t hash, uint16_t type,
+	struct vm_msg_part *parts, int num)
+{
+	struct ebpf_vm_executor *executor = worker->executor;
+	struct vm_outbound *out = NULL;
+	struct vm_msg_header *hdr = NULL;
+	uint32_t size = 0, record_size, offset;
+	
+	for (int idx = 0; idx < num; idx++) {
+		size += parts[idx].size;
+	}
+	
+	record_size = VM_MSG_RECORD_SIZE(size);
+	if (record_size > executor->max_msg_size) {
+		vm_log("Message is too big to send.");
+		return -1;
+	}
+	
+	out = get_outbound(worker, dst, hash & (VM_MAX_WORKERS - 1));
+	if (out == NULL) {
+		vm_log("Failed to allocate outbound buffer.");
+		return -1;
+	}
+	
+	/* the record does not fit behind a batch the peer did not take, the caller tries again later */
+	if ((out->len != 0) && (out->len + record_size > executor->max_msg_size)) {
+		(void)flush_outbound(worker, out);
+		if (out->len != 0) {
+			return VM_SEND_BUSY;
+		}
+	}
+	
+	if (out->len == 0) {
+		out->start_ns = (executor->batch_timeout_us != 0) ? vm_now_ns() : 0;
+		ub_list_push_back(&worker->outbound_list, &out->list);
+	}
+	
+	hdr = (struct vm_msg_header *)(out->buf + out->len);
+	hdr->type = type;
+	hdr->reserved = 0;
+	hdr->size = size;
+	
+	offset = out->len + sizeof(*hdr);
+	for (int idx = 0; idx < num; idx++) {
+		memcpy(out->buf + offset, parts[idx].buf, parts[idx].size);
+		offset += parts[idx].size;
+	}
+	
+	memset(out->buf + offset, 0, out->len + record_size - offset);
+	out->len += record_size;
+	return 0;
+}
+
+void vm_flush_outbound(struct ebpf_vm_worker *worker, int force)
+{
+	struct ebpf_vm_executor *executor = worker->executor;
+	struct vm_outbound *out = NULL, *tmp = NULL;
+	uint64_t now = 0;
+	
+	if (ub_list_is_empty(&worker->outbound_list)) {
+		return;
+	}
+	
+	/* without a timeout everything queued during this pass goes out at the end of the pass */
+	if ((force == 0) && (executor->batch_timeout_us != 0)) {
+		now = vm_now_ns();
+	}
+	
+	UB_LIST_FOR_EACH_SAFE(out, tmp, list, &worker->outbound_list) {
+		if ((now != 0) && (now - out->start_ns < executor->batch_timeout_us * 1000ULL)) {
+			continue;
+		}
+	
+		(void)flush_outbound(worker, out);
+	}
+}
+
+int vm_outbound_init(struct ebpf_vm_worker *worker)
+{
+	for (int idx = 0; idx < VM_OUTBOUND_HASH_SIZE; idx++) {
+		ub_list_init(&worker->outbound_hash[idx]);
+	}
+	
+	ub_list_init(&worker->outbound_list);
+	return 0;
+}
+
+void vm_outbound_cleanup(struct ebpf_vm_worker *worker)
+{
+	struct vm_outbound *out = NULL, *tmp = NULL;
+	
+	for (int idx = 0; idx < VM_OUTBOUND_HASH_SIZE; idx++) {
+		UB_LIST_FOR_EACH_SAFE(out, tmp, node, &worker->outbound_hash[idx]) {
+			ub_list_remove(&out->node);
+			free(out);
+		}
+	}
+	
+	ub_list_init(&worker->outbound_list);
+}
@@ -0,0 +1,478 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "ebpf_vm_simulator.h"
+#include "ebpf_vm_packet.h"
+#include "ebpf_vm_flow.h"
+#include "ebpf_vm_perf.h"
+
+/*
+ * A runner owns one vm instance and feeds it the packets of one source, in
+ * the calling thread, or in worker 0 of an attached executor. Each packet
+ * only resets the registers and the packet mapping and is copied into the
+ * padded buffer, a batch costs one call into the source. In flow mode the vm comes from the flow table instead.
+ */
+struct vm_packet_runner {
+	struct vm_packet_source_ops *ops;
+	void *ctx;
+	struct vm_packet_config cfg;
+	struct ebpf_vm_program *prog;
+	struct ebpf_vm *vm;
+	uint64_t entry_fp;
+	uint32_t should_stop;
+	/* the source ended and the flows are flushed */
+	uint32_t done;
+	uint64_t start_ns;
+	/* NULL unless flow_slots is set */
+	struct vm_flow_table *flows;
+	/* latest packet timestamp, the time base of the flow timeouts */
+	uint64_t clock_ns;
+	/* the mapped copy of the packet, buf_size bytes and VM_PKT_PAD more */
+	uint8_t *buf;
+	uint32_t buf_size;
+	struct vm_packet_stats stats;
+	struct vm_packet pkts[VM_PKT_MAX_BATCH];
+};
+
+static struct vm_packet_source_ops *registered_packet_source[VM_PKT_SOURCE_MAX];
+
+int register_packet_source(struct vm_packet_source_ops *ops)
+{
+	registered_packet_source[ops->type] = ops;
+	return 0;
+}
+
+/*
+ * vms of an attached runner belong to worker 0, the others only get the
+ * helpers. The packet entry stays reserved also while no packet is mapped.
+ */
+static struct ebpf_vm *new_vm(struct vm_packet_runner *runner)
+{
+	struct ebpf_vm *vm = NULL;
+	
+	if (vm_instantiate(runner->prog, 1, &vm, NULL) != 1) {
+		return NULL;
+	}
+	
+	vm->rd.reserved_ptes = 1U << VM_PKT_PTE;
+	if (runner->cfg.executor != NULL) {
+		vm_worker_bind(&runner->cfg.executor->workers[0], vm);
+	} else {
+		vm->rd.symbols = ebpf_global_helpers()->symbols;
+	}
+	return vm;
+}
+
+struct vm_packet_runner *vm_packet_open(struct ebpf_vm_program *prog, const struct vm_packet_config *cfg)
+{
+	struct vm_packet_runner *runner = NULL;
+	
+	if ((cfg->source >= VM_PKT_SOURCE_MAX) || (registered_packet_source[cfg->source] == NULL)) {
+		printf("Unsupported packet source %u.\n", cfg->source);
+		return NULL;
+	}
+	
+	runner = calloc(1, sizeof(*runner));
+	if (runner == NULL) {
+		printf("Failed to allocate packet runner.\n");
+		return NULL;
+	}
+	
+	runner->cfg = *cfg;
+	if (runner->cfg.batch_size == 0) {
+		runner->cfg.batch_size = VM_PKT_DEFAULT_BATCH;
+	} else if (runner->cfg.batch_size > VM_PKT_MAX_BATCH) {
+		runner->cfg.batch_size = VM_PKT_MAX_BATCH;
+	}
+	if (runner->cfg.block_size == 0) {
+		runner->cfg.block_size = VM_PKT_DEFAULT_BLOCK_SIZE;
+	}
+	if (runner->cfg.block_num == 0) {
+		runner->cfg.block_num = VM_PKT_DEFAULT_BLOCK_NUM;
+	}
+	if (runner->cfg.block_timeout_ms == 0) {
+		runner->cfg.block_timeout_ms = VM_PKT_DEFAULT_BLOCK_TIMEOUT_MS;
+	}
+	
+	if ((cfg->executor != NULL) && (cfg->executor->packets != NULL)) {
+		printf("The executor already polls a packet runner.\n");
+		free(runner);
+		return NULL;
+	}
+	
+	runner->buf_size = VM_PKT_DEFAULT_BUF_SIZE;
+	runner->buf = malloc(runner->buf_size + VM_PKT_PAD);
+	if (runner->buf == NULL) {
+		printf("Failed to allocate packet buffer.\n");
+		free(runner);
+		return NULL;
+	}
+	
+	runner->prog = prog;
+	runner->vm = new_vm(runner);
+	if (runner->vm == NULL) {
+		free(runner->buf);
+		free(runner);
+		return NULL;
+	}
+	runner->entry_fp = runner->vm->reg[EBPF_REG_FP];
+	/* it runs the next packet, wherever it would have migrated to */
+	runner->vm->rd.pinned = 1;
+	
+	if (cfg->flow_slots != 0) {
+		runner->flows = vm_flow_table_create(cfg->flow_slots, cfg->flow_timeout_ms);
+		if (runner->flows == NULL) {
+			destroy_vm(runner->vm);
+			free(runner->buf);
+			free(runner);
+			return NULL;
+		}
+	}
+	
+	runner->ops = registered_packet_source[cfg->source];
+	runner->ctx = runner->ops->open(&runner->cfg);
+	if (runner->ctx == NULL) {
+		vm_flow_table_destroy(runner->flows);
+		destroy_vm(runner->vm);
+		free(runner->buf);
+		free(runner);
+		return NULL;
+	}
+	
+	if (cfg->executor != NULL) {
+		cfg->executor->packets = runner;
+	}
+	
+	return runner;
+}
+
+static struct vm_pte *packet_pte(struct ebpf_vm *vm)
+{
+	return &vm->page_table[vm->sys_reg[EBPF_SYS_REG_PAGE_TABLE_IDX]].entries[VM_PKT_PTE];
+}
+
+/* only packets longer than any before get here */
+static int grow_buf(struct vm_packet_runner *runner, uint32_t len)
+{
+	uint32_t size = runner->buf_size;
+	uint8_t *buf = NULL;
+	
+	while (size < len) {
+		size *= 2;
+	}
+	
+	buf = malloc((size_t)size + VM_PKT_PAD);
+	if (buf == NULL) {
+		return -1;
+	}
+	
+	free(runner->buf);
+	runner->buf = buf;
+	runner->buf_size = size;
+	return 0;
+}
+
+static inline void run_packet(struct vm_packet_runner *runner, struct ebpf_vm *vm, const struct vm_packet *pkt,
+	uint64_t flags)
+{
+	struct vm_pte *pte = packet_pte(vm);
+	uint64_t insns = vm->rd.insns_retired;
+	uint64_t verdict;
+	
+	if ((pkt->len > runner->buf_size) && (grow_buf(runner, pkt->len) != 0)) {
+		runner->stats.errors++;
+		return;
+	}
+	
+	/* a shorter packet must not show the tail of the one before */
+	memcpy(runner->buf, pkt->data, pkt->len);
+	memset(runner->buf + pkt->len, 0, VM_PKT_PAD);
+	pte->va = (uint64_t)(uintptr_t)runner->buf;
+	pte->size = pkt->len;
+	vm->reg[EBPF_REG_ARG1] = VM_PKT_VA;
+	vm->reg[EBPF_REG_ARG2] = pkt->len;
+	vm->reg[EBPF_REG_ARG3] = pkt->wire_len;
+	vm->reg[EBPF_REG_ARG4] = pkt->ts_ns;
+	vm->reg[EBPF_REG_ARG5] = flags;
+	vm->reg[EBPF_REG_FP] = runner->entry_fp;
+	vm->sys_reg[EBPF_SYS_REG_PC] = runner->prog->entry;
+	vm->state.stack_depth = 0;
+	vm->state.vm_state = VM_STATE_RUNNING;
+	
+	verdict = VM_PERF_RUN(vm);
+	if (vm->state.vm_state != VM_STATE_EXIT) {
+		runner->stats.errors++;
+	} else if (verdict != 0) {
+		runner->stats.matches++;
+	}
+	runner->stats.insns += vm->rd.insns_retired - insns;
+	runner->stats.bytes += pkt->wire_len;
+}
+
+/*
+ * The last run of an idle flow, without a packet. A vm still running or
+ * waiting after it, for a peer of migrate_to() say, is handed to worker 0.
+ */
+static void evict_flow(void *arg, struct vm_flow_entry *entry)
+{
+	struct vm_packet_runner *runner = arg;
+	struct ebpf_vm *vm = entry->vm;
+	struct vm_pte *pte = NULL;
+	uint64_t insns;
+	
+	if (vm == NULL) {
+		return;
+	}
+	
+	runner->stats.flows_evicted++;
+	insns = vm->rd.insns_retired;
+	pte = packet_pte(vm);
+	pte->va = 0;
+	pte->size = 0;
+	vm->reg[EBPF_REG_ARG1] = 0;
+	vm->reg[EBPF_REG_ARG2] = 0;
+	vm->reg[EBPF_REG_ARG3] = 0;
+	vm->reg[EBPF_REG_ARG4] = runner->clock_ns;
+	vm->reg[EBPF_REG_ARG5] = VM_FLOW_EVICT;
+	vm->reg[EBPF_REG_FP] = runner->entry_fp;
+	vm->sys_reg[EBPF_SYS_REG_PC] = runner->prog->entry;
+	vm->state.stack_depth = 0;
+	vm->state.vm_state = VM_STATE_RUNNING;
+	
+	(void)VM_PERF_RUN(vm);
+	runner->stats.insns += vm->rd.insns_retired - insns;
+	if (vm->state.vm_state == VM_STATE_EXIT) {
+		runner->stats.flows_migrated += vm->rd.migrated;
+		destroy_vm(vm);
+	} else if (runner->cfg.executor != NULL) {
+		ub_list_push_back(&runner->cfg.executor->workers[0].vm_list, &vm->rd.list);
+	} else {
+		runner->stats.errors++;
+		destroy_vm(vm);
+	}
+}
+
+/* a flow whose vm could not be created, or migrated away, gets a new one with the next packet */
+static void run_flow_packet(struct vm_packet_runner *runner, const struct vm_packet *pkt)
+{
+	struct vm_flow_entry *entry = NULL;
+	struct vm_flow_key key;
+	uint32_t reverse;
+	uint64_t flags;
+	int created;
+	
+	/* flows time out before the packet can take a slot, even within a batch */
+	if (pkt->ts_ns > runner->clock_ns) {
+		runner->clock_ns = pkt->ts_ns;
+		vm_flow_expire(runner->flows, runner->clock_ns, evict_flow, runner);
+	}
+	
+	if (vm_flow_parse(pkt, &key, &reverse) != 0) {
+		run_packet(runner, runner->vm, pkt, 0);
+		return;
+	}
+	
+	entry = vm_flow_find(runner->flows, &key, runner->clock_ns, &created);
+	if (entry == NULL) {
+		runner->stats.flow_overflows++;
+		run_packet(runner, runner->vm, pkt, 0);
+		return;
+	}
+	
+	entry->last_ns = runner->clock_ns;
+	flags = reverse ? VM_FLOW_REVERSE : 0;
+	if (entry->vm == NULL) {
+		entry->vm = new_vm(runner);
+		if (entry->vm == NULL) {
+			runner->stats.errors++;
+			return;
+		}
+		runner->stats.flows++;
+		flags |= VM_FLOW_NEW;
+	}
+	
+	run_packet(runner, entry->vm, pkt, flags);
+	if (entry->vm->rd.migrated) {
+		destroy_vm(entry->vm);
+		entry->vm = NULL;
+	}
+}
+
+/* packet timestamps are wall clock time */
+static void idle_clock(struct vm_packet_runner *runner)
+{
+	uint64_t now_ns = vm_wall_ns();
+	
+	if (now_ns > runner->clock_ns) {
+		runner->clock_ns = now_ns;
+	}
+}
+
+/* one batch, VM_PKT_SOURCE_END once the source ended, max_packets are done or vm_packet_stop() */
+static int packet_batch(struct vm_packet_runner *runner)
+{
+	struct vm_packet_stats *stats = &runner->stats;
+	struct vm_packet *pkts = runner->pkts;
+	uint64_t max_packets = runner->cfg.max_packets;
+	uint32_t max = runner->cfg.batch_size;
+	int num;
+	
+	if (__atomic_load_n(&runner->should_stop, __ATOMIC_RELAXED)) {
+		return VM_PKT_SOURCE_END;
+	}
+	
+	if (max_packets != 0) {
+		if (stats->packets >= max_packets) {
+			return VM_PKT_SOURCE_END;
+		}
+		if (max_packets - stats->packets < max) {
+			max = max_packets - stats->packets;
+		}
+	}
+	
+	num = runner->ops->next_batch(runner->ctx, pkts, max);
+	if (num == VM_PKT_SOURCE_END) {
+		return VM_PKT_SOURCE_END;
+	}
+	if (num == 0) {
+		/* live sources: a quiet interface still times its flows out */
+		if (runner->flows != NULL) {
+			idle_clock(runner);
+			vm_flow_expire(runner->flows, runner->clock_ns, evict_flow, runner);
+		}
+		return 0;
+	}
+	
+	stats->batches++;
+	for (int idx = 0; idx < num; idx++) {
+		if (idx + 1 < num) {
+			__builtin_prefetch(pkts[idx + 1].data);
+		}
+		if (runner->flows != NULL) {
+			run_flow_packet(runner, &pkts[idx]);
+		} else {
+			run_packet(runner, runner->vm, &pkts[idx], 0);
+		}
+	}
+	stats->packets += num;
+	return num;
+}
+
+static void packet_finish(struct vm_packet_runner *runner)
+{
+	if (runner->flows != NULL) {
+		vm_flow_flush(runner->flows, evict_flow, runner);
+	}
+	
+	runner->stats.elapsed_ns += vm_now_ns() - runner->start_ns;
+	runner->start_ns = 0;
+	if (runner->ops->get_drops != NULL) {
+		runner->stats.source_drops = runner->ops->get_drops(runner->ctx);
+	}
+	runner->done = 1;
+}
+
+/*
+ * Called by worker 0 of an attached executor on every pass. Once the source
+ * ended the executor is stopped as soon as the evicted vms it was handed
+ * have left worker 0.
+ */
+int vm_packet_poll(struct vm_packet_runner *runner)
+{
+	struct ebpf_vm_executor *executor = runner->cfg.executor;
+	
+	if (runner->done) {
+		if (ub_list_is_empty(&executor->workers[0].vm_list)) {
+			vm_executor_stop(executor);
+		}
+		return VM_PKT_SOURCE_END;
+	}
+	
+	if (runner->start_ns == 0) {
+		runner->start_ns = vm_now_ns();
+	}
+	
+	if (packet_batch(runner) == VM_PKT_SOURCE_END) {
+		packet_finish(runner);
+		return VM_PKT_SOURCE_END;
+	}
+	return 0;
+}
+
+/* runs until the source ends, max_packets are done or vm_packet_stop(), an attached runner runs the executor */
+int vm_packet_run(struct vm_packet_runner *runner)
+{
+	int num;
+	
+	if (runner->cfg.executor != NULL) {
+		vm_executor_run(runner->cfg.executor);
+		return 0;
+	}
+	
+	runner->start_ns = vm_now_ns();
+	do {
+		num = packet_batch(runner);
+	} while (num != VM_PKT_SOURCE_END);
+	
+	packet_finish(runner);
+	return 0;
+}
+
+void vm_packet_stop(struct vm_packet_runner *runner)
+{
+	__atomic_store_n(&runner->should_stop, 1, __ATOMIC_RELAXED);
+}
+
+/* while the runner runs the counters may be a batch behind */
+void vm_packet_get_stats(struct vm_packet_runner *runner, struct vm_packet_stats *stats)
+{
+	uint64_t start_ns = runner->start_ns;
+	
+	*stats = runner->stats;
+	if (start_ns != 0) {
+		stats->elapsed_ns += vm_now_ns() - start_ns;
+	}
+}
+
+void vm_packet_report(struct vm_packet_runner *runner, FILE *out)
+{
+	struct vm_packet_stats stats;
+	double secs, pkts;
+	
+	vm_packet_get_stats(runner, &stats);
+	secs = (double)stats.elapsed_ns / 1e9;
+	pkts = (stats.packets != 0) ? (double)stats.packets : 1.0;
+	fprintf(out, "packets=%lu bytes=%lu batches=%lu matches=%lu errors=%lu drops=%lu\n", stats.packets, stats.bytes,
+		stats.batches, stats.matches, stats.errors, stats.source_drops);
+	if (runner->flows != NULL) {
+		fprintf(out, "flows=%lu evicted=%lu migrated=%lu overflows=%lu\n", stats.flows, stats.flows_evicted,
+			stats.flows_migrated, stats.flow_overflows);
+	}
+	fprintf(out, "elapsed=%.3fs mpps=%.3f gbps=%.3f ns_per_pkt=%.1f insns_per_pkt=%.1f pkts_per_batch=%.1f\n", secs,
+		(secs > 0) ? stats.packets / secs / 1e6 : 0.0, (secs > 0) ? stats.bytes * 8 / secs / 1e9 : 0.0,
+		stats.elapsed_ns / pkts, stats.insns / pkts, (stats.batches != 0) ? (double)stats.packets / stats.batches : 0.0);
+}
+
+void vm_packet_close(struct vm_packet_runner *runner)
+{
+	if (runner == NULL) {
+		return;
+	}
+	
+	if (runner->cfg.executor != NULL) {
+		runner->cfg.executor->packets = NULL;
+	}
+	
+	/* a runner closed before the end of its source still has flows */
+	if ((runner->flows != NULL) && !runner->done) {
+		vm_flow_flush(runner->flows, evict_flow, runner);
+	}
+	vm_flow_table_destroy(runner->flows);
+	runner->ops->close(runner->ctx);
+	destroy_vm(runner->vm);
+	free(runner->buf);
+	free(runner);
+}
@@ -0,0 +1,133 @@
+#ifndef _EBPF_VM_PACKET_H_
+#define _EBPF_VM_PACKET_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "ebpf_vm_simulator.h"
+
+/*
+ * Packet mode runs a program once per packet. The packet is copied into a
+ * buffer with VM_PKT_PAD zero bytes behind it and mapped into the vm through
+ * page table entry VM_PKT_PTE, so that a load which starts inside the packet
+ * never leaves the buffer. The program is entered with
+ *   r1 = VM_PKT_VA, the packet starting at its link layer header
+ *   r2 = captured length
+ *   r3 = length on the wire
+ *   r4 = capture timestamp in nanoseconds
+ *   r5 = VM_FLOW_* flags
+ * and its r0 is the verdict, packets with a non zero verdict are counted as
+ * matches. The data region of the vm is kept from packet to packet. Only the
+ * first byte of a load is translated, programs check r2 before reading, past
+ * the packet they read zeros.
+ *
+ * With flow_slots set every IP flow gets a vm of its own, created on its
+ * first packet, so the data region holds per flow state. Packets of both
+ * directions go to the same vm, VM_FLOW_REVERSE marks those sent from the
+ * higher address. An idle flow is run once more with r1 to r3 zero, r4 the
+ * flow clock and VM_FLOW_EVICT, and destroyed after. Its program may
+ * migrate_to() an aggregation node from there, this needs cfg.executor.
+ * Other packets and flows beyond the table size go to one shared vm, its
+ * migrate_to() fails. Flows
+ * are parsed from Ethernet headers, sources refuse other link types then.
+ */
+#define VM_PKT_PTE 1
+#define VM_PKT_VA ((uint64_t)VM_PKT_PTE << INDEX_SHIFT)
+/* the widest load */
+#define VM_PKT_PAD 8
+#define VM_PKT_DEFAULT_BUF_SIZE 2048
+#define VM_PKT_DEFAULT_BATCH 64
+#define VM_PKT_MAX_BATCH 1024
+#define VM_PKT_DEFAULT_BLOCK_SIZE (1 << 20)
+#define VM_PKT_DEFAULT_BLOCK_NUM 64
+#define VM_PKT_DEFAULT_BLOCK_TIMEOUT_MS 10
+/* r5 of the program */
+#define VM_FLOW_NEW 0x1
+#define VM_FLOW_EVICT 0x2
+#define VM_FLOW_REVERSE 0x4
+/* returned by next_batch() once the source has nothing more to give */
+#define VM_PKT_SOURCE_END (-1)
+
+enum {
+	VM_PKT_SOURCE_PCAP,
+	VM_PKT_SOURCE_AF_PACKET,
+	VM_PKT_SOURCE_MAX
+};
+
+struct vm_packet_config {
+	uint32_t source;
+	/* pcap file name, or the interface of AF_PACKET */
+	const char *name;
+	uint32_t batch_size;
+	/* pcap: replays of the file after the first pass, for benchmarks */
+	uint32_t repeat;
+	/* AF_PACKET: TPACKET_V3 ring geometry and block retire timeout */
+	uint32_t block_size;
+	uint32_t block_num;
+	uint32_t block_timeout_ms;
+	/* AF_PACKET: non zero joins a PACKET_FANOUT_HASH group, one runner per thread */
+	uint32_t fanout_group;
+	/* stop after that many packets, 0 runs until the source ends or vm_packet_stop() */
+	uint64_t max_packets;
+	/* power of 2 flow table size, 0 runs every packet in one vm */
+	uint32_t flow_slots;
+	/* idle time after which a flow is evicted, 0 for VM_FLOW_DEFAULT_TIMEOUT_MS */
+	uint32_t flow_timeout_ms;
+	/*
+	 * Runs the vms on worker 0 of the executor, which polls the runner
+	 * between its own vms. Helpers that talk to other nodes need it.
+	 */
+	struct ebpf_vm_executor *executor;
+};
+
+/* valid until the next call of next_batch() on the same source */
+struct vm_packet {
+	const uint8_t *data;
+	uint32_t len;
+	uint32_t wire_len;
+	uint64_t ts_ns;
+};
+
+struct vm_packet_stats {
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t batches;
+	uint64_t matches;
+	uint64_t insns;
+	/* runs that ended in anything but an exit, the vm is reset for the next packet */
+	uint64_t errors;
+	/* dropped by the kernel before the ring since the open, AF_PACKET only */
+	uint64_t source_drops;
+	uint64_t elapsed_ns;
+	uint64_t flows;
+	uint64_t flows_evicted;
+	/* evicted flows whose vm migrated away */
+	uint64_t flows_migrated;
+	/* packets of new flows that found the table full */
+	uint64_t flow_overflows;
+};
+
+/*
+ * next_batch() fills up to max packets and returns their number, 0 when none
+ * is ready yet, VM_PKT_SOURCE_END at the end of a file or on errors. Memory
+ * of the previous batch goes back to the source on the next call.
+ */
+struct vm_packet_source_ops {
+	int type;
+	void *(*open)(const struct vm_packet_config *cfg);
+	void (*close)(void *ctx);
+	int (*next_batch)(void *ctx, struct vm_packet *pkts, uint32_t max);
+	uint64_t (*get_drops)(void *ctx);
+};
+
+struct vm_packet_runner;
+
+int register_packet_source(struct vm_packet_source_ops *ops);
+struct vm_packet_runner *vm_packet_open(struct ebpf_vm_program *prog, const struct vm_packet_config *cfg);
+int vm_packet_run(struct vm_packet_runner *runner);
+int vm_packet_poll(struct vm_packet_runner *runner);
+void vm_packet_stop(struct vm_packet_runner *runner);
+void vm_packet_get_stats(struct vm_packet_runner *runner, struct vm_packet_stats *stats);
+void vm_packet_report(struct vm_packet_runner *runner, FILE *out);
+void vm_packet_close(struct vm_packet_runner *runner);
+
+#endif
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <poll.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <net/if_arp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "ebpf_vm_packet.h"
+
+/*
+ * Live source on a TPACKET_V3 receive ring. The kernel fills whole blocks,
+ * packets point into the ring and a block is handed back once every packet
+ * of it has been run, on the call after the batch that held its last one.
+ * A runner attached to an executor must not block its worker, it never waits.
+ */
+#define VM_AFP_FRAME_SIZE 2048
+#define VM_AFP_POLL_TIMEOUT_MS 100
+
+struct vm_afp_context {
+	int fd;
+	uint8_t *ring;
+	size_t ring_size;
+	uint32_t block_size;
+	uint32_t block_num;
+	uint32_t block;
+	/* block being handed out, NULL while waiting for the kernel */
+	struct tpacket_block_desc *held;
+	struct tpacket3_hdr *next;
+	uint32_t left;
+	uint64_t drops;
+	int poll_timeout_ms;
+};
+
+static struct tpacket_block_desc *vm_afp_block(struct vm_afp_context *ctx, uint32_t block)
+{
+	return (struct tpacket_block_desc *)(ctx->ring + (size_t)block * ctx->block_size);
+}
+
+static int vm_afp_setup_ring(struct vm_afp_context *ctx, const struct vm_packet_config *cfg)
+{
+	struct tpacket_req3 req = {0};
+	int version = TPACKET_V3;
+	
+	if (setsockopt(ctx->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0) {
+		perror("Failed to set TPACKET_V3");
+		return -1;
+	}
+	
+	req.tp_block_size = ctx->block_size;
+	req.tp_block_nr = ctx->block_num;
+	req.tp_frame_size = VM_AFP_FRAME_SIZE;
+	req.tp_frame_nr = (ctx->block_size / VM_AFP_FRAME_SIZE) * ctx->block_num;
+	req.tp_retire_blk_tov = cfg->block_timeout_ms;
+	if (setsockopt(ctx->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0) {
+		perror("Failed to set up the packet ring");
+		return -1;
+	}
+	
+	ctx->ring_size = (size_t)ctx->block_size * ctx->block_num;
+	ctx->ring = mmap(NULL, ctx->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ctx->fd, 0);
+	if (ctx->ring == MAP_FAILED) {
+		perror("Failed to map the packet ring");
+		ctx->ring = NULL;
+		return -1;
+	}
+	
+	return 0;
+}
+
+static int vm_afp_bind(struct vm_afp_context *ctx, const struct vm_packet_config *cfg)
+{
+	struct sockaddr_ll addr = {0};
+	int fanout;
+	
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_ALL);
+	addr.sll_ifindex = if_nametoindex(cfg->name);
+	if (addr.sll_ifindex == 0) {
+		printf("Unknown interface %s.\n", cfg->name);
+		return -1;
+	}
+	
+	/* loopback frames carry an Ethernet header too */
+	if (cfg->flow_slots != 0) {
+		struct ifreq ifr = {0};
+	
+		snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", cfg->name);
+		if (ioctl(ctx->fd, SIOCGIFHWADDR, &ifr) != 0) {
+			perror("Failed to get interface type");
+			return -1;
+		}
+		if ((ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) && (ifr.ifr_hwaddr.sa_family != ARPHRD_LOOPBACK)) {
+			printf("Flows need an Ethernet interface, %s has type %u.\n", cfg->name, ifr.ifr_hwaddr.sa_family);
+			return -1;
+		}
+	}
+	
+	if (bind(ctx->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		perror("Failed to bind packet socket");
+		return -1;
+	}
+	
+	/* the kernel spreads flows over the sockets of the group, one per runner */
+	if (cfg->fanout_group != 0) {
+		fanout = (cfg->fanout_group & 0xffff) | (PACKET_FANOUT_HASH << 16);
+		if (setsockopt(ctx->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) != 0) {
+			perror("Failed to join packet fanout group");
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+static void vm_afp_close(void *arg)
+{
+	struct vm_afp_context *ctx = arg;
+	
+	if (ctx->ring != NULL) {
+		munmap(ctx->ring, ctx->ring_size);
+	}
+	if (ctx->fd >= 0) {
+		close(ctx->fd);
+	}
+	free(ctx);
+}
+
+static void *vm_afp_open(const struct vm_packet_config *cfg)
+{
+	struct vm_afp_context *ctx = NULL;
+	long page = sysconf(_SC_PAGESIZE);
+	
+	if ((cfg->block_size % page != 0) || (cfg->block_size < VM_AFP_FRAME_SIZE)) {
+		printf("Invalid packet ring block size %u, it must be a multiple of %ld.\n", cfg->block_size, page);
+		return NULL;
+	}
+	
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL) {
+		printf("Failed to allocate packet socket context.\n");
+		return NULL;
+	}
+	
+	ctx->block_size = cfg->block_size;
+	ctx->block_num = cfg->block_num;
+	ctx->poll_timeout_ms = (cfg->executor != NULL) ? 0 : VM_AFP_POLL_TIMEOUT_MS;
+	ctx->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (ctx->fd < 0) {
+		perror("Failed to create packet socket");
+		vm_afp_close(ctx);
+		return NULL;
+	}
+	
+	if ((vm_afp_setup_ring(ctx, cfg) != 0) || (vm_afp_bind(ctx, cfg) != 0)) {
+		vm_afp_close(ctx);
+		return NULL;
+	}
+	
+	return ctx;
+}
+
+static int vm_afp_next_batch(void *arg, struct vm_packet *pkts, uint32_t max)
+{
+	struct vm_afp_context *ctx = arg;
+	struct tpacket_block_desc *desc = NULL;
+	struct tpacket3_hdr *hdr = NULL;
+	struct pollfd pfd;
+	uint32_t num = 0;
+	
+	if ((ctx->held != NULL) && (ctx->left == 0)) {
+		__atomic_store_n(&ctx->held->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		ctx->held = NULL;
+		ctx->block = (ctx->block + 1) % ctx->block_num;
+	}
+	
+	if (ctx->held == NULL) {
+		desc = vm_afp_block(ctx, ctx->block);
+		if (!(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+			pfd.fd = ctx->fd;
+			pfd.events = POLLIN | POLLERR;
+			pfd.revents = 0;
+			(void)poll(&pfd, 1, ctx->poll_timeout_ms);
+			if (!(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+				return 0;
+			}
+		}
+	
+		ctx->held = desc;
+		ctx->left = desc->hdr.bh1.num_pkts;
+		ctx->next = (struct tpacket3_hdr *)((uint8_t *)desc + desc->hdr.bh1.offset_to_first_pkt);
+	}
+	
+	while ((num < max) && (ctx->left != 0)) {
+		hdr = ctx->next;
+		pkts[num].data = (uint8_t *)hdr + hdr->tp_mac;
+		pkts[num].len = hdr->tp_snaplen;
+		pkts[num].wire_len = hdr->tp_len;
+		pkts[num].ts_ns = (uint64_t)hdr->tp_sec * 1000000000ULL + hdr->tp_nsec;
+		ctx->next = (struct tpacket3_hdr *)((uint8_t *)hdr + hdr->tp_next_offset);
+		ctx->left--;
+		num++;
+	}
+	
+	return (int)num;
+}
+
+/* the kernel resets its counters on every read */
+static uint64_t vm_afp_get_drops(void *arg)
+{
+	struct vm_afp_context *ctx = arg;
+	struct tpacket_stats_v3 stats = {0};
+	socklen_t len = sizeof(stats);
+	
+	if (getsockopt(ctx->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len) == 0) {
+		ctx->drops += stats.tp_drops;
+	}
+	
+	return ctx->drops;
+}
+
+static struct vm_packet_source_ops afp_ops = {
+	.type = VM_PKT_SOURCE_AF_PACKET,
+	.open = vm_afp_open,
+	.close = vm_afp_close,
+	.next_batch = vm_afp_next_batch,
+	.get_drops = vm_afp_get_drops,
+};
+
+static __attribute__((constructor)) void vm_afp_register_source(void)
+{
+	register_packet_source(&afp_ops);
+}
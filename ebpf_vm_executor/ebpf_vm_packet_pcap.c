@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ebpf_vm_packet.h"
+
+/*
+ * Offline source. The file is mapped read only and packets point into the
+ * mapping, so a replayed file costs no copies either.
+ */
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_record_header {
+	uint32_t ts_sec;
+	uint32_t ts_frac;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+struct vm_pcap_context {
+	uint8_t *base;
+	size_t size;
+	size_t offset;
+	uint32_t swapped;
+	uint32_t nsec;
+	uint32_t repeat;
+};
+
+static uint32_t pcap_u32(struct vm_pcap_context *ctx, uint32_t value)
+{
+	return ctx->swapped ? __builtin_bswap32(value) : value;
+}
+
+static void *vm_pcap_open(const struct vm_packet_config *cfg)
+{
+	struct vm_pcap_context *ctx = NULL;
+	struct pcap_file_header *header = NULL;
+	struct stat st;
+	uint32_t magic;
+	int fd;
+	
+	fd = open(cfg->name, O_RDONLY);
+	if (fd < 0) {
+		perror("Failed to open pcap file");
+		return NULL;
+	}
+	
+	if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(*header))) {
+		printf("Invalid pcap file %s.\n", cfg->name);
+		close(fd);
+		return NULL;
+	}
+	
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL) {
+		printf("Failed to allocate pcap context.\n");
+		close(fd);
+		return NULL;
+	}
+	
+	ctx->size = st.st_size;
+	ctx->base = mmap(NULL, ctx->size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (ctx->base == MAP_FAILED) {
+		perror("Failed to map pcap file");
+		free(ctx);
+		return NULL;
+	}
+	
+	header = (struct pcap_file_header *)ctx->base;
+	magic = header->magic;
+	if ((magic == __builtin_bswap32(PCAP_MAGIC_USEC)) || (magic == __builtin_bswap32(PCAP_MAGIC_NSEC))) {
+		ctx->swapped = 1;
+		magic = __builtin_bswap32(magic);
+	}
+	if ((magic != PCAP_MAGIC_USEC) && (magic != PCAP_MAGIC_NSEC)) {
+		printf("Unsupported pcap file %s, magic = 0x%x.\n", cfg->name, header->magic);
+		munmap(ctx->base, ctx->size);
+		free(ctx);
+		return NULL;
+	}
+	
+	if ((cfg->flow_slots != 0) && (pcap_u32(ctx, header->linktype) != PCAP_LINKTYPE_ETHERNET)) {
+		printf("Flows need an Ethernet capture, %s has link type %u.\n", cfg->name, pcap_u32(ctx, header->linktype));
+		munmap(ctx->base, ctx->size);
+		free(ctx);
+		return NULL;
+	}
+	
+	ctx->nsec = (magic == PCAP_MAGIC_NSEC);
+	ctx->offset = sizeof(*header);
+	ctx->repeat = cfg->repeat;
+	return ctx;
+}
+
+static void vm_pcap_close(void *arg)
+{
+	struct vm_pcap_context *ctx = arg;
+	
+	munmap(ctx->base, ctx->size);
+	free(ctx);
+}
+
+/* a truncated last record ends the pass */
+static int vm_pcap_next_batch(void *arg, struct vm_packet *pkts, uint32_t max)
+{
+	struct vm_pcap_context *ctx = arg;
+	struct pcap_record_header rec;
+	uint32_t num = 0;
+	
+	while (num < max) {
+		if (ctx->offset + sizeof(rec) > ctx->size) {
+			if (ctx->repeat == 0) {
+				break;
+			}
+			ctx->repeat--;
+			ctx->offset = sizeof(struct pcap_file_header);
+			continue;
+		}
+	
+		memcpy(&rec, ctx->base + ctx->offset, sizeof(rec));
+		rec.incl_len = pcap_u32(ctx, rec.incl_len);
+		if (ctx->offset + sizeof(rec) + rec.incl_len > ctx->size) {
+			ctx->offset = ctx->size;
+			continue;
+		}
+	
+		pkts[num].data = ctx->base + ctx->offset + sizeof(rec);
+		pkts[num].len = rec.incl_len;
+		pkts[num].wire_len = pcap_u32(ctx, rec.orig_len);
+		pkts[num].ts_ns = (uint64_t)pcap_u32(ctx, rec.ts_sec) * 1000000000ULL +
+			(uint64_t)pcap_u32(ctx, rec.ts_frac) * (ctx->nsec ? 1 : 1000);
+		ctx->offset += sizeof(rec) + rec.incl_len;
+		num++;
+	}
+	
+	return (num != 0) ? (int)num : VM_PKT_SOURCE_END;
+}
+
+static struct vm_packet_source_ops pcap_ops = {
+	.type = VM_PKT_SOURCE_PCAP,
+	.open = vm_pcap_open,
+	.close = vm_pcap_close,
+	.next_batch = vm_pcap_next_batch,
+	.get_drops = NULL,
+};
+
+static __attribute__((constructor)) void vm_pcap_register_source(void)
+{
+	register_packet_source(&pcap_ops);
+}
@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "ebpf_vm_simulator.h"
+#include "ebpf_vm_perf.h"
+
+/*
+ * The interpreter is entered through a small native trampoline per eBPF
+ * function, so the function shows up as a frame of its own in perf call
+ * stacks. The trampolines are listed in /tmp/perf-<pid>.map and, for perf
+ * inject --jit, as code loads in /tmp/jit-<pid>.dump.
+ *
+ * A trampoline is called as tramp(vm, run_ebpf_vm) and calls run_ebpf_vm(vm)
+ * inside a frame pointer frame.
+ */
+#if defined(__x86_64__)
+#define VM_PERF_SLOT_SIZE 16
+#define VM_PERF_ELF_MACH EM_X86_64
+/* push %rbp; mov %rsp,%rbp; call *%rsi; pop %rbp; ret */
+static const uint8_t vm_perf_tramp_code[] = {0x55, 0x48, 0x89, 0xe5, 0xff, 0xd6, 0x5d, 0xc3};
+static const uint8_t vm_perf_tramp_pad[] = {0xcc};
+#elif defined(__aarch64__)
+#define VM_PERF_SLOT_SIZE 32
+#define VM_PERF_ELF_MACH EM_AARCH64
+/* stp x29, x30, [sp, #-16]!; mov x29, sp; blr x1; ldp x29, x30, [sp], #16; ret */
+static const uint32_t vm_perf_tramp_code[] = {0xa9bf7bfd, 0x910003fd, 0xd63f0020, 0xa8c17bfd, 0xd65f03c0};
+/* brk #0 */
+static const uint32_t vm_perf_tramp_pad[] = {0xd4200000};
+#endif
+
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+
+struct jitdump_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t total_size;
+	uint32_t elf_mach;
+	uint32_t pad1;
+	uint32_t pid;
+	uint64_t timestamp;
+	uint64_t flags;
+};
+
+struct jitdump_code_load {
+	uint32_t id;
+	uint32_t total_size;
+	uint64_t timestamp;
+	uint32_t pid;
+	uint32_t tid;
+	uint64_t vma;
+	uint64_t code_addr;
+	uint64_t code_size;
+	uint64_t code_index;
+};
+
+typedef uint64_t (*vm_perf_tramp)(struct ebpf_vm *vm, uint64_t (*run)(struct ebpf_vm *vm));
+
+int vm_perf_active;
+
+static pthread_mutex_t vm_perf_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t vm_perf_flags;
+static FILE *vm_perf_map;
+static FILE *vm_perf_dump;
+static uint64_t vm_perf_code_index;
+
+static int open_perf_map(void)
+{
+	char name[64];
+	
+	snprintf(name, sizeof(name), "/tmp/perf-%d.map", getpid());
+	vm_perf_map = fopen(name, "w");
+	if (vm_perf_map == NULL) {
+		perror("Failed to open perf map");
+		return -1;
+	}
+	
+	return 0;
+}
+
+/* perf record finds the dump by the executable mapping of it, the mapping is kept until exit */
+static int open_jitdump(void)
+{
+	struct jitdump_header header = {0};
+	char name[64];
+	void *marker = NULL;
+	int fd;
+	
+	snprintf(name, sizeof(name), "/tmp/jit-%d.dump", getpid());
+	fd = open(name, O_CREAT | O_TRUNC | O_RDWR, 0666);
+	if (fd < 0) {
+		perror("Failed to open jitdump");
+		return -1;
+	}
+	
+	marker = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+	if (marker == MAP_FAILED) {
+		perror("Failed to map jitdump");
+		close(fd);
+		return -1;
+	}
+	
+	vm_perf_dump = fdopen(fd, "w");
+	if (vm_perf_dump == NULL) {
+		perror("Failed to open jitdump");
+		munmap(marker, sysconf(_SC_PAGESIZE));
+		close(fd);
+		return -1;
+	}
+	
+	header.magic = JITDUMP_MAGIC;
+	header.version = JITDUMP_VERSION;
+	header.total_size = sizeof(header);
+	header.elf_mach = VM_PERF_ELF_MACH;
+	header.pid = getpid();
+	/* perf record -k 1 samples with the monotonic clock, jitdump records have to match it */
+	header.timestamp = vm_now_ns();
+	fwrite(&header, sizeof(header), 1, vm_perf_dump);
+	fflush(vm_perf_dump);
+	return 0;
+}
+
+/* process wide, perf maps stay on once an executor asked for them */
+int vm_perf_map_init(uint32_t flags)
+{
+	int ret = 0;
+	
+	if (flags == 0) {
+		return 0;
+	}
+	
+#if !defined(VM_PERF_SLOT_SIZE)
+	printf("Perf maps are not supported on this architecture.\n");
+	return -1;
+#else
+	/* perf inject --jit also wants the map for the samples it cannot place */
+	if (flags & VM_PERF_JITDUMP) {
+		flags |= VM_PERF_MAP;
+	}
+	
+	pthread_mutex_lock(&vm_perf_lock);
+	if ((flags & VM_PERF_MAP) && !(vm_perf_flags & VM_PERF_MAP)) {
+		ret = open_perf_map();
+		vm_perf_flags |= (ret == 0) ? VM_PERF_MAP : 0;
+	}
+	if ((ret == 0) && (flags & VM_PERF_JITDUMP) && !(vm_perf_flags & VM_PERF_JITDUMP)) {
+		ret = open_jitdump();
+		vm_perf_flags |= (ret == 0) ? VM_PERF_JITDUMP : 0;
+	}
+	if (vm_perf_flags != 0) {
+		__atomic_store_n(&vm_perf_active, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&vm_perf_lock);
+	return ret;
+#endif
+}
+
+#if defined(VM_PERF_SLOT_SIZE)
+static void write_slot(uint8_t *slot)
+{
+	for (uint32_t off = 0; off < VM_PERF_SLOT_SIZE; off += sizeof(vm_perf_tramp_pad)) {
+		memcpy(slot + off, vm_perf_tramp_pad, sizeof(vm_perf_tramp_pad));
+	}
+	memcpy(slot, vm_perf_tramp_code, sizeof(vm_perf_tramp_code));
+}
+
+static void write_code_load(const char *name, const uint8_t *code)
+{
+	struct jitdump_code_load rec = {0};
+	uint32_t name_len = strlen(name) + 1;
+	
+	rec.id = JIT_CODE_LOAD;
+	rec.total_size = sizeof(rec) + name_len + VM_PERF_SLOT_SIZE;
+	rec.timestamp = vm_now_ns();
+	rec.pid = getpid();
+	rec.tid = (uint32_t)syscall(SYS_gettid);
+	rec.vma = (uint64_t)(uintptr_t)code;
+	rec.code_addr = rec.vma;
+	rec.code_size = VM_PERF_SLOT_SIZE;
+	rec.code_index = vm_perf_code_index++;
+	fwrite(&rec, sizeof(rec), 1, vm_perf_dump);
+	fwrite(name, name_len, 1, vm_perf_dump);
+	fwrite(code, VM_PERF_SLOT_SIZE, 1, vm_perf_dump);
+}
+
+static void announce_slot(const char *name, const uint8_t *code)
+{
+	if (vm_perf_map != NULL) {
+		fprintf(vm_perf_map, "%lx %x %s\n", (uint64_t)(uintptr_t)code, VM_PERF_SLOT_SIZE, name);
+	}
+	if (vm_perf_dump != NULL) {
+		write_code_load(name, code);
+	}
+}
+
+/* called with vm_perf_lock held, the first vm running the segment pays for it */
+static struct vm_perf_code *create_perf_code(struct vm_code_segment *seg)
+{
+	struct vm_func_symbol *funcs = __atomic_load_n(&seg->funcs, __ATOMIC_ACQUIRE);
+	uint32_t num = (funcs != NULL) ? seg->num_funcs : 0;
+	size_t page = sysconf(_SC_PAGESIZE);
+	struct vm_perf_code *code = calloc(1, sizeof(*code));
+	size_t len = ((size_t)(num + 1) * VM_PERF_SLOT_SIZE + page - 1) & ~(page - 1);
+	uint8_t *base = NULL;
+	char name[VM_FUNC_NAME_SIZE + 32];
+	
+	if (code == NULL) {
+		return NULL;
+	}
+	
+	base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		perror("Failed to map perf trampolines");
+		return code;
+	}
+	
+	for (uint32_t slot = 0; slot <= num; slot++) {
+		write_slot(base + (size_t)slot * VM_PERF_SLOT_SIZE);
+	}
+	__builtin___clear_cache((char *)base, (char *)base + len);
+	if (mprotect(base, len, PROT_READ | PROT_EXEC) != 0) {
+		perror("Failed to protect perf trampolines");
+		munmap(base, len);
+		return code;
+	}
+	
+	snprintf(name, sizeof(name), "bpf:%016lx", seg->hash);
+	announce_slot(name, base);
+	for (uint32_t idx = 0; idx < num; idx++) {
+		snprintf(name, sizeof(name), "bpf:%s:%016lx", funcs[idx].name, seg->hash);
+		announce_slot(name, base + (size_t)(idx + 1) * VM_PERF_SLOT_SIZE);
+	}
+	if (vm_perf_map != NULL) {
+		fflush(vm_perf_map);
+	}
+	if (vm_perf_dump != NULL) {
+		fflush(vm_perf_dump);
+	}
+	
+	code->base = base;
+	code->num = num;
+	return code;
+}
+
+/* enters the interpreter through the trampoline of the function holding pc */
+uint64_t vm_perf_run(struct ebpf_vm *vm)
+{
+	struct vm_code_segment *seg = vm->rd.code_seg;
+	struct vm_perf_code *code = NULL;
+	int32_t func;
+	uint32_t slot = 0;
+	
+	if (seg == NULL) {
+		return run_ebpf_vm(vm);
+	}
+	
+	code = __atomic_load_n(&seg->perf, __ATOMIC_ACQUIRE);
+	if (code == NULL) {
+		pthread_mutex_lock(&vm_perf_lock);
+		code = seg->perf;
+		if (code == NULL) {
+			code = create_perf_code(seg);
+			__atomic_store_n(&seg->perf, code, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&vm_perf_lock);
+	}
+	
+	if ((code == NULL) || (code->base == NULL)) {
+		return run_ebpf_vm(vm);
+	}
+	
+	func = vm_code_find_func(seg, (uint32_t)vm->sys_reg[EBPF_SYS_REG_PC]);
+	if ((func >= 0) && ((uint32_t)func < code->num)) {
+		slot = func + 1;
+	}
+	
+	return ((vm_perf_tramp)(code->base + (size_t)slot * VM_PERF_SLOT_SIZE))(vm, run_ebpf_vm);
+}
+#else
+uint64_t vm_perf_run(struct ebpf_vm *vm)
+{
+	return run_ebpf_vm(vm);
+}
+#endif
+
+/*
+ * The trampolines are not unmapped with their segment: perf resolves samples
+ * after the process is gone and an address reused by another segment would
+ * be attributed to both.
+ */
+void vm_perf_code_free(struct vm_perf_code *code)
+{
+	free(code);
+}
@@ -0,0 +1,26 @@
+#ifndef _EBPF_VM_PERF_H_
+#define _EBPF_VM_PERF_H_
+
+#include <stdint.h>
+#include "ebpf_vm_simulator.h"
+
+/*
+ * Native entry points of one code segment, slot 0 for pcs outside of any
+ * function symbol, slot n + 1 for function n. base is NULL when the
+ * trampolines could not be mapped, such segments run directly.
+ */
+struct vm_perf_code {
+	uint8_t *base;
+	uint32_t num;
+};
+
+extern int vm_perf_active;
+
+int vm_perf_map_init(uint32_t flags);
+uint64_t vm_perf_run(struct ebpf_vm *vm);
+void vm_perf_code_free(struct vm_perf_code *code);
+
+/* a single test of the process wide flag when perf maps are off */
+#define VM_PERF_RUN(vm) (__builtin_expect(vm_perf_active, 0) ? vm_perf_run(vm) : run_ebpf_vm(vm))
+
+#endif
@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "ebpf_vm_simulator.h"
+
+/*
+ * VM images come from power of two size classes. Every thread keeps a small
+ * cache per class and exchanges batches with the global free list, which is
+ * refilled from hugepage backed slabs bound to the node of the refilling thread.
+ */
+#define VM_POOL_MIN_SHIFT 10
+#define VM_POOL_MAX_SHIFT 18
+#define VM_POOL_CLASSES (VM_POOL_MAX_SHIFT - VM_POOL_MIN_SHIFT + 1)
+#define VM_POOL_LARGE 0xffffffff
+#define VM_POOL_SLAB_SIZE (2UL << 20)
+#define VM_POOL_BATCH 32
+#define VM_POOL_MPOL_PREFERRED 1
+
+struct vm_pool_obj {
+	uint32_t class;
+	uint32_t size;
+	uint64_t reserved;
+};
+
+struct vm_pool_free_obj {
+	struct vm_pool_free_obj *next;
+};
+
+struct vm_pool_class {
+	pthread_mutex_t lock;
+	struct vm_pool_free_obj *free_list;
+	uint64_t free_num;
+};
+
+struct vm_pool_cache {
+	struct vm_pool_free_obj *free_list[VM_POOL_CLASSES];
+	uint32_t free_num[VM_POOL_CLASSES];
+};
+
+static struct vm_pool_class vm_pool_classes[VM_POOL_CLASSES];
+static __thread struct vm_pool_cache vm_pool_cache;
+static __thread int vm_pool_cache_registered;
+static pthread_once_t vm_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t vm_pool_key;
+
+static uint32_t vm_pool_class_size(uint32_t class)
+{
+	return 1U << (class + VM_POOL_MIN_SHIFT);
+}
+
+static uint32_t vm_pool_size_to_class(uint32_t size)
+{
+	uint32_t class = 0;
+	
+	while ((class < VM_POOL_CLASSES) && (vm_pool_class_size(class) < size)) {
+		class++;
+	}
+	
+	return (class < VM_POOL_CLASSES) ? class : VM_POOL_LARGE;
+}
+
+static void vm_pool_bind_local(void *addr, size_t size)
+{
+#if defined(SYS_mbind) && defined(SYS_getcpu)
+	unsigned int cpu, node;
+	unsigned long mask;
+	
+	if ((syscall(SYS_getcpu, &cpu, &node, NULL) != 0) || (node >= sizeof(mask) * 8)) {
+		return;
+	}
+	
+	/* best effort, pages still come from the first touching thread's node without it */
+	mask = 1UL << node;
+	(void)syscall(SYS_mbind, addr, size, VM_POOL_MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+#endif
+}
+
+static void *vm_pool_map_slab(void)
+{
+	void *slab;
+	
+	slab = mmap(NULL, VM_POOL_SLAB_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (slab == MAP_FAILED) {
+		/* no hugepages reserved, ask for transparent ones instead */
+		slab = mmap(NULL, VM_POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slab == MAP_FAILED) {
+			return NULL;
+		}
+		(void)madvise(slab, VM_POOL_SLAB_SIZE, MADV_HUGEPAGE);
+	}
+	
+	vm_pool_bind_local(slab, VM_POOL_SLAB_SIZE);
+	return slab;
+}
+
+/* called with the class lock held */
+static int vm_pool_grow(struct vm_pool_class *pc, uint32_t class)
+{
+	uint32_t obj_size = vm_pool_class_size(class);
+	uint8_t *slab = vm_pool_map_slab();
+	
+	if (slab == NULL) {
+		return -1;
+	}
+	
+	for (uint64_t offset = 0; offset + obj_size <= VM_POOL_SLAB_SIZE; offset += obj_size) {
+		struct vm_pool_free_obj *obj = (struct vm_pool_free_obj *)(slab + offset);
+	
+		obj->next = pc->free_list;
+		pc->free_list = obj;
+		pc->free_num++;
+	}
+	
+	return 0;
+}
+
+static void vm_pool_refill(struct vm_pool_cache *cache, uint32_t class)
+{
+	struct vm_pool_class *pc = &vm_pool_classes[class];
+	
+	pthread_mutex_lock(&pc->lock);
+	if ((pc->free_list == NULL) && (vm_pool_grow(pc, class) != 0)) {
+		pthread_mutex_unlock(&pc->lock);
+		return;
+	}
+	
+	for (int idx = 0; (idx < VM_POOL_BATCH) && (pc->free_list != NULL); idx++) {
+		struct vm_pool_free_obj *obj = pc->free_list;
+	
+		pc->free_list = obj->next;
+		pc->free_num--;
+		obj->next = cache->free_list[class];
+		cache->free_list[class] = obj;
+		cache->free_num[class]++;
+	}
+	pthread_mutex_unlock(&pc->lock);
+}
+
+static void vm_pool_drain(struct vm_pool_cache *cache, uint32_t class, uint32_t keep)
+{
+	struct vm_pool_class *pc = &vm_pool_classes[class];
+	
+	pthread_mutex_lock(&pc->lock);
+	while (cache->free_num[class] > keep) {
+		struct vm_pool_free_obj *obj = cache->free_list[class];
+	
+		cache->free_list[class] = obj->next;
+		cache->free_num[class]--;
+		obj->next = pc->free_list;
+		pc->free_list = obj;
+		pc->free_num++;
+	}
+	pthread_mutex_unlock(&pc->lock);
+}
+
+static void vm_pool_thread_exit(void *arg)
+{
+	struct vm_pool_cache *cache = arg;
+	
+	for (uint32_t class = 0; class < VM_POOL_CLASSES; class++) {
+		vm_pool_drain(cache, class, 0);
+	}
+}
+
+static void vm_pool_init_once(void)
+{
+	for (uint32_t class = 0; class < VM_POOL_CLASSES; class++) {
+		pthread_mutex_init(&vm_pool_classes[class].lock, NULL);
+		vm_pool_classes[class].free_list = NULL;
+		vm_pool_classes[class].free_num = 0;
+	}
+	
+	pthread_key_create(&vm_pool_key, vm_pool_thread_exit);
+}
+
+static struct vm_pool_cache *vm_pool_get_cache(void)
+{
+	if (!vm_pool_cache_registered) {
+		pthread_once(&vm_pool_once, vm_pool_init_once);
+		/* hands the cache back to the global lists when the thread exits */
+		pthread_setspecific(vm_pool_key, &vm_pool_cache);
+		vm_pool_cache_registered = 1;
+	}
+	
+	return &vm_pool_cache;
+}
+
+void *vm_pool_alloc(uint32_t size)
+{
+	uint32_t total = size + sizeof(struct vm_pool_obj);
+	uint32_t class = vm_pool_size_to_class(total);
+	struct vm_pool_cache *cache = NULL;
+	struct vm_pool_obj *obj = NULL;
+	
+	if (class == VM_POOL_LARGE) {
+		obj = malloc(total);
+	} else {
+		cache = vm_pool_get_cache();
+		if (cache->free_list[class] == NULL) {
+			vm_pool_refill(cache, class);
+		}
+	
+		obj = (struct vm_pool_obj *)cache->free_list[class];
+		if (obj != NULL) {
+			cache->free_list[class] = cache->free_list[class]->next;
+			cache->free_num[class]--;
+		}
+	}
+	
+	if (obj == NULL) {
+		return NULL;
+	}
+	
+	obj->class = class;
+	obj->size = size;
+	return obj + 1;
+}
+
+void vm_pool_free(void *ptr)
+{
+	struct vm_pool_obj *obj = (struct vm_pool_obj *)ptr - 1;
+	struct vm_pool_free_obj *free_obj = (struct vm_pool_free_obj *)obj;
+	struct vm_pool_cache *cache = NULL;
+	uint32_t class;
+	
+	if (ptr == NULL) {
+		return;
+	}
+	
+	class = obj->class;
+	if (class == VM_POOL_LARGE) {
+		free(obj);
+		return;
+	}
+	
+	cache = vm_pool_get_cache();
+	free_obj->next = cache->free_list[class];
+	cache->free_list[class] = free_obj;
+	cache->free_num[class]++;
+	
+	if (cache->free_num[class] > 2 * VM_POOL_BATCH) {
+		vm_pool_drain(cache, class, VM_POOL_BATCH);
+	}
+}
@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "ebpf_vm_profile.h"
+
+static struct ub_list vm_profile_list = {&vm_profile_list, &vm_profile_list};
+static pthread_mutex_t vm_profile_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void vm_profile_free(struct vm_profile *profile)
+{
+	if (profile == NULL) {
+		return;
+	}
+	
+	pthread_mutex_lock(&vm_profile_list_lock);
+	ub_list_remove(&profile->node);
+	pthread_mutex_unlock(&vm_profile_list_lock);
+	
+	pthread_mutex_destroy(&profile->lock);
+	free(profile->pc_count);
+	free(profile->pc_cycles);
+	free(profile);
+}
+
+#ifdef EBPF_VM_PROFILE
+
+/* index of the function holding pc, -1 when the loader gave no symbol for it */
+static const char *func_name(struct vm_code_segment *seg, int32_t func)
+{
+	return (func < 0) ? "[unknown]" : seg->funcs[func].name;
+}
+
+__thread struct vm_profile_cursor vm_profile_cursor = {.last_pc = VM_PROFILE_NO_PC};
+
+static struct vm_profile *vm_profile_create(struct vm_code_segment *seg)
+{
+	struct vm_profile *profile = calloc(1, sizeof(*profile));
+	
+	if (profile == NULL) {
+		return NULL;
+	}
+	
+	profile->seg = seg;
+	profile->num_insns = seg->size / sizeof(struct ebpf_instruction);
+	profile->pc_count = calloc(profile->num_insns, sizeof(uint64_t));
+	profile->pc_cycles = calloc(profile->num_insns, sizeof(uint64_t));
+	if ((profile->pc_count == NULL) || (profile->pc_cycles == NULL)) {
+		free(profile->pc_count);
+		free(profile->pc_cycles);
+		free(profile);
+		return NULL;
+	}
+	
+	pthread_mutex_init(&profile->lock, NULL);
+	ub_list_init(&profile->node);
+	return profile;
+}
+
+/* vms with the code embedded in the image have no segment and are not profiled */
+void vm_profile_enter(struct ebpf_vm *vm)
+{
+	struct vm_profile_cursor *cur = &vm_profile_cursor;
+	struct vm_code_segment *seg = vm->rd.code_seg;
+	struct vm_profile *profile = NULL;
+	struct vm_profile *expected = NULL;
+	
+	if (seg != NULL) {
+		profile = __atomic_load_n(&seg->profile, __ATOMIC_ACQUIRE);
+		if (profile == NULL) {
+			profile = vm_profile_create(seg);
+			if ((profile != NULL) &&
+				!__atomic_compare_exchange_n(&seg->profile, &expected, profile, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				vm_profile_free(profile);
+				profile = expected;
+			} else if (profile != NULL) {
+				pthread_mutex_lock(&vm_profile_list_lock);
+				ub_list_push_back(&vm_profile_list, &profile->node);
+				pthread_mutex_unlock(&vm_profile_list_lock);
+			}
+		}
+	}
+	
+	if (cur->profile != profile) {
+		cur->profile = profile;
+		cur->last_pc = VM_PROFILE_NO_PC;
+		cur->stack_cycles = 0;
+		cur->stack_count = 0;
+	}
+}
+
+static void add_stack(struct vm_profile *profile, const struct vm_profile_stack *stack)
+{
+	struct vm_profile_stack *entry = NULL;
+	uint32_t idx;
+	
+	pthread_mutex_lock(&profile->lock);
+	for (idx = 0; idx < profile->num_stacks; idx++) {
+		entry = &profile->stacks[idx];
+		if ((entry->depth == stack->depth) &&
+			(memcmp(entry->frames, stack->frames, stack->depth * sizeof(stack->frames[0])) == 0)) {
+			break;
+		}
+	}
+	
+	if (idx == profile->num_stacks) {
+		if (idx == VM_PROFILE_MAX_STACKS) {
+			profile->dropped_stacks++;
+			pthread_mutex_unlock(&profile->lock);
+			return;
+		}
+	
+		entry = &profile->stacks[profile->num_stacks++];
+		*entry = *stack;
+		entry->cycles = 0;
+		entry->count = 0;
+	}
+	
+	entry->cycles += stack->cycles;
+	entry->count += stack->count;
+	pthread_mutex_unlock(&profile->lock);
+}
+
+/*
+ * Charges the cycles since the last flush to the current call chain. Called
+ * whenever the chain is about to change, on calls, exits and when the vm stops
+ * running. Callers are found from the link registers saved in each frame.
+ */
+void vm_profile_flush(struct ebpf_vm *vm, const struct ebpf_instruction *ins)
+{
+	struct vm_profile_cursor *cur = &vm_profile_cursor;
+	struct vm_profile *profile = cur->profile;
+	struct vm_profile_stack stack = {0};
+	uint64_t lr = vm->sys_reg[EBPF_SYS_REG_LR];
+	uint64_t fp = vm->reg[EBPF_REG_FP];
+	int32_t depth;
+	
+	if (profile == NULL) {
+		return;
+	}
+	
+	if (cur->last_pc != VM_PROFILE_NO_PC) {
+		uint64_t delta = vm_profile_tick() - cur->last_tick;
+		profile->pc_cycles[cur->last_pc] += delta;
+		profile->opcode_cycles[cur->last_opcode] += delta;
+		cur->stack_cycles += delta;
+		cur->last_pc = VM_PROFILE_NO_PC;
+	}
+	
+	if (cur->stack_count == 0) {
+		return;
+	}
+	
+	depth = vm->state.stack_depth;
+	if (depth >= VM_PROFILE_MAX_FRAMES) {
+		depth = VM_PROFILE_MAX_FRAMES - 1;
+	}
+	
+	stack.depth = depth + 1;
+	stack.frames[depth] = vm_code_find_func(profile->seg, ins - ebpf_vm_code(vm));
+	while (depth-- > 0) {
+		uint64_t saved;
+	
+		stack.frames[depth] = vm_code_find_func(profile->seg, lr - 1);
+		fp += EBPF_VM_STACK_FRAME_SIZE;
+		saved = vm_mmu(fp + 4 * sizeof(uint64_t), vm);
+		lr = (saved != PAGE_TABLE_ERROR) ? *(uint64_t *)saved : 0;
+	}
+	
+	stack.cycles = cur->stack_cycles;
+	stack.count = cur->stack_count;
+	add_stack(profile, &stack);
+	cur->stack_cycles = 0;
+	cur->stack_count = 0;
+}
+
+static void write_flat(struct vm_profile *profile, FILE *out)
+{
+	struct vm_code_segment *seg = profile->seg;
+	uint32_t num_funcs = (seg->funcs != NULL) ? seg->num_funcs : 0;
+	uint64_t *func_cycles = calloc(num_funcs + 1, sizeof(uint64_t));
+	uint64_t *func_count = calloc(num_funcs + 1, sizeof(uint64_t));
+	uint64_t total = 0;
+	uint32_t pc;
+	
+	if ((func_cycles == NULL) || (func_count == NULL)) {
+		printf("Failed to allocate profile report.\n");
+		free(func_cycles);
+		free(func_count);
+		return;
+	}
+	
+	/* slot 0 collects pcs outside of any known function */
+	for (pc = 0; pc < profile->num_insns; pc++) {
+		int32_t func = vm_code_find_func(seg, pc);
+		func_cycles[func + 1] += profile->pc_cycles[pc];
+		func_count[func + 1] += profile->pc_count[pc];
+		total += profile->pc_cycles[pc];
+	}
+	
+	fprintf(out, "# code %016llx, %u instructions, %llu cycles\n",
+		(unsigned long long)seg->hash, profile->num_insns, (unsigned long long)total);
+	fprintf(out, "# %-14s %7s %14s  %s\n", "self_cycles", "self%", "insns", "function");
+	for (int32_t func = -1; func < (int32_t)num_funcs; func++) {
+		if (func_count[func + 1] == 0) {
+			continue;
+		}
+	
+		fprintf(out, "  %-14llu %6.2f%% %14llu  %s\n", (unsigned long long)func_cycles[func + 1],
+			(total != 0) ? 100.0 * func_cycles[func + 1] / total : 0.0,
+			(unsigned long long)func_count[func + 1], func_name(seg, func));
+	}
+	
+	fprintf(out, "# %-6s %14s %14s  %-6s %s\n", "pc", "count", "cycles", "opcode", "location");
+	for (pc = 0; pc < profile->num_insns; pc++) {
+		const struct ebpf_instruction *ins = (const struct ebpf_instruction *)seg->code + pc;
+		int32_t func = vm_code_find_func(seg, pc);
+	
+		if (profile->pc_count[pc] == 0) {
+			continue;
+		}
+	
+		fprintf(out, "  %-6u %14llu %14llu  0x%02x   %s+%u\n", pc, (unsigned long long)profile->pc_count[pc],
+			(unsigned long long)profile->pc_cycles[pc], ins->opcode, func_name(seg, func),
+			(func < 0) ? pc : pc - seg->funcs[func].start);
+	}
+	
+	fprintf(out, "# %-6s %14s %14s\n", "opcode", "count", "cycles");
+	for (int op = 0; op < 256; op++) {
+		if (profile->opcode_count[op] == 0) {
+			continue;
+		}
+	
+		fprintf(out, "  0x%02x   %14llu %14llu\n", op, (unsigned long long)profile->opcode_count[op],
+			(unsigned long long)profile->opcode_cycles[op]);
+	}
+	
+	free(func_cycles);
+	free(func_count);
+}
+
+/* one "root;...;leaf cycles" line per call chain, the input format of flamegraph.pl */
+static void write_folded(struct vm_profile *profile, FILE *out)
+{
+	pthread_mutex_lock(&profile->lock);
+	for (uint32_t idx = 0; idx < profile->num_stacks; idx++) {
+		struct vm_profile_stack *stack = &profile->stacks[idx];
+	
+		for (uint32_t frame = 0; frame < stack->depth; frame++) {
+			fprintf(out, "%s%s", (frame == 0) ? "" : ";", func_name(profile->seg, stack->frames[frame]));
+		}
+		fprintf(out, " %llu\n", (unsigned long long)stack->cycles);
+	}
+	
+	if (profile->dropped_stacks != 0) {
+		printf("Profile of code %016llx dropped %llu call chains.\n",
+			(unsigned long long)profile->seg->hash, (unsigned long long)profile->dropped_stacks);
+	}
+	pthread_mutex_unlock(&profile->lock);
+}
+
+/* either output may be NULL */
+int vm_profile_write(struct vm_code_segment *seg, FILE *flat, FILE *folded)
+{
+	struct vm_profile *profile = __atomic_load_n(&seg->profile, __ATOMIC_ACQUIRE);
+	
+	if (profile == NULL) {
+		return -1;
+	}
+	
+	if (flat != NULL) {
+		write_flat(profile, flat);
+	}
+	
+	if (folded != NULL) {
+		write_folded(profile, folded);
+	}
+	
+	return 0;
+}
+
+/* returns the number of profiled code segments written */
+int vm_profile_write_all(FILE *flat, FILE *folded)
+{
+	struct vm_profile *profile = NULL;
+	int count = 0;
+	
+	pthread_mutex_lock(&vm_profile_list_lock);
+	UB_LIST_FOR_EACH(profile, node, &vm_profile_list) {
+		if (vm_profile_write(profile->seg, flat, folded) == 0) {
+			count++;
+		}
+	}
+	pthread_mutex_unlock(&vm_profile_list_lock);
+	return count;
+}
+
+#else
+
+int vm_profile_write(struct vm_code_segment *seg, FILE *flat, FILE *folded)
+{
+	printf("Profiling is not built in, configure with -DEBPF_VM_PROFILE=ON.\n");
+	return -1;
+}
+
+int vm_profile_write_all(FILE *flat, FILE *folded)
+{
+	return vm_profile_write(NULL, flat, folded);
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef _EBPF_VM_PROFILE_H_
+#define _EBPF_VM_PROFILE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "ebpf_vm_simulator.h"
+
+#define VM_PROFILE_MAX_STACKS 1024
+#define VM_PROFILE_MAX_FRAMES (EBPF_VM_STACK_DEPTH_MAX + 1)
+#define VM_PROFILE_NO_PC UINT32_MAX
+
+/*
+ * Profiles are kept per code segment, so every instance of a program adds to
+ * the same counters. The counters are plain increments, several workers
+ * running the same program may lose a few of them, run a single worker for
+ * exact counts.
+ */
+struct vm_profile_stack {
+	uint32_t depth;
+	/* function indexes from the root to the leaf, -1 when unknown */
+	int32_t frames[VM_PROFILE_MAX_FRAMES];
+	uint64_t cycles;
+	uint64_t count;
+};
+
+struct vm_profile {
+	struct ub_list node;
+	struct vm_code_segment *seg;
+	uint32_t num_insns;
+	uint64_t opcode_count[256];
+	uint64_t opcode_cycles[256];
+	uint64_t *pc_count;
+	uint64_t *pc_cycles;
+	pthread_mutex_t lock;
+	uint32_t num_stacks;
+	uint64_t dropped_stacks;
+	struct vm_profile_stack stacks[VM_PROFILE_MAX_STACKS];
+};
+
+/* where the running thread is, cycles are charged when the next instruction starts */
+struct vm_profile_cursor {
+	struct vm_profile *profile;
+	uint32_t last_pc;
+	uint8_t last_opcode;
+	uint64_t last_tick;
+	uint64_t stack_cycles;
+	uint64_t stack_count;
+};
+
+static inline uint64_t vm_profile_tick(void)
+{
+#if defined(__x86_64__)
+	uint32_t lo, hi;
+	
+	__asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+	uint64_t tick;
+	
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(tick));
+	return tick;
+#else
+	return vm_now_ns();
+#endif
+}
+
+void vm_profile_free(struct vm_profile *profile);
+
+#ifdef EBPF_VM_PROFILE
+
+extern __thread struct vm_profile_cursor vm_profile_cursor;
+
+void vm_profile_enter(struct ebpf_vm *vm);
+void vm_profile_flush(struct ebpf_vm *vm, const struct ebpf_instruction *ins);
+
+static inline void vm_profile_insn(struct ebpf_vm *vm, const struct ebpf_instruction *ins)
+{
+	struct vm_profile_cursor *cur = &vm_profile_cursor;
+	struct vm_profile *profile = cur->profile;
+	uint32_t pc = ins - ebpf_vm_code(vm);
+	uint64_t tick;
+	
+	if (profile == NULL) {
+		return;
+	}
+	
+	tick = vm_profile_tick();
+	if (cur->last_pc != VM_PROFILE_NO_PC) {
+		uint64_t delta = tick - cur->last_tick;
+		profile->pc_cycles[cur->last_pc] += delta;
+		profile->opcode_cycles[cur->last_opcode] += delta;
+		cur->stack_cycles += delta;
+	}
+	
+	profile->pc_count[pc]++;
+	profile->opcode_count[ins->opcode]++;
+	cur->stack_count++;
+	cur->last_pc = pc;
+	cur->last_opcode = ins->opcode;
+	cur->last_tick = tick;
+}
+
+#define VM_PROFILE_ENTER(vm) vm_profile_enter(vm)
+#define VM_PROFILE_INSN(vm, ins) vm_profile_insn((vm), (ins))
+#define VM_PROFILE_FLUSH(vm, ins) vm_profile_flush((vm), (ins))
+
+#else
+
+#define VM_PROFILE_ENTER(vm) do { } while (0)
+#define VM_PROFILE_INSN(vm, ins) do { } while (0)
+#define VM_PROFILE_FLUSH(vm, ins) do { } while (0)
+
+#endif
+
+#endif
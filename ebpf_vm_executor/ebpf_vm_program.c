@@ -0,0 +1,513 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "ebpf_vm_simulator.h"
+#include "ebpf_vm_profile.h"
+#include "ebpf_vm_perf.h"
+
+#define VM_IMAGE_ALIGN 64
+#define VM_CODE_HASH_SIZE 256
+
+static struct ub_list vm_code_hash[VM_CODE_HASH_SIZE];
+static pthread_mutex_t vm_code_lock = PTHREAD_MUTEX_INITIALIZER;
+static int vm_code_hash_ready;
+
+static uint64_t hash_code(const uint8_t *code, uint32_t size)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	
+	for (uint32_t idx = 0; idx < size; idx++) {
+		hash = (hash ^ code[idx]) * 1099511628211ULL;
+	}
+	
+	return hash;
+}
+
+/*
+ * The hash may come from the sender of a vm, the code is still compared, so
+ * a wrong one only costs the sharing. Neither hashing nor the comparison
+ * runs under the lock; two first users of some code may both add it.
+ */
+struct vm_code_segment *vm_code_get_hashed(const void *code, uint32_t size, uint64_t hash)
+{
+	struct vm_code_segment *seg = NULL, *found = NULL;
+	struct ub_list *bucket = NULL;
+	
+	pthread_mutex_lock(&vm_code_lock);
+	if (!vm_code_hash_ready) {
+		for (int idx = 0; idx < VM_CODE_HASH_SIZE; idx++) {
+			ub_list_init(&vm_code_hash[idx]);
+		}
+		vm_code_hash_ready = 1;
+	}
+	
+	bucket = &vm_code_hash[hash & (VM_CODE_HASH_SIZE - 1)];
+	UB_LIST_FOR_EACH(seg, node, bucket) {
+		if ((seg->hash == hash) && (seg->size == size)) {
+			__atomic_add_fetch(&seg->refcnt, 1, __ATOMIC_RELAXED);
+			found = seg;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&vm_code_lock);
+	
+	/* the reference keeps the segment while it is compared */
+	if (found != NULL) {
+		if (memcmp(found->code, code, size) == 0) {
+			return found;
+		}
+		vm_code_put(found);
+	}
+	
+	seg = malloc(sizeof(*seg) + size);
+	if (seg == NULL) {
+		return NULL;
+	}
+	
+	seg->refcnt = 1;
+	seg->size = size;
+	seg->hash = hash;
+	seg->funcs = NULL;
+	seg->num_funcs = 0;
+	seg->profile = NULL;
+	seg->perf = NULL;
+	memcpy(seg->code, code, size);
+	
+	pthread_mutex_lock(&vm_code_lock);
+	ub_list_push_back(bucket, &seg->node);
+	pthread_mutex_unlock(&vm_code_lock);
+	return seg;
+}
+
+struct vm_code_segment *vm_code_get(const void *code, uint32_t size)
+{
+	return vm_code_get_hashed(code, size, hash_code(code, size));
+}
+
+void vm_code_put(struct vm_code_segment *seg)
+{
+	uint32_t refcnt;
+	
+	if (seg == NULL) {
+		return;
+	}
+	
+	/* only dropping the last reference needs the lock, vm_code_get() revives segments under it */
+	refcnt = __atomic_load_n(&seg->refcnt, __ATOMIC_RELAXED);
+	while (refcnt > 1) {
+		if (__atomic_compare_exchange_n(&seg->refcnt, &refcnt, refcnt - 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			return;
+		}
+	}
+	
+	pthread_mutex_lock(&vm_code_lock);
+	if (__atomic_sub_fetch(&seg->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		ub_list_remove(&seg->node);
+		vm_profile_free(seg->profile);
+		vm_perf_code_free(seg->perf);
+		free(seg->funcs);
+		free(seg);
+	}
+	pthread_mutex_unlock(&vm_code_lock);
+}
+
+/* index of the function holding pc, -1 without symbols or outside of them */
+int32_t vm_code_find_func(struct vm_code_segment *seg, uint32_t pc)
+{
+	struct vm_func_symbol *funcs = __atomic_load_n(&seg->funcs, __ATOMIC_ACQUIRE);
+	int32_t low = 0;
+	int32_t high;
+	
+	if (funcs == NULL) {
+		return -1;
+	}
+	
+	high = (int32_t)seg->num_funcs - 1;
+	while (low <= high) {
+		int32_t mid = (low + high) / 2;
+		if (pc < funcs[mid].start) {
+			high = mid - 1;
+		} else if (pc >= funcs[mid].start + funcs[mid].size) {
+			low = mid + 1;
+		} else {
+			return mid;
+		}
+	}
+	
+	return -1;
+}
+
+void vm_attach_code(struct ebpf_vm *vm, struct vm_code_segment *seg)
+{
+	__atomic_add_fetch(&seg->refcnt, 1, __ATOMIC_RELAXED);
+	vm->rd.code_seg = seg;
+	vm->rd.code_hash = seg->hash;
+	vm->rd.insns = (struct ebpf_instruction *)seg->code;
+	vm->state.flags |= VM_F_SHARED_CODE;
+}
+
+static int compare_func_symbol(const void *a, const void *b)
+{
+	const struct vm_func_symbol *fa = a;
+	const struct vm_func_symbol *fb = b;
+	
+	return (fa->start > fb->start) - (fa->start < fb->start);
+}
+
+/*
+ * Names pcs of the segment for profiles. Segments are shared by content, the
+ * first caller wins. Symbols without a size extend to the next symbol.
+ */
+int vm_code_set_symbols(struct vm_code_segment *seg, const struct vm_func_symbol *funcs, uint32_t num)
+{
+	uint32_t num_insns = seg->size / sizeof(struct ebpf_instruction);
+	struct vm_func_symbol *sorted = NULL;
+	
+	if (num == 0) {
+		return 0;
+	}
+	
+	sorted = malloc(num * sizeof(*sorted));
+	if (sorted == NULL) {
+		printf("Failed to allocate function symbols.\n");
+		return -1;
+	}
+	
+	memcpy(sorted, funcs, num * sizeof(*sorted));
+	qsort(sorted, num, sizeof(*sorted), compare_func_symbol);
+	for (uint32_t idx = 0; idx < num; idx++) {
+		uint32_t end = (idx + 1 < num) ? sorted[idx + 1].start : num_insns;
+	
+		sorted[idx].name[VM_FUNC_NAME_SIZE - 1] = '\0';
+		if ((sorted[idx].size == 0) || (sorted[idx].start + sorted[idx].size > end)) {
+			sorted[idx].size = (end > sorted[idx].start) ? end - sorted[idx].start : 0;
+		}
+	}
+	
+	pthread_mutex_lock(&vm_code_lock);
+	if (seg->funcs == NULL) {
+		seg->num_funcs = num;
+		__atomic_store_n(&seg->funcs, sorted, __ATOMIC_RELEASE);
+		sorted = NULL;
+	}
+	pthread_mutex_unlock(&vm_code_lock);
+	
+	free(sorted);
+	return 0;
+}
+
+/* the image, followed by the code when it is not embedded in the image */
+int vm_image_parts(struct ebpf_vm *vm, struct vm_msg_part *parts)
+{
+	parts[0].buf = vm;
+	parts[0].size = ebpf_vm_image_size(vm);
+	if (vm->rd.code_seg == NULL) {
+		return 1;
+	}
+	
+	parts[1].buf = vm->rd.code_seg->code;
+	parts[1].size = vm->rd.code_seg->size;
+	return 2;
+}
+
+static int verify_jump(uint32_t pc, int64_t offset, uint32_t num)
+{
+	int64_t target = (int64_t)pc + offset + 1;
+	
+	return ((target >= 0) && (target < num)) ? 0 : -1;
+}
+
+static int verify_atomic(const struct ebpf_instruction *ins)
+{
+	if ((EBPF_MEM_SIZE(ins->opcode) != EBPF_W) && (EBPF_MEM_SIZE(ins->opcode) != EBPF_DW)) {
+		return -1;
+	}
+	
+	switch (ins->immediate) {
+	case EBPF_ALU_OP_ADD:
+	case EBPF_ALU_OP_OR:
+	case EBPF_ALU_OP_AND:
+	case EBPF_ALU_OP_XOR:
+	case EBPF_ATOMIC_CMPXCHG:
+		return 0;
+	case EBPF_ATOMIC_XCHG:
+	case (EBPF_ALU_OP_ADD | EBPF_ATOMIC_FETCH):
+	case (EBPF_ALU_OP_OR | EBPF_ATOMIC_FETCH):
+	case (EBPF_ALU_OP_AND | EBPF_ATOMIC_FETCH):
+	case (EBPF_ALU_OP_XOR | EBPF_ATOMIC_FETCH):
+		/* the old value goes to the source register */
+		return (ins->src_reg == EBPF_REG_FP) ? -1 : 0;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Structural checks which only need to run once per program: register
+ * numbers, jump and call targets, wide loads and the end of the program.
+ */
+int ebpf_vm_verify(const struct ebpf_instruction *insns, uint32_t num)
+{
+	uint32_t pc;
+	
+	if (num == 0) {
+		printf("Empty program.\n");
+		return -1;
+	}
+	
+	for (pc = 0; pc < num; pc++) {
+		const struct ebpf_instruction *ins = &insns[pc];
+		uint8_t cls = EBPF_OPCODE_CLASS(ins->opcode);
+	
+		if ((ins->dst_reg >= PKT_VM_USER_REG_NUM) || (ins->src_reg >= PKT_VM_USER_REG_NUM)) {
+			printf("Invalid register at instruction %u.\n", pc);
+			return -1;
+		}
+	
+		switch (cls) {
+		case EBPF_CLS_ALU:
+		case EBPF_CLS_ALU64:
+			if (ins->dst_reg == EBPF_REG_FP) {
+				printf("Write to frame pointer at instruction %u.\n", pc);
+				return -1;
+			}
+	
+			if (((EBPF_ALU_OP(ins->opcode) == EBPF_ALU_OP_DIV) || (EBPF_ALU_OP(ins->opcode) == EBPF_ALU_OP_MOD)) &&
+				((ins->opcode & EBPF_SRC_IS_REG) == 0) && (ins->immediate == 0)) {
+				printf("Division by zero at instruction %u.\n", pc);
+				return -1;
+			}
+			break;
+		case EBPF_CLS_STX:
+			if ((EBPF_MODE(ins->opcode) == EBPF_ATOMIC) && (verify_atomic(ins) != 0)) {
+				printf("Invalid atomic operation at instruction %u.\n", pc);
+				return -1;
+			}
+			break;
+		case EBPF_CLS_LDX:
+			if (ins->dst_reg == EBPF_REG_FP) {
+				printf("Write to frame pointer at instruction %u.\n", pc);
+				return -1;
+			}
+			break;
+		case EBPF_CLS_LD:
+			if (ins->opcode == (EBPF_CLS_LD | EBPF_IMM | EBPF_DW)) {
+				if ((pc + 1 >= num) || (insns[pc + 1].opcode != 0) || (ins->dst_reg == EBPF_REG_FP)) {
+					printf("Invalid wide load at instruction %u.\n", pc);
+					return -1;
+				}
+				pc++;
+			}
+			break;
+		case EBPF_CLS_JMP:
+			if (EBPF_JMP_OP(ins->opcode) == EBPF_JMP_OP_EXIT) {
+				break;
+			}
+	
+			if (EBPF_JMP_OP(ins->opcode) == EBPF_JMP_OP_CALL) {
+				if ((ins->src_reg == EBPF_PSEUDO_CALL) ? (verify_jump(pc, ins->immediate, num) != 0) :
+					((uint32_t)ins->immediate >= PKT_VM_MAX_SYMBS)) {
+					printf("Invalid call target at instruction %u.\n", pc);
+					return -1;
+				}
+				break;
+			}
+	
+			if (verify_jump(pc, ins->offset, num) != 0) {
+				printf("Jump out of program at instruction %u.\n", pc);
+				return -1;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	
+	/* the interpreter must never run past the last instruction */
+	if ((insns[num - 1].opcode != (EBPF_CLS_JMP | EBPF_JMP_OP_EXIT)) &&
+		(insns[num - 1].opcode != (EBPF_CLS_JMP | EBPF_JMP_OP_JA))) {
+		printf("Program does not end with exit.\n");
+		return -1;
+	}
+	
+	return 0;
+}
+
+struct ebpf_vm_program *create_program(const uint8_t *code, uint32_t code_size, uint32_t entry)
+{
+	struct ebpf_vm_program *prog = NULL;
+	uint32_t num = code_size / sizeof(struct ebpf_instruction);
+	
+	if ((code_size % sizeof(struct ebpf_instruction) != 0) || (entry >= num)) {
+		printf("Invalid program, code_size = %u, entry = %u.\n", code_size, entry);
+		return NULL;
+	}
+	
+	if (ebpf_vm_verify((const struct ebpf_instruction *)code, num) != 0) {
+		return NULL;
+	}
+	
+	prog = calloc(1, sizeof(*prog));
+	if (prog == NULL) {
+		printf("Failed to allocate program.\n");
+		return NULL;
+	}
+	
+	prog->code_seg = vm_code_get(code, code_size);
+	if (prog->code_seg == NULL) {
+		printf("Failed to allocate program code.\n");
+		free(prog);
+		return NULL;
+	}
+	
+	prog->code = prog->code_seg->code;
+	prog->code_size = code_size;
+	prog->entry = entry;
+	prog->stack_size = EBPF_VM_DEFAULT_STACK_SIZE;
+	prog->data_size = EBPF_VM_DEFAULT_DATA_SIZE;
+	return prog;
+}
+
+void destroy_program(struct ebpf_vm_program *prog)
+{
+	vm_code_put(prog->code_seg);
+	free(prog->globals);
+	free(prog);
+}
+
+/* image offsets are 16 bits wide and the data region starts right after struct ebpf_vm */
+static int check_image_sizes(uint32_t stack_size, uint32_t data_size)
+{
+	if ((stack_size > UINT16_MAX) || (sizeof(struct ebpf_vm) + data_size > UINT16_MAX)) {
+		printf("Invalid vm sizes, stack_size = %u, data_size = %u.\n", stack_size, data_size);
+		return -1;
+	}
+	
+	return 0;
+}
+
+int program_set_stack_size(struct ebpf_vm_program *prog, uint32_t stack_size)
+{
+	/* the frame of vm_main plus the caller registers saved by a call */
+	if ((stack_size < 2 * EBPF_VM_STACK_FRAME_SIZE) || (stack_size % EBPF_VM_STACK_FRAME_SIZE != 0)) {
+		printf("Invalid stack size %u.\n", stack_size);
+		return -1;
+	}
+	
+	if (check_image_sizes(stack_size, prog->data_size) != 0) {
+		return -1;
+	}
+	
+	prog->stack_size = stack_size;
+	return 0;
+}
+
+/* data_size is the room left for load_data() after the globals */
+int program_set_data_size(struct ebpf_vm_program *prog, uint32_t data_size)
+{
+	if (check_image_sizes(prog->stack_size, prog->globals_size + data_size) != 0) {
+		return -1;
+	}
+	
+	prog->data_size = prog->globals_size + data_size;
+	return 0;
+}
+
+int program_set_globals(struct ebpf_vm_program *prog, const uint8_t *globals, uint32_t size)
+{
+	uint32_t data_size = prog->data_size - prog->globals_size;
+	uint8_t *copy = NULL;
+	
+	if (check_image_sizes(prog->stack_size, size + data_size) != 0) {
+		return -1;
+	}
+	
+	if (size != 0) {
+		copy = malloc(size);
+		if (copy == NULL) {
+			printf("Failed to allocate globals.\n");
+			return -1;
+		}
+		memcpy(copy, globals, size);
+	}
+	
+	free(prog->globals);
+	prog->globals = copy;
+	prog->globals_size = size;
+	prog->data_size = size + data_size;
+	return 0;
+}
+
+int vm_instantiate(struct ebpf_vm_program *prog, uint32_t n, struct ebpf_vm **vms, const struct vm_instance_init *init)
+{
+	/* instances only hold their registers, data and stack, the code stays in the program's segment */
+	uint64_t image_size = sizeof(struct ebpf_vm) + prog->stack_size + prog->data_size;
+	uint64_t stride = (image_size + VM_IMAGE_ALIGN - 1) & ~(uint64_t)(VM_IMAGE_ALIGN - 1);
+	uint64_t total = sizeof(struct vm_image_block) + n * stride;
+	struct vm_image_block *block = NULL;
+	uint8_t *base = NULL;
+	
+	if (n == 0) {
+		return 0;
+	}
+	
+	if (total > UINT32_MAX) {
+		printf("Too many instances, n = %u.\n", n);
+		return -1;
+	}
+	
+	block = vm_pool_alloc(total);
+	if (block == NULL) {
+		printf("Failed to allocate %u instances.\n", n);
+		return -1;
+	}
+	
+	block->refcnt = n;
+	block->num = n;
+	block->reserved = 0;
+	base = (uint8_t *)(block + 1);
+	
+	for (uint32_t idx = 0; idx < n; idx++) {
+		struct ebpf_vm *vm = (struct ebpf_vm *)(base + idx * stride);
+	
+		vm_setup_image(vm, NULL, 0, prog->stack_size, prog->data_size);
+		vm_attach_code(vm, prog->code_seg);
+		vm->sys_reg[EBPF_SYS_REG_PC] = prog->entry;
+		vm->rd.block = block;
+	
+		if (prog->globals_size != 0) {
+			memcpy((uint8_t *)vm + vm->data, prog->globals, prog->globals_size);
+			vm->state.next_data_to_use = prog->globals_size;
+		}
+	
+		if (init != NULL) {
+			memcpy(&vm->reg[EBPF_REG_ARG1], init[idx].args, sizeof(init[idx].args));
+			if (init[idx].data != NULL) {
+				(void)load_data(vm, (uint8_t *)init[idx].data, init[idx].data_len);
+			}
+		}
+	
+		vms[idx] = vm;
+	}
+	
+	return n;
+}
+
+void vm_free_image(struct ebpf_vm *vm)
+{
+	struct vm_image_block *block = vm->rd.block;
+	
+	if (block == NULL) {
+		vm_pool_free(vm);
+		return;
+	}
+	
+	/* instances of one block may be destroyed by different workers */
+	if (__atomic_sub_fetch(&block->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		vm_pool_free(block);
+	}
+}
@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#endif
+
+#define PKT_VM_EXECUTOR 1
+
+#include "ebpf_vm_simulator.h"
+#include "ebpf_vm_functions.h"
+
+/*
+ * Bulk kernels behind the memory, hashing and search helpers. The helpers
+ * check the vm ranges once and hand plain host buffers to these functions.
+ * x86 picks the SSE4.2/AVX2 variants at run time, aarch64 uses NEON and the
+ * CRC extension when the compiler targets them.
+ */
+#define CRC32C_POLY 0x82f63b78
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint32_t crc32c_table[256];
+static uint32_t (*crc32c_impl)(uint32_t crc, const uint8_t *buf, uint64_t len);
+static int64_t (*search_impl)(const uint8_t *buf, uint64_t len, const struct vm_search_pattern *patterns,
+	uint32_t num, uint32_t *match);
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *buf, uint64_t len)
+{
+	for (uint64_t idx = 0; idx < len; idx++) {
+		crc = crc32c_table[(crc ^ buf[idx]) & 0xff] ^ (crc >> 8);
+	}
+	
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *buf, uint64_t len)
+{
+	uint64_t crc64 = crc;
+	
+	for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), buf += sizeof(uint64_t)) {
+		uint64_t val;
+	
+		memcpy(&val, buf, sizeof(val));
+		crc64 = _mm_crc32_u64(crc64, val);
+	}
+	
+	crc = (uint32_t)crc64;
+	for (; len > 0; len--) {
+		crc = _mm_crc32_u8(crc, *buf++);
+	}
+	
+	return crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_arm(uint32_t crc, const uint8_t *buf, uint64_t len)
+{
+	for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), buf += sizeof(uint64_t)) {
+		uint64_t val;
+	
+		memcpy(&val, buf, sizeof(val));
+		crc = __crc32cd(crc, val);
+	}
+	
+	for (; len > 0; len--) {
+		crc = __crc32cb(crc, *buf++);
+	}
+	
+	return crc;
+}
+#endif
+
+/* does pattern p occur at buf + pos, which is known to match its first byte */
+static int match_at(const uint8_t *buf, uint64_t len, uint64_t pos, const struct vm_search_pattern *p)
+{
+	return (pos + p->len <= len) && (memcmp(buf + pos, p->bytes, p->len) == 0);
+}
+
+static int match_any(const uint8_t *buf, uint64_t len, uint64_t pos, const struct vm_search_pattern *patterns,
+	uint32_t num, uint32_t *match)
+{
+	for (uint32_t idx = 0; idx < num; idx++) {
+		if ((buf[pos] == patterns[idx].bytes[0]) && match_at(buf, len, pos, &patterns[idx])) {
+			*match = idx;
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+static int64_t search_sw(const uint8_t *buf, uint64_t len, const struct vm_search_pattern *patterns,
+	uint32_t num, uint32_t *match)
+{
+	for (uint64_t pos = 0; pos < len; pos++) {
+		if (match_any(buf, len, pos, patterns, num, match)) {
+			return pos;
+		}
+	}
+	
+	return -1;
+}
+
+/*
+ * The vector searches filter block positions on the first two bytes of every
+ * pattern (one for single byte patterns) and only verify the candidates.
+ */
+#if defined(__x86_64__)
+static int64_t search_sse2(const uint8_t *buf, uint64_t len, const struct vm_search_pattern *patterns,
+	uint32_t num, uint32_t *match)
+{
+	uint64_t pos = 0;
+	int64_t ret;
+	
+	for (; pos + 17 <= len; pos += 16) {
+		__m128i b0 = _mm_loadu_si128((const __m128i *)(buf + pos));
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(buf + pos + 1));
+		uint32_t mask = 0;
+	
+		for (uint32_t idx = 0; idx < num; idx++) {
+			__m128i eq = _mm_cmpeq_epi8(b0, _mm_set1_epi8(patterns[idx].bytes[0]));
+	
+			if (patterns[idx].len > 1) {
+				eq = _mm_and_si128(eq, _mm_cmpeq_epi8(b1, _mm_set1_epi8(patterns[idx].bytes[1])));
+			}
+			mask |= (uint32_t)_mm_movemask_epi8(eq);
+		}
+	
+		while (mask != 0) {
+			uint64_t cand = pos + __builtin_ctz(mask);
+	
+			if (match_any(buf, len, cand, patterns, num, match)) {
+				return cand;
+			}
+			mask &= mask - 1;
+		}
+	}
+	
+	ret = search_sw(buf + pos, len - pos, patterns, num, match);
+	return (ret < 0) ? ret : (int64_t)pos + ret;
+}
+
+__attribute__((target("avx2")))
+static int64_t search_avx2(const uint8_t *buf, uint64_t len, const struct vm_search_pattern *patterns,
+	uint32_t num, uint32_t *match)
+{
+	uint64_t pos = 0;
+	int64_t ret;
+	
+	for (; pos + 33 <= len; pos += 32) {
+		__m256i b0 = _mm256_loadu_si256((const __m256i *)(buf + pos));
+		__m256i b1 = _mm256_loadu_si256((const __m256i *)(buf + pos + 1));
+		uint32_t mask = 0;
+	
+		for (uint32_t idx = 0; idx < num; idx++) {
+			__m256i eq = _mm256_cmpeq_epi8(b0, _mm256_set1_epi8(patterns[idx].bytes[0]));
+	
+			if (patterns[idx].len > 1) {
+				eq = _mm256_and_si256(eq, _mm256_cmpeq_epi8(b1, _mm256_set1_epi8(patterns[idx].bytes[1])));
+			}
+			mask |= (uint32_t)_mm256_movemask_epi8(eq);
+		}
+	
+		while (mask != 0) {
+			uint64_t cand = pos + __builtin_ctz(mask);
+	
+			if (match_any(buf, len, cand, patterns, num, match)) {
+				return cand;
+			}
+			mask &= mask - 1;
+		}
+	}
+	
+	ret = search_sse2(buf + pos, len - pos, patterns, num, match);
+	return (ret < 0) ? ret : (int64_t)pos + ret;
+}
+#elif defined(__aarch64__)
+static int64_t search_neon(const uint8_t *buf, uint64_t len, const struct vm_search_pattern *patterns,
+	uint32_t num, uint32_t *match)
+{
+	uint64_t pos = 0;
+	int64_t ret;
+	
+	for (; pos + 17 <= len; pos += 16) {
+		uint8x16_t b0 = vld1q_u8(buf + pos);
+		uint8x16_t b1 = vld1q_u8(buf + pos + 1);
+		uint8x16_t any = vdupq_n_u8(0);
+		uint64_t mask;
+	
+		for (uint32_t idx = 0; idx < num; idx++) {
+			uint8x16_t eq = vceqq_u8(b0, vdupq_n_u8(patterns[idx].bytes[0]));
+	
+			if (patterns[idx].len > 1) {
+				eq = vandq_u8(eq, vceqq_u8(b1, vdupq_n_u8(patterns[idx].bytes[1])));
+			}
+			any = vorrq_u8(any, eq);
+		}
+	
+		/* four bits per byte, so candidate k is bit 4 * k */
+		mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(any), 4)), 0);
+		mask &= 0x1111111111111111ULL;
+		while (mask != 0) {
+			uint64_t cand = pos + (__builtin_ctzll(mask) >> 2);
+	
+			if (match_any(buf, len, cand, patterns, num, match)) {
+				return cand;
+			}
+			mask &= mask - 1;
+		}
+	}
+	
+	ret = search_sw(buf + pos, len - pos, patterns, num, match);
+	return (ret < 0) ? ret : (int64_t)pos + ret;
+}
+#endif
+
+static void simd_init_once(void)
+{
+	for (uint32_t idx = 0; idx < 256; idx++) {
+		uint32_t crc = idx;
+	
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc & 1) ? ((crc >> 1) ^ CRC32C_POLY) : (crc >> 1);
+		}
+		crc32c_table[idx] = crc;
+	}
+	
+	crc32c_impl = crc32c_sw;
+	search_impl = search_sw;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_impl = crc32c_sse42;
+	}
+	search_impl = __builtin_cpu_supports("avx2") ? search_avx2 : search_sse2;
+#elif defined(__aarch64__)
+#if defined(__ARM_FEATURE_CRC32)
+	crc32c_impl = crc32c_arm;
+#endif
+	search_impl = search_neon;
+#endif
+}
+
+/* seed is the crc of the preceding data, 0 to start */
+uint32_t vm_crc32c(uint32_t seed, const void *buf, uint64_t len)
+{
+	pthread_once(&simd_once, simd_init_once);
+	return ~crc32c_impl(~seed, buf, len);
+}
+
+static uint64_t xxh_rotl(uint64_t val, int bits)
+{
+	return (val << bits) | (val >> (64 - bits));
+}
+
+static uint64_t xxh_read64(const uint8_t *p)
+{
+	uint64_t val;
+	
+	memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+static uint32_t xxh_read32(const uint8_t *p)
+{
+	uint32_t val;
+	
+	memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = xxh_rotl(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static uint64_t xxh_merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/*
+ * XXH64 is built around four independent 64 bit lanes, which already keep a
+ * scalar core busy; it has no vector formulation worth dispatching to.
+ */
+uint64_t vm_xxhash64(uint64_t seed, const void *buf, uint64_t len)
+{
+	const uint8_t *p = buf;
+	const uint8_t *end = p + len;
+	uint64_t hash;
+	
+	if (len >= 32) {
+		uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		uint64_t v2 = seed + XXH_PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH_PRIME64_1;
+	
+		do {
+			v1 = xxh_round(v1, xxh_read64(p));
+			v2 = xxh_round(v2, xxh_read64(p + 8));
+			v3 = xxh_round(v3, xxh_read64(p + 16));
+			v4 = xxh_round(v4, xxh_read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+	
+		hash = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+		hash = xxh_merge_round(hash, v1);
+		hash = xxh_merge_round(hash, v2);
+		hash = xxh_merge_round(hash, v3);
+		hash = xxh_merge_round(hash, v4);
+	} else {
+		hash = seed + XXH_PRIME64_5;
+	}
+	
+	hash += len;
+	for (; p + 8 <= end; p += 8) {
+		hash ^= xxh_round(0, xxh_read64(p));
+		hash = xxh_rotl(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	
+	if (p + 4 <= end) {
+		hash ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+		hash = xxh_rotl(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	
+	for (; p < end; p++) {
+		hash ^= (*p) * XXH_PRIME64_5;
+		hash = xxh_rotl(hash, 11) * XXH_PRIME64_1;
+	}
+	
+	hash ^= hash >> 33;
+	hash *= XXH_PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= XXH_PRIME64_3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+/* offset of the earliest occurrence of any pattern, the lowest index wins a tie */
+int64_t vm_mem_search(const uint8_t *buf, uint64_t len, const struct vm_search_pattern *patterns,
+	uint32_t num, uint32_t *match)
+{
+	for (uint32_t idx = 0; idx < num; idx++) {
+		if ((patterns[idx].len == 0) || (patterns[idx].len > VM_SEARCH_PATTERN_SIZE)) {
+			return -1;
+		}
+	}
+	
+	pthread_once(&simd_once, simd_init_once);
+	return search_impl(buf, len, patterns, num, match);
+}
@@ -13,6 +13,11 @@
 #include "ebpf_vm_simulator.h"
 #include "ebpf_vm_transport.h"
 #include "ebpf_vm_functions.h"
+#include "ebpf_vm_profile.h"
+#include "ebpf_vm_perf.h"
+#include "ebpf_vm_log.h"
+#include "ebpf_vm_trace.h"
+#include "ebpf_vm_packet.h"
 
 struct transport_ops *registered_transport[PKT_VM_TRANSPORT_TYPE_MAX];
 
@@ -56,7 +61,7 @@ uint64_t vm_mmu(uint64_t va, struct ebpf_vm *vm)
 	uint64_t offset = va & ENTRY_MASK;
 	int idx = vm->sys_reg[EBPF_SYS_REG_PAGE_TABLE_IDX];
 	
-	if ((va >> PACKET_VA_SHIFT) != 0) {
+	if (((va >> PACKET_VA_SHIFT) != 0) || ((va >> INDEX_SHIFT) >= BUCKET_ENTRIES)) {
 		return PAGE_TABLE_ERROR;
 	}
 	
@@ -68,6 +73,47 @@ uint64_t vm_mmu(uint64_t va, struct ebpf_vm *vm)
 	return PAGE_TABLE_ERROR;
 }
 
+/* like vm_mmu, but every byte of [va, va + len) must be in the one entry, len 0 never is */
+uint64_t vm_mmu_range(uint64_t va, uint64_t len, struct ebpf_vm *vm)
+{
+	struct vm_pte *e = NULL;
+	uint64_t offset = va & ENTRY_MASK;
+	int idx = vm->sys_reg[EBPF_SYS_REG_PAGE_TABLE_IDX];
+	
+	if (((va >> PACKET_VA_SHIFT) != 0) || ((va >> INDEX_SHIFT) >= BUCKET_ENTRIES) || (len == 0)) {
+		return PAGE_TABLE_ERROR;
+	}
+	
+	e = &vm->page_table[idx].entries[(va >> INDEX_SHIFT)];
+	if ((e->va != 0x00) && (offset <= e->size) && (len <= e->size - offset)) {
+		return e->va + offset;
+	}
+	
+	return PAGE_TABLE_ERROR;
+}
+
+/* a size argument covers every pointer since the previous one, a zero size none */
+static int check_helper_args(struct ebpf_vm *vm, const struct ebpf_symbol *symb)
+{
+	uint32_t first = 0;
+	
+	for (uint32_t idx = 0; idx < symb->num_args; idx++) {
+		if (symb->arg_types[idx] != EBPF_ARG_SIZE) {
+			continue;
+		}
+	
+		for (uint32_t ptr = first; (ptr < idx) && (vm->reg[idx + 1] != 0); ptr++) {
+			if ((symb->arg_types[ptr] == EBPF_ARG_PTR) &&
+				(vm_mmu_range(vm->reg[ptr + 1], vm->reg[idx + 1], vm) == PAGE_TABLE_ERROR)) {
+				return -1;
+			}
+		}
+		first = idx + 1;
+	}
+	
+	return 0;
+}
+
 void update_vm_state(struct ebpf_vm *vm, int state)
 {
 	vm->state.vm_state = state;
@@ -93,11 +139,69 @@ static void restore_caller_register(struct ebpf_vm *vm)
 	vm->sys_reg[EBPF_SYS_REG_LR] = *fp++;
 }
 
+/*
+ * Atomics other than the plain add. Variants fetching the old value are
+ * fully ordered like in the kernel, the others are relaxed. The 32 bit
+ * forms zero extend the fetched value, ebpf_vm_verify() rejects unknown ops.
+ */
+#define EBPF_ATOMIC_OP(TYPE, vm, ins, addr) do { \
+	TYPE val = (TYPE)(vm)->reg[(ins)->src_reg]; \
+	TYPE old; \
+	switch ((ins)->immediate) { \
+	case EBPF_ALU_OP_OR: \
+		__atomic_fetch_or((addr), val, __ATOMIC_RELAXED); \
+		break; \
+	case EBPF_ALU_OP_AND: \
+		__atomic_fetch_and((addr), val, __ATOMIC_RELAXED); \
+		break; \
+	case EBPF_ALU_OP_XOR: \
+		__atomic_fetch_xor((addr), val, __ATOMIC_RELAXED); \
+		break; \
+	case (EBPF_ALU_OP_ADD | EBPF_ATOMIC_FETCH): \
+		(vm)->reg[(ins)->src_reg] = __atomic_fetch_add((addr), val, __ATOMIC_SEQ_CST); \
+		break; \
+	case (EBPF_ALU_OP_OR | EBPF_ATOMIC_FETCH): \
+		(vm)->reg[(ins)->src_reg] = __atomic_fetch_or((addr), val, __ATOMIC_SEQ_CST); \
+		break; \
+	case (EBPF_ALU_OP_AND | EBPF_ATOMIC_FETCH): \
+		(vm)->reg[(ins)->src_reg] = __atomic_fetch_and((addr), val, __ATOMIC_SEQ_CST); \
+		break; \
+	case (EBPF_ALU_OP_XOR | EBPF_ATOMIC_FETCH): \
+		(vm)->reg[(ins)->src_reg] = __atomic_fetch_xor((addr), val, __ATOMIC_SEQ_CST); \
+		break; \
+	case EBPF_ATOMIC_XCHG: \
+		(vm)->reg[(ins)->src_reg] = __atomic_exchange_n((addr), val, __ATOMIC_SEQ_CST); \
+		break; \
+	case EBPF_ATOMIC_CMPXCHG: \
+		/* r0 holds the expected value and receives the old one */ \
+		old = (TYPE)(vm)->reg[EBPF_REG_RETURN_RESULT]; \
+		(void)__atomic_compare_exchange_n((addr), &old, val, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+		(vm)->reg[EBPF_REG_RETURN_RESULT] = old; \
+		break; \
+	default: \
+		break; \
+	} \
+} while (0)
+
+static void ebpf_atomic32(struct ebpf_vm *vm, const struct ebpf_instruction *ins, uint32_t *addr)
+{
+	EBPF_ATOMIC_OP(uint32_t, vm, ins, addr);
+}
+
+static void ebpf_atomic64(struct ebpf_vm *vm, const struct ebpf_instruction *ins, uint64_t *addr)
+{
+	EBPF_ATOMIC_OP(uint64_t, vm, ins, addr);
+}
+
 uint64_t run_ebpf_vm(struct ebpf_vm *vm)
 {
 	struct ebpf_instruction *ins = ebpf_vm_code(vm) + vm->sys_reg[EBPF_SYS_REG_PC];
+	uint64_t retired = 0;
 	
+	VM_PROFILE_ENTER(vm);
 	while (1) {
+		VM_PROFILE_INSN(vm, ins);
+		retired++;
 		switch (ins->opcode) {
 		case (EBPF_CLS_ALU64 | EBPF_ALU_OP_ADD | EBPF_SRC_IS_IMM): {
 			vm->reg[ins->dst_reg] += (uint64_t)ins->immediate;
@@ -261,25 +365,38 @@ uint64_t run_ebpf_vm(struct ebpf_vm *vm)
 		}
 		case (EBPF_CLS_JMP | EBPF_JMP_OP_CALL): {
 			if (ins->src_reg == EBPF_PSEUDO_CALL) {
+				VM_PROFILE_FLUSH(vm, ins);
 				save_caller_register(vm);
 				vm->state.stack_depth++;
 				vm->reg[EBPF_REG_FP] -= EBPF_VM_STACK_FRAME_SIZE;
 				vm->sys_reg[EBPF_SYS_REG_LR] = ins - ebpf_vm_code(vm) + 1;
 				vm->sys_reg[EBPF_SYS_REG_PC] = vm->sys_reg[EBPF_SYS_REG_LR] + ins->immediate;
-				vm->reg[0] = run_ebpf_vm(vm);
+				vm->reg[0] = VM_PERF_RUN(vm);
 				if (vm->state.vm_state != VM_STATE_RUNNING) {
+					vm->rd.insns_retired += retired;
 					return 0;
 				}
 			} else if ((ins->immediate < PKT_VM_MAX_SYMBS) && (vm->rd.symbols[ins->immediate].func != NULL)) {
+				const struct ebpf_symbol *symb = &vm->rd.symbols[ins->immediate];
 				vm->sys_reg[EBPF_SYS_REG_PC] = ins - ebpf_vm_code(vm);
-				vm->reg[0] = vm->rd.symbols[ins->immediate].func(vm->reg[1], vm->reg[2], vm->reg[3], vm->reg[4], vm->reg[5], vm);
+				uint64_t call_ns = VM_LAT_HELPER_START(vm);
+	
+				vm->rd.helper_calls++;
+				VM_TRACE_HELPER(vm, ins->immediate);
+				/* the helper is not called with a buffer it could only check in part */
+				vm->reg[0] = (check_helper_args(vm, symb) == 0) ?
+					symb->func(vm->reg[1], vm->reg[2], vm->reg[3], vm->reg[4], vm->reg[5], vm) : VM_MEM_FAULT;
+				VM_LAT_HELPER_END(vm, ins->immediate, call_ns);
 				if (vm->state.vm_state != VM_STATE_RUNNING) {
+					VM_PROFILE_FLUSH(vm, ins);
+					vm->rd.insns_retired += retired;
 					return 0;
 				}
 			}
 			break;
 		}
 		case (EBPF_CLS_JMP | EBPF_JMP_OP_EXIT): {
+			VM_PROFILE_FLUSH(vm, ins);
 			if (vm->state.stack_depth != 0) {
 				vm->sys_reg[EBPF_SYS_REG_PC] = vm->sys_reg[EBPF_SYS_REG_LR];
 				vm->reg[EBPF_REG_FP] += EBPF_VM_STACK_FRAME_SIZE;
@@ -288,6 +405,7 @@ uint64_t run_ebpf_vm(struct ebpf_vm *vm)
 			} else {
 				update_vm_state(vm, VM_STATE_EXIT);
 			}
+			vm->rd.insns_retired += retired;
 			return vm->reg[0];
 		}
 		case (EBPF_CLS_JMP | EBPF_JMP_OP_JLT | EBPF_SRC_IS_IMM): {
@@ -367,14 +485,22 @@ uint64_t run_ebpf_vm(struct ebpf_vm *vm)
 			*(uint64_t *)store_addr = (uint64_t)vm->reg[ins->src_reg];
 			break;
 		}
-		case (EBPF_CLS_STX | EBPF_XADD | EBPF_W): {
+		case (EBPF_CLS_STX | EBPF_ATOMIC | EBPF_W): {
 			uint64_t store_addr = vm_mmu(vm->reg[ins->dst_reg] + ins->offset, vm);
-			__atomic_fetch_add((uint32_t *)store_addr, (uint32_t)vm->reg[ins->src_reg], __ATOMIC_RELAXED);
+			if (ins->immediate == EBPF_ALU_OP_ADD) {
+				__atomic_fetch_add((uint32_t *)store_addr, (uint32_t)vm->reg[ins->src_reg], __ATOMIC_RELAXED);
+			} else {
+				ebpf_atomic32(vm, ins, (uint32_t *)store_addr);
+			}
 			break;
 		}
-		case (EBPF_CLS_STX | EBPF_XADD | EBPF_DW): {
+		case (EBPF_CLS_STX | EBPF_ATOMIC | EBPF_DW): {
 			uint64_t store_addr = vm_mmu(vm->reg[ins->dst_reg] + ins->offset, vm);
-			__atomic_fetch_add((uint64_t *)store_addr, (uint64_t)vm->reg[ins->src_reg], __ATOMIC_RELAXED);
+			if (ins->immediate == EBPF_ALU_OP_ADD) {
+				__atomic_fetch_add((uint64_t *)store_addr, (uint64_t)vm->reg[ins->src_reg], __ATOMIC_RELAXED);
+			} else {
+				ebpf_atomic64(vm, ins, (uint64_t *)store_addr);
+			}
 			break;
 		}
 		case (EBPF_CLS_ST | EBPF_MEM | EBPF_B): {
@@ -406,97 +532,587 @@ uint64_t run_ebpf_vm(struct ebpf_vm *vm)
 			break;
 		}
 		default: {
-			printf("invalid ebpf opcode %x\n", ins->opcode);
+			vm_log_at(VM_LOG_T_MSG, vm->rd.id, ins - ebpf_vm_code(vm), "invalid ebpf opcode %lx", (uint64_t)ins->opcode);
+			VM_PROFILE_FLUSH(vm, ins);
 			update_vm_state(vm, VM_STATE_EXIT);
+			vm->rd.insns_retired += retired;
 			return 0;
 		}
 		} /*end of switch*/
 		/* increase PC */
 		ins++;
 	} /*end of while*/
-
+	
 	/*should never be here*/
 	return 0;
 }
 
-static void receive_vm(struct ebpf_vm_executor *executor, void *buf, int buf_size)
+/* a migrated vm keeps its id, new ones are named after the node and worker creating them */
+void vm_worker_bind(struct ebpf_vm_worker *worker, struct ebpf_vm *vm)
+{
+	if (vm->rd.id == VM_ID_NONE) {
+		vm->rd.id = ((uint64_t)worker->executor->node_id << VM_ID_NODE_SHIFT) |
+			((worker->next_vm_id++ & VM_ID_SEQ_MASK) << VM_ID_WORKER_SHIFT) | worker->index;
+	}
+	vm->rd.symbols = worker->executor->helpers->symbols;
+	vm->rd.executor = worker->executor;
+	vm->rd.worker = worker;
+}
+
+static int worker_add_vm(struct ebpf_vm_worker *worker, struct ebpf_vm *vm)
+{
+	vm_worker_bind(worker, vm);
+	ub_list_push_back(&worker->vm_list, &vm->rd.list);
+	return 0;
+}
+
+static struct ebpf_vm *receive_vm(void *buf, int buf_size)
 {
+	struct vm_code_segment *seg = NULL;
 	struct ebpf_vm *vm = NULL;
+	uint32_t image_size;
 	
 	if (buf_size < sizeof(struct ebpf_vm)) {
-		printf("vm size is too small, buf_size = %d.\n", buf_size);
-		return;
+		vm_log("vm size is too small, buf_size = %lu.", (uint64_t)buf_size);
+		return NULL;
 	}
 	
-	vm = calloc(1, buf_size);
+	/* a vm with shared code is followed by the code, which goes into the local segment cache */
+	image_size = ebpf_vm_image_size((struct ebpf_vm *)buf);
+	if ((image_size > buf_size) ||
+		((((struct ebpf_vm *)buf)->state.flags & VM_F_SHARED_CODE) && (image_size == buf_size))) {
+		vm_log("Invalid vm image, buf_size = %lu.", (uint64_t)buf_size);
+		return NULL;
+	}
+	
+	if (((struct ebpf_vm *)buf)->state.flags & VM_F_SHARED_CODE) {
+		seg = vm_code_get_hashed((uint8_t *)buf + image_size, buf_size - image_size, ((struct ebpf_vm *)buf)->rd.code_hash);
+		if (seg == NULL) {
+			vm_log("Failed to get code segment for input vm.");
+			return NULL;
+		}
+	}
+	
+	vm = vm_pool_alloc(image_size);
 	if (vm == NULL) {
-		printf("Failed to allocate vm for input vm.\n");
-		return;
+		vm_log("Failed to allocate vm for input vm.");
+		vm_code_put(seg);
+		return NULL;
 	}
 	
-	memcpy(vm, buf, buf_size);
+	memcpy(vm, buf, image_size);
 	
 	vm->page_table[0].entries[0].va = (uint64_t)vm + vm->data;
+	vm->rd.fanout = NULL;
+	vm->rd.block = NULL;
+	/* reservations belong to the host that made them, so do the host addresses they map */
+	for (uint32_t idx = 0; idx < BUCKET_ENTRIES; idx++) {
+		if (vm->rd.reserved_ptes & (1U << idx)) {
+			for (uint32_t ptb = 0; ptb < PAGE_TABLE_NUM; ptb++) {
+				memset(&vm->page_table[ptb].entries[idx], 0, sizeof(struct vm_pte));
+			}
+		}
+	}
+	vm->rd.reserved_ptes = 0;
+	vm->rd.pinned = 0;
+	/* a fork child may be sent while its parent is half way through its children */
+	vm->rd.sends_done = 0;
+	vm->rd.code_seg = seg;
+	vm->rd.insns = (seg != NULL) ? (struct ebpf_instruction *)seg->code : (struct ebpf_instruction *)((uint8_t *)vm + vm->code);
 	ub_list_init(&vm->address_monitor_list);
+	return vm;
+}
+
+static void start_received_vm(struct ebpf_vm *vm)
+{
+	/* skip the migrate_to or clone_to call which sent this vm */
 	vm->sys_reg[EBPF_SYS_REG_PC]++;
 	update_vm_state(vm, VM_STATE_RUNNING);
+}
+
+static void receive_clone(struct ebpf_vm_worker *worker, void *buf, int buf_size)
+{
+	struct vm_clone_header *clone = buf;
+	struct vm_clone_fanout *fanout = NULL;
+	struct ebpf_vm *vm = NULL;
+	uint32_t targets_size;
+	uint64_t parent;
+	
+	if ((buf_size < sizeof(*clone)) || (clone->count == 0)) {
+		vm_log("Invalid clone message, buf_size = %lu.", (uint64_t)buf_size);
+		worker->stats.recv_drops++;
+		return;
+	}
+	
+	targets_size = clone->count * sizeof(struct node_url);
+	if (buf_size < sizeof(*clone) + targets_size) {
+		vm_log("Invalid clone message, buf_size = %lu.", (uint64_t)buf_size);
+		worker->stats.recv_drops++;
+		return;
+	}
+	
+	vm = receive_vm((uint8_t *)(clone + 1) + targets_size, buf_size - sizeof(*clone) - targets_size);
+	if (vm == NULL) {
+		worker->stats.recv_drops++;
+		return;
+	}
+	
+	/* every clone is a vm of its own */
+	parent = vm->rd.id;
+	vm->rd.id = VM_ID_NONE;
+	
+	if (clone->count > 1) {
+		fanout = malloc(sizeof(*fanout) + targets_size);
+		if (fanout == NULL) {
+			vm_log("Failed to allocate clone fanout.");
+			destroy_vm(vm);
+			worker->stats.recv_drops++;
+			return;
+		}
 	
-	add_vm(executor, vm);
+		fanout->base = clone->base;
+		fanout->count = clone->count;
+		memcpy(fanout->targets, clone + 1, targets_size);
+		vm->rd.fanout = fanout;
+		update_vm_state(vm, VM_STATE_CLONE_TO);
+	} else {
+		vm->reg[0] = clone->base;
+		start_received_vm(vm);
+	}
+	
+	worker->stats.clones_in++;
+	worker_add_vm(worker, vm);
+	VM_TRACE_VM(vm, VM_TRACE_CREATE, parent);
 }
 
-void vm_executor_run(struct ebpf_vm_executor *executor)
+static void receive_fork(struct ebpf_vm_worker *worker, void *buf, int buf_size)
+{
+	struct vm_fork_context *fork = buf;
+	struct ebpf_vm *vm = NULL;
+	
+	if (buf_size < sizeof(*fork)) {
+		vm_log("Invalid fork message, buf_size = %lu.", (uint64_t)buf_size);
+		worker->stats.recv_drops++;
+		return;
+	}
+	
+	vm = receive_vm(fork + 1, buf_size - sizeof(*fork));
+	if (vm == NULL) {
+		worker->stats.recv_drops++;
+		return;
+	}
+	
+	memcpy(&vm->rd.fork, fork, sizeof(*fork));
+	vm->rd.fork_count = 0;
+	vm->rd.join_count = 0;
+	vm->rd.join_deadline_ns = 0;
+	vm->rd.id = VM_ID_NONE;
+	vm->reg[0] = fork->index;
+	start_received_vm(vm);
+	worker->stats.forks_in++;
+	worker_add_vm(worker, vm);
+	VM_TRACE_VM(vm, VM_TRACE_CREATE, fork->parent_id);
+}
+
+static void receive_fork_return(struct ebpf_vm_worker *worker, void *buf, int buf_size)
+{
+	struct vm_fork_return *ret = buf;
+	struct remote_thread *thread = NULL;
+	struct ebpf_vm *vm = NULL;
+	
+	if (buf_size < sizeof(*ret)) {
+		vm_log("Invalid fork return message, buf_size = %lu.", (uint64_t)buf_size);
+		return;
+	}
+	
+	vm = vm_worker_find_vm(worker, ret->parent_id);
+	if (vm == NULL) {
+		vm_log("Parent vm %lu of fork return is gone.", ret->parent_id);
+		return;
+	}
+	
+	/* the index comes from the network, it must name one of the children the vm waits for */
+	if (ret->index >= vm->rd.fork_count) {
+		vm_log_vm(vm, "Fork return for thread %lu of %lu.", ret->index, vm->rd.fork_count);
+		return;
+	}
+	
+	thread = (struct remote_thread *)vm_mmu_range(ret->thread_list + ret->index * sizeof(*thread), sizeof(*thread), vm);
+	if (thread == (struct remote_thread *)PAGE_TABLE_ERROR) {
+		vm_log_vm(vm, "Invalid fork thread list %lx.", ret->thread_list);
+		return;
+	}
+	
+	thread->result = ret->result;
+	vm->rd.join_count++;
+}
+
+static void receive_record(struct ebpf_vm_worker *worker, struct vm_msg_header *hdr)
+{
+	struct ebpf_vm *vm = NULL;
+	
+	switch (hdr->type) {
+	case VM_MSG_MIGRATE:
+		vm = receive_vm(hdr + 1, hdr->size);
+		if (vm != NULL) {
+			start_received_vm(vm);
+			worker->stats.migrations_in++;
+			worker_add_vm(worker, vm);
+			VM_TRACE_VM(vm, VM_TRACE_MIGRATE_IN, vm->rd.hops);
+		} else {
+			worker->stats.recv_drops++;
+		}
+		break;
+	case VM_MSG_CLONE:
+		receive_clone(worker, hdr + 1, hdr->size);
+		break;
+	case VM_MSG_FORK:
+		receive_fork(worker, hdr + 1, hdr->size);
+		break;
+	case VM_MSG_FORK_RETURN:
+		receive_fork_return(worker, hdr + 1, hdr->size);
+		break;
+	case VM_MSG_MEM_READ:
+	case VM_MSG_MEM_READ_DATA:
+	case VM_MSG_MEM_WRITE:
+	case VM_MSG_MEM_WRITE_ACK:
+		vm_receive_mem_msg(worker, hdr->type, hdr + 1, hdr->size);
+		break;
+	default:
+		vm_log("Unknown message type %lu.", (uint64_t)hdr->type);
+		worker->stats.recv_drops++;
+		break;
+	}
+}
+
+/* replies to a vm or memory operation must be handled by the worker that owns it */
+static uint32_t record_owner(struct ebpf_vm_worker *worker, struct vm_msg_header *hdr)
+{
+	uint32_t owner = worker->index;
+	
+	switch (hdr->type) {
+	case VM_MSG_FORK_RETURN:
+		if (hdr->size >= sizeof(struct vm_fork_return)) {
+			owner = ((struct vm_fork_return *)(hdr + 1))->parent_worker;
+		}
+		break;
+	case VM_MSG_MEM_READ_DATA:
+	case VM_MSG_MEM_WRITE_ACK:
+		if (hdr->size >= sizeof(struct vm_mem_msg)) {
+			owner = vm_id_worker(((struct vm_mem_msg *)(hdr + 1))->op_id);
+		}
+		break;
+	default:
+		break;
+	}
+	
+	return (owner < worker->executor->num_workers) ? owner : worker->index;
+}
+
+static void forward_record(struct ebpf_vm_worker *worker, struct vm_msg_header *hdr)
+{
+	struct vm_inbox_msg *msg = malloc(sizeof(*msg) + sizeof(*hdr) + hdr->size);
+	
+	if (msg == NULL) {
+		vm_log("Failed to forward message to worker %lu.", (uint64_t)worker->index);
+		return;
+	}
+	
+	memcpy(msg->buf, hdr, sizeof(*hdr) + hdr->size);
+	pthread_mutex_lock(&worker->inbox_lock);
+	ub_list_push_back(&worker->inbox, &msg->list);
+	__atomic_store_n(&worker->inbox_len, worker->inbox_len + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&worker->inbox_lock);
+}
+
+static void poll_inbox(struct ebpf_vm_worker *worker)
+{
+	struct vm_inbox_msg *msg, *tmp;
+	struct ub_list inbox;
+	
+	if (__atomic_load_n(&worker->inbox_len, __ATOMIC_ACQUIRE) == 0) {
+		return;
+	}
+	
+	ub_list_init(&inbox);
+	pthread_mutex_lock(&worker->inbox_lock);
+	UB_LIST_FOR_EACH_SAFE(msg, tmp, list, &worker->inbox) {
+		ub_list_remove(&msg->list);
+		ub_list_push_back(&inbox, &msg->list);
+	}
+	__atomic_store_n(&worker->inbox_len, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&worker->inbox_lock);
+	
+	UB_LIST_FOR_EACH_SAFE(msg, tmp, list, &inbox) {
+		ub_list_remove(&msg->list);
+		receive_record(worker, (struct vm_msg_header *)msg->buf);
+		free(msg);
+	}
+}
+
+static void receive_msg(struct ebpf_vm_worker *worker, void *buf, int buf_size)
+{
+	struct ebpf_vm_executor *executor = worker->executor;
+	uint8_t *p = buf;
+	uint32_t remain = buf_size;
+	
+	/* a message packs one or more records, each padded to VM_MSG_ALIGN */
+	while (remain >= sizeof(struct vm_msg_header)) {
+		struct vm_msg_header *hdr = (struct vm_msg_header *)p;
+		uint32_t record_size, owner;
+	
+		if (hdr->size > remain - sizeof(*hdr)) {
+			vm_log("Invalid message, buf_size = %lu.", (uint64_t)buf_size);
+			worker->stats.recv_drops++;
+			return;
+		}
+	
+		owner = record_owner(worker, hdr);
+		if (owner == worker->index) {
+			receive_record(worker, hdr);
+		} else {
+			forward_record(&executor->workers[owner], hdr);
+			worker->stats.records_forwarded++;
+		}
+	
+		record_size = VM_MSG_RECORD_SIZE(hdr->size);
+		if (record_size >= remain) {
+			break;
+		}
+	
+		p += record_size;
+		remain -= record_size;
+	}
+}
+
+static uint32_t clone_subtree_size(uint32_t count, uint32_t fanout, uint32_t idx)
+{
+	return (count / fanout) + ((idx < (count % fanout)) ? 1 : 0);
+}
+
+int vm_clone_fanout(struct ebpf_vm *vm, struct node_url *targets, uint32_t base, uint32_t count)
+{
+	struct ebpf_vm_executor *executor = vm->rd.executor;
+	uint32_t fanout = executor->clone_fanout;
+	uint32_t start, num, idx;
+	int ret = PKT_VM_PEER_READY;
+	
+	/* without a fan-out every target is a sub-tree of its own, i.e. plain unicast */
+	if ((fanout < 2) || (fanout > count)) {
+		fanout = count;
+	}
+	
+	/* the origin only talks to the head of each sub-tree, so only those need to be resolved */
+	for (idx = 0, start = 0; idx < fanout; idx++, start += num) {
+		num = clone_subtree_size(count, fanout, idx);
+		if (executor->transport->resolve(executor->transport_ctx, &targets[start]) == PKT_VM_PEER_PENDING) {
+			ret = PKT_VM_PEER_PENDING;
+		}
+	}
+	
+	if (ret == PKT_VM_PEER_PENDING) {
+		return ret;
+	}
+	
+	for (idx = 0, start = 0; idx < fanout; idx++, start += num) {
+		struct vm_clone_header clone;
+		struct vm_msg_part parts[4];
+		int sent;
+	
+		num = clone_subtree_size(count, fanout, idx);
+		if (idx < vm->rd.sends_done) {
+			continue;
+		}
+		clone.base = base + start;
+		clone.count = num;
+		vm->reg[0] = clone.base;
+	
+		parts[0].buf = &clone;
+		parts[0].size = sizeof(clone);
+		parts[1].buf = &targets[start];
+		parts[1].size = num * sizeof(struct node_url);
+	
+		sent = vm_send_msg(vm->rd.worker, &targets[start], clone.base, VM_MSG_CLONE, parts,
+						2 + vm_image_parts(vm, &parts[2]));
+		if (sent == VM_SEND_BUSY) {
+			/* the caller parks the vm, the sub-trees sent so far are skipped on the next call */
+			vm->rd.sends_done = idx;
+			return VM_SEND_BUSY;
+		}
+		if (sent != 0) {
+			vm_log_vm(vm, "Failed to clone vm.");
+		} else {
+			vm->rd.worker->stats.clones_out++;
+		}
+	}
+	
+	vm->rd.sends_done = 0;
+	return ret;
+}
+
+static void forward_clone(struct ebpf_vm *vm)
 {
+	struct vm_clone_fanout *fanout = vm->rd.fanout;
+	
+	switch (vm_clone_fanout(vm, fanout->targets + 1, fanout->base + 1, fanout->count - 1)) {
+	case PKT_VM_PEER_PENDING:
+	case VM_SEND_BUSY:
+		return;
+	default:
+		break;
+	}
+	
+	vm->reg[0] = fanout->base;
+	vm->rd.fanout = NULL;
+	free(fanout);
+	start_received_vm(vm);
+}
+
+static void *worker_run(void *arg)
+{
+	struct ebpf_vm_worker *worker = arg;
+	struct ebpf_vm_executor *executor = worker->executor;
 	struct ebpf_vm *vm = NULL, *tmp = NULL;
-	struct transport_message recv_msg;
+	struct vm_worker_stats *stats = &worker->stats;
+	struct transport_message recv_msg = {0};
+	uint64_t vms, runnable, waiting, recv_ns;
 	int msg_len;
 	
 	while (executor->state.should_stop == 0) {
-		UB_LIST_FOR_EACH_SAFE(vm, tmp, rd.list, &executor->vm_list) {
+		vms = 0;
+		runnable = 0;
+		waiting = 0;
+		UB_LIST_FOR_EACH_SAFE(vm, tmp, rd.list, &worker->vm_list) {
+			if (vm->state.vm_state == VM_STATE_CLONE_TO) {
+				forward_clone(vm);
+			}
+	
 			if (vm->state.vm_state == VM_STATE_RUNNING ||
-				vm->state.vm_state == VM_STATE_WAIT_FOR_ADDRESS) {
-					run_ebpf_vm(vm);
+				vm->state.vm_state == VM_STATE_WAIT_FOR_ADDRESS ||
+				vm->state.vm_state == VM_STATE_WAIT_FOR_PEER ||
+				vm->state.vm_state == VM_STATE_WAIT_FOR_JOIN) {
+					uint64_t insns = vm->rd.insns_retired;
+					uint64_t helper_calls = vm->rd.helper_calls;
+					uint32_t state = vm->state.vm_state;
+					uint64_t start_ns = executor->state.tracing ? vm_wall_ns() : 0;
+					uint64_t slice_ns = executor->state.latency ? vm_now_ns() : 0;
+	
+					if (state == VM_STATE_RUNNING) {
+						runnable++;
+					} else {
+						waiting++;
+					}
+	
+					VM_PERF_RUN(vm);
+					if (executor->state.tracing) {
+						vm_trace_slice(vm, state, start_ns);
+					}
+					/* like the trace, a poll that leaves the vm waiting is not a slice */
+					if (executor->state.latency && ((state == VM_STATE_RUNNING) || (vm->state.vm_state != state))) {
+						vm_hist_record(&worker->latency->hists[VM_LAT_SLICE], vm_now_ns() - slice_ns);
+					}
+					stats->runs++;
+					stats->insns += vm->rd.insns_retired - insns;
+					stats->helper_calls += vm->rd.helper_calls - helper_calls;
 			}
-			
+	
 			if (vm->state.vm_state == VM_STATE_EXIT) {
+				VM_TRACE_VM(vm, vm->rd.migrated ? VM_TRACE_MIGRATE_OUT : VM_TRACE_EXIT,
+					vm->rd.migrated ? vm->rd.hops : vm->rd.insns_retired);
 				ub_list_remove(&vm->rd.list);
 				destroy_vm(vm);
+				stats->vms_exited++;
+			} else {
+				vms++;
 			}
 		}
-		
+	
+		/* an attached packet runner gets one batch per pass */
+		if ((worker->index == 0) && (executor->packets != NULL)) {
+			(void)vm_packet_poll(executor->packets);
+		}
+	
+		poll_inbox(worker);
+		vm_mem_op_poll(worker);
+		vm_flush_outbound(worker, 0);
+	
+		recv_msg.queue = worker->index;
+		recv_ns = executor->state.latency ? vm_now_ns() : 0;
 		msg_len = executor->transport->recv(executor->transport_ctx, &recv_msg);
 		if (msg_len != 0) {
-			receive_vm(executor, recv_msg.buf, recv_msg.buf_size);
+			/* empty polls are not samples */
+			if (executor->state.latency) {
+				vm_hist_record(&worker->latency->hists[VM_LAT_RECV], vm_now_ns() - recv_ns);
+			}
+			stats->msgs_recv++;
+			stats->bytes_recv += recv_msg.buf_size;
+			receive_msg(worker, recv_msg.buf, recv_msg.buf_size);
 			executor->transport->return_buf(executor->transport_ctx, &recv_msg);
 		}
+	
+		stats->vms = vms;
+		stats->vms_runnable = runnable;
+		stats->vms_waiting = waiting;
+		if ((++stats->passes & (VM_STATS_PUBLISH_PASSES - 1)) == 0) {
+			vm_stats_publish(worker);
+		}
 	}
+	
+	vm_stats_publish(worker);
+	return NULL;
 }
 
-int add_vm(struct ebpf_vm_executor *executor, struct ebpf_vm *vm)
+void vm_executor_run(struct ebpf_vm_executor *executor)
 {
-	vm->rd.id = executor->next_vm_id++;
-	vm->rd.symbols = ebpf_global_symbs;
-	vm->rd.executor = executor;
-	ub_list_push_back(&executor->vm_list, &vm->rd.list);
-	return 0;
+	uint32_t idx;
+	
+	/* the calling thread runs worker 0 */
+	for (idx = 1; idx < executor->num_workers; idx++) {
+		if (pthread_create(&executor->workers[idx].thread, NULL, worker_run, &executor->workers[idx]) != 0) {
+			perror("Failed to create worker thread");
+			executor->state.should_stop = 1;
+			break;
+		}
+	}
+	
+	worker_run(&executor->workers[0]);
+	
+	while (--idx > 0) {
+		pthread_join(executor->workers[idx].thread, NULL);
+	}
 }
 
-struct ebpf_vm *create_vm(uint8_t *code, uint32_t code_size)
+struct ebpf_vm *vm_worker_find_vm(struct ebpf_vm_worker *worker, uint64_t id)
 {
 	struct ebpf_vm *vm = NULL;
-	int total_size = sizeof(struct ebpf_vm);
-	
-	total_size += code_size;
-	total_size += EBPF_VM_DEFAULT_STACK_SIZE;
-	total_size += EBPF_VM_DEFAULT_DATA_SIZE;
 	
-	vm = calloc(1, total_size);
-	if (vm == NULL) {
-		return NULL;
+	UB_LIST_FOR_EACH(vm, rd.list, &worker->vm_list) {
+		if (vm->rd.id == id) {
+			return vm;
+		}
 	}
 	
+	return NULL;
+}
+
+/* vms are added before vm_executor_run() and spread round robin over the workers */
+int add_vm(struct ebpf_vm_executor *executor, struct ebpf_vm *vm)
+{
+	struct ebpf_vm_worker *worker = &executor->workers[executor->next_worker];
+	
+	executor->next_worker = (executor->next_worker + 1) % executor->num_workers;
+	worker_add_vm(worker, vm);
+	VM_TRACE_VM(vm, VM_TRACE_CREATE, VM_ID_NONE);
+	return 0;
+}
+
+void vm_setup_image(struct ebpf_vm *vm, const uint8_t *code, uint32_t code_size, uint16_t stack_size, uint16_t data_size)
+{
+	memset(vm, 0, sizeof(struct ebpf_vm) + code_size + stack_size + data_size);
+	
 	vm->code_size = code_size;
-	vm->stack_size = EBPF_VM_DEFAULT_STACK_SIZE;
-	vm->data_size = EBPF_VM_DEFAULT_DATA_SIZE;
+	vm->stack_size = stack_size;
+	vm->data_size = data_size;
 	vm->code = sizeof(struct ebpf_vm);
 	vm->data = vm->code + vm->code_size;
 	vm->stack = vm->data + vm->data_size;
@@ -506,19 +1122,70 @@ struct ebpf_vm *create_vm(uint8_t *code, uint32_t code_size)
 	vm->page_table[0].entries[0].va = (uint64_t)vm + vm->data;
 	vm->page_table[0].entries[0].size = vm->data_size + vm->stack_size;
 	
-	memcpy(((uint8_t *)vm + vm->code), code, code_size);
+	if (code_size != 0) {
+		memcpy(((uint8_t *)vm + vm->code), code, code_size);
+	}
+	vm->rd.insns = (struct ebpf_instruction *)((uint8_t *)vm + vm->code);
 	ub_list_init(&vm->address_monitor_list);
+}
+
+struct ebpf_vm *create_vm(uint8_t *code, uint32_t code_size)
+{
+	struct ebpf_vm *vm = NULL;
+	int total_size = sizeof(struct ebpf_vm);
+	
+	total_size += code_size;
+	total_size += EBPF_VM_DEFAULT_STACK_SIZE;
+	total_size += EBPF_VM_DEFAULT_DATA_SIZE;
+	
+	vm = vm_pool_alloc(total_size);
+	if (vm == NULL) {
+		return NULL;
+	}
+	
+	vm_setup_image(vm, code, code_size, EBPF_VM_DEFAULT_STACK_SIZE, EBPF_VM_DEFAULT_DATA_SIZE);
 	return vm;
 }
 
+struct address_monitor_entry *vm_monitor_entry_alloc(struct ebpf_vm *vm)
+{
+	struct ebpf_vm_worker *worker = vm->rd.worker;
+	struct address_monitor_entry *entry = NULL;
+	
+	if ((worker == NULL) || ub_list_is_empty(&worker->monitor_free_list)) {
+		return calloc(1, sizeof(*entry));
+	}
+	
+	entry = list_first_entry(&worker->monitor_free_list, struct address_monitor_entry, list);
+	ub_list_remove(&entry->list);
+	worker->monitor_free_num--;
+	memset(entry, 0, sizeof(*entry));
+	return entry;
+}
+
+void vm_monitor_entry_free(struct ebpf_vm *vm, struct address_monitor_entry *entry)
+{
+	struct ebpf_vm_worker *worker = vm->rd.worker;
+	
+	if ((worker == NULL) || (worker->monitor_free_num >= VM_MONITOR_FREE_MAX)) {
+		free(entry);
+		return;
+	}
+	
+	ub_list_push_head(&entry->list, &worker->monitor_free_list);
+	worker->monitor_free_num++;
+}
+
 void destroy_vm(struct ebpf_vm *vm)
 {
 	struct address_monitor_entry *entry, *tmp = NULL;
 	UB_LIST_FOR_EACH_SAFE(entry, tmp, list, &vm->address_monitor_list){
 		ub_list_remove(&entry->list);
-		free(entry);
+		vm_monitor_entry_free(vm, entry);
 	}
-	free(vm);
+	free(vm->rd.fanout);
+	vm_code_put(vm->rd.code_seg);
+	vm_free_image(vm);
 }
 
 int load_data(struct ebpf_vm *vm, uint8_t *data, uint32_t len)
@@ -540,9 +1207,74 @@ int register_transport(struct transport_ops *ops)
 	return 0;
 }
 
+static void worker_init(struct ebpf_vm_executor *executor, uint32_t index)
+{
+	struct ebpf_vm_worker *worker = &executor->workers[index];
+	
+	worker->executor = executor;
+	worker->index = index;
+	worker->next_vm_id = 1;
+	worker->next_mem_op_id = 0;
+	ub_list_init(&worker->vm_list);
+	ub_list_init(&worker->mem_op_list);
+	ub_list_init(&worker->deferred_mem_list);
+	ub_list_init(&worker->inbox);
+	worker->inbox_len = 0;
+	ub_list_init(&worker->monitor_free_list);
+	worker->monitor_free_num = 0;
+	memset(&worker->stats, 0, sizeof(worker->stats));
+	pthread_mutex_init(&worker->inbox_lock, NULL);
+	vm_outbound_init(worker);
+}
+
+static void worker_cleanup(struct ebpf_vm_worker *worker)
+{
+	struct address_monitor_entry *entry, *tmp_entry;
+	struct vm_inbox_msg *msg, *tmp_msg;
+	struct ebpf_vm *vm, *tmp;
+	
+	UB_LIST_FOR_EACH_SAFE(vm, tmp, rd.list, &worker->vm_list){
+		ub_list_remove(&vm->rd.list);
+		destroy_vm(vm);
+	}
+	
+	UB_LIST_FOR_EACH_SAFE(entry, tmp_entry, list, &worker->monitor_free_list) {
+		ub_list_remove(&entry->list);
+		free(entry);
+	}
+	
+	UB_LIST_FOR_EACH_SAFE(msg, tmp_msg, list, &worker->inbox) {
+		ub_list_remove(&msg->list);
+		free(msg);
+	}
+	
+	vm_mem_op_cleanup(worker);
+	vm_outbound_cleanup(worker);
+	pthread_mutex_destroy(&worker->inbox_lock);
+}
+
+static uint32_t node_id(const struct node_url *url)
+{
+	uint64_t key = ((uint64_t)url->ip << 16) | url->port;
+	
+	return (uint32_t)vm_xxhash64(0, &key, sizeof(key)) & VM_ID_NODE_MASK;
+}
+
+/* undoes worker_init() and the map lock for an executor that never ran */
+static void executor_init_fail(struct ebpf_vm_executor *executor)
+{
+	vm_executor_stop(executor);
+	for (uint32_t idx = 0; idx < executor->num_workers; idx++) {
+		worker_cleanup(&executor->workers[idx]);
+	}
+	pthread_mutex_destroy(&executor->maps_lock);
+	free(executor);
+}
+
 void *vm_executor_init(struct ebpf_vm_executor_config *cfg)
 {
 	struct ebpf_vm_executor *executor = NULL;
+	struct transport_config transport_cfg = cfg->transport;
 	
 	executor = malloc(sizeof(*executor));
 	if (executor == NULL) {
@@ -550,31 +1282,136 @@ void *vm_executor_init(struct ebpf_vm_executor_config *cfg)
 		return NULL;
 	}
 	
-	ub_list_init(&executor->vm_list);
 	executor->state.should_stop = 0;
-	executor->transport = registered_transport[PKT_VM_TRANSPORT_TYPE_RDMA];
-	executor->transport_ctx = executor->transport->init(&cfg->transport);
+	executor->clone_fanout = cfg->clone_fanout;
+	executor->self_url = (cfg->transport.transport_type == PKT_VM_TRANSPORT_TYPE_UDP) ?
+		cfg->transport.udp_cfg.self_url : cfg->transport.rdma_cfg.self_url;
+	executor->node_id = node_id(&executor->self_url);
+	executor->batch_timeout_us = cfg->batch_timeout_us;
+	executor->helpers = (cfg->helpers != NULL) ? cfg->helpers : ebpf_global_helpers();
+	executor->num_workers = (cfg->num_workers == 0) ? 1 : cfg->num_workers;
+	if (executor->num_workers > VM_MAX_WORKERS) {
+		executor->num_workers = VM_MAX_WORKERS;
+	}
+	executor->next_worker = 0;
+	executor->packets = NULL;
+	for (uint32_t idx = 0; idx < executor->num_workers; idx++) {
+		worker_init(executor, idx);
+	}
+	
+	pthread_mutex_init(&executor->maps_lock, NULL);
+	memset(executor->maps, 0, sizeof(executor->maps));
+	executor->map_memory_left = (cfg->map_memory != 0) ? cfg->map_memory : VM_DEFAULT_MAP_MEMORY;
+	
+	if ((transport_cfg.transport_type >= PKT_VM_TRANSPORT_TYPE_MAX) ||
+		(registered_transport[transport_cfg.transport_type] == NULL)) {
+		printf("Unsupported transport type %u.\n", transport_cfg.transport_type);
+		executor_init_fail(executor);
+		return NULL;
+	}
+	
+	/* one transport queue per worker */
+	if (transport_cfg.transport_type == PKT_VM_TRANSPORT_TYPE_UDP) {
+		transport_cfg.udp_cfg.num_queues = executor->num_workers;
+	} else {
+		transport_cfg.rdma_cfg.num_qps = executor->num_workers;
+	}
+	executor->transport = registered_transport[transport_cfg.transport_type];
+	executor->transport_ctx = executor->transport->init(&transport_cfg);
 	if (executor->transport_ctx == NULL) {
 		perror("Failed to initialize transport");
-		free(executor);
+		executor_init_fail(executor);
+		return NULL;
+	}
+	
+	executor->max_msg_size = executor->transport->get_max_msg_size(executor->transport_ctx);
+	
+	if (vm_perf_map_init(cfg->perf_map) != 0) {
+		executor->transport->exit(executor->transport_ctx);
+		executor_init_fail(executor);
+		return NULL;
+	}
+	
+	executor->stats_page = NULL;
+	if (vm_stats_init(executor, cfg->stats_name) != 0) {
+		executor->transport->exit(executor->transport_ctx);
+		executor_init_fail(executor);
+		return NULL;
+	}
+	
+	if (vm_trace_init(executor, cfg->trace_name) != 0) {
+		vm_stats_exit(executor);
+		executor->transport->exit(executor->transport_ctx);
+		executor_init_fail(executor);
+		return NULL;
+	}
+	
+	if (vm_latency_init(executor, cfg->latency_hist) != 0) {
+		vm_trace_exit(executor);
+		vm_stats_exit(executor);
+		executor->transport->exit(executor->transport_ctx);
+		executor_init_fail(executor);
 		return NULL;
 	}
 	
 	return executor;
 }
 
+/* vm_executor_run() returns once every worker has seen the flag */
+void vm_executor_stop(struct ebpf_vm_executor *executor)
+{
+	executor->state.should_stop = 1;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
 void vm_executor_destroy(struct ebpf_vm_executor *executor)
 {
-	struct ebpf_vm *vm, *tmp;
+	uint32_t idx;
 	
 	if (executor->transport_ctx) {
+		for (idx = 0; idx < executor->num_workers; idx++) {
+			vm_flush_outbound(&executor->workers[idx], 1);
+		}
 		executor->transport->exit(executor->transport_ctx);
 	}
 	
-	UB_LIST_FOR_EACH_SAFE(vm, tmp, rd.list, &executor->vm_list){
-		ub_list_remove(&vm->rd.list);
-		free(vm);
+	for (idx = 0; idx < executor->num_workers; idx++) {
+		worker_cleanup(&executor->workers[idx]);
 	}
 	
+	vm_executor_destroy_maps(executor);
+	pthread_mutex_destroy(&executor->maps_lock);
+	vm_stats_exit(executor);
+	vm_trace_exit(executor);
+	vm_latency_exit(executor);
+	vm_log_flush();
 	free(executor);
+}
+
+int vm_executor_resolve_peers(struct ebpf_vm_executor *executor, struct node_url *peers, int num, int wait)
+{
+	int ready, pending;
+	
+	do {
+		ready = 0;
+		pending = 0;
+		for (int idx = 0; idx < num; idx++) {
+			switch (executor->transport->resolve(executor->transport_ctx, &peers[idx])) {
+			case PKT_VM_PEER_READY:
+				ready++;
+				break;
+			case PKT_VM_PEER_PENDING:
+				pending++;
+				break;
+			default:
+				break;
+			}
+		}
+	
+		if ((pending != 0) && wait) {
+			usleep(1000);
+		}
+	} while ((pending != 0) && wait);
+	
+	return ready;
 }
\ No newline at end of file
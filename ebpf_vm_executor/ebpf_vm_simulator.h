@@ -1,8 +1,14 @@
 #ifndef _EBPF_VM_SIMULATOR_H_
 #define _EBPF_VM_SIMULATOR_H_
 
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 #include "ub_list.h"
 #include "ebpf_vm_transport.h"
+#include "ebpf_vm_stats.h"
+#include "ebpf_vm_hist.h"
 
 #define EBPF_VM_STACK_DEPTH_MAX 3
 #define EBPF_VM_STACK_FRAME_SIZE 64
@@ -12,6 +18,48 @@
 #define PKT_VM_SYS_REG_NUM 4
 #define PKT_VM_INVALID_FUNC_IDX 0xffffffff
 #define PKT_VM_MAX_SYMBS 256
+#define VM_OUTBOUND_HASH_SIZE 64
+/* a batch the transport did not take is retried on every pass for this long */
+#define VM_OUTBOUND_RETRY_MS 1000
+/* vm_send_msg() result while such a batch holds up the record, the caller parks and retries */
+#define VM_SEND_BUSY (-2)
+#define VM_MAX_WORKERS 16
+#define VM_MONITOR_FREE_MAX 1024
+#define VM_MAX_MAPS 64
+/* bytes all maps of an executor may take, programs size their maps themselves */
+#define VM_DEFAULT_MAP_MEMORY (256ULL << 20)
+/* fork_join() gives up on children that did not return by then */
+#define VM_FORK_JOIN_TIMEOUT_MS 5000
+/* fork_to() and clone_to() take at most this many targets per call */
+#define VM_MAX_REMOTE_TARGETS 1024
+#define VM_MAP_ALL_CPUS 0xffffffff
+#define VM_ID_WORKER_SHIFT 8
+#define vm_id_worker(ID) ((uint32_t)((ID) & ((1 << VM_ID_WORKER_SHIFT) - 1)))
+/* vm ids: node of origin, sequence and worker of origin, assigned once */
+#define VM_ID_NODE_SHIFT 40
+#define VM_ID_SEQ_MASK ((1ULL << (VM_ID_NODE_SHIFT - VM_ID_WORKER_SHIFT)) - 1)
+#define VM_ID_NODE_MASK 0xffffff
+#define VM_ID_NONE 0
+#define VM_MSG_ALIGN 8
+#define VM_MSG_RECORD_SIZE(size) ((sizeof(struct vm_msg_header) + (size) + VM_MSG_ALIGN - 1) & ~(VM_MSG_ALIGN - 1))
+
+/* intervals, deadlines and latencies */
+static inline uint64_t vm_now_ns(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* timestamps that leave the process, so that logs, traces and stats of several nodes line up */
+static inline uint64_t vm_wall_ns(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 enum {
 	/*00*/ EBPF_REG_RETURN_RESULT,
@@ -103,11 +151,20 @@ enum {
 	EBPF_XADD = 6 << 5,
 };
 #define EBPF_MODE(code) ((code) & 0xe0)
+#define EBPF_ATOMIC EBPF_XADD
+
+/* immediate of EBPF_ATOMIC instructions: an alu op, optionally fetching the old value */
+#define EBPF_ATOMIC_FETCH 0x01
+#define EBPF_ATOMIC_XCHG (0xe0 | EBPF_ATOMIC_FETCH)
+#define EBPF_ATOMIC_CMPXCHG (0xf0 | EBPF_ATOMIC_FETCH)
 
 #define EBPF_TO_LE 0x00
 #define EBPF_TO_BE 0x08
 
 struct ebpf_vm;
+struct ub_address;
+struct vm_map_def;
+struct vm_search_pattern;
 
 struct address_monitor_entry {
 	struct ub_list list;
@@ -119,13 +176,44 @@ struct address_monitor_entry {
 
 typedef uint64_t (*ebpf_external_func)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, struct ebpf_vm *vm);
 
+#define EBPF_HELPER_MAX_ARGS 5
+#define EBPF_HELPER_HASH_SIZE 512
+
+/*
+ * What a helper expects in r1-r5. EBPF_ARG_SIZE is the length of every
+ * pointer since the previous size, the interpreter checks those ranges are
+ * mapped before the call and returns VM_MEM_FAULT otherwise.
+ */
+enum {
+	EBPF_ARG_UNUSED,
+	EBPF_ARG_SCALAR,
+	EBPF_ARG_PTR,
+	EBPF_ARG_SIZE
+};
+
 struct ebpf_symbol {
 	const char *name;
 	ebpf_external_func func;
+	uint8_t num_args;
+	uint8_t arg_types[EBPF_HELPER_MAX_ARGS];
 };
 
 extern struct ebpf_symbol ebpf_global_symbs[];
 
+/*
+ * Helpers callable by vms, indexed by the immediate of the call instruction.
+ * The global table wraps ebpf_global_symbs; executors can get their own
+ * table which starts as a copy of the built-in helpers. Names are hashed for
+ * the ELF loader, and must outlive the table.
+ */
+struct ebpf_helper_table {
+	struct ebpf_symbol *symbols;
+	/* open addressing table of helper index + 1, keyed by name */
+	uint16_t hash[EBPF_HELPER_HASH_SIZE];
+	uint32_t hash_ready;
+	pthread_mutex_t lock;
+};
+
 struct ebpf_instruction {
 	uint8_t opcode;
 	uint8_t dst_reg:4;
@@ -136,21 +224,230 @@ struct ebpf_instruction {
 
 #define EBPF_RAW_INSN(CODE, DST, SRC, OFF, IMM) {CODE, DST, SRC, OFF, IMM}
 
+/* perf_map flags, /tmp/perf-<pid>.map and /tmp/jit-<pid>.dump */
+#define VM_PERF_MAP 1
+#define VM_PERF_JITDUMP 2
+
 struct ebpf_vm_executor_config {
 	struct transport_config transport;
+	uint32_t clone_fanout;
+	uint32_t batch_timeout_us;
+	uint32_t num_workers;
+	/* NULL for the global helper table */
+	struct ebpf_helper_table *helpers;
+	/* shared memory object for ctinspector-stat, NULL keeps the stats private */
+	const char *stats_name;
+	/* Chrome trace file written by vm_executor_destroy(), NULL disables tracing */
+	const char *trace_name;
+	/* record latency histograms, see vm_executor_latency() */
+	uint32_t latency_hist;
+	/* VM_PERF_MAP and VM_PERF_JITDUMP, for perf to name the eBPF functions */
+	uint32_t perf_map;
+	/* 0 for VM_DEFAULT_MAP_MEMORY */
+	uint64_t map_memory;
 };
 
 struct executor_state {
 	uint32_t should_stop:1;
-	uint32_t unused:31;
+	uint32_t tracing:1;
+	uint32_t latency:1;
+	uint32_t unused:29;
 };
 
-struct ebpf_vm_executor {
+/*
+ * Latencies seen by one worker, written by it only. Helper histograms are
+ * allocated on the first call of the helper.
+ */
+struct vm_worker_latency {
+	struct vm_hist hists[VM_LAT_HELPER];
+	struct vm_hist *helpers[PKT_VM_MAX_SYMBS];
+};
+
+/*
+ * Each worker thread owns its vms, outbound batches and memory operations, and
+ * polls its own transport queue. Memory operation ids carry the index of the
+ * owning worker in their low bits so that replies can be routed to it. Vm ids
+ * stay with a migrating vm, so messages to a vm name its worker explicitly.
+ */
+struct ebpf_vm_worker {
+	struct ebpf_vm_executor *executor;
+	uint32_t index;
+	pthread_t thread;
 	struct ub_list vm_list;
+	uint64_t next_vm_id;
+	struct ub_list outbound_hash[VM_OUTBOUND_HASH_SIZE];
+	struct ub_list outbound_list;
+	struct ub_list mem_op_list;
+	struct ub_list deferred_mem_list;
+	uint64_t next_mem_op_id;
+	struct ub_list monitor_free_list;
+	uint32_t monitor_free_num;
+	/* records received by another worker for vms owned by this one */
+	pthread_mutex_t inbox_lock;
+	struct ub_list inbox;
+	uint32_t inbox_len;
+	/* only written by the worker thread, see vm_stats_publish() */
+	struct vm_worker_stats stats;
+	/* NULL unless the executor records latencies */
+	struct vm_worker_latency *latency;
+};
+
+/*
+ * Executor owned map, see ebpf_vm_map.c. Hash maps keep their slots in
+ * values, arrays their elements, per-cpu arrays one copy per worker.
+ */
+struct vm_map {
+	uint64_t id;
+	uint32_t type;
+	uint32_t key_size;
+	uint32_t value_size;
+	uint32_t max_entries;
+	uint32_t num_cpus;
+	uint32_t capacity;
+	uint32_t slot_size;
+	uint32_t count;
+	uint32_t tombstones;
+	/* odd while a rebuild moves the slots of a hash map */
+	uint32_t seq;
+	uint64_t clock;
+	/* serializes writers of hash maps, readers never take it */
+	pthread_mutex_t lock;
+	uint8_t *values;
+};
+
+struct ebpf_vm_executor {
 	struct transport_ops *transport;
 	void *transport_ctx;
 	struct executor_state state;
-	uint64_t next_vm_id;
+	uint32_t clone_fanout;
+	uint32_t max_msg_size;
+	uint32_t batch_timeout_us;
+	struct node_url self_url;
+	/* 24 bit hash of self_url, the top bits of the vm ids created here */
+	uint32_t node_id;
+	struct ebpf_helper_table *helpers;
+	uint32_t num_workers;
+	uint32_t next_worker;
+	struct ebpf_vm_worker workers[VM_MAX_WORKERS];
+	pthread_mutex_t maps_lock;
+	struct vm_map *maps[VM_MAX_MAPS];
+	/* what is left of the map memory budget, under maps_lock */
+	uint64_t map_memory_left;
+	struct vm_stats_page *stats_page;
+	/* packet runner polled by worker 0, see vm_packet_open() */
+	struct vm_packet_runner *packets;
+	char stats_name[VM_STATS_NAME_SIZE];
+	char *trace_name;
+};
+
+enum {
+	VM_MSG_MIGRATE,
+	VM_MSG_CLONE,
+	VM_MSG_FORK,
+	VM_MSG_FORK_RETURN,
+	VM_MSG_MEM_READ,
+	VM_MSG_MEM_READ_DATA,
+	VM_MSG_MEM_WRITE,
+	VM_MSG_MEM_WRITE_ACK
+};
+
+struct vm_msg_header {
+	uint16_t type;
+	uint16_t reserved;
+	uint32_t size;
+};
+
+/*
+ * A clone message carries the sub-tree of targets the receiver is responsible for.
+ * The receiver is targets[0] with clone index base, and forwards the vm to the rest.
+ */
+struct vm_clone_header {
+	uint32_t base;
+	uint32_t count;
+};
+
+/*
+ * Where a forked child sends its result: the parent vm on the parent node,
+ * and the slot of the parent's remote_thread array owned by this child.
+ */
+struct vm_fork_context {
+	struct node_url parent;
+	uint64_t parent_id;
+	uint64_t thread_list;
+	uint64_t index;
+	uint32_t parent_worker;
+	uint32_t reserved;
+};
+
+struct vm_fork_return {
+	uint64_t parent_id;
+	uint64_t thread_list;
+	uint64_t index;
+	uint64_t result;
+	uint32_t parent_worker;
+	uint32_t reserved;
+};
+
+/*
+ * Remote memory requests are served by the executor of the node owning the memory.
+ * addr is a host address on that node, offset and len describe one chunk of the copy.
+ */
+struct vm_mem_msg {
+	struct node_url requester;
+	uint64_t op_id;
+	uint64_t addr;
+	uint32_t offset;
+	uint32_t len;
+};
+
+struct vm_mem_op {
+	struct ub_list list;
+	uint64_t id;
+	uint64_t vm_id;
+	uint64_t local_addr;
+	uint64_t completion_addr;
+	uint64_t result;
+	/* read data outside of the first len bytes is dropped */
+	uint64_t len;
+	uint64_t remaining;
+};
+
+struct vm_deferred_mem_msg {
+	struct ub_list list;
+	uint16_t type;
+	struct vm_mem_msg msg;
+};
+
+struct vm_clone_fanout {
+	uint32_t base;
+	uint32_t count;
+	struct node_url targets[];
+};
+
+struct vm_inbox_msg {
+	struct ub_list list;
+	uint8_t buf[];
+};
+
+struct vm_msg_part {
+	const void *buf;
+	uint32_t size;
+};
+
+/*
+ * Records bound for the same node are packed into one transport message,
+ * which is sent when it is full or when vm_flush_outbound() decides it is due.
+ */
+struct vm_outbound {
+	struct ub_list node;
+	struct ub_list list;
+	struct node_url dst;
+	uint32_t route;
+	uint32_t len;
+	uint64_t start_ns;
+	/* first failed send of the queued batch, 0 while none failed */
+	uint64_t fail_ns;
+	uint8_t buf[];
 };
 
 enum {
@@ -158,12 +455,16 @@ enum {
 	VM_STATE_EXIT,
 	VM_STATE_WAIT_FOR_ADDRESS,
 	VM_STATE_MIGRATE_TO,
-	VM_STATE_CLONE_TO
+	VM_STATE_CLONE_TO,
+	VM_STATE_WAIT_FOR_PEER,
+	VM_STATE_WAIT_FOR_JOIN
 };
 
+#define VM_F_SHARED_CODE 0x1
+
 struct ebpf_vm_state {
 	uint8_t stack_depth;
-	uint8_t unused;
+	uint8_t flags;
 	uint16_t next_data_to_use;
 	uint32_t vm_state;
 };
@@ -173,7 +474,7 @@ struct ebpf_vm_state {
 #define INDEX_SHIFT 32
 #define PAGE_TABLE_ERROR 0xffffffffffffffff
 #define PAGE_TABLE_NUM 1
-#define BUCKET_ENTRIES 1
+#define BUCKET_ENTRIES 4
 
 struct vm_pte {
 	uint64_t va;
@@ -184,11 +485,98 @@ struct vm_ptb {
 	struct vm_pte entries[BUCKET_ENTRIES];
 };
 
+/*
+ * A program is parsed, relocated and verified once and can then be
+ * instantiated any number of times without touching the ELF file again.
+ */
+struct ebpf_vm_program {
+	struct vm_code_segment *code_seg;
+	uint8_t *code;
+	uint32_t code_size;
+	uint32_t entry;
+	uint16_t stack_size;
+	uint16_t data_size;
+	/* initial contents of the program's globals at the start of the data region */
+	uint8_t *globals;
+	uint32_t globals_size;
+};
+
+/* initial r1-r5 and data of one instance created by vm_instantiate() */
+struct vm_instance_init {
+	uint64_t args[5];
+	const void *data;
+	uint32_t data_len;
+};
+
+/*
+ * Immutable code shared by every vm running the same program. Segments are
+ * looked up by content, so vms received from other nodes share them too.
+ */
+#define VM_FUNC_NAME_SIZE 64
+
+struct vm_func_symbol {
+	char name[VM_FUNC_NAME_SIZE];
+	uint32_t start;
+	uint32_t size;
+};
+
+struct vm_profile;
+struct vm_perf_code;
+
+struct vm_code_segment {
+	struct ub_list node;
+	uint32_t refcnt;
+	uint32_t size;
+	uint64_t hash;
+	/* function symbols sorted by start pc, set once by the loader */
+	struct vm_func_symbol *funcs;
+	uint32_t num_funcs;
+	/* only allocated by builds with EBPF_VM_PROFILE */
+	struct vm_profile *profile;
+	/* perf trampolines, created by the first run with perf maps on */
+	struct vm_perf_code *perf;
+	uint8_t code[];
+};
+
+/* instances created together share one allocation, released with the last of them */
+struct vm_image_block {
+	uint32_t refcnt;
+	uint32_t num;
+	uint64_t reserved;
+};
+
 struct vm_runtime_data {
 	struct ub_list list;
 	struct ebpf_vm_executor *executor;
+	struct ebpf_vm_worker *worker;
 	struct ebpf_symbol *symbols;
+	struct vm_clone_fanout *fanout;
+	struct vm_image_block *block;
+	struct ebpf_instruction *insns;
+	struct vm_code_segment *code_seg;
+	/* hash of the shared code, it travels with the vm so receivers need not hash the code */
+	uint64_t code_hash;
+	struct vm_fork_context fork;
+	/* children of the last fork_to(), results of others are dropped */
+	uint64_t fork_count;
+	uint64_t join_count;
+	uint64_t join_deadline_ns;
+	/* children or sub-trees the parked fork_to() or clone_to() has sent already */
+	uint64_t sends_done;
+	/* unique over the nodes and kept across migrations, see worker_add_vm() */
 	uint64_t id;
+	/* lifetime counters of the vm, they travel with it */
+	uint64_t insns_retired;
+	uint64_t helper_calls;
+	uint32_t hops;
+	/* set once the vm has been sent away, its local exit is a migration */
+	uint32_t migrated;
+	/* bit per page table entry the host maps itself, mmap() never hands them out */
+	uint32_t reserved_ptes;
+	/* the host runs the vm again after its exit, migrate_to() fails */
+	uint32_t pinned;
+	/* when the vm started to wait for an address event, for the wake latency */
+	uint64_t wait_start_ns;
 };
 
 struct ebpf_vm {
@@ -206,10 +594,31 @@ struct ebpf_vm {
 	struct ub_list address_monitor_list;
 };
 
-#define ebpf_vm_code(VM) (struct ebpf_instruction *)((uint8_t *)(VM) + (VM)->code)
+#define ebpf_vm_code(VM) ((VM)->rd.insns)
+#define ebpf_vm_image_size(VM) (sizeof(struct ebpf_vm) + (VM)->code_size + (VM)->stack_size + (VM)->data_size)
 
 struct ebpf_vm *create_vm(uint8_t *code, uint32_t code_size);
 struct ebpf_vm *create_vm_from_elf(const char *elf_file_name);
+void vm_setup_image(struct ebpf_vm *vm, const uint8_t *code, uint32_t code_size, uint16_t stack_size, uint16_t data_size);
+struct ebpf_vm_program *create_program(const uint8_t *code, uint32_t code_size, uint32_t entry);
+struct ebpf_vm_program *create_program_from_elf(const char *elf_file_name);
+struct ebpf_vm_program *create_program_from_elf_with_helpers(const char *elf_file_name, struct ebpf_helper_table *helpers);
+void destroy_program(struct ebpf_vm_program *prog);
+int program_set_stack_size(struct ebpf_vm_program *prog, uint32_t stack_size);
+int program_set_data_size(struct ebpf_vm_program *prog, uint32_t data_size);
+int program_set_globals(struct ebpf_vm_program *prog, const uint8_t *globals, uint32_t size);
+int ebpf_vm_verify(const struct ebpf_instruction *insns, uint32_t num);
+int vm_instantiate(struct ebpf_vm_program *prog, uint32_t n, struct ebpf_vm **vms, const struct vm_instance_init *init);
+void vm_free_image(struct ebpf_vm *vm);
+struct vm_code_segment *vm_code_get(const void *code, uint32_t size);
+struct vm_code_segment *vm_code_get_hashed(const void *code, uint32_t size, uint64_t hash);
+void vm_code_put(struct vm_code_segment *seg);
+void vm_attach_code(struct ebpf_vm *vm, struct vm_code_segment *seg);
+int vm_code_set_symbols(struct vm_code_segment *seg, const struct vm_func_symbol *funcs, uint32_t num);
+int32_t vm_code_find_func(struct vm_code_segment *seg, uint32_t pc);
+int vm_profile_write(struct vm_code_segment *seg, FILE *flat, FILE *folded);
+int vm_profile_write_all(FILE *flat, FILE *folded);
+int vm_image_parts(struct ebpf_vm *vm, struct vm_msg_part *parts);
 int add_vm(struct ebpf_vm_executor *executor, struct ebpf_vm *vm);
 int load_data(struct ebpf_vm *vm, uint8_t *data, uint32_t len);
 void destroy_vm(struct ebpf_vm *vm);
@@ -217,7 +626,55 @@ void vm_executor_run(struct ebpf_vm_executor *executor);
 uint64_t run_ebpf_vm(struct ebpf_vm *vm);
 void update_vm_state(struct ebpf_vm *vm, int state);
 uint64_t vm_mmu(uint64_t va, struct ebpf_vm *vm);
+uint64_t vm_mmu_range(uint64_t va, uint64_t len, struct ebpf_vm *vm);
 void *vm_executor_init(struct ebpf_vm_executor_config *cfg);
+void vm_executor_stop(struct ebpf_vm_executor *executor);
 void vm_executor_destroy(struct ebpf_vm_executor *executor);
+void vm_executor_stats(struct ebpf_vm_executor *executor, struct vm_worker_stats *sum);
+int vm_stats_init(struct ebpf_vm_executor *executor, const char *name);
+void vm_stats_publish(struct ebpf_vm_worker *worker);
+void vm_stats_exit(struct ebpf_vm_executor *executor);
+int vm_trace_init(struct ebpf_vm_executor *executor, const char *name);
+int vm_trace_write(struct ebpf_vm_executor *executor, FILE *out);
+void vm_trace_exit(struct ebpf_vm_executor *executor);
+int vm_latency_init(struct ebpf_vm_executor *executor, uint32_t enable);
+void vm_latency_exit(struct ebpf_vm_executor *executor);
+int vm_executor_latency(struct ebpf_vm_executor *executor, uint32_t type, uint32_t helper, struct vm_hist *sum);
+void vm_executor_latency_report(struct ebpf_vm_executor *executor, FILE *out);
+int vm_send_msg(struct ebpf_vm_worker *worker, struct node_url *dst, uint32_t hash, uint16_t type,
+	struct vm_msg_part *parts, int num);
+void vm_flush_outbound(struct ebpf_vm_worker *worker, int force);
+int vm_outbound_init(struct ebpf_vm_worker *worker);
+void vm_outbound_cleanup(struct ebpf_vm_worker *worker);
+int vm_clone_fanout(struct ebpf_vm *vm, struct node_url *targets, uint32_t base, uint32_t count);
+struct ebpf_vm *vm_worker_find_vm(struct ebpf_vm_worker *worker, uint64_t id);
+void vm_worker_bind(struct ebpf_vm_worker *worker, struct ebpf_vm *vm);
+int vm_remote_memcpy(struct ebpf_vm *vm, struct ub_address *dst, struct ub_address *src, uint64_t len,
+	uint64_t completion_addr, uint64_t result);
+void vm_receive_mem_msg(struct ebpf_vm_worker *worker, uint16_t type, void *buf, int buf_size);
+void vm_mem_op_poll(struct ebpf_vm_worker *worker);
+void vm_mem_op_cleanup(struct ebpf_vm_worker *worker);
+void *vm_pool_alloc(uint32_t size);
+void vm_pool_free(void *ptr);
+struct address_monitor_entry *vm_monitor_entry_alloc(struct ebpf_vm *vm);
+void vm_monitor_entry_free(struct ebpf_vm *vm, struct address_monitor_entry *entry);
+uint64_t vm_map_id(const char *name);
+struct vm_map *vm_executor_map(struct ebpf_vm_executor *executor, const struct vm_map_def *def);
+struct vm_map *vm_executor_find_map(struct ebpf_vm_executor *executor, uint64_t id);
+struct vm_map *vm_executor_get_map(struct ebpf_vm_executor *executor, const char *name);
+void vm_executor_destroy_maps(struct ebpf_vm_executor *executor);
+int vm_map_lookup(struct vm_map *map, const void *key, void *value, uint32_t cpu);
+int vm_map_update(struct vm_map *map, const void *key, const void *value, uint64_t flags, uint32_t cpu);
+int vm_map_delete(struct vm_map *map, const void *key);
+uint32_t vm_crc32c(uint32_t seed, const void *buf, uint64_t len);
+uint64_t vm_xxhash64(uint64_t seed, const void *buf, uint64_t len);
+int64_t vm_mem_search(const uint8_t *buf, uint64_t len, const struct vm_search_pattern *patterns,
+	uint32_t num, uint32_t *match);
+struct ebpf_helper_table *ebpf_global_helpers(void);
+struct ebpf_helper_table *ebpf_helper_table_create(void);
+void ebpf_helper_table_destroy(struct ebpf_helper_table *table);
+int ebpf_helper_register(struct ebpf_helper_table *table, uint32_t idx, const struct ebpf_symbol *helper);
+uint32_t ebpf_helper_lookup(struct ebpf_helper_table *table, const char *name);
+int vm_executor_resolve_peers(struct ebpf_vm_executor *executor, struct node_url *peers, int num, int wait);
 
 #endif /*_EBPF_VM_SIMULATOR_H_*/
\ No newline at end of file
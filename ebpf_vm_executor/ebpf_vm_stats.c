@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "ebpf_vm_simulator.h"
+
+_Static_assert(VM_STATS_MAX_WORKERS >= VM_MAX_WORKERS, "stats page is too small for the workers");
+
+static size_t stats_page_size(void)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	
+	return (sizeof(struct vm_stats_page) + page - 1) & ~(page - 1);
+}
+
+/* without a name the snapshots still back vm_executor_stats() */
+int vm_stats_init(struct ebpf_vm_executor *executor, const char *name)
+{
+	struct vm_stats_page *page = NULL;
+	size_t size = stats_page_size();
+	char ip[INET_ADDRSTRLEN] = "";
+	int fd;
+	
+	executor->stats_name[0] = '\0';
+	if (name == NULL) {
+		page = calloc(1, size);
+		if (page == NULL) {
+			printf("Failed to allocate stats page.\n");
+			return -1;
+		}
+	} else {
+		if ((name[0] != '/') || (strlen(name) >= VM_STATS_NAME_SIZE)) {
+			printf("Invalid stats name %s, expected /<name>.\n", name);
+			return -1;
+		}
+	
+		fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror("Failed to create stats shared memory");
+			return -1;
+		}
+	
+		if (ftruncate(fd, size) != 0) {
+			perror("Failed to size stats shared memory");
+			close(fd);
+			shm_unlink(name);
+			return -1;
+		}
+	
+		page = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (page == MAP_FAILED) {
+			perror("Failed to map stats shared memory");
+			shm_unlink(name);
+			return -1;
+		}
+	
+		snprintf(executor->stats_name, sizeof(executor->stats_name), "%s", name);
+	}
+	
+	inet_ntop(AF_INET, &executor->self_url.ip, ip, sizeof(ip));
+	snprintf(page->node, sizeof(page->node), "%s:%u", ip, ntohs(executor->self_url.port));
+	page->version = VM_STATS_VERSION;
+	page->num_workers = executor->num_workers;
+	page->pid = getpid();
+	page->start_ns = vm_wall_ns();
+	/* readers check the magic last */
+	__atomic_store_n(&page->magic, VM_STATS_MAGIC, __ATOMIC_RELEASE);
+	executor->stats_page = page;
+	return 0;
+}
+
+/* called by the worker thread only, readers retry while seq is odd */
+void vm_stats_publish(struct ebpf_vm_worker *worker)
+{
+	struct vm_stats_page *page = worker->executor->stats_page;
+	struct vm_stats_slot *slot = NULL;
+	
+	if (page == NULL) {
+		return;
+	}
+	
+	slot = &page->workers[worker->index];
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->publish_ns = vm_wall_ns();
+	slot->stats = worker->stats;
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+void vm_stats_exit(struct ebpf_vm_executor *executor)
+{
+	if (executor->stats_page == NULL) {
+		return;
+	}
+	
+	if (executor->stats_name[0] != '\0') {
+		munmap(executor->stats_page, stats_page_size());
+		shm_unlink(executor->stats_name);
+	} else {
+		free(executor->stats_page);
+	}
+	
+	executor->stats_page = NULL;
+}
+
+/* sum of the last published snapshots, the running totals of a worker are its own */
+void vm_executor_stats(struct ebpf_vm_executor *executor, struct vm_worker_stats *sum)
+{
+	struct vm_worker_stats stats;
+	
+	memset(sum, 0, sizeof(*sum));
+	if (executor->stats_page == NULL) {
+		return;
+	}
+	
+	for (uint32_t idx = 0; idx < executor->num_workers; idx++) {
+		(void)vm_stats_read(executor->stats_page, idx, &stats);
+		vm_stats_add(sum, &stats);
+	}
+}
@@ -0,0 +1,90 @@
+#ifndef _EBPF_VM_STATS_H_
+#define _EBPF_VM_STATS_H_
+
+#include <stdint.h>
+
+#define VM_STATS_MAGIC 0x54534d56
+#define VM_STATS_VERSION 1
+#define VM_STATS_MAX_WORKERS 16
+#define VM_STATS_NAME_SIZE 64
+/* worker loop passes between two snapshots, a power of 2 */
+#define VM_STATS_PUBLISH_PASSES 256
+
+/*
+ * Counters of one executor worker. The worker bumps its private copy with
+ * plain increments and publishes a snapshot every VM_STATS_PUBLISH_PASSES
+ * passes of its loop. Gauges hold the value seen by the last pass.
+ */
+struct vm_worker_stats {
+	uint64_t passes;
+	uint64_t vms;
+	uint64_t vms_runnable;
+	uint64_t vms_waiting;
+	uint64_t runs;
+	uint64_t insns;
+	uint64_t helper_calls;
+	uint64_t vms_exited;
+	uint64_t migrations_in;
+	uint64_t migrations_out;
+	uint64_t clones_in;
+	uint64_t clones_out;
+	uint64_t forks_in;
+	uint64_t forks_out;
+	uint64_t msgs_sent;
+	uint64_t bytes_sent;
+	uint64_t send_failures;
+	uint64_t msgs_recv;
+	uint64_t bytes_recv;
+	uint64_t recv_drops;
+	uint64_t records_forwarded;
+	uint64_t monitor_wakeups;
+};
+
+/* odd seq while the worker is writing the snapshot */
+struct vm_stats_slot {
+	uint64_t seq;
+	uint64_t publish_ns;
+	struct vm_worker_stats stats;
+} __attribute__((aligned(64)));
+
+/*
+ * Layout of the shared memory object, /dev/shm/<name>. The executor is the
+ * only writer, readers map it read only and never slow the workers down.
+ */
+struct vm_stats_page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_workers;
+	uint32_t pid;
+	uint64_t start_ns;
+	char node[32];
+	struct vm_stats_slot workers[VM_STATS_MAX_WORKERS];
+};
+
+/* consistent copy of one worker's snapshot, returns the time it was published */
+static inline uint64_t vm_stats_read(const struct vm_stats_page *page, uint32_t worker, struct vm_worker_stats *stats)
+{
+	const struct vm_stats_slot *slot = &page->workers[worker];
+	uint64_t seq, publish_ns;
+	
+	do {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		publish_ns = slot->publish_ns;
+		*stats = slot->stats;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || (seq != __atomic_load_n(&slot->seq, __ATOMIC_RELAXED)));
+	
+	return publish_ns;
+}
+
+static inline void vm_stats_add(struct vm_worker_stats *sum, const struct vm_worker_stats *stats)
+{
+	uint64_t *dst = (uint64_t *)sum;
+	const uint64_t *src = (const uint64_t *)stats;
+	
+	for (uint32_t idx = 0; idx < sizeof(*stats) / sizeof(uint64_t); idx++) {
+		dst[idx] += src[idx];
+	}
+}
+
+#endif
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "ub_list.h"
+#include "ebpf_vm_simulator.h"
+#include "ebpf_vm_trace.h"
+
+/*
+ * Every thread recording events owns a ring and is its only writer. The
+ * rings keep the last VM_TRACE_RING_SIZE events, a reader copies an event
+ * and then checks that the writer has not wrapped over it meanwhile.
+ */
+struct vm_trace_ring {
+	struct ub_list node;
+	uint64_t head;
+	/* node of the first event, mixed once another node shows up */
+	uint32_t node_id;
+	uint32_t mixed;
+	uint32_t closed;
+	struct vm_trace_event events[VM_TRACE_RING_SIZE];
+};
+
+int vm_trace_active;
+
+static struct ub_list vm_trace_rings = {&vm_trace_rings, &vm_trace_rings};
+static pthread_mutex_t vm_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t vm_trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t vm_trace_key;
+static __thread struct vm_trace_ring *vm_trace_ring;
+
+static const char *trace_names[VM_TRACE_MAX] = {
+	"create", "run", "helper", "wait", "wake", "migrate_out", "migrate_in", "exit",
+};
+
+/* rings outlive their thread, the executor writes them out after its workers are gone */
+static void close_ring(void *arg)
+{
+	struct vm_trace_ring *ring = arg;
+	
+	__atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+static void create_key(void)
+{
+	(void)pthread_key_create(&vm_trace_key, close_ring);
+}
+
+static struct vm_trace_ring *open_ring(void)
+{
+	struct vm_trace_ring *ring = NULL;
+	
+	pthread_once(&vm_trace_once, create_key);
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL) {
+		return NULL;
+	}
+	
+	pthread_mutex_lock(&vm_trace_lock);
+	ub_list_push_back(&vm_trace_rings, &ring->node);
+	pthread_mutex_unlock(&vm_trace_lock);
+	(void)pthread_setspecific(vm_trace_key, ring);
+	vm_trace_ring = ring;
+	return ring;
+}
+
+void vm_trace_record(uint32_t type, uint32_t node, uint32_t worker, uint64_t vm_id, uint64_t ts_ns, uint64_t dur_ns,
+	uint64_t arg)
+{
+	struct vm_trace_ring *ring = vm_trace_ring;
+	struct vm_trace_event *ev = NULL;
+	uint64_t head;
+	
+	if ((ring == NULL) && ((ring = open_ring()) == NULL)) {
+		return;
+	}
+	
+	head = ring->head;
+	if (head == 0) {
+		ring->node_id = node;
+	} else if (node != ring->node_id) {
+		__atomic_store_n(&ring->mixed, 1, __ATOMIC_RELAXED);
+	}
+	
+	ev = &ring->events[head & (VM_TRACE_RING_SIZE - 1)];
+	ev->ts_ns = ts_ns;
+	ev->dur_ns = dur_ns;
+	ev->vm_id = vm_id;
+	ev->arg = arg;
+	ev->node = node;
+	ev->worker = worker;
+	ev->type = type;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int is_wait_state(uint32_t state)
+{
+	return (state == VM_STATE_WAIT_FOR_ADDRESS) || (state == VM_STATE_WAIT_FOR_PEER) ||
+		(state == VM_STATE_WAIT_FOR_JOIN);
+}
+
+/*
+ * Called after each run_ebpf_vm() of a traced executor with the state the vm
+ * was run in. Waiting vms are polled by every pass, a poll that leaves the vm
+ * waiting is not a slice.
+ */
+void vm_trace_slice(struct ebpf_vm *vm, uint32_t state, uint64_t start_ns)
+{
+	struct ebpf_vm_worker *worker = vm->rd.worker;
+	uint32_t node = worker->executor->node_id;
+	uint64_t end_ns;
+	
+	if (state != VM_STATE_RUNNING) {
+		if (vm->state.vm_state == state) {
+			return;
+		}
+		vm_trace_record(VM_TRACE_WAKE, node, worker->index, vm->rd.id, start_ns, 0, state);
+	}
+	
+	end_ns = vm_wall_ns();
+	vm_trace_record(VM_TRACE_RUN, node, worker->index, vm->rd.id, start_ns, end_ns - start_ns, 0);
+	if (is_wait_state(vm->state.vm_state)) {
+		vm_trace_record(VM_TRACE_WAIT, node, worker->index, vm->rd.id, end_ns, 0, vm->state.vm_state);
+	}
+}
+
+/* the call polled by a waiting vm is left out, its wake up is traced instead */
+void vm_trace_helper(struct ebpf_vm *vm, uint32_t idx)
+{
+	if ((vm->rd.worker == NULL) || (vm->rd.executor->state.tracing == 0) ||
+		(vm->state.vm_state != VM_STATE_RUNNING)) {
+		return;
+	}
+	
+	VM_TRACE_VM(vm, VM_TRACE_HELPER, idx);
+}
+
+static const char *wait_name(uint64_t state)
+{
+	switch (state) {
+	case VM_STATE_WAIT_FOR_ADDRESS:
+		return "address";
+	case VM_STATE_WAIT_FOR_PEER:
+		return "peer";
+	case VM_STATE_WAIT_FOR_JOIN:
+		return "join";
+	default:
+		return "unknown";
+	}
+}
+
+/* vm ids do not fit into a json number, they are written as hex strings */
+static void write_event(FILE *out, struct ebpf_vm_executor *executor, const struct vm_trace_event *ev)
+{
+	struct ebpf_symbol *symbols = executor->helpers->symbols;
+	const char *name = trace_names[ev->type];
+	
+	if (ev->type == VM_TRACE_HELPER) {
+		name = ((ev->arg < PKT_VM_MAX_SYMBS) && (symbols[ev->arg].name != NULL)) ? symbols[ev->arg].name : "helper";
+	}
+	
+	fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"pid\":%u,\"tid\":%u,\"ts\":%lu.%03lu,", name,
+		(ev->type == VM_TRACE_HELPER) ? "helper" : "vm", ev->node, ev->worker, ev->ts_ns / 1000, ev->ts_ns % 1000);
+	if (ev->type == VM_TRACE_RUN) {
+		fprintf(out, "\"ph\":\"X\",\"dur\":%lu.%03lu,", ev->dur_ns / 1000, ev->dur_ns % 1000);
+	} else {
+		fprintf(out, "\"ph\":\"i\",\"s\":\"t\",");
+	}
+	
+	fprintf(out, "\"args\":{\"vm\":\"0x%lx\"", ev->vm_id);
+	switch (ev->type) {
+	case VM_TRACE_CREATE:
+		fprintf(out, ",\"parent\":\"0x%lx\"}}", ev->arg);
+		break;
+	case VM_TRACE_WAIT:
+	case VM_TRACE_WAKE:
+		fprintf(out, ",\"state\":\"%s\"}}", wait_name(ev->arg));
+		break;
+	case VM_TRACE_EXIT:
+		fprintf(out, ",\"insns\":%lu}}", ev->arg);
+		break;
+	case VM_TRACE_MIGRATE_OUT:
+	case VM_TRACE_MIGRATE_IN:
+		/* both ends of a hop share the flow id, on whichever nodes they were traced */
+		fprintf(out, ",\"hop\":%lu}}", ev->arg);
+		fprintf(out, ",\n{\"name\":\"migrate\",\"cat\":\"migrate\",\"pid\":%u,\"tid\":%u,\"ts\":%lu.%03lu,"
+			"\"ph\":\"%s\",%s\"id\":\"0x%lx.%lu\"}", ev->node, ev->worker, ev->ts_ns / 1000, ev->ts_ns % 1000,
+			(ev->type == VM_TRACE_MIGRATE_OUT) ? "s" : "f", (ev->type == VM_TRACE_MIGRATE_OUT) ? "" : "\"bp\":\"e\",",
+			ev->vm_id, ev->arg);
+		break;
+	default:
+		fprintf(out, "}}");
+		break;
+	}
+}
+
+/*
+ * Writes the events of this executor in the Chrome trace event format, which
+ * Perfetto and chrome://tracing load. The pid of the events is the node part
+ * of the vm ids, the tid the worker. Can be called while the workers run.
+ */
+int vm_trace_write(struct ebpf_vm_executor *executor, FILE *out)
+{
+	struct vm_trace_ring *ring = NULL;
+	struct vm_trace_event ev;
+	char ip[INET_ADDRSTRLEN] = "";
+	uint64_t head, idx;
+	
+	inet_ntop(AF_INET, &executor->self_url.ip, ip, sizeof(ip));
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"%s:%u\"}}",
+		executor->node_id, ip, ntohs(executor->self_url.port));
+	for (idx = 0; idx < executor->num_workers; idx++) {
+		fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%lu,\"args\":{\"name\":\"worker %lu\"}}",
+			executor->node_id, idx, idx);
+	}
+	
+	pthread_mutex_lock(&vm_trace_lock);
+	UB_LIST_FOR_EACH(ring, node, &vm_trace_rings) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (idx = (head > VM_TRACE_RING_SIZE) ? head - VM_TRACE_RING_SIZE : 0; idx < head; idx++) {
+			ev = ring->events[idx & (VM_TRACE_RING_SIZE - 1)];
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			/* the slot may have been reused while it was copied */
+			if (idx + VM_TRACE_RING_SIZE <= __atomic_load_n(&ring->head, __ATOMIC_RELAXED)) {
+				continue;
+			}
+	
+			if ((ev.node == executor->node_id) && (ev.type < VM_TRACE_MAX)) {
+				write_event(out, executor, &ev);
+			}
+		}
+	}
+	pthread_mutex_unlock(&vm_trace_lock);
+	
+	fprintf(out, "\n]}\n");
+	return ferror(out) ? -1 : 0;
+}
+
+/* tracing starts with the executor, the file is written by vm_trace_exit() */
+int vm_trace_init(struct ebpf_vm_executor *executor, const char *name)
+{
+	executor->trace_name = NULL;
+	executor->state.tracing = 0;
+	if (name == NULL) {
+		return 0;
+	}
+	
+	executor->trace_name = strdup(name);
+	if (executor->trace_name == NULL) {
+		printf("Failed to allocate trace name.\n");
+		return -1;
+	}
+	
+	executor->state.tracing = 1;
+	__atomic_fetch_add(&vm_trace_active, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void vm_trace_exit(struct ebpf_vm_executor *executor)
+{
+	struct vm_trace_ring *ring = NULL, *tmp = NULL;
+	FILE *out = NULL;
+	
+	if (executor->trace_name == NULL) {
+		return;
+	}
+	
+	out = fopen(executor->trace_name, "w");
+	if (out == NULL) {
+		perror("Failed to open trace file");
+	} else {
+		if (vm_trace_write(executor, out) != 0) {
+			printf("Failed to write trace file %s.\n", executor->trace_name);
+		}
+		fclose(out);
+	}
+	
+	/* rings of exited workers which only held this executor's events are done */
+	pthread_mutex_lock(&vm_trace_lock);
+	UB_LIST_FOR_EACH_SAFE(ring, tmp, node, &vm_trace_rings) {
+		if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) && !ring->mixed && (ring->node_id == executor->node_id)) {
+			ub_list_remove(&ring->node);
+			free(ring);
+		}
+	}
+	pthread_mutex_unlock(&vm_trace_lock);
+	
+	executor->state.tracing = 0;
+	__atomic_fetch_sub(&vm_trace_active, 1, __ATOMIC_RELAXED);
+	free(executor->trace_name);
+	executor->trace_name = NULL;
+}
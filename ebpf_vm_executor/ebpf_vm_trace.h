@@ -0,0 +1,59 @@
+#ifndef _EBPF_VM_TRACE_H_
+#define _EBPF_VM_TRACE_H_
+
+#include <stdint.h>
+#include "ebpf_vm_simulator.h"
+
+/* events per thread, a power of 2, the oldest are overwritten */
+#define VM_TRACE_RING_SIZE 65536
+
+enum {
+	VM_TRACE_CREATE,
+	VM_TRACE_RUN,
+	VM_TRACE_HELPER,
+	VM_TRACE_WAIT,
+	VM_TRACE_WAKE,
+	VM_TRACE_MIGRATE_OUT,
+	VM_TRACE_MIGRATE_IN,
+	VM_TRACE_EXIT,
+	VM_TRACE_MAX
+};
+
+/*
+ * One lifecycle event. arg is the parent vm of a created vm, the helper
+ * index of a call, the state a vm waits in, or the hop of a migration.
+ */
+struct vm_trace_event {
+	uint64_t ts_ns;
+	uint64_t dur_ns;
+	uint64_t vm_id;
+	uint64_t arg;
+	uint32_t node;
+	uint16_t worker;
+	uint16_t type;
+};
+
+extern int vm_trace_active;
+
+void vm_trace_record(uint32_t type, uint32_t node, uint32_t worker, uint64_t vm_id, uint64_t ts_ns, uint64_t dur_ns,
+	uint64_t arg);
+void vm_trace_slice(struct ebpf_vm *vm, uint32_t state, uint64_t start_ns);
+void vm_trace_helper(struct ebpf_vm *vm, uint32_t idx);
+
+/* a single test of the executor flag when tracing is off */
+#define VM_TRACE(worker, type, vm_id, arg) do { \
+	if (__builtin_expect((worker)->executor->state.tracing, 0)) { \
+		vm_trace_record((type), (worker)->executor->node_id, (worker)->index, (vm_id), vm_wall_ns(), 0, (arg)); \
+	} \
+} while (0)
+
+#define VM_TRACE_VM(vm, type, arg) VM_TRACE((vm)->rd.worker, (type), (vm)->rd.id, (arg))
+
+/* the interpreter also runs vms outside of any executor, gate it on the process wide count */
+#define VM_TRACE_HELPER(vm, idx) do { \
+	if (__builtin_expect(vm_trace_active, 0)) { \
+		vm_trace_helper((vm), (idx)); \
+	} \
+} while (0)
+
+#endif
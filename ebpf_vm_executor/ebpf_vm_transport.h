@@ -21,12 +21,16 @@ struct rdma_transport_config {
 	int ib_port;
 	unsigned int max_msg_size;
 	unsigned int rx_depth;
+	unsigned int peer_credits;
+	unsigned int num_qps;
 	int use_event;
 	int gid_index;
 };
 
 struct udp_transport_config {
 	struct node_url self_url;
+	unsigned int max_msg_size;
+	unsigned int num_queues;
 };
 
 struct transport_config {
@@ -37,18 +41,40 @@ struct transport_config {
 	};
 };
 
+enum {
+	PKT_VM_PEER_READY,
+	PKT_VM_PEER_PENDING,
+	PKT_VM_PEER_FAILED
+};
+
+/*
+ * queue selects the local queue (one per executor worker) a message is sent
+ * from or received on; hash picks one of the peer's queues on send.
+ */
 struct transport_message {
 	void *buf;
 	int buf_size;
+	uint32_t queue;
+	uint32_t hash;
+};
+
+struct transport_peer_stats {
+	struct node_url url;
+	uint64_t credit_stalls;
+	uint64_t queued_msgs;
+	int64_t credits;
 };
 
 struct transport_ops {
 	int type;
 	void *(*init)(struct transport_config *cfg);
 	void (*exit)(void *ctx);
+	int (*resolve)(void *ctx, struct node_url *dst);
 	int (*send)(void *ctx, struct node_url *dst, struct transport_message *msg);
 	int (*recv)(void *ctx, struct transport_message *msg);
 	void (*return_buf)(void *ctx, struct transport_message *msg);
+	unsigned int (*get_max_msg_size)(void *ctx);
+	int (*peer_stats)(void *ctx, struct transport_peer_stats *stats, int max);
 };
 
 int register_transport(struct transport_ops *ops);
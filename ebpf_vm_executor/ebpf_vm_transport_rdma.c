@@ -5,17 +5,22 @@
 #include <stdint.h>
 #include <ctype.h>
 #include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <infiniband/verbs.h>
 
 #include "ub_list.h"
+#include "ebpf_vm_simulator.h"
 #include "ebpf_vm_transport_rdma.h"
+#include "ebpf_vm_log.h"
 
-void wire_gid_to_gid(const uint8_t *wgid, union ibv_gid *gid)
+void wire_gid_to_gid(const char *wgid, union ibv_gid *gid)
 {
-	uint8_t tmp[9];
+	char tmp[9];
 	__be32 v32;
 	int i;
 	uint32_t tmp_gid[4];
@@ -28,7 +33,7 @@ void wire_gid_to_gid(const uint8_t *wgid, union ibv_gid *gid)
 	memcpy(gid, tmp_gid, sizeof(*gid));
 }
 
-void gid_to_wire_gid(const union ibv_gid *gid, uint8_t wgid[])
+void gid_to_wire_gid(const union ibv_gid *gid, char wgid[])
 {
 	uint32_t tmp_gid[4];
 	int i;
@@ -44,16 +49,70 @@ static void printf_rdma_addr_message(struct rdma_addr_message *msg)
 	char gid[33];
 	
 	inet_ntop(AF_INET6, &msg->gid, gid, sizeof(gid));
-	printf("address: LID 0x%04x, QPN 0x%06x, PSN 0x%06x: GID %s\n",
-			msg->lid, msg->qpn, msg->psn, gid);
+	printf("address: LID 0x%04x, QPN 0x%06x, PSN 0x%06x: GID %s, %d QPs\n",
+			msg->lid, msg->qpn, msg->psn, gid, msg->num_qps);
 }
 
+static void pkt_vm_rdma_format_addr(struct rdma_addr_message *addr, char *msg)
+{
+	int n, idx;
+	
+	n = sprintf(msg, "%04x:%06x:%06x:", addr->lid, addr->qpn, addr->psn);
+	gid_to_wire_gid(&addr->gid, (msg + n));
+	n += GID_STR_SIZE - 1;
+	n += sprintf(msg + n, ":%02x", addr->num_qps);
+	for (idx = 0; idx < PKT_VM_RDMA_MAX_QPS; idx++) {
+		n += sprintf(msg + n, ":%06x", (idx < addr->num_qps) ? addr->qpn_list[idx] : 0);
+	}
+	sprintf(msg + n, ":%08x:%04x:%04x:%02x", addr->url.ip, addr->url.port, addr->credits, addr->ctrl_credits);
+}
+
+static int pkt_vm_rdma_parse_addr(struct rdma_addr_message *addr, char *msg)
+{
+	char gid_str[GID_STR_SIZE];
+	unsigned int port;
+	int n, len, idx;
+	
+	msg[sizeof(EXCH_MSG_PATTERN) - 1] = '\0';
+	if ((sscanf(msg, "%x:%x:%x:%32[0-9a-f]:%x%n", &addr->lid, &addr->qpn, &addr->psn,
+			gid_str, &addr->num_qps, &n) != 5) ||
+		(addr->num_qps < 1) || (addr->num_qps > PKT_VM_RDMA_MAX_QPS)) {
+		return -1;
+	}
+	
+	/* unused qp numbers are sent as zeros */
+	for (idx = 0; idx < PKT_VM_RDMA_MAX_QPS; idx++) {
+		if (sscanf(msg + n, ":%x%n", &addr->qpn_list[idx], &len) != 1) {
+			return -1;
+		}
+		n += len;
+	}
+	
+	if (sscanf(msg + n, ":%x:%x:%x:%x", &addr->url.ip, &port, &addr->credits, &addr->ctrl_credits) != 4) {
+		return -1;
+	}
+	addr->url.port = (uint16_t)port;
+	addr->url.reserved = 0;
+	
+	wire_gid_to_gid(gid_str, &addr->gid);
+	return 0;
+}
+
+static uint32_t pkt_vm_rdma_hash_url(struct node_url *n)
+{
+	uint64_t key = ((uint64_t)n->ip << 16) | n->port;
+	
+	return (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & (PKT_VM_RDMA_DST_HASH_SIZE - 1);
+}
+
+/* the caller holds table_lock */
 static struct rdma_addr_info *pkt_vm_rdma_find_dest(struct pkt_vm_rdma_context *ctx, struct node_url *n)
 {
+	struct ub_list *bucket = &ctx->dst_addr_hash[pkt_vm_rdma_hash_url(n)];
 	struct rdma_addr_info *e;
 	
-	UB_LIST_FOR_EACH(e, node, &ctx->dst_addr_list) {
-		if (memcmp(&e->key, n, sizeof(struct node_url)) == 0) {
+	UB_LIST_FOR_EACH(e, node, bucket) {
+		if ((e->key.ip == n->ip) && (e->key.port == n->port)) {
 			return e;
 		}
 	}
@@ -61,13 +120,26 @@ static struct rdma_addr_info *pkt_vm_rdma_find_dest(struct pkt_vm_rdma_context *
 	return NULL;
 }
 
-static struct rdma_addr_info *pkt_vm_rdma_add_dest(struct pkt_vm_rdma_context *ctx, struct node_url *n, uint8_t *msg)
+/* only the thread that moves the peer out of state queues it */
+static void pkt_vm_rdma_queue_resolve(struct pkt_vm_rdma_context *ctx, struct rdma_addr_info *dst, int state)
+{
+	if (!__atomic_compare_exchange_n(&dst->state, &state, PKT_VM_RDMA_DST_RESOLVING, 0, __ATOMIC_RELAXED,
+		__ATOMIC_RELAXED)) {
+		return;
+	}
+	
+	pthread_mutex_lock(&ctx->resolve_lock);
+	ub_list_push_back(&ctx->resolve_list, &dst->pending);
+	pthread_cond_signal(&ctx->resolve_cond);
+	pthread_mutex_unlock(&ctx->resolve_lock);
+}
+
+/* the caller holds table_lock for writing */
+static struct rdma_addr_info *pkt_vm_rdma_add_dest(struct pkt_vm_rdma_context *ctx, struct node_url *n)
 {
 	struct rdma_addr_info *dst;
-	uint8_t gid_str[GID_STR_SIZE];
-	struct ibv_ah_attr ah_attr = {0};
 	
-	dst = malloc(sizeof(*dst));
+	dst = calloc(1, sizeof(*dst));
 	if (dst == NULL) {
 		perror("Failed to allocate memory");
 		return NULL;
@@ -76,9 +148,130 @@ static struct rdma_addr_info *pkt_vm_rdma_add_dest(struct pkt_vm_rdma_context *c
 	dst->key.ip = n->ip;
 	dst->key.port = n->port;
 	dst->key.reserved = 0;
+	dst->state = PKT_VM_RDMA_DST_IDLE;
+	/* credits are granted by the peer when we resolve it */
+	pthread_mutex_init(&dst->lock, NULL);
+	ub_list_init(&dst->send_queue);
+	
+	ub_list_push_back(&ctx->dst_addr_hash[pkt_vm_rdma_hash_url(n)], &dst->node);
+	return dst;
+}
+
+static struct rdma_addr_info *pkt_vm_rdma_get_dest(struct pkt_vm_rdma_context *ctx, struct node_url *n, int create)
+{
+	struct rdma_addr_info *dst = NULL;
+	
+	pthread_rwlock_rdlock(&ctx->table_lock);
+	dst = pkt_vm_rdma_find_dest(ctx, n);
+	pthread_rwlock_unlock(&ctx->table_lock);
+	if ((dst != NULL) || !create) {
+		return dst;
+	}
 	
-	sscanf(msg, "%x:%x:%x:%s", &dst->info.lid, &dst->info.qpn, &dst->info.psn, gid_str);
-	wire_gid_to_gid(gid_str, &dst->info.gid);
+	pthread_rwlock_wrlock(&ctx->table_lock);
+	dst = pkt_vm_rdma_find_dest(ctx, n);
+	if (dst == NULL) {
+		dst = pkt_vm_rdma_add_dest(ctx, n);
+	}
+	pthread_rwlock_unlock(&ctx->table_lock);
+	return dst;
+}
+
+/* rx_depth less one control slot per sender, split evenly and capped at peer_credits */
+static uint32_t pkt_vm_rdma_fair_share(struct pkt_vm_rdma_context *ctx)
+{
+	uint32_t senders = __atomic_load_n(&ctx->num_senders, __ATOMIC_RELAXED);
+	uint32_t share;
+	
+	if (senders == 0) {
+		senders = 1;
+	}
+	
+	share = ((uint32_t)ctx->rx_depth > senders) ? (ctx->rx_depth - senders) / senders : 0;
+	if (share > ctx->peer_credits) {
+		share = ctx->peer_credits;
+	}
+	return (share != 0) ? share : 1;
+}
+
+static uint32_t pkt_vm_rdma_take_credits(struct pkt_vm_rdma_context *ctx, uint32_t want)
+{
+	uint32_t free_credits = __atomic_load_n(&ctx->free_credits, __ATOMIC_RELAXED);
+	uint32_t got;
+	
+	do {
+		got = (free_credits < want) ? free_credits : want;
+		if (got == 0) {
+			return 0;
+		}
+	} while (!__atomic_compare_exchange_n(&ctx->free_credits, &free_credits, free_credits - got, 0, __ATOMIC_RELAXED,
+		__ATOMIC_RELAXED));
+	
+	return got;
+}
+
+/* the caller holds src->lock, tops the sender up from the pool and returns whether it is still short */
+static int pkt_vm_rdma_grant(struct pkt_vm_rdma_context *ctx, struct rdma_addr_info *src, uint32_t share)
+{
+	uint32_t got;
+	
+	if ((src->ctrl_granted == 0) && (pkt_vm_rdma_take_credits(ctx, 1) == 1)) {
+		src->ctrl_granted = 1;
+		src->ctrl_to_return = 1;
+	}
+	
+	if (src->granted < share) {
+		got = pkt_vm_rdma_take_credits(ctx, share - src->granted);
+		src->granted += got;
+		src->credits_to_return += got;
+	}
+	
+	return (src->ctrl_granted == 0) || (src->granted < share);
+}
+
+/*
+ * The server side of an address exchange, the grant goes back in the reply.
+ * A sender that exchanges again has restarted, what it held goes back to
+ * the pool first.
+ */
+static void pkt_vm_rdma_register_sender(struct pkt_vm_rdma_context *ctx, struct rdma_addr_info *src,
+	struct rdma_addr_message *reply)
+{
+	int short_of_share;
+	
+	pthread_mutex_lock(&src->lock);
+	if (src->sender) {
+		__atomic_fetch_add(&ctx->free_credits, src->granted + src->ctrl_granted, __ATOMIC_RELAXED);
+	} else {
+		src->sender = 1;
+		__atomic_fetch_add(&ctx->num_senders, 1, __ATOMIC_RELAXED);
+	}
+	
+	src->granted = 0;
+	src->ctrl_granted = 0;
+	src->credits_to_return = 0;
+	src->ctrl_to_return = 0;
+	short_of_share = pkt_vm_rdma_grant(ctx, src, pkt_vm_rdma_fair_share(ctx));
+	reply->credits = src->credits_to_return;
+	reply->ctrl_credits = src->ctrl_to_return;
+	src->credits_to_return = 0;
+	src->ctrl_to_return = 0;
+	pthread_mutex_unlock(&src->lock);
+	
+	/* other senders may be above the new share, they shrink as they return buffers */
+	if (short_of_share) {
+		__atomic_store_n(&ctx->short_senders, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static int pkt_vm_rdma_setup_dest(struct pkt_vm_rdma_context *ctx, struct rdma_addr_info *dst, char *msg)
+{
+	struct ibv_ah_attr ah_attr = {0};
+	
+	if (pkt_vm_rdma_parse_addr(&dst->info, msg) != 0) {
+		printf("Malformed remote address.\n");
+		return -1;
+	}
 	
 	if (dst->info.gid.global.interface_id) {
 		ah_attr.is_global = 1;
@@ -92,12 +285,17 @@ static struct rdma_addr_info *pkt_vm_rdma_add_dest(struct pkt_vm_rdma_context *c
 	dst->ah = ibv_create_ah(ctx->pd, &ah_attr);
 	if (!dst->ah) {
 		perror("Failed to create AH");
-		return NULL;
+		return -1;
 	}
 	
-	ub_list_push_back(&ctx->dst_addr_list, &dst->node);
+	/* a repeated exchange means the peer started over, so do its grants */
+	pthread_mutex_lock(&dst->lock);
+	dst->credits = dst->info.credits;
+	dst->ctrl_credits = dst->info.ctrl_credits;
+	pthread_mutex_unlock(&dst->lock);
+	
 	printf_rdma_addr_message(&dst->info);
-	return dst;
+	return 0;
 }
 
 static void *pkt_vm_rdma_server_main(void *arg)
@@ -114,7 +312,7 @@ static void *pkt_vm_rdma_server_main(void *arg)
 	
 	reuse_addr = 1;
 	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr));
-
+	
 	name.sin_family = AF_INET;
 	name.sin_port = ctx->cfg.self_url.port;
 	name.sin_addr.s_addr = ctx->cfg.self_url.ip;
@@ -134,107 +332,296 @@ static void *pkt_vm_rdma_server_main(void *arg)
 	}
 	
 	while (ctx->state.should_stop == 0) {
-		uint8_t msg[sizeof(EXCH_MSG_PATTERN)];
+		char msg[sizeof(EXCH_MSG_PATTERN)];
+		struct rdma_addr_message peer, reply;
+		struct rdma_addr_info *src = NULL;
 		int connfd, n;
-		
+	
 		connfd = accept(sockfd, NULL, NULL);
 		if (connfd < 0) {
 			perror("Failed to accept new connection");
 			continue;
 		}
-		
+	
 		n = read(connfd, msg, sizeof(msg));
 		if (n != sizeof(msg)) {
 			perror("Couldn't read remote address");
 			close(connfd);
 			continue;
 		}
-		
-		n = sprintf(msg, "%04x:%06x:%06x:", ctx->local_addr.lid,
-					ctx->local_addr.qpn, ctx->local_addr.psn);
-		gid_to_wire_gid(&ctx->local_addr.gid, (msg + n));
 	
+		src = (pkt_vm_rdma_parse_addr(&peer, msg) == 0) ? pkt_vm_rdma_get_dest(ctx, &peer.url, 1) : NULL;
+		if (src == NULL) {
+			printf("Malformed remote address.\n");
+			close(connfd);
+			continue;
+		}
+	
+		reply = ctx->local_addr;
+		pkt_vm_rdma_register_sender(ctx, src, &reply);
+		pkt_vm_rdma_format_addr(&reply, msg);
 		if (write(connfd, msg, sizeof(msg)) != sizeof(msg) ||
 			read(connfd, msg, sizeof(msg)) != sizeof("done")) {
 			perror("Couldn't rea/write remote address");
 		}
-		
+	
 		close(connfd);
 	}
 	
 	close(sockfd);
+	return NULL;
 }
 
-static struct rdma_addr_info *pkt_vm_rdma_get_node_info(struct pkt_vm_rdma_context *ctx, struct node_url *server_url)
+/* starts a non-blocking connect, the exchange goes on as the socket becomes ready */
+static int pkt_vm_rdma_start_exchange(struct pkt_vm_rdma_context *ctx, struct pkt_vm_rdma_resolving *r)
 {
-	uint8_t msg[sizeof(EXCH_MSG_PATTERN)];
 	struct sockaddr_in name = {0};
-	int sockfd, n;
+	char svr[32];
 	
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd < 0) {
+	r->phase = PKT_VM_RDMA_EXCH_CONNECTING;
+	r->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (r->fd < 0) {
 		perror("Failed to create socket");
-		return NULL;
+		return -1;
 	}
 	
 	name.sin_family = AF_INET;
-	name.sin_port = server_url->port;
-	name.sin_addr.s_addr = server_url->ip;
+	name.sin_port = r->dst->key.port;
+	name.sin_addr.s_addr = r->dst->key.ip;
 	
-	if (connect(sockfd, (struct sockaddr *)&name, sizeof(name)) < 0) {
-		char svr[32];
+	r->offset = 0;
+	r->deadline_ns = vm_now_ns() + PKT_VM_RDMA_RESOLVE_TIMEOUT_MS * 1000000ULL;
+	pkt_vm_rdma_format_addr(&ctx->local_addr, r->msg);
+	if ((connect(r->fd, (struct sockaddr *)&name, sizeof(name)) < 0) && (errno != EINPROGRESS)) {
 		inet_ntop(AF_INET, &name.sin_addr.s_addr, svr, sizeof(svr));
 		printf("server = %s, port = %d\n", svr, ntohs(name.sin_port));
-		
 		perror("Failed to connect to server");
-		close(sockfd);
-		return NULL;
+		return -1;
 	}
 	
-	n = sprintf(msg, "%04x:%06x:%06x:", ctx->local_addr.lid,
-				ctx->local_addr.qpn, ctx->local_addr.psn);
-	gid_to_wire_gid(&ctx->local_addr.gid, (msg + n));
+	return 0;
+}
+
+/* moves the exchange on when its socket is ready, returns 1 once the reply is in and -1 on failure */
+static int pkt_vm_rdma_step_exchange(struct pkt_vm_rdma_resolving *r)
+{
+	socklen_t len = sizeof(int);
+	ssize_t n;
+	int err = 0;
+	
+	switch (r->phase) {
+	case PKT_VM_RDMA_EXCH_CONNECTING:
+		if ((getsockopt(r->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) || (err != 0)) {
+			printf("Failed to connect to server: %s\n", strerror(err ? err : errno));
+			return -1;
+		}
+		r->phase = PKT_VM_RDMA_EXCH_SENDING;
+		/* fallthrough */
+	case PKT_VM_RDMA_EXCH_SENDING:
+		n = write(r->fd, r->msg + r->offset, sizeof(r->msg) - r->offset);
+		if (n < 0) {
+			if ((errno == EAGAIN) || (errno == EINTR)) {
+				return 0;
+			}
+			perror("Couldn't send local address");
+			return -1;
+		}
+		r->offset += n;
+		if (r->offset == sizeof(r->msg)) {
+			r->phase = PKT_VM_RDMA_EXCH_RECEIVING;
+			r->offset = 0;
+		}
+		return 0;
+	case PKT_VM_RDMA_EXCH_RECEIVING:
+		n = read(r->fd, r->msg + r->offset, sizeof(r->msg) - r->offset);
+		if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+			return 0;
+		}
+		if (n <= 0) {
+			perror("Couldn't read remote address");
+			return -1;
+		}
+		r->offset += n;
+		if (r->offset < sizeof(r->msg)) {
+			return 0;
+		}
+		/* the server only waits for this to close, the socket buffer has room for it */
+		if (write(r->fd, "done", sizeof("done")) != sizeof("done")) {
+			perror("Couldn't write done");
+			return -1;
+		}
+		return 1;
+	default:
+		return -1;
+	}
+}
+
+/* the executor only reads info and ah after it observes the READY state */
+static void pkt_vm_rdma_finish_exchange(struct pkt_vm_rdma_context *ctx, struct pkt_vm_rdma_resolving *r, int ret)
+{
+	int state;
 	
-	if (write(sockfd, msg, sizeof(msg)) != sizeof(msg)) {
-		perror("Couldn't send local address");
-		close(sockfd);
-		return NULL;
+	if (r->fd >= 0) {
+		close(r->fd);
 	}
 	
-	if (read(sockfd, msg, sizeof(msg)) != sizeof(msg) ||
-		write(sockfd, "done", sizeof("done")) != sizeof("done")) {
-		perror("Couldn't rea/write remote address");
-		close(sockfd);
-		return NULL;
+	state = ((ret == 1) && (pkt_vm_rdma_setup_dest(ctx, r->dst, r->msg) == 0)) ?
+		PKT_VM_RDMA_DST_READY : PKT_VM_RDMA_DST_FAILED;
+	r->dst->retry_time = time(NULL) + PKT_VM_RDMA_RETRY_INTERVAL;
+	__atomic_store_n(&r->dst->state, state, __ATOMIC_RELEASE);
+}
+
+/*
+ * Up to PKT_VM_RDMA_MAX_RESOLVING exchanges run at once, so an unreachable
+ * peer only holds up its own slot until its deadline.
+ */
+static void *pkt_vm_rdma_resolver_main(void *arg)
+{
+	struct pkt_vm_rdma_context *ctx = arg;
+	struct pkt_vm_rdma_resolving slots[PKT_VM_RDMA_MAX_RESOLVING];
+	struct pollfd fds[PKT_VM_RDMA_MAX_RESOLVING];
+	int active = 0, started, timeout, ret, idx;
+	uint64_t now_ns, left_ms;
+	
+	while (1) {
+		pthread_mutex_lock(&ctx->resolve_lock);
+		while ((active == 0) && ub_list_is_empty(&ctx->resolve_list) && (ctx->state.should_stop == 0)) {
+			pthread_cond_wait(&ctx->resolve_cond, &ctx->resolve_lock);
+		}
+	
+		if (ctx->state.should_stop != 0) {
+			pthread_mutex_unlock(&ctx->resolve_lock);
+			break;
+		}
+	
+		started = active;
+		while ((active < PKT_VM_RDMA_MAX_RESOLVING) && !ub_list_is_empty(&ctx->resolve_list)) {
+			slots[active].dst = list_first_entry(&ctx->resolve_list, struct rdma_addr_info, pending);
+			ub_list_remove(&slots[active].dst->pending);
+			active++;
+		}
+		pthread_mutex_unlock(&ctx->resolve_lock);
+	
+		/* a peer that cannot even start fails right away, its slot is dropped below */
+		for (idx = started; idx < active; idx++) {
+			if (pkt_vm_rdma_start_exchange(ctx, &slots[idx]) != 0) {
+				pkt_vm_rdma_finish_exchange(ctx, &slots[idx], -1);
+				slots[idx].dst = NULL;
+			}
+		}
+	
+		now_ns = vm_now_ns();
+		timeout = PKT_VM_RDMA_RESOLVE_POLL_MS;
+		for (idx = 0; idx < active; idx++) {
+			fds[idx].fd = (slots[idx].dst != NULL) ? slots[idx].fd : -1;
+			fds[idx].events = (slots[idx].phase == PKT_VM_RDMA_EXCH_RECEIVING) ? POLLIN : POLLOUT;
+			fds[idx].revents = 0;
+			if ((slots[idx].dst != NULL) && (slots[idx].deadline_ns > now_ns)) {
+				left_ms = (slots[idx].deadline_ns - now_ns + 999999) / 1000000;
+				timeout = (left_ms < (uint64_t)timeout) ? (int)left_ms : timeout;
+			}
+		}
+	
+		if ((poll(fds, active, timeout) < 0) && (errno != EINTR)) {
+			perror("Failed to poll resolving peers");
+		}
+	
+		/* finished exchanges free their slots, the last slot moves into the gap */
+		now_ns = vm_now_ns();
+		for (idx = 0; idx < active;) {
+			ret = (slots[idx].dst == NULL) ? -1 : 0;
+			if ((ret == 0) && (fds[idx].revents != 0)) {
+				ret = pkt_vm_rdma_step_exchange(&slots[idx]);
+			}
+			if ((ret == 0) && (now_ns >= slots[idx].deadline_ns)) {
+				printf("Address exchange timed out after %d ms.\n", PKT_VM_RDMA_RESOLVE_TIMEOUT_MS);
+				ret = -1;
+			}
+			if (ret == 0) {
+				idx++;
+				continue;
+			}
+	
+			if (slots[idx].dst != NULL) {
+				pkt_vm_rdma_finish_exchange(ctx, &slots[idx], ret);
+			}
+			active--;
+			slots[idx] = slots[active];
+			fds[idx] = fds[active];
+		}
 	}
 	
-	close(sockfd);
-	return pkt_vm_rdma_add_dest(ctx, server_url, msg);
+	for (idx = 0; idx < active; idx++) {
+		if (slots[idx].dst != NULL) {
+			pkt_vm_rdma_finish_exchange(ctx, &slots[idx], -1);
+		}
+	}
+	return NULL;
 }
 
-static int pkt_vm_rdma_enable_qp(struct pkt_vm_rdma_context *ctx)
+/* the peer is added on first use and stays, *dst is NULL only when that failed */
+static int pkt_vm_rdma_resolve_dest(struct pkt_vm_rdma_context *ctx, struct node_url *n, struct rdma_addr_info **dst)
 {
-	struct ibv_qp_attr attr = {
-			.qp_state = IBV_QPS_RTR
-	};
+	int state;
 	
-	if (ibv_modify_qp(ctx->qp, &attr, IBV_QP_STATE)) {
-			fprintf(stderr, "Failed to modify QP to RTR\n");
-			return 1;
+	*dst = pkt_vm_rdma_get_dest(ctx, n, 1);
+	if (*dst == NULL) {
+		return PKT_VM_PEER_FAILED;
+	}
+	
+	state = __atomic_load_n(&(*dst)->state, __ATOMIC_ACQUIRE);
+	switch (state) {
+	case PKT_VM_RDMA_DST_READY:
+		return PKT_VM_PEER_READY;
+	case PKT_VM_RDMA_DST_RESOLVING:
+		return PKT_VM_PEER_PENDING;
+	case PKT_VM_RDMA_DST_FAILED:
+		/* keep reporting the failure until the retry interval expires */
+		if (time(NULL) < (*dst)->retry_time) {
+			return PKT_VM_PEER_FAILED;
+		}
+		pkt_vm_rdma_queue_resolve(ctx, *dst, state);
+		return PKT_VM_PEER_PENDING;
+	default:
+		pkt_vm_rdma_queue_resolve(ctx, *dst, state);
+		return PKT_VM_PEER_PENDING;
 	}
+}
+
+static int pkt_vm_rdma_resolve(void *info, struct node_url *n)
+{
+	struct rdma_addr_info *dst = NULL;
 	
-	attr.qp_state = IBV_QPS_RTS;
-	attr.sq_psn = ctx->local_addr.psn;
+	return pkt_vm_rdma_resolve_dest(info, n, &dst);
+}
+
+static int pkt_vm_rdma_enable_qp(struct pkt_vm_rdma_context *ctx)
+{
+	int idx;
 	
-	if (ibv_modify_qp(ctx->qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN)) {
-			fprintf(stderr, "Failed to modify QP to RTS\n");
-			return 1;
+	for (idx = 0; idx < ctx->num_qps; idx++) {
+		struct ibv_qp_attr attr = {
+				.qp_state = IBV_QPS_RTR
+		};
+	
+		if (ibv_modify_qp(ctx->queues[idx].qp, &attr, IBV_QP_STATE)) {
+				fprintf(stderr, "Failed to modify QP to RTR\n");
+				return 1;
+		}
+	
+		attr.qp_state = IBV_QPS_RTS;
+		attr.sq_psn = ctx->local_addr.psn;
+	
+		if (ibv_modify_qp(ctx->queues[idx].qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN)) {
+				fprintf(stderr, "Failed to modify QP to RTS\n");
+				return 1;
+		}
 	}
 	
 	return 0;
 }
 
-static int pkt_vm_rdma_post_recv(struct pkt_vm_rdma_context *ctx, uint8_t *buf)
+static int pkt_vm_rdma_post_recv(struct pkt_vm_rdma_context *ctx, void *buf)
 {
 	struct ibv_sge list = {
 		.addr = (uintptr_t)buf,
@@ -248,7 +635,7 @@ static int pkt_vm_rdma_post_recv(struct pkt_vm_rdma_context *ctx, uint8_t *buf)
 	};
 	struct ibv_recv_wr *bad_wr;
 	
-	return ibv_post_recv(ctx->qp, &wr, &bad_wr);
+	return ibv_post_srq_recv(ctx->srq, &wr, &bad_wr);
 }
 
 static struct pkt_vm_rdma_context *pkt_vm_rdma_init_ctx(struct rdma_transport_config *cfg)
@@ -256,7 +643,7 @@ static struct pkt_vm_rdma_context *pkt_vm_rdma_init_ctx(struct rdma_transport_co
 	struct ibv_device **dev_list;
 	struct ibv_device *ib_dev = NULL;
 	struct pkt_vm_rdma_context *ctx;
-	int idx;
+	int idx, ring_size;
 	
 	dev_list = ibv_get_device_list(NULL);
 	if (!dev_list) {
@@ -284,27 +671,49 @@ static struct pkt_vm_rdma_context *pkt_vm_rdma_init_ctx(struct rdma_transport_co
 	memcpy(&ctx->cfg, cfg, sizeof(ctx->cfg));
 	ctx->send_flags = IBV_SEND_SIGNALED;
 	ctx->rx_depth = cfg->rx_depth;
-	ctx->buf_size = 2 * cfg->rx_depth * cfg->max_msg_size;
-	ub_list_init(&ctx->dst_addr_list);
+	ctx->num_qps = (cfg->num_qps == 0) ? 1 : cfg->num_qps;
+	if (ctx->num_qps > PKT_VM_RDMA_MAX_QPS) {
+		ctx->num_qps = PKT_VM_RDMA_MAX_QPS;
+	}
+	ctx->peer_credits = (cfg->peer_credits != 0) ? cfg->peer_credits : ((cfg->rx_depth / 2) ? (cfg->rx_depth / 2) : 1);
+	ctx->free_credits = cfg->rx_depth;
+	ub_list_init(&ctx->credit_list);
+	ub_list_init(&ctx->blocked_list);
+	ring_size = cfg->rx_depth * cfg->max_msg_size;
+	ctx->buf_size = (1 + ctx->num_qps) * ring_size;
+	pthread_rwlock_init(&ctx->table_lock, NULL);
+	pthread_mutex_init(&ctx->list_lock, NULL);
+	ub_list_init(&ctx->resolve_list);
+	pthread_mutex_init(&ctx->resolve_lock, NULL);
+	pthread_cond_init(&ctx->resolve_cond, NULL);
+	for (idx = 0; idx < PKT_VM_RDMA_DST_HASH_SIZE; idx++) {
+		ub_list_init(&ctx->dst_addr_hash[idx]);
+	}
 	
 	ctx->buf = calloc(1, ctx->buf_size);
 	if (!ctx->buf) {
 		fprintf(stderr, "Failed to allocate recv buf.\n");
 		goto clean_ctx;
 	}
-	ctx->send_buf = ctx->buf + cfg->rx_depth * cfg->max_msg_size;
-	ctx->send_offset = 0;
-
+	/* the first ring holds the shared receive buffers, then one send ring per queue */
+	ctx->send_buf = ctx->buf + ring_size;
+	for (idx = 0; idx < ctx->num_qps; idx++) {
+		ctx->queues[idx].send_buf = ctx->send_buf + idx * ring_size;
+		ctx->queues[idx].send_offset = 0;
+		ctx->queues[idx].send_outstanding = 0;
+		pthread_mutex_init(&ctx->queues[idx].lock, NULL);
+	}
+	
 	ctx->context = ibv_open_device(ib_dev);
 	if (!ctx->context) {
 		fprintf(stderr, "Couldn't get context for %s\n", ibv_get_device_name(ib_dev));
 		goto clean_buffer;
 	}
-
+	
 	{
 		struct ibv_port_attr port_info = {};
 		int mtu;
-		
+	
 		if (ibv_query_port(ctx->context, cfg->ib_port, &port_info)) {
 			fprintf(stderr, "Unable to query port info for port %d\n", cfg->ib_port);
 			goto clean_device;
@@ -338,83 +747,100 @@ static struct pkt_vm_rdma_context *pkt_vm_rdma_init_ctx(struct rdma_transport_co
 		goto clean_pd;
 	}
 	
-	ctx->cq = ibv_create_cq(ctx->context, cfg->rx_depth + 1, NULL, ctx->channel, 0);
-	if (!ctx->cq) {
-		fprintf(stderr, "Couldn't create CQ\n");
-		goto clean_mr;
+	{
+		struct ibv_srq_init_attr srq_attr = {
+			.attr = {
+				.max_wr = cfg->rx_depth,
+				.max_sge = 1
+			}
+		};
+	
+		ctx->srq = ibv_create_srq(ctx->pd, &srq_attr);
+		if (!ctx->srq) {
+			fprintf(stderr, "Couldn't create SRQ\n");
+			goto clean_mr;
+		}
 	}
 	
-	{
+	for (idx = 0; idx < ctx->num_qps; idx++) {
+		struct pkt_vm_rdma_queue *q = &ctx->queues[idx];
 		struct ibv_qp_attr attr;
 		struct ibv_qp_init_attr init_attr = {
-			.send_cq = ctx->cq,
-			.recv_cq = ctx->cq,
 			.cap = {
-				.max_send_wr = 1,
-				.max_recv_wr = cfg->rx_depth,
+				.max_send_wr = cfg->rx_depth,
 				.max_send_sge = 1,
 				.max_recv_sge = 1
 			},
 			.qp_type = IBV_QPT_UD,
 		};
-		
-		ctx->qp = ibv_create_qp(ctx->pd, &init_attr);
-		if (!ctx->qp) {
+	
+		/* any queue may complete every shared receive buffer plus its own sends */
+		q->cq = ibv_create_cq(ctx->context, 2 * cfg->rx_depth + 1, NULL, ctx->channel, 0);
+		if (!q->cq) {
+			fprintf(stderr, "Couldn't create CQ\n");
+			goto clean_queues;
+		}
+	
+		init_attr.send_cq = q->cq;
+		init_attr.recv_cq = q->cq;
+		init_attr.srq = ctx->srq;
+		q->qp = ibv_create_qp(ctx->pd, &init_attr);
+		if (!q->qp) {
 			fprintf(stderr, "Couldn't create QP\n");
-			goto clean_cq;
+			goto clean_queues;
 		}
-		
-		ibv_query_qp(ctx->qp, &attr, IBV_QP_CAP, &init_attr);
-		if (init_attr.cap.max_inline_data >= cfg->max_msg_size) {
-			ctx->send_flags |= IBV_SEND_INLINE;
+	
+		if (idx == 0) {
+			ibv_query_qp(q->qp, &attr, IBV_QP_CAP, &init_attr);
+			if (init_attr.cap.max_inline_data >= cfg->max_msg_size) {
+				ctx->send_flags |= IBV_SEND_INLINE;
+			}
 		}
-	}
 	
-	{
-		struct ibv_qp_attr attr = {
-			.qp_state = IBV_QPS_INIT,
-			.pkey_index = 0,
-			.port_num = cfg->ib_port,
-			.qkey = 0x11111111
-		};
-		
-		if (ibv_modify_qp(ctx->qp, &attr,
+		attr.qp_state = IBV_QPS_INIT;
+		attr.pkey_index = 0;
+		attr.port_num = cfg->ib_port;
+		attr.qkey = 0x11111111;
+		if (ibv_modify_qp(q->qp, &attr,
 					IBV_QP_STATE |
 					IBV_QP_PKEY_INDEX |
 					IBV_QP_PORT |
 					IBV_QP_QKEY)) {
 			fprintf(stderr, "Failed to modify QP to INIT\n");
-			goto clean_qp;
+			goto clean_queues;
 		}
 	}
 	
 	return ctx;
-
-clean_qp:
-	ibv_destroy_qp(ctx->qp);
-
-clean_cq:
-	ibv_destroy_cq(ctx->cq);
-
+	
+clean_queues:
+	for (idx = 0; idx < ctx->num_qps; idx++) {
+		if (ctx->queues[idx].qp)
+			ibv_destroy_qp(ctx->queues[idx].qp);
+		if (ctx->queues[idx].cq)
+			ibv_destroy_cq(ctx->queues[idx].cq);
+	}
+	ibv_destroy_srq(ctx->srq);
+	
 clean_mr:
 	ibv_dereg_mr(ctx->mr);
-
+	
 clean_pd:
 	ibv_dealloc_pd(ctx->pd);
-
+	
 clean_comp_channel:
 	if (ctx->channel)
 		ibv_destroy_comp_channel(ctx->channel);
-
+	
 clean_device:
 	ibv_close_device(ctx->context);
-
+	
 clean_buffer:
 	free(ctx->buf);
-
+	
 clean_ctx:
 	free(ctx);
-
+	
 	return NULL;
 }
 
@@ -428,7 +854,12 @@ static int pkt_vm_rdma_get_local_addr(struct pkt_vm_rdma_context *ctx)
 	}
 	
 	ctx->local_addr.lid = ctx->portinfo.lid;
-	ctx->local_addr.qpn = ctx->qp->qp_num;
+	ctx->local_addr.num_qps = ctx->num_qps;
+	for (int idx = 0; idx < ctx->num_qps; idx++) {
+		ctx->local_addr.qpn_list[idx] = ctx->queues[idx].qp->qp_num;
+	}
+	ctx->local_addr.qpn = ctx->local_addr.qpn_list[0];
+	ctx->local_addr.url = ctx->cfg.self_url;
 	ctx->local_addr.psn = lrand48() & 0xffffff;
 	
 	if (cfg->gid_index >= 0) {
@@ -445,31 +876,30 @@ static int pkt_vm_rdma_get_local_addr(struct pkt_vm_rdma_context *ctx)
 	
 }
 
-int pkt_vm_rdma_send(void *info, struct node_url *n, struct transport_message *msg)
+/* the caller holds dst->lock, -1 when the post fails or the queue has no send slot left */
+static int pkt_vm_rdma_post_send(struct pkt_vm_rdma_context *ctx, struct pkt_vm_rdma_queue *q,
+	struct rdma_addr_info *dst, uint32_t hash, uint16_t flags, const void *buf, int size)
 {
-	struct pkt_vm_rdma_context *ctx = info;
-	struct rdma_addr_info *dst = pkt_vm_rdma_find_dest(ctx, n);
+	struct pkt_vm_rdma_header *hdr = NULL;
 	struct ibv_sge list = {0};
 	struct ibv_send_wr wr = {0};
 	struct ibv_send_wr *bad_wr;
 	
-	if (msg->buf_size > ctx->cfg.max_msg_size) {
-		printf("Message is too big to send.\n");
-		return 0;
-	}
-	
-	if (dst == NULL) {
-		dst = pkt_vm_rdma_get_node_info(ctx, n);
-		if (dst == NULL) {
-			perror("Failed to get destination information");
-			return 0;
-		}
+	pthread_mutex_lock(&q->lock);
+	if (__atomic_load_n(&q->send_outstanding, __ATOMIC_RELAXED) >= ctx->rx_depth) {
+		pthread_mutex_unlock(&q->lock);
+		return -1;
 	}
 	
-	memcpy(ctx->send_buf + ctx->send_offset, msg->buf, msg->buf_size);
+	hdr = (struct pkt_vm_rdma_header *)(q->send_buf + q->send_offset);
+	hdr->src = ctx->cfg.self_url;
+	hdr->credits = dst->credits_to_return;
+	hdr->flags = flags | (dst->ctrl_to_return ? PKT_VM_RDMA_F_CTRL_RETURN : 0);
+	hdr->reserved = 0;
+	memcpy(hdr + 1, buf, size);
 	
-	list.addr = (uintptr_t)(ctx->send_buf + ctx->send_offset);
-	list.length = msg->buf_size;
+	list.addr = (uintptr_t)hdr;
+	list.length = sizeof(*hdr) + size;
 	list.lkey = ctx->mr->lkey;
 	
 	wr.wr_id = (uint64_t)list.addr;
@@ -478,67 +908,392 @@ int pkt_vm_rdma_send(void *info, struct node_url *n, struct transport_message *m
 	wr.opcode = IBV_WR_SEND;
 	wr.send_flags = ctx->send_flags;
 	wr.wr.ud.ah = dst->ah;
-	wr.wr.ud.remote_qpn = dst->info.qpn;
+	wr.wr.ud.remote_qpn = dst->info.qpn_list[hash % dst->info.num_qps];
 	wr.wr.ud.remote_qkey = 0x11111111;
 	
-	if (ibv_post_send(ctx->qp, &wr, &bad_wr) == 0) {
-		ctx->send_offset = (ctx->send_offset + ctx->cfg.max_msg_size) % (ctx->cfg.max_msg_size * ctx->cfg.rx_depth);
-		return msg->buf_size;
-	} else {
-		return 0;
+	if (ibv_post_send(q->qp, &wr, &bad_wr) != 0) {
+		pthread_mutex_unlock(&q->lock);
+		return -1;
 	}
+	
+	__atomic_fetch_add(&q->send_outstanding, 1, __ATOMIC_RELAXED);
+	q->send_offset = (q->send_offset + ctx->cfg.max_msg_size) % (ctx->cfg.max_msg_size * ctx->cfg.rx_depth);
+	pthread_mutex_unlock(&q->lock);
+	
+	/* the returned credits travelled with this message, the credit list drops the peer lazily */
+	dst->credits_to_return = 0;
+	dst->ctrl_to_return = 0;
+	if (flags & PKT_VM_RDMA_F_CREDIT_ONLY) {
+		dst->ctrl_credits--;
+	}
+	return 0;
 }
 
-int pkt_vm_rdma_recv(void *info, struct transport_message *msg)
+static struct pkt_vm_rdma_queue *pkt_vm_rdma_get_queue(struct pkt_vm_rdma_context *ctx, uint32_t queue)
+{
+	return &ctx->queues[queue % ctx->num_qps];
+}
+
+/* the caller holds dst->lock, returns whether the send queue is empty */
+static int pkt_vm_rdma_flush_queue(struct pkt_vm_rdma_context *ctx, struct rdma_addr_info *dst)
+{
+	struct pkt_vm_rdma_pending_msg *pending, *tmp;
+	
+	UB_LIST_FOR_EACH_SAFE(pending, tmp, node, &dst->send_queue) {
+		struct pkt_vm_rdma_queue *q = pkt_vm_rdma_get_queue(ctx, pending->queue);
+	
+		if ((dst->credits <= 0) ||
+			(pkt_vm_rdma_post_send(ctx, q, dst, pending->hash, 0, pending->buf, pending->size) != 0)) {
+			return 0;
+		}
+	
+		dst->credits--;
+		dst->queued_msgs--;
+		ub_list_remove(&pending->node);
+		free(pending);
+	}
+	
+	return 1;
+}
+
+/* list_lock is taken before a peer's lock, so callers must not hold one */
+static void pkt_vm_rdma_mark_blocked(struct pkt_vm_rdma_context *ctx, struct rdma_addr_info *dst)
+{
+	pthread_mutex_lock(&ctx->list_lock);
+	if (!dst->in_blocked_list) {
+		ub_list_push_back(&ctx->blocked_list, &dst->blocked_node);
+		dst->in_blocked_list = 1;
+		__atomic_fetch_add(&ctx->blocked_peers, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&ctx->list_lock);
+}
+
+static void pkt_vm_rdma_mark_owing(struct pkt_vm_rdma_context *ctx, struct rdma_addr_info *dst)
+{
+	if (__atomic_load_n(&dst->in_credit_list, __ATOMIC_RELAXED)) {
+		return;
+	}
+	
+	pthread_mutex_lock(&ctx->list_lock);
+	if (!dst->in_credit_list) {
+		ub_list_push_back(&ctx->credit_list, &dst->credit_node);
+		__atomic_store_n(&dst->in_credit_list, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&ctx->owing_peers, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&ctx->list_lock);
+}
+
+/*
+ * The caller holds src->lock. A credit update takes the control slot instead
+ * of a credit, otherwise two idle peers could deadlock. Without the slot the
+ * credits wait for the next message to the peer.
+ */
+static void pkt_vm_rdma_send_credits(struct pkt_vm_rdma_context *ctx, struct pkt_vm_rdma_queue *q,
+	struct rdma_addr_info *src)
+{
+	if ((src->ctrl_credits != 0) && (__atomic_load_n(&src->state, __ATOMIC_ACQUIRE) == PKT_VM_RDMA_DST_READY)) {
+		(void)pkt_vm_rdma_post_send(ctx, q, src, 0, PKT_VM_RDMA_F_CREDIT_ONLY, NULL, 0);
+	}
+}
+
+/* peers that owe nothing any more leave the list */
+static void pkt_vm_rdma_return_credits(struct pkt_vm_rdma_context *ctx, struct pkt_vm_rdma_queue *q)
+{
+	struct rdma_addr_info *dst, *tmp;
+	
+	pthread_mutex_lock(&ctx->list_lock);
+	UB_LIST_FOR_EACH_SAFE(dst, tmp, credit_node, &ctx->credit_list) {
+		pthread_mutex_lock(&dst->lock);
+		if (dst->credits_to_return != 0) {
+			pkt_vm_rdma_send_credits(ctx, q, dst);
+		}
+		if (dst->credits_to_return == 0) {
+			ub_list_remove(&dst->credit_node);
+			__atomic_store_n(&dst->in_credit_list, 0, __ATOMIC_RELAXED);
+			__atomic_fetch_sub(&ctx->owing_peers, 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&dst->lock);
+	}
+	pthread_mutex_unlock(&ctx->list_lock);
+}
+
+/* runs while a sender is short of its share and the pool has buffers, the grants go out like returned credits */
+static void pkt_vm_rdma_top_up(struct pkt_vm_rdma_context *ctx)
+{
+	uint32_t share = pkt_vm_rdma_fair_share(ctx);
+	struct rdma_addr_info *dst;
+	int still_short = 0, owing;
+	
+	__atomic_store_n(&ctx->short_senders, 0, __ATOMIC_RELAXED);
+	pthread_rwlock_rdlock(&ctx->table_lock);
+	for (int idx = 0; idx < PKT_VM_RDMA_DST_HASH_SIZE; idx++) {
+		UB_LIST_FOR_EACH(dst, node, &ctx->dst_addr_hash[idx]) {
+			pthread_mutex_lock(&dst->lock);
+			if (!dst->sender) {
+				pthread_mutex_unlock(&dst->lock);
+				continue;
+			}
+			still_short |= pkt_vm_rdma_grant(ctx, dst, share);
+			owing = (dst->credits_to_return != 0);
+			pthread_mutex_unlock(&dst->lock);
+	
+			if (owing) {
+				pkt_vm_rdma_mark_owing(ctx, dst);
+			}
+		}
+	}
+	pthread_rwlock_unlock(&ctx->table_lock);
+	
+	if (still_short) {
+		__atomic_store_n(&ctx->short_senders, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static unsigned int pkt_vm_rdma_get_max_msg_size(void *info)
 {
 	struct pkt_vm_rdma_context *ctx = info;
-	struct ibv_wc wc;
 	
-	if (ibv_poll_cq(ctx->cq, 1, &wc) <= 0) {
+	return ctx->cfg.max_msg_size - UD_GRH_SIZE - sizeof(struct pkt_vm_rdma_header);
+}
+
+int pkt_vm_rdma_send(void *info, struct node_url *n, struct transport_message *msg)
+{
+	struct pkt_vm_rdma_context *ctx = info;
+	struct pkt_vm_rdma_queue *q = pkt_vm_rdma_get_queue(ctx, msg->queue);
+	struct pkt_vm_rdma_pending_msg *pending = NULL;
+	struct rdma_addr_info *dst = NULL;
+	int ret = 0;
+	
+	if (msg->buf_size > pkt_vm_rdma_get_max_msg_size(ctx)) {
+		vm_log("Message is too big to send.");
 		return 0;
 	}
 	
-	if (wc.status != IBV_WC_SUCCESS) {
-		printf("wc failure status = %d.\n", wc.status);
+	if (pkt_vm_rdma_resolve_dest(ctx, n, &dst) != PKT_VM_PEER_READY) {
+		/* callers are expected to wait on resolve() before sending */
 		return 0;
 	}
 	
-	if (wc.opcode != IBV_WC_RECV) {
-		if (wc.opcode != IBV_WC_SEND) {
-			printf("wc failure opcode = %d.\n", wc.opcode);
-		}
-		
+	pthread_mutex_lock(&dst->lock);
+	if (ub_list_is_empty(&dst->send_queue) && (dst->credits > 0) &&
+		(pkt_vm_rdma_post_send(ctx, q, dst, msg->hash, 0, msg->buf, msg->buf_size) == 0)) {
+		dst->credits--;
+		pthread_mutex_unlock(&dst->lock);
+		return msg->buf_size;
+	}
+	
+	/* a peer that stopped returning credits does not get our memory, the caller retries */
+	if (dst->queued_msgs >= PKT_VM_RDMA_MAX_QUEUED_MSGS) {
+		dst->credit_stalls++;
+		pthread_mutex_unlock(&dst->lock);
+		return 0;
+	}
+	
+	/* the receiver has no buffer left for us, keep the message until it returns credits */
+	pending = malloc(sizeof(*pending) + msg->buf_size);
+	if (pending == NULL) {
+		pthread_mutex_unlock(&dst->lock);
+		vm_log("Failed to queue message.");
 		return 0;
 	}
 	
-	msg->buf = (void *)((char *)wc.wr_id + UD_GRH_SIZE);
-	msg->buf_size = wc.byte_len - UD_GRH_SIZE;
+	pending->queue = msg->queue;
+	pending->hash = msg->hash;
+	pending->size = msg->buf_size;
+	memcpy(pending->buf, msg->buf, msg->buf_size);
+	ub_list_push_back(&dst->send_queue, &pending->node);
+	dst->queued_msgs++;
+	dst->credit_stalls++;
+	ret = msg->buf_size;
+	pthread_mutex_unlock(&dst->lock);
+	
+	pkt_vm_rdma_mark_blocked(ctx, dst);
+	return ret;
+}
+
+static void pkt_vm_rdma_flush_blocked(struct pkt_vm_rdma_context *ctx)
+{
+	struct rdma_addr_info *dst, *tmp;
+	
+	pthread_mutex_lock(&ctx->list_lock);
+	UB_LIST_FOR_EACH_SAFE(dst, tmp, blocked_node, &ctx->blocked_list) {
+		pthread_mutex_lock(&dst->lock);
+		if (pkt_vm_rdma_flush_queue(ctx, dst)) {
+			ub_list_remove(&dst->blocked_node);
+			dst->in_blocked_list = 0;
+			__atomic_fetch_sub(&ctx->blocked_peers, 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&dst->lock);
+	}
+	pthread_mutex_unlock(&ctx->list_lock);
+}
+
+int pkt_vm_rdma_recv(void *info, struct transport_message *msg)
+{
+	struct pkt_vm_rdma_context *ctx = info;
+	struct pkt_vm_rdma_queue *q = pkt_vm_rdma_get_queue(ctx, msg->queue);
+	struct pkt_vm_rdma_header *hdr;
+	struct rdma_addr_info *src;
+	struct ibv_wc wc;
+	
+	while (ibv_poll_cq(q->cq, 1, &wc) > 0) {
+		if (wc.wr_id >= (uint64_t)ctx->send_buf) {
+			__atomic_fetch_sub(&q->send_outstanding, 1, __ATOMIC_RELAXED);
+			if (wc.status != IBV_WC_SUCCESS) {
+				vm_log("send wc failure status = %lu.", (uint64_t)wc.status);
+			}
+			continue;
+		}
+	
+		/* every receive buffer is someone's credit, a failed one goes back to the SRQ */
+		if (wc.status != IBV_WC_SUCCESS) {
+			vm_log("wc failure status = %lu.", (uint64_t)wc.status);
+			pkt_vm_rdma_post_recv(ctx, (void *)wc.wr_id);
+			continue;
+		}
+	
+		if (wc.opcode != IBV_WC_RECV) {
+			vm_log("wc failure opcode = %lu.", (uint64_t)wc.opcode);
+			continue;
+		}
+	
+		/* an unknown sender is resolved now, its credits can only be returned once it is ready */
+		hdr = (struct pkt_vm_rdma_header *)((char *)wc.wr_id + UD_GRH_SIZE);
+		(void)pkt_vm_rdma_resolve_dest(ctx, &hdr->src, &src);
+		if ((src != NULL) && ((hdr->credits != 0) || (hdr->flags != 0))) {
+			pthread_mutex_lock(&src->lock);
+			src->credits += hdr->credits;
+			if (hdr->flags & PKT_VM_RDMA_F_CTRL_RETURN) {
+				src->ctrl_credits = 1;
+			}
+			/* the sender's control slot is reposted below, it gets it back with our next message */
+			if (hdr->flags & PKT_VM_RDMA_F_CREDIT_ONLY) {
+				src->ctrl_to_return = 1;
+			}
+			(void)pkt_vm_rdma_flush_queue(ctx, src);
+			pthread_mutex_unlock(&src->lock);
+		}
+	
+		if (hdr->flags & PKT_VM_RDMA_F_CREDIT_ONLY) {
+			pkt_vm_rdma_post_recv(ctx, (void *)wc.wr_id);
+			continue;
+		}
+	
+		msg->buf = (void *)(hdr + 1);
+		msg->buf_size = wc.byte_len - UD_GRH_SIZE - sizeof(*hdr);
+		return msg->buf_size;
+	}
 	
-	return msg->buf_size;
+	/* idle: push out queued messages and whatever credits are still owed, nothing to lock when there are none */
+	if (__atomic_load_n(&ctx->blocked_peers, __ATOMIC_RELAXED) != 0) {
+		pkt_vm_rdma_flush_blocked(ctx);
+	}
+	if (__atomic_load_n(&ctx->short_senders, __ATOMIC_RELAXED) &&
+		(__atomic_load_n(&ctx->free_credits, __ATOMIC_RELAXED) != 0)) {
+		pkt_vm_rdma_top_up(ctx);
+	}
+	if (__atomic_load_n(&ctx->owing_peers, __ATOMIC_RELAXED) != 0) {
+		pkt_vm_rdma_return_credits(ctx, q);
+	}
+	return 0;
 }
 
 static void pkt_vm_rdma_return_buf(void *info, struct transport_message *msg)
 {
-	pkt_vm_rdma_post_recv(info, msg->buf);
+	struct pkt_vm_rdma_context *ctx = info;
+	struct pkt_vm_rdma_header *hdr = (struct pkt_vm_rdma_header *)msg->buf - 1;
+	struct rdma_addr_info *src;
+	struct node_url url = hdr->src;
+	int owing;
+	
+	pkt_vm_rdma_post_recv(ctx, (char *)hdr - UD_GRH_SIZE);
+	
+	src = pkt_vm_rdma_get_dest(ctx, &url, 0);
+	if (src == NULL) {
+		return;
+	}
+	
+	/* a sender above its share gets the buffer back into the pool instead */
+	pthread_mutex_lock(&src->lock);
+	if (src->sender && (src->granted > pkt_vm_rdma_fair_share(ctx))) {
+		src->granted--;
+		__atomic_fetch_add(&ctx->free_credits, 1, __ATOMIC_RELAXED);
+	} else {
+		src->credits_to_return++;
+	}
+	if (src->credits_to_return >= (src->granted + 1) / 2) {
+		pkt_vm_rdma_send_credits(ctx, pkt_vm_rdma_get_queue(ctx, msg->queue), src);
+	}
+	owing = (src->credits_to_return != 0);
+	pthread_mutex_unlock(&src->lock);
+	
+	if (owing) {
+		pkt_vm_rdma_mark_owing(ctx, src);
+	}
+}
+
+static int pkt_vm_rdma_peer_stats(void *info, struct transport_peer_stats *stats, int max)
+{
+	struct pkt_vm_rdma_context *ctx = info;
+	struct rdma_addr_info *dst;
+	int num = 0;
+	
+	pthread_rwlock_rdlock(&ctx->table_lock);
+	for (int idx = 0; idx < PKT_VM_RDMA_DST_HASH_SIZE; idx++) {
+		UB_LIST_FOR_EACH(dst, node, &ctx->dst_addr_hash[idx]) {
+			if (num >= max) {
+				goto out;
+			}
+	
+			pthread_mutex_lock(&dst->lock);
+			stats[num].url = dst->key;
+			stats[num].credit_stalls = dst->credit_stalls;
+			stats[num].queued_msgs = dst->queued_msgs;
+			stats[num].credits = dst->credits;
+			pthread_mutex_unlock(&dst->lock);
+			num++;
+		}
+	}
+	
+out:
+	pthread_rwlock_unlock(&ctx->table_lock);
+	return num;
 }
 
 static void pkt_vm_rdma_exit(void *info)
 {
 	struct pkt_vm_rdma_context *ctx = info;
+	struct pkt_vm_rdma_pending_msg *pending, *tmp_pending;
 	struct rdma_addr_info *dst, *tmp;
+	int idx;
 	
 	if (ctx->server_thread != (pthread_t)0) {
 		ctx->state.should_stop = 1;
 		pthread_join(ctx->server_thread, NULL);
 	}
 	
-	if (ibv_destroy_qp(ctx->qp)) {
-		fprintf(stderr, "Couldn't destroy OP\n");
-		return;
+	if (ctx->resolver_thread != (pthread_t)0) {
+		pthread_mutex_lock(&ctx->resolve_lock);
+		ctx->state.should_stop = 1;
+		pthread_cond_signal(&ctx->resolve_cond);
+		pthread_mutex_unlock(&ctx->resolve_lock);
+		pthread_join(ctx->resolver_thread, NULL);
+	}
+	
+	for (idx = 0; idx < ctx->num_qps; idx++) {
+		if (ibv_destroy_qp(ctx->queues[idx].qp)) {
+			fprintf(stderr, "Couldn't destroy OP\n");
+			return;
+		}
+	
+		if (ibv_destroy_cq(ctx->queues[idx].cq)) {
+			fprintf(stderr, "Couldn't destroy CQ\n");
+			return;
+		}
 	}
 	
-	if (ibv_destroy_cq(ctx->cq)) {
-		fprintf(stderr, "Couldn't destroy CQ\n");
+	if (ibv_destroy_srq(ctx->srq)) {
+		fprintf(stderr, "Couldn't destroy SRQ\n");
 		return;
 	}
 	
@@ -547,14 +1302,22 @@ static void pkt_vm_rdma_exit(void *info)
 		return;
 	}
 	
-	UB_LIST_FOR_EACH_SAFE(dst, tmp, node, &ctx->dst_addr_list) {
-		ub_list_remove(&dst->node);
-
-		if (ibv_destroy_ah(dst->ah)) {
-			perror("Couldn't destroy AH");
+	for (idx = 0; idx < PKT_VM_RDMA_DST_HASH_SIZE; idx++) {
+		UB_LIST_FOR_EACH_SAFE(dst, tmp, node, &ctx->dst_addr_hash[idx]) {
+			ub_list_remove(&dst->node);
+	
+			if ((dst->ah != NULL) && ibv_destroy_ah(dst->ah)) {
+				perror("Couldn't destroy AH");
+			}
+	
+			UB_LIST_FOR_EACH_SAFE(pending, tmp_pending, node, &dst->send_queue) {
+				ub_list_remove(&pending->node);
+				free(pending);
+			}
+			pthread_mutex_destroy(&dst->lock);
+	
+			free(dst);
 		}
-
-		free(dst);
 	}
 	
 	if (ibv_dealloc_pd(ctx->pd)) {
@@ -592,7 +1355,7 @@ static void *pkt_vm_rdma_init(struct transport_config *cfg)
 	}
 	
 	for (idx = 0; idx < cfg->rdma_cfg.rx_depth; idx++) {
-		ret = pkt_vm_rdma_post_recv(ctx, (ctx->buf + (idx * cfg->rdma_cfg.max_msg_size)));
+		ret = pkt_vm_rdma_post_recv(ctx, ctx->buf + (idx * cfg->rdma_cfg.max_msg_size));
 		if (ret != 0) {
 			perror("Failed to post recv buffer");
 		}
@@ -607,6 +1370,13 @@ static void *pkt_vm_rdma_init(struct transport_config *cfg)
 		return NULL;
 	}
 	
+	ret = pthread_create(&ctx->resolver_thread, NULL, pkt_vm_rdma_resolver_main, ctx);
+	if (ret != 0) {
+		perror("Failed to create resolver thread");
+		pkt_vm_rdma_exit(ctx);
+		return NULL;
+	}
+	
 	pkt_vm_rdma_enable_qp(ctx);
 	return ctx;
 }
@@ -615,9 +1385,12 @@ static struct transport_ops rdma_ops = {
 	.type = PKT_VM_TRANSPORT_TYPE_RDMA,
 	.init = pkt_vm_rdma_init,
 	.exit = pkt_vm_rdma_exit,
+	.resolve = pkt_vm_rdma_resolve,
 	.send = pkt_vm_rdma_send,
 	.recv = pkt_vm_rdma_recv,
 	.return_buf = pkt_vm_rdma_return_buf,
+	.get_max_msg_size = pkt_vm_rdma_get_max_msg_size,
+	.peer_stats = pkt_vm_rdma_peer_stats,
 };
 
 static __attribute__((constructor)) void pkt_vm_rdma_register_transport(void)
@@ -1,29 +1,134 @@
 #ifndef _EBPF_VM_TRANSPORT_RDMA_H_
 #define _EBPF_VM_TRANSPORT_RDMA_H_
 
+#include <pthread.h>
 #include "ebpf_vm_transport.h"
 
-#define EXCH_MSG_PATTERN "0000:000000:000000:00000000000000000000000000000000"
+#define PKT_VM_RDMA_MAX_QPS 16
+#define EXCH_MSG_QP_PATTERN ":000000"
+/* url ip:port of the sender and the credits:control credits the server grants it */
+#define EXCH_MSG_GRANT_PATTERN ":00000000:0000:0000:00"
+/* lid:qpn:psn:gid:num_qps followed by PKT_VM_RDMA_MAX_QPS qp numbers and the grant */
+#define EXCH_MSG_PATTERN "0000:000000:000000:00000000000000000000000000000000:00" \
+	EXCH_MSG_QP_PATTERN EXCH_MSG_QP_PATTERN EXCH_MSG_QP_PATTERN EXCH_MSG_QP_PATTERN \
+	EXCH_MSG_QP_PATTERN EXCH_MSG_QP_PATTERN EXCH_MSG_QP_PATTERN EXCH_MSG_QP_PATTERN \
+	EXCH_MSG_QP_PATTERN EXCH_MSG_QP_PATTERN EXCH_MSG_QP_PATTERN EXCH_MSG_QP_PATTERN \
+	EXCH_MSG_QP_PATTERN EXCH_MSG_QP_PATTERN EXCH_MSG_QP_PATTERN EXCH_MSG_QP_PATTERN \
+	EXCH_MSG_GRANT_PATTERN
 #define GID_STR_SIZE 33
 #define UD_GRH_SIZE 40
+#define PKT_VM_RDMA_DST_HASH_SIZE 1024
+#define PKT_VM_RDMA_RETRY_INTERVAL 1
+/* address exchanges in flight at once, each gets PKT_VM_RDMA_RESOLVE_TIMEOUT_MS */
+#define PKT_VM_RDMA_MAX_RESOLVING 16
+#define PKT_VM_RDMA_RESOLVE_TIMEOUT_MS 1000
+/* how soon newly queued peers are picked up while exchanges are in flight */
+#define PKT_VM_RDMA_RESOLVE_POLL_MS 10
+/* messages kept for a peer without credits, further sends fail until it returns some */
+#define PKT_VM_RDMA_MAX_QUEUED_MSGS 256
 
 enum {
 	PKT_VM_RDMA_RECV_WRID = 1,
 	PKT_VM_RDMA_SEND_WRID = 2
 };
 
+#define PKT_VM_RDMA_F_CREDIT_ONLY 0x1
+/* the receiver may send its next credit only message */
+#define PKT_VM_RDMA_F_CTRL_RETURN 0x2
+
+/*
+ * Every datagram starts with this header. credits returns receive buffers
+ * the sender has reposted for the receiver since its last message, or
+ * grants it new ones.
+ *
+ * Credits come out of the receiver's SRQ. Its rx_depth buffers are a pool
+ * the server hands out in the address exchange: one control slot per sender,
+ * which carries credit only messages, and a fair share of the rest for data.
+ * A sender holding more than its share gets buffers it used back into the
+ * pool instead of as credits, and senders short of their share are topped up
+ * from the pool, so the SRQ is never oversubscribed. The control slot comes
+ * back with PKT_VM_RDMA_F_CTRL_RETURN on the next message to its owner.
+ */
+struct pkt_vm_rdma_header {
+	struct node_url src;
+	uint16_t credits;
+	uint16_t flags;
+	uint32_t reserved;
+};
+
+struct pkt_vm_rdma_pending_msg {
+	struct ub_list node;
+	uint32_t queue;
+	uint32_t hash;
+	int size;
+	uint8_t buf[];
+};
+
 struct rdma_addr_message {
 	int lid;
 	int qpn;
 	int psn;
 	union ibv_gid gid;
+	int num_qps;
+	int qpn_list[PKT_VM_RDMA_MAX_QPS];
+	struct node_url url;
+	int credits;
+	int ctrl_credits;
 };
 
+enum {
+	PKT_VM_RDMA_DST_IDLE,
+	PKT_VM_RDMA_DST_RESOLVING,
+	PKT_VM_RDMA_DST_READY,
+	PKT_VM_RDMA_DST_FAILED
+};
+
+/*
+ * Peers stay in the table until the transport exits. state, info and ah are
+ * published by the resolver, lock covers credits, the send queue and the
+ * counters, and the list flags belong to the context's list_lock.
+ */
 struct rdma_addr_info {
 	struct ub_list node;
+	struct ub_list pending;
 	struct node_url key;
+	int state;
+	time_t retry_time;
 	struct rdma_addr_message info;
 	struct ibv_ah *ah;
+	pthread_mutex_t lock;
+	/* what we may send to the peer */
+	int64_t credits;
+	uint32_t ctrl_credits;
+	/* what the peer may send to us, and what we owe it */
+	uint32_t sender;
+	uint32_t granted;
+	uint32_t ctrl_granted;
+	uint32_t credits_to_return;
+	uint32_t ctrl_to_return;
+	uint32_t in_credit_list;
+	uint32_t in_blocked_list;
+	struct ub_list credit_node;
+	struct ub_list blocked_node;
+	struct ub_list send_queue;
+	uint64_t queued_msgs;
+	uint64_t credit_stalls;
+};
+
+enum {
+	PKT_VM_RDMA_EXCH_CONNECTING,
+	PKT_VM_RDMA_EXCH_SENDING,
+	PKT_VM_RDMA_EXCH_RECEIVING
+};
+
+/* an address exchange of the resolver, offset is how much of msg went out or came in */
+struct pkt_vm_rdma_resolving {
+	struct rdma_addr_info *dst;
+	int fd;
+	int phase;
+	uint32_t offset;
+	uint64_t deadline_ns;
+	char msg[sizeof(EXCH_MSG_PATTERN)];
 };
 
 struct pkt_vm_rdma_state {
@@ -32,25 +137,60 @@ struct pkt_vm_rdma_state {
 	uint32_t unused:30;
 };
 
+/*
+ * One UD QP per executor worker. Receives of all QPs land in the shared SRQ
+ * so that receive buffers are not partitioned between workers; each queue
+ * polls its own CQ and owns a slice of the send ring. lock serializes the
+ * senders of a queue, completions only decrement send_outstanding.
+ */
+struct pkt_vm_rdma_queue {
+	struct ibv_cq *cq;
+	struct ibv_qp *qp;
+	pthread_mutex_t lock;
+	char *send_buf;
+	int send_offset;
+	int send_outstanding;
+};
+
 struct pkt_vm_rdma_context {
 	struct rdma_transport_config cfg;
 	struct ibv_context *context;
 	struct ibv_comp_channel *channel;
 	struct ibv_pd *pd;
 	struct ibv_mr *mr;
-	struct ibv_cq *cq;
-	struct ibv_qp *qp;
+	struct ibv_srq *srq;
+	int num_qps;
+	struct pkt_vm_rdma_queue queues[PKT_VM_RDMA_MAX_QPS];
 	char *buf;
 	int buf_size;
 	char *send_buf;
-	int send_offset;
 	int send_flags;
 	int rx_depth;
+	/* most credits one sender gets */
+	unsigned int peer_credits;
+	/* SRQ buffers not granted to any sender, and the number of senders */
+	uint32_t free_credits;
+	uint32_t num_senders;
+	/* set while a sender holds less than its share */
+	uint32_t short_senders;
+	/* peer table membership, a peer is locked on its own after the lookup */
+	pthread_rwlock_t table_lock;
+	/* credit_list and blocked_list, taken before a peer's lock */
+	pthread_mutex_t list_lock;
+	/* lengths of the two lists, an idle poll reads them without locks */
+	uint32_t owing_peers;
+	uint32_t blocked_peers;
 	pthread_t server_thread;
+	pthread_t resolver_thread;
+	pthread_mutex_t resolve_lock;
+	pthread_cond_t resolve_cond;
+	struct ub_list resolve_list;
 	struct pkt_vm_rdma_state state;
 	struct ibv_port_attr portinfo;
 	struct rdma_addr_message local_addr;
-	struct ub_list dst_addr_list;
+	struct ub_list dst_addr_hash[PKT_VM_RDMA_DST_HASH_SIZE];
+	struct ub_list credit_list;
+	struct ub_list blocked_list;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "ebpf_vm_transport_udp.h"
+#include "ebpf_vm_log.h"
+
+/*
+ * Datagram transport for loopback and plain ethernet setups. There is no
+ * retransmission, a datagram dropped by the network or by a full receive
+ * buffer is lost with the vm it carried.
+ */
+static struct pkt_vm_udp_queue *pkt_vm_udp_get_queue(struct pkt_vm_udp_context *ctx, uint32_t queue)
+{
+	return &ctx->queues[queue % ctx->num_queues];
+}
+
+static int pkt_vm_udp_open_socket(struct pkt_vm_udp_context *ctx)
+{
+	struct sockaddr_in addr = {0};
+	int buf_size = PKT_VM_UDP_SOCKET_BUF_SIZE;
+	int one = 1;
+	int fd;
+	
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		perror("Failed to create udp socket");
+		return -1;
+	}
+	
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+		perror("Failed to set SO_REUSEPORT");
+		close(fd);
+		return -1;
+	}
+	
+	/* best effort, the kernel caps these at rmem_max and wmem_max */
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+	(void)setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+	
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = ctx->cfg.self_url.ip;
+	addr.sin_port = ctx->cfg.self_url.port;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		perror("Failed to bind udp socket");
+		close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+static unsigned int pkt_vm_udp_get_max_msg_size(void *info)
+{
+	struct pkt_vm_udp_context *ctx = info;
+	
+	return ctx->max_msg_size;
+}
+
+/* there is no connection to set up, any address is ready */
+static int pkt_vm_udp_resolve(void *info, struct node_url *n)
+{
+	return ((n->ip == 0) || (n->port == 0)) ? PKT_VM_PEER_FAILED : PKT_VM_PEER_READY;
+}
+
+static int pkt_vm_udp_send(void *info, struct node_url *n, struct transport_message *msg)
+{
+	struct pkt_vm_udp_context *ctx = info;
+	struct pkt_vm_udp_queue *q = pkt_vm_udp_get_queue(ctx, msg->queue);
+	struct sockaddr_in addr = {0};
+	struct pollfd pfd = {.fd = q->fd, .events = POLLOUT};
+	ssize_t ret;
+	
+	if (msg->buf_size > ctx->max_msg_size) {
+		vm_log("Message is too big to send.");
+		return 0;
+	}
+	
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = n->ip;
+	addr.sin_port = n->port;
+	
+	while (1) {
+		ret = sendto(q->fd, msg->buf, msg->buf_size, 0, (struct sockaddr *)&addr, sizeof(addr));
+		if (ret == msg->buf_size) {
+			return msg->buf_size;
+		}
+	
+		/* the send buffer is full, wait for it to drain rather than drop the vm */
+		if ((ret < 0) && ((errno == EAGAIN) || (errno == ENOBUFS)) &&
+			(poll(&pfd, 1, PKT_VM_UDP_SEND_TIMEOUT_MS) > 0)) {
+			continue;
+		}
+	
+		if ((ret < 0) && (errno == EINTR)) {
+			continue;
+		}
+	
+		break;
+	}
+	
+	q->send_failures++;
+	vm_log_errno("Failed to send udp message");
+	return 0;
+}
+
+static int pkt_vm_udp_recv(void *info, struct transport_message *msg)
+{
+	struct pkt_vm_udp_context *ctx = info;
+	struct pkt_vm_udp_queue *q = pkt_vm_udp_get_queue(ctx, msg->queue);
+	ssize_t ret;
+	
+	ret = recv(q->fd, q->buf, ctx->max_msg_size, MSG_DONTWAIT | MSG_TRUNC);
+	if (ret <= 0) {
+		return 0;
+	}
+	
+	if (ret > ctx->max_msg_size) {
+		vm_log("Dropped truncated udp message of %ld bytes.", ret);
+		return 0;
+	}
+	
+	msg->buf = q->buf;
+	msg->buf_size = ret;
+	return ret;
+}
+
+/* the queue buffer is reused by the next recv */
+static void pkt_vm_udp_return_buf(void *info, struct transport_message *msg)
+{
+}
+
+static int pkt_vm_udp_peer_stats(void *info, struct transport_peer_stats *stats, int max)
+{
+	return 0;
+}
+
+static void pkt_vm_udp_exit(void *info)
+{
+	struct pkt_vm_udp_context *ctx = info;
+	
+	for (int idx = 0; idx < ctx->num_queues; idx++) {
+		if (ctx->queues[idx].fd >= 0) {
+			close(ctx->queues[idx].fd);
+		}
+		free(ctx->queues[idx].buf);
+	}
+	
+	free(ctx);
+}
+
+static void *pkt_vm_udp_init(struct transport_config *cfg)
+{
+	struct pkt_vm_udp_context *ctx = NULL;
+	int idx;
+	
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL) {
+		perror("Failed to allocate udp context");
+		return NULL;
+	}
+	
+	ctx->cfg = cfg->udp_cfg;
+	ctx->max_msg_size = cfg->udp_cfg.max_msg_size;
+	if ((ctx->max_msg_size == 0) || (ctx->max_msg_size > PKT_VM_UDP_MAX_MSG_SIZE)) {
+		ctx->max_msg_size = PKT_VM_UDP_MAX_MSG_SIZE;
+	}
+	
+	ctx->num_queues = (cfg->udp_cfg.num_queues == 0) ? 1 : cfg->udp_cfg.num_queues;
+	if (ctx->num_queues > PKT_VM_UDP_MAX_QUEUES) {
+		ctx->num_queues = PKT_VM_UDP_MAX_QUEUES;
+	}
+	
+	for (idx = 0; idx < ctx->num_queues; idx++) {
+		ctx->queues[idx].fd = -1;
+	}
+	
+	for (idx = 0; idx < ctx->num_queues; idx++) {
+		ctx->queues[idx].buf = malloc(ctx->max_msg_size);
+		ctx->queues[idx].fd = pkt_vm_udp_open_socket(ctx);
+		if ((ctx->queues[idx].buf == NULL) || (ctx->queues[idx].fd < 0)) {
+			printf("Failed to create udp queue %d.\n", idx);
+			pkt_vm_udp_exit(ctx);
+			return NULL;
+		}
+	}
+	
+	return ctx;
+}
+
+static struct transport_ops udp_ops = {
+	.type = PKT_VM_TRANSPORT_TYPE_UDP,
+	.init = pkt_vm_udp_init,
+	.exit = pkt_vm_udp_exit,
+	.resolve = pkt_vm_udp_resolve,
+	.send = pkt_vm_udp_send,
+	.recv = pkt_vm_udp_recv,
+	.return_buf = pkt_vm_udp_return_buf,
+	.get_max_msg_size = pkt_vm_udp_get_max_msg_size,
+	.peer_stats = pkt_vm_udp_peer_stats,
+};
+
+static __attribute__((constructor)) void pkt_vm_udp_register_transport(void)
+{
+	register_transport(&udp_ops);
+}
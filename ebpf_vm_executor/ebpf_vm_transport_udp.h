@@ -0,0 +1,30 @@
+#ifndef _EBPF_VM_TRANSPORT_UDP_H_
+#define _EBPF_VM_TRANSPORT_UDP_H_
+
+#include "ebpf_vm_transport.h"
+
+#define PKT_VM_UDP_MAX_QUEUES 16
+/* largest udp payload, less room for the ip and udp headers */
+#define PKT_VM_UDP_MAX_MSG_SIZE 65000
+#define PKT_VM_UDP_SOCKET_BUF_SIZE (16 << 20)
+#define PKT_VM_UDP_SEND_TIMEOUT_MS 100
+
+/*
+ * One socket per executor worker, all bound to the node url with
+ * SO_REUSEPORT. The kernel spreads incoming datagrams over the sockets by
+ * flow, records for another worker are forwarded by the executor.
+ */
+struct pkt_vm_udp_queue {
+	int fd;
+	uint8_t *buf;
+	uint64_t send_failures;
+};
+
+struct pkt_vm_udp_context {
+	struct udp_transport_config cfg;
+	unsigned int max_msg_size;
+	int num_queues;
+	struct pkt_vm_udp_queue queues[PKT_VM_UDP_MAX_QUEUES];
+};
+
+#endif
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ebpf_vm_stats.h"
+
+/*
+ * Samples the statistics page of a running executor, see vm_stats_init().
+ * The page is mapped read only, sampling never touches the executor.
+ */
+#define STAT_DEFAULT_NAME "/ctinspector"
+#define STAT_HEADER_EVERY 20
+
+struct stat_config {
+	const char *name;
+	uint32_t interval_ms;
+	uint32_t count;
+	int per_worker;
+	int raw;
+};
+
+static const char *stat_names[] = {
+	"passes", "vms", "vms_runnable", "vms_waiting", "runs", "insns", "helper_calls", "vms_exited",
+	"migrations_in", "migrations_out", "clones_in", "clones_out", "forks_in", "forks_out",
+	"msgs_sent", "bytes_sent", "send_failures", "msgs_recv", "bytes_recv", "recv_drops",
+	"records_forwarded", "monitor_wakeups",
+};
+
+_Static_assert(sizeof(stat_names) / sizeof(stat_names[0]) == sizeof(struct vm_worker_stats) / sizeof(uint64_t),
+	"stat_names is out of date");
+
+static const struct vm_stats_page *map_stats(const char *name)
+{
+	const struct vm_stats_page *page = NULL;
+	struct stat st;
+	int fd;
+	
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		perror("Failed to open stats shared memory");
+		return NULL;
+	}
+	
+	if ((fstat(fd, &st) != 0) || (st.st_size < sizeof(*page))) {
+		printf("Stats shared memory %s is too small.\n", name);
+		close(fd);
+		return NULL;
+	}
+	
+	page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED) {
+		perror("Failed to map stats shared memory");
+		return NULL;
+	}
+	
+	if ((__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != VM_STATS_MAGIC) || (page->version != VM_STATS_VERSION) ||
+		(page->num_workers > VM_STATS_MAX_WORKERS)) {
+		printf("%s is not a ctinspector stats page.\n", name);
+		munmap((void *)page, sizeof(*page));
+		return NULL;
+	}
+	
+	return page;
+}
+
+static void sample(const struct vm_stats_page *page, struct vm_worker_stats *workers, struct vm_worker_stats *sum)
+{
+	memset(sum, 0, sizeof(*sum));
+	for (uint32_t idx = 0; idx < page->num_workers; idx++) {
+		(void)vm_stats_read(page, idx, &workers[idx]);
+		vm_stats_add(sum, &workers[idx]);
+	}
+}
+
+static void print_raw(const char *prefix, const struct vm_worker_stats *stats)
+{
+	const uint64_t *val = (const uint64_t *)stats;
+	
+	printf("%s", prefix);
+	for (uint32_t idx = 0; idx < sizeof(stat_names) / sizeof(stat_names[0]); idx++) {
+		printf(" %s=%lu", stat_names[idx], val[idx]);
+	}
+	printf("\n");
+}
+
+static void print_header(void)
+{
+	printf("%-6s %6s %5s %5s %10s %10s %8s %8s %8s %8s %8s %8s %9s %9s %6s %8s\n",
+		"worker", "vms", "run", "wait", "minsns/s", "helpers/s", "mig_in", "mig_out", "clone_in", "clone_out",
+		"msgs_tx", "msgs_rx", "MB_tx/s", "MB_rx/s", "drops", "wakeups");
+}
+
+/* counters are per second over the interval, vms, run and wait are gauges */
+static void print_rates(const char *worker, const struct vm_worker_stats *cur, const struct vm_worker_stats *prev, double secs)
+{
+	printf("%-6s %6lu %5lu %5lu %10.2f %10.0f %8.0f %8.0f %8.0f %8.0f %8.0f %8.0f %9.2f %9.2f %6lu %8.0f\n",
+		worker, cur->vms, cur->vms_runnable, cur->vms_waiting,
+		(cur->insns - prev->insns) / secs / 1e6,
+		(cur->helper_calls - prev->helper_calls) / secs,
+		(cur->migrations_in - prev->migrations_in) / secs,
+		(cur->migrations_out - prev->migrations_out) / secs,
+		(cur->clones_in - prev->clones_in) / secs,
+		(cur->clones_out - prev->clones_out) / secs,
+		(cur->msgs_sent - prev->msgs_sent) / secs,
+		(cur->msgs_recv - prev->msgs_recv) / secs,
+		(cur->bytes_sent - prev->bytes_sent) / secs / 1e6,
+		(cur->bytes_recv - prev->bytes_recv) / secs / 1e6,
+		cur->recv_drops - prev->recv_drops,
+		(cur->monitor_wakeups - prev->monitor_wakeups) / secs);
+}
+
+static int parse_stat_config(struct stat_config *cfg, int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{.name = "name", .has_arg = 1, .val = 'n'},
+		{.name = "interval", .has_arg = 1, .val = 'i'},
+		{.name = "count", .has_arg = 1, .val = 'c'},
+		{.name = "workers", .has_arg = 0, .val = 'w'},
+		{.name = "raw", .has_arg = 0, .val = 'o'},
+		{}
+	};
+	
+	while (1) {
+		int c = getopt_long(argc, argv, "n:i:c:wo", long_options, NULL);
+		if (c == -1)
+			break;
+	
+		switch (c) {
+		case 'n':
+			cfg->name = optarg;
+			break;
+		case 'i':
+			cfg->interval_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			cfg->count = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			cfg->per_worker = 1;
+			break;
+		case 'o':
+			cfg->raw = 1;
+			break;
+		default:
+			return -1;
+		}
+	}
+	
+	return (cfg->interval_ms == 0) ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct stat_config cfg = {.name = STAT_DEFAULT_NAME, .interval_ms = 1000, .count = 0};
+	struct vm_worker_stats cur[VM_STATS_MAX_WORKERS], prev[VM_STATS_MAX_WORKERS];
+	struct vm_worker_stats cur_sum, prev_sum;
+	struct timespec interval, last, now;
+	const struct vm_stats_page *page = NULL;
+	char worker[sizeof("worker=4294967295")];
+	
+	if (parse_stat_config(&cfg, argc, argv) != 0) {
+		printf("usage: %s [-n /shm_name] [-i interval_ms] [-c count] [-w] [-o]\n", argv[0]);
+		return 1;
+	}
+	
+	page = map_stats(cfg.name);
+	if (page == NULL) {
+		return 1;
+	}
+	
+	if (cfg.raw) {
+		sample(page, cur, &cur_sum);
+		for (uint32_t idx = 0; cfg.per_worker && (idx < page->num_workers); idx++) {
+			snprintf(worker, sizeof(worker), "worker=%u", idx);
+			print_raw(worker, &cur[idx]);
+		}
+		print_raw("worker=all", &cur_sum);
+		return 0;
+	}
+	
+	printf("node %s pid %u workers %u\n", page->node, page->pid, page->num_workers);
+	interval.tv_sec = cfg.interval_ms / 1000;
+	interval.tv_nsec = (cfg.interval_ms % 1000) * 1000000L;
+	sample(page, prev, &prev_sum);
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	
+	for (uint32_t round = 0; (cfg.count == 0) || (round < cfg.count); round++) {
+		double secs;
+	
+		nanosleep(&interval, NULL);
+		/* the page outlives an executor that was killed, stop with the process */
+		if ((kill(page->pid, 0) != 0) && (errno == ESRCH)) {
+			printf("executor %u is gone\n", page->pid);
+			break;
+		}
+	
+		sample(page, cur, &cur_sum);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		secs = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+	
+		if ((round % STAT_HEADER_EVERY) == 0) {
+			print_header();
+		}
+	
+		for (uint32_t idx = 0; cfg.per_worker && (idx < page->num_workers); idx++) {
+			snprintf(worker, sizeof(worker), "%u", idx);
+			print_rates(worker, &cur[idx], &prev[idx], secs);
+		}
+		print_rates("all", &cur_sum, &prev_sum, secs);
+		fflush(stdout);
+	
+		memcpy(prev, cur, sizeof(prev));
+		prev_sum = cur_sum;
+		last = now;
+	}
+	
+	return 0;
+}
@@ -35,9 +35,18 @@ static void usage(void)
 	printf("  -s, --size=<size>                 size of message to exchange (default 2048)\n");
 	printf("  -r, --rx-depth=<dep>              number of receives to post at a time (default 500)\n");
 	printf("  -g, --gid-idx=<gid index>         local port gid index\n");
+	printf("  -C, --peer-credits=<credits>      receive buffers granted to each peer (default rx-depth / 2)\n");
 	printf("  -f, --ebpf-program=<vm file>      path to ebpf program\n");
 	printf("  -t, --test-case=<test case index> test case index\n");
 	printf("  -c, --client                      act as client\n");
+	printf("  -F, --clone-fanout=<fanout>       forward clones through a tree of the given fan-out\n");
+	printf("  -B, --batch-timeout=<usec>        hold outgoing batches up to <usec> (default: flush every pass)\n");
+	printf("  -w, --workers=<num>               number of executor worker threads, one QP each (default 1)\n");
+	printf("  -S, --stats=</name>               publish statistics in shared memory for ctinspector-stat\n");
+	printf("  -T, --trace=<file>                write a Chrome trace of the vm lifecycles on exit\n");
+	printf("  -L, --latency                     record latency histograms and print them on exit\n");
+	printf("  -M, --perf-map                    name the eBPF functions in /tmp/perf-<pid>.map\n");
+	printf("  -J, --jitdump                     also write /tmp/jit-<pid>.dump for perf inject --jit\n");
 }
 
 static int parse_config(struct vm_test_config *test_cfg,
@@ -54,12 +63,21 @@ static int parse_config(struct vm_test_config *test_cfg,
 		{.name = "msg-size",     .has_arg = 1, .val = 's'},
 		{.name = "rx-depth",     .has_arg = 1, .val = 'r'},
 		{.name = "gid-idx",      .has_arg = 1, .val = 'g'},
+		{.name = "peer-credits", .has_arg = 1, .val = 'C'},
 		{.name = "client",       .has_arg = 0, .val = 'c'},
+		{.name = "clone-fanout", .has_arg = 1, .val = 'F'},
+		{.name = "batch-timeout", .has_arg = 1, .val = 'B'},
+		{.name = "workers",      .has_arg = 1, .val = 'w'},
+		{.name = "stats",        .has_arg = 1, .val = 'S'},
+		{.name = "trace",        .has_arg = 1, .val = 'T'},
+		{.name = "latency",      .has_arg = 0, .val = 'L'},
+		{.name = "perf-map",     .has_arg = 0, .val = 'M'},
+		{.name = "jitdump",      .has_arg = 0, .val = 'J'},
 	};
 	struct rdma_transport_config *rdma_cfg = &executor_cfg->transport.rdma_cfg;
 	
 	while (1) {
-		int c = getopt_long(argc, argv, "f:t:a:p:d:i:s:r:g:c", long_options, NULL);
+		int c = getopt_long(argc, argv, "f:t:a:p:d:i:s:r:g:C:cF:B:w:S:T:LMJ", long_options, NULL);
 		if (c == -1)
 			break;
 		
@@ -109,9 +127,45 @@ static int parse_config(struct vm_test_config *test_cfg,
 			rdma_cfg->gid_index = strtoul(optarg, NULL, 0);
 			break;
 			
+		case 'C':
+			rdma_cfg->peer_credits = strtoul(optarg, NULL, 0);
+			break;
+			
 		case 'c':
 			test_cfg->act_as_client = 1;
 			break;
+			
+		case 'F':
+			executor_cfg->clone_fanout = strtoul(optarg, NULL, 0);
+			break;
+			
+		case 'B':
+			executor_cfg->batch_timeout_us = strtoul(optarg, NULL, 0);
+			break;
+			
+		case 'w':
+			executor_cfg->num_workers = strtoul(optarg, NULL, 0);
+			break;
+			
+		case 'S':
+			executor_cfg->stats_name = strdup(optarg);
+			break;
+			
+		case 'T':
+			executor_cfg->trace_name = strdup(optarg);
+			break;
+			
+		case 'L':
+			executor_cfg->latency_hist = 1;
+			break;
+			
+		case 'M':
+			executor_cfg->perf_map |= VM_PERF_MAP;
+			break;
+			
+		case 'J':
+			executor_cfg->perf_map |= VM_PERF_MAP | VM_PERF_JITDUMP;
+			break;
 		}
 	}
 	
@@ -121,7 +175,7 @@ static int parse_config(struct vm_test_config *test_cfg,
 
 static void say_hello_to(struct ebpf_vm_executor *executor, char *ip, uint16_t port)
 {
-	struct transport_message send_msg;
+	struct transport_message send_msg = {0};
 	struct node_url dst = {0};
 	char msg[64];
 	int ret;
@@ -151,7 +205,7 @@ static void test_transport(struct ebpf_vm_executor *executor, int act_as_client)
 	}
 	
 	while (recv_msg_num < expected_msg_num) {
-		struct transport_message recv_msg;
+		struct transport_message recv_msg = {0};
 		int msg_len = executor->transport->recv(executor->transport_ctx, &recv_msg);
 		if (msg_len != 0) {
 			recv_msg_num++;
@@ -205,6 +259,9 @@ int main(int argc, char **argv)
 	//test_transport(executor, test_cfg.act_as_client);
 
 	tests[test_cfg.test_case]->teardown(test_ctx);
+	if (cfg.latency_hist) {
+		vm_executor_latency_report(executor, stdout);
+	}
 	vm_executor_destroy(executor);
 	return 0;
 }
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <sys/mman.h>
+
+#include "ebpf_vm_simulator.h"
+
+/*
+ * Contention benchmark for the atomic instructions: every thread runs its own
+ * vm, and all of them hammer counters on one page mapped into each vm.
+ */
+#define BENCH_MAX_THREADS 64
+#define BENCH_PAGE_SIZE 4096
+#define BENCH_LINE_SIZE 64
+#define BENCH_PAGE_VA (1ULL << INDEX_SHIFT)
+
+#define ATOMIC_DW(IMM) EBPF_RAW_INSN(EBPF_CLS_STX | EBPF_ATOMIC | EBPF_DW, EBPF_REG_ARG1, EBPF_REG_ARG3, 0, (IMM))
+
+enum {
+	BENCH_CHECK_NONE,
+	BENCH_CHECK_SUM,
+	BENCH_CHECK_MAX
+};
+
+struct bench_op {
+	const char *name;
+	const struct ebpf_instruction *code;
+	uint32_t code_size;
+	/* how the final counter value is checked */
+	int check;
+};
+
+/* r1: counter, r2: iterations */
+#define SIMPLE_OP(IMM) { \
+	EBPF_RAW_INSN(EBPF_CLS_ALU64 | EBPF_ALU_OP_MOV | EBPF_SRC_IS_IMM, EBPF_REG_ARG3, 0, 0, 1), \
+	ATOMIC_DW(IMM), \
+	EBPF_RAW_INSN(EBPF_CLS_ALU64 | EBPF_ALU_OP_SUB | EBPF_SRC_IS_IMM, EBPF_REG_ARG2, 0, 0, 1), \
+	EBPF_RAW_INSN(EBPF_CLS_JMP | EBPF_JMP_OP_JNE | EBPF_SRC_IS_IMM, EBPF_REG_ARG2, 0, -4, 0), \
+	EBPF_RAW_INSN(EBPF_CLS_ALU64 | EBPF_ALU_OP_MOV | EBPF_SRC_IS_IMM, EBPF_REG_RETURN_RESULT, 0, 0, 0), \
+	EBPF_RAW_INSN(EBPF_CLS_JMP | EBPF_JMP_OP_EXIT, 0, 0, 0, 0) \
+}
+
+static const struct ebpf_instruction code_add[] = SIMPLE_OP(EBPF_ALU_OP_ADD);
+static const struct ebpf_instruction code_fetch_add[] = SIMPLE_OP(EBPF_ALU_OP_ADD | EBPF_ATOMIC_FETCH);
+static const struct ebpf_instruction code_or[] = SIMPLE_OP(EBPF_ALU_OP_OR);
+static const struct ebpf_instruction code_xchg[] = SIMPLE_OP(EBPF_ATOMIC_XCHG);
+
+/* increment with a compare and exchange loop */
+static const struct ebpf_instruction code_cmpxchg[] = {
+	EBPF_RAW_INSN(EBPF_CLS_LDX | EBPF_MEM | EBPF_DW, EBPF_REG_RETURN_RESULT, EBPF_REG_ARG1, 0, 0),
+	EBPF_RAW_INSN(EBPF_CLS_ALU64 | EBPF_ALU_OP_MOV | EBPF_SRC_IS_REG, EBPF_REG_ARG3, EBPF_REG_RETURN_RESULT, 0, 0),
+	EBPF_RAW_INSN(EBPF_CLS_ALU64 | EBPF_ALU_OP_ADD | EBPF_SRC_IS_IMM, EBPF_REG_ARG3, 0, 0, 1),
+	EBPF_RAW_INSN(EBPF_CLS_ALU64 | EBPF_ALU_OP_MOV | EBPF_SRC_IS_REG, EBPF_REG_ARG4, EBPF_REG_RETURN_RESULT, 0, 0),
+	ATOMIC_DW(EBPF_ATOMIC_CMPXCHG),
+	EBPF_RAW_INSN(EBPF_CLS_JMP | EBPF_JMP_OP_JNE | EBPF_SRC_IS_REG, EBPF_REG_RETURN_RESULT, EBPF_REG_ARG4, -5, 0),
+	EBPF_RAW_INSN(EBPF_CLS_ALU64 | EBPF_ALU_OP_SUB | EBPF_SRC_IS_IMM, EBPF_REG_ARG2, 0, 0, 1),
+	EBPF_RAW_INSN(EBPF_CLS_JMP | EBPF_JMP_OP_JNE | EBPF_SRC_IS_IMM, EBPF_REG_ARG2, 0, -8, 0),
+	EBPF_RAW_INSN(EBPF_CLS_ALU64 | EBPF_ALU_OP_MOV | EBPF_SRC_IS_IMM, EBPF_REG_RETURN_RESULT, 0, 0, 0),
+	EBPF_RAW_INSN(EBPF_CLS_JMP | EBPF_JMP_OP_EXIT, 0, 0, 0, 0)
+};
+
+/* max tracker: publish 1..iterations, skipping the exchange when the counter is already larger */
+static const struct ebpf_instruction code_max[] = {
+	EBPF_RAW_INSN(EBPF_CLS_ALU64 | EBPF_ALU_OP_MOV | EBPF_SRC_IS_IMM, EBPF_REG_6, 0, 0, 0),
+	EBPF_RAW_INSN(EBPF_CLS_ALU64 | EBPF_ALU_OP_ADD | EBPF_SRC_IS_IMM, EBPF_REG_6, 0, 0, 1),
+	EBPF_RAW_INSN(EBPF_CLS_LDX | EBPF_MEM | EBPF_DW, EBPF_REG_RETURN_RESULT, EBPF_REG_ARG1, 0, 0),
+	EBPF_RAW_INSN(EBPF_CLS_JMP | EBPF_JMP_OP_JGE | EBPF_SRC_IS_REG, EBPF_REG_RETURN_RESULT, EBPF_REG_6, 3, 0),
+	EBPF_RAW_INSN(EBPF_CLS_ALU64 | EBPF_ALU_OP_MOV | EBPF_SRC_IS_REG, EBPF_REG_ARG4, EBPF_REG_RETURN_RESULT, 0, 0),
+	EBPF_RAW_INSN(EBPF_CLS_STX | EBPF_ATOMIC | EBPF_DW, EBPF_REG_ARG1, EBPF_REG_6, 0, EBPF_ATOMIC_CMPXCHG),
+	EBPF_RAW_INSN(EBPF_CLS_JMP | EBPF_JMP_OP_JNE | EBPF_SRC_IS_REG, EBPF_REG_RETURN_RESULT, EBPF_REG_ARG4, -4, 0),
+	EBPF_RAW_INSN(EBPF_CLS_ALU64 | EBPF_ALU_OP_SUB | EBPF_SRC_IS_IMM, EBPF_REG_ARG2, 0, 0, 1),
+	EBPF_RAW_INSN(EBPF_CLS_JMP | EBPF_JMP_OP_JNE | EBPF_SRC_IS_IMM, EBPF_REG_ARG2, 0, -8, 0),
+	EBPF_RAW_INSN(EBPF_CLS_ALU64 | EBPF_ALU_OP_MOV | EBPF_SRC_IS_IMM, EBPF_REG_RETURN_RESULT, 0, 0, 0),
+	EBPF_RAW_INSN(EBPF_CLS_JMP | EBPF_JMP_OP_EXIT, 0, 0, 0, 0)
+};
+
+static const struct bench_op bench_ops[] = {
+	{"add", code_add, sizeof(code_add), BENCH_CHECK_SUM},
+	{"fetch_add", code_fetch_add, sizeof(code_fetch_add), BENCH_CHECK_SUM},
+	{"or", code_or, sizeof(code_or), BENCH_CHECK_NONE},
+	{"xchg", code_xchg, sizeof(code_xchg), BENCH_CHECK_NONE},
+	{"cmpxchg", code_cmpxchg, sizeof(code_cmpxchg), BENCH_CHECK_SUM},
+	{"max", code_max, sizeof(code_max), BENCH_CHECK_MAX},
+};
+
+struct bench_config {
+	uint32_t threads;
+	uint64_t iterations;
+	int private_lines;
+	const char *op;
+};
+
+struct bench_thread {
+	pthread_t thread;
+	struct ebpf_vm *vm;
+	pthread_barrier_t *barrier;
+	uint64_t elapsed_ns;
+};
+
+static void *bench_thread_run(void *arg)
+{
+	struct bench_thread *bt = arg;
+	uint64_t start;
+	
+	pthread_barrier_wait(bt->barrier);
+	start = vm_now_ns();
+	run_ebpf_vm(bt->vm);
+	bt->elapsed_ns = vm_now_ns() - start;
+	return NULL;
+}
+
+static int parse_bench_config(struct bench_config *cfg, int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{.name = "threads", .has_arg = 1, .val = 't'},
+		{.name = "iterations", .has_arg = 1, .val = 'n'},
+		{.name = "op", .has_arg = 1, .val = 'o'},
+		{.name = "private", .has_arg = 0, .val = 'p'},
+		{}
+	};
+	
+	while (1) {
+		int c = getopt_long(argc, argv, "t:n:o:p", long_options, NULL);
+		if (c == -1)
+			break;
+	
+		switch (c) {
+		case 't':
+			cfg->threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			cfg->iterations = strtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			cfg->op = optarg;
+			break;
+		case 'p':
+			cfg->private_lines = 1;
+			break;
+		default:
+			return -1;
+		}
+	}
+	
+	if ((cfg->threads == 0) || (cfg->threads > BENCH_MAX_THREADS) || (cfg->iterations == 0) ||
+		(cfg->private_lines && (cfg->threads * BENCH_LINE_SIZE > BENCH_PAGE_SIZE))) {
+		return -1;
+	}
+	
+	return 0;
+}
+
+static int run_op(struct bench_config *cfg, const struct bench_op *op, uint64_t *page)
+{
+	struct bench_thread threads[BENCH_MAX_THREADS] = {0};
+	struct ebpf_vm *vms[BENCH_MAX_THREADS];
+	struct ebpf_vm_program *prog = NULL;
+	pthread_barrier_t barrier;
+	uint64_t max_ns = 0, expected, got = 0;
+	int ok = 1;
+	
+	prog = create_program((const uint8_t *)op->code, op->code_size, 0);
+	if ((prog == NULL) || (vm_instantiate(prog, cfg->threads, vms, NULL) != cfg->threads)) {
+		printf("Failed to create vms for %s.\n", op->name);
+		return -1;
+	}
+	
+	memset(page, 0, BENCH_PAGE_SIZE);
+	pthread_barrier_init(&barrier, NULL, cfg->threads);
+	for (uint32_t idx = 0; idx < cfg->threads; idx++) {
+		struct ebpf_vm *vm = vms[idx];
+		uint64_t line = cfg->private_lines ? idx * BENCH_LINE_SIZE : 0;
+	
+		vm->page_table[0].entries[1].va = (uint64_t)page;
+		vm->page_table[0].entries[1].size = BENCH_PAGE_SIZE;
+		vm->reg[EBPF_REG_ARG1] = BENCH_PAGE_VA + line;
+		vm->reg[EBPF_REG_ARG2] = cfg->iterations;
+		threads[idx].vm = vm;
+		threads[idx].barrier = &barrier;
+		pthread_create(&threads[idx].thread, NULL, bench_thread_run, &threads[idx]);
+	}
+	
+	for (uint32_t idx = 0; idx < cfg->threads; idx++) {
+		pthread_join(threads[idx].thread, NULL);
+		max_ns = (threads[idx].elapsed_ns > max_ns) ? threads[idx].elapsed_ns : max_ns;
+		destroy_vm(vms[idx]);
+	}
+	pthread_barrier_destroy(&barrier);
+	destroy_program(prog);
+	
+	for (uint32_t idx = 0; idx < (cfg->private_lines ? cfg->threads : 1); idx++) {
+		uint64_t value = page[idx * BENCH_LINE_SIZE / sizeof(uint64_t)];
+	
+		got = (op->check == BENCH_CHECK_MAX) ? ((value > got) ? value : got) : got + value;
+	}
+	
+	expected = (op->check == BENCH_CHECK_MAX) ? cfg->iterations : cfg->iterations * cfg->threads;
+	if ((op->check != BENCH_CHECK_NONE) && (got != expected)) {
+		ok = 0;
+	}
+	
+	/* one line per op, key=value pairs for scripts */
+	printf("op=%s threads=%u iterations=%lu lines=%s elapsed_ns=%lu ns_per_op=%.2f mops=%.2f check=%s\n",
+		op->name, cfg->threads, cfg->iterations, cfg->private_lines ? "private" : "shared", max_ns,
+		(double)max_ns / cfg->iterations, (double)cfg->iterations * cfg->threads * 1000.0 / max_ns,
+		(op->check == BENCH_CHECK_NONE) ? "skipped" : (ok ? "ok" : "failed"));
+	return ok ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_config cfg = {.threads = 4, .iterations = 1000000, .private_lines = 0, .op = NULL};
+	uint64_t *page = NULL;
+	int ret = 0;
+	
+	if (parse_bench_config(&cfg, argc, argv) != 0) {
+		printf("usage: %s [-t threads] [-n iterations] [-o add|fetch_add|or|xchg|cmpxchg|max] [-p]\n", argv[0]);
+		return 1;
+	}
+	
+	page = mmap(NULL, BENCH_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED) {
+		perror("Failed to map shared page");
+		return 1;
+	}
+	
+	for (uint32_t idx = 0; idx < sizeof(bench_ops) / sizeof(bench_ops[0]); idx++) {
+		if ((cfg.op == NULL) || (strcmp(cfg.op, bench_ops[idx].name) == 0)) {
+			ret |= run_op(&cfg, &bench_ops[idx], page);
+		}
+	}
+	
+	munmap(page, BENCH_PAGE_SIZE);
+	return (ret == 0) ? 0 : 1;
+}
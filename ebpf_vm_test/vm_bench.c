@@ -0,0 +1,418 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+
+#include "ebpf_vm_simulator.h"
+
+/*
+ * Interpreter micro-benchmarks. Programs run straight through run_ebpf_vm,
+ * no executor and no transport. Every workload is a loop over r1 iterations
+ * with a fixed instruction count per iteration, so the executed instruction
+ * count is known without instrumenting the interpreter.
+ */
+#define BENCH_MAX_VMS 64
+#define BENCH_CREATE_BATCH 64
+
+#define ALU64_IMM(OP, DST, IMM) EBPF_RAW_INSN(EBPF_CLS_ALU64 | (OP) | EBPF_SRC_IS_IMM, (DST), 0, 0, (IMM))
+#define ALU64_REG(OP, DST, SRC) EBPF_RAW_INSN(EBPF_CLS_ALU64 | (OP) | EBPF_SRC_IS_REG, (DST), (SRC), 0, 0)
+#define JMP_IMM(OP, DST, IMM, OFF) EBPF_RAW_INSN(EBPF_CLS_JMP | (OP) | EBPF_SRC_IS_IMM, (DST), 0, (OFF), (IMM))
+#define JA(OFF) EBPF_RAW_INSN(EBPF_CLS_JMP | EBPF_JMP_OP_JA, 0, 0, (OFF), 0)
+#define LDX(SIZE, DST, SRC, OFF) EBPF_RAW_INSN(EBPF_CLS_LDX | EBPF_MEM | (SIZE), (DST), (SRC), (OFF), 0)
+#define STX(SIZE, DST, SRC, OFF) EBPF_RAW_INSN(EBPF_CLS_STX | EBPF_MEM | (SIZE), (DST), (SRC), (OFF), 0)
+#define CALL(SRC, IMM) EBPF_RAW_INSN(EBPF_CLS_JMP | EBPF_JMP_OP_CALL, 0, (SRC), 0, (IMM))
+#define EXIT() EBPF_RAW_INSN(EBPF_CLS_JMP | EBPF_JMP_OP_EXIT, 0, 0, 0, 0)
+
+struct bench_workload {
+	const char *name;
+	const struct ebpf_instruction *code;
+	uint32_t code_size;
+	/* executed instructions: per_iter * iterations + fixed */
+	uint32_t per_iter;
+	uint32_t fixed;
+	/* names for profiles, NULL leaves every pc unknown */
+	const struct vm_func_symbol *funcs;
+	uint32_t num_funcs;
+};
+
+/* dependent 64 bit alu chain */
+static const struct ebpf_instruction code_alu[] = {
+	ALU64_IMM(EBPF_ALU_OP_MOV, EBPF_REG_RETURN_RESULT, 0),
+	ALU64_IMM(EBPF_ALU_OP_MOV, EBPF_REG_ARG3, 0x1234567),
+	ALU64_REG(EBPF_ALU_OP_ADD, EBPF_REG_RETURN_RESULT, EBPF_REG_ARG1),
+	ALU64_REG(EBPF_ALU_OP_XOR, EBPF_REG_RETURN_RESULT, EBPF_REG_ARG3),
+	ALU64_IMM(EBPF_ALU_OP_MUL, EBPF_REG_RETURN_RESULT, 3),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_ARG4, EBPF_REG_RETURN_RESULT),
+	ALU64_IMM(EBPF_ALU_OP_RSH, EBPF_REG_ARG4, 7),
+	ALU64_REG(EBPF_ALU_OP_XOR, EBPF_REG_RETURN_RESULT, EBPF_REG_ARG4),
+	ALU64_REG(EBPF_ALU_OP_ADD, EBPF_REG_ARG3, EBPF_REG_RETURN_RESULT),
+	ALU64_IMM(EBPF_ALU_OP_LSH, EBPF_REG_ARG3, 1),
+	ALU64_IMM(EBPF_ALU_OP_SUB, EBPF_REG_ARG1, 1),
+	JMP_IMM(EBPF_JMP_OP_JNE, EBPF_REG_ARG1, 0, -10),
+	EXIT()
+};
+
+/* two pseudo random branches per iteration, both arms of equal length */
+static const struct ebpf_instruction code_branch[] = {
+	ALU64_IMM(EBPF_ALU_OP_MOV, EBPF_REG_RETURN_RESULT, 0),
+	ALU64_IMM(EBPF_ALU_OP_MOV, EBPF_REG_ARG5, 1),
+	ALU64_IMM(EBPF_ALU_OP_MUL, EBPF_REG_ARG5, 1103515245),
+	ALU64_IMM(EBPF_ALU_OP_ADD, EBPF_REG_ARG5, 12345),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_ARG3, EBPF_REG_ARG5),
+	ALU64_IMM(EBPF_ALU_OP_RSH, EBPF_REG_ARG3, 16),
+	ALU64_IMM(EBPF_ALU_OP_AND, EBPF_REG_ARG3, 1),
+	JMP_IMM(EBPF_JMP_OP_JEQ, EBPF_REG_ARG3, 0, 2),
+	ALU64_IMM(EBPF_ALU_OP_ADD, EBPF_REG_RETURN_RESULT, 1),
+	JA(2),
+	ALU64_IMM(EBPF_ALU_OP_ADD, EBPF_REG_RETURN_RESULT, 3),
+	ALU64_IMM(EBPF_ALU_OP_XOR, EBPF_REG_RETURN_RESULT, 1),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_ARG4, EBPF_REG_ARG5),
+	ALU64_IMM(EBPF_ALU_OP_RSH, EBPF_REG_ARG4, 20),
+	ALU64_IMM(EBPF_ALU_OP_AND, EBPF_REG_ARG4, 3),
+	JMP_IMM(EBPF_JMP_OP_JGT, EBPF_REG_ARG4, 1, 2),
+	ALU64_IMM(EBPF_ALU_OP_SUB, EBPF_REG_RETURN_RESULT, 1),
+	JA(2),
+	ALU64_IMM(EBPF_ALU_OP_ADD, EBPF_REG_RETURN_RESULT, 2),
+	ALU64_IMM(EBPF_ALU_OP_XOR, EBPF_REG_RETURN_RESULT, 2),
+	ALU64_IMM(EBPF_ALU_OP_SUB, EBPF_REG_ARG1, 1),
+	JMP_IMM(EBPF_JMP_OP_JNE, EBPF_REG_ARG1, 0, -20),
+	EXIT()
+};
+
+/* loads and stores of every size on the stack */
+static const struct ebpf_instruction code_memory[] = {
+	ALU64_IMM(EBPF_ALU_OP_MOV, EBPF_REG_RETURN_RESULT, 0),
+	ALU64_IMM(EBPF_ALU_OP_MOV, EBPF_REG_ARG3, 0),
+	STX(EBPF_DW, EBPF_REG_FP, EBPF_REG_ARG3, -8),
+	STX(EBPF_DW, EBPF_REG_FP, EBPF_REG_ARG3, -16),
+	STX(EBPF_W, EBPF_REG_FP, EBPF_REG_ARG3, -20),
+	LDX(EBPF_DW, EBPF_REG_ARG3, EBPF_REG_FP, -8),
+	ALU64_REG(EBPF_ALU_OP_ADD, EBPF_REG_ARG3, EBPF_REG_ARG1),
+	STX(EBPF_DW, EBPF_REG_FP, EBPF_REG_ARG3, -8),
+	LDX(EBPF_DW, EBPF_REG_ARG4, EBPF_REG_FP, -16),
+	ALU64_REG(EBPF_ALU_OP_XOR, EBPF_REG_ARG4, EBPF_REG_ARG3),
+	STX(EBPF_DW, EBPF_REG_FP, EBPF_REG_ARG4, -16),
+	LDX(EBPF_W, EBPF_REG_ARG5, EBPF_REG_FP, -20),
+	ALU64_IMM(EBPF_ALU_OP_ADD, EBPF_REG_ARG5, 1),
+	STX(EBPF_W, EBPF_REG_FP, EBPF_REG_ARG5, -20),
+	STX(EBPF_B, EBPF_REG_FP, EBPF_REG_ARG5, -24),
+	LDX(EBPF_B, EBPF_REG_RETURN_RESULT, EBPF_REG_FP, -24),
+	ALU64_IMM(EBPF_ALU_OP_SUB, EBPF_REG_ARG1, 1),
+	JMP_IMM(EBPF_JMP_OP_JNE, EBPF_REG_ARG1, 0, -13),
+	LDX(EBPF_DW, EBPF_REG_RETURN_RESULT, EBPF_REG_FP, -16),
+	EXIT()
+};
+
+/* a bpf to bpf call per iteration */
+static const struct ebpf_instruction code_call[] = {
+	ALU64_IMM(EBPF_ALU_OP_MOV, EBPF_REG_7, 0),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_6, EBPF_REG_ARG1),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_ARG1, EBPF_REG_6),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_ARG2, EBPF_REG_7),
+	CALL(EBPF_PSEUDO_CALL, 5),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_7, EBPF_REG_RETURN_RESULT),
+	ALU64_IMM(EBPF_ALU_OP_SUB, EBPF_REG_6, 1),
+	JMP_IMM(EBPF_JMP_OP_JNE, EBPF_REG_6, 0, -6),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_RETURN_RESULT, EBPF_REG_7),
+	EXIT(),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_RETURN_RESULT, EBPF_REG_ARG1),
+	ALU64_REG(EBPF_ALU_OP_XOR, EBPF_REG_RETURN_RESULT, EBPF_REG_ARG2),
+	ALU64_IMM(EBPF_ALU_OP_ADD, EBPF_REG_RETURN_RESULT, 1),
+	EXIT()
+};
+
+static const struct vm_func_symbol funcs_call[] = {
+	{"bench_loop", 0, 10},
+	{"bench_callee", 10, 4},
+};
+
+/* a host helper call per iteration, the call immediate is patched at startup */
+#define HELPER_CALL_PC 4
+static struct ebpf_instruction code_helper[] = {
+	ALU64_IMM(EBPF_ALU_OP_MOV, EBPF_REG_7, 0),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_6, EBPF_REG_ARG1),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_ARG1, EBPF_REG_6),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_ARG2, EBPF_REG_7),
+	CALL(0, 0),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_7, EBPF_REG_RETURN_RESULT),
+	ALU64_IMM(EBPF_ALU_OP_SUB, EBPF_REG_6, 1),
+	JMP_IMM(EBPF_JMP_OP_JNE, EBPF_REG_6, 0, -6),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_RETURN_RESULT, EBPF_REG_7),
+	EXIT()
+};
+
+static const struct bench_workload bench_workloads[] = {
+	{"alu", code_alu, sizeof(code_alu), 10, 3},
+	{"branch", code_branch, sizeof(code_branch), 16, 3},
+	{"memory", code_memory, sizeof(code_memory), 13, 7},
+	{"call", code_call, sizeof(code_call), 10, 4, funcs_call, 2},
+	{"helper", code_helper, sizeof(code_helper), 6, 4},
+};
+
+struct bench_config {
+	uint64_t iterations;
+	uint32_t repeat;
+	uint32_t creates;
+	const char *workload;
+	const char *elf_file;
+	const char *profile;
+};
+
+static uint64_t bench_helper(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4, uint64_t r5, struct ebpf_vm *vm)
+{
+	return (r1 ^ r2) + 1;
+}
+
+static int register_bench_helper(void)
+{
+	struct ebpf_symbol helper = {"bench_helper", bench_helper, 2, {EBPF_ARG_SCALAR, EBPF_ARG_SCALAR}};
+	int idx = ebpf_helper_register(NULL, PKT_VM_INVALID_FUNC_IDX, &helper);
+	
+	if (idx < 0) {
+		return -1;
+	}
+	
+	code_helper[HELPER_CALL_PC].immediate = idx;
+	return 0;
+}
+
+static int parse_bench_config(struct bench_config *cfg, int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{.name = "iterations", .has_arg = 1, .val = 'n'},
+		{.name = "repeat", .has_arg = 1, .val = 'r'},
+		{.name = "creates", .has_arg = 1, .val = 'c'},
+		{.name = "workload", .has_arg = 1, .val = 'w'},
+		{.name = "file", .has_arg = 1, .val = 'f'},
+		{.name = "profile", .has_arg = 1, .val = 'P'},
+		{}
+	};
+	
+	while (1) {
+		int c = getopt_long(argc, argv, "n:r:c:w:f:P:", long_options, NULL);
+		if (c == -1)
+			break;
+	
+		switch (c) {
+		case 'n':
+			cfg->iterations = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			cfg->repeat = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			cfg->creates = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			cfg->workload = optarg;
+			break;
+		case 'f':
+			cfg->elf_file = optarg;
+			break;
+		case 'P':
+			cfg->profile = optarg;
+			break;
+		default:
+			return -1;
+		}
+	}
+	
+	if ((cfg->iterations == 0) || (cfg->repeat == 0) || (cfg->repeat > BENCH_MAX_VMS)) {
+		return -1;
+	}
+	
+	return 0;
+}
+
+static void prepare_vm(struct ebpf_vm *vm, uint64_t arg)
+{
+	vm->rd.symbols = ebpf_global_helpers()->symbols;
+	vm->reg[EBPF_REG_ARG1] = arg;
+	update_vm_state(vm, VM_STATE_RUNNING);
+}
+
+/* <prefix>.<name>.flat and <prefix>.<name>.folded, needs a build with EBPF_VM_PROFILE */
+static void write_profile(struct bench_config *cfg, const char *name, struct ebpf_vm_program *prog)
+{
+	char path[256];
+	FILE *flat = NULL;
+	FILE *folded = NULL;
+	
+	if (cfg->profile == NULL) {
+		return;
+	}
+	
+	snprintf(path, sizeof(path), "%s.%s.flat", cfg->profile, name);
+	flat = fopen(path, "w");
+	snprintf(path, sizeof(path), "%s.%s.folded", cfg->profile, name);
+	folded = fopen(path, "w");
+	if ((flat == NULL) || (folded == NULL)) {
+		printf("Failed to open profile files %s.%s.*\n", cfg->profile, name);
+	} else {
+		(void)vm_profile_write(prog->code_seg, flat, folded);
+	}
+	
+	if (flat != NULL) {
+		fclose(flat);
+	}
+	if (folded != NULL) {
+		fclose(folded);
+	}
+}
+
+/* every repeat runs a fresh vm, the best and the mean run are reported */
+static int run_workload(struct bench_config *cfg, const struct bench_workload *wl)
+{
+	struct ebpf_vm *vms[BENCH_MAX_VMS];
+	struct ebpf_vm_program *prog = NULL;
+	uint64_t best_ns = UINT64_MAX, total_ns = 0, result = 0, insns;
+	int ok = 1;
+	
+	prog = create_program((const uint8_t *)wl->code, wl->code_size, 0);
+	if (prog == NULL) {
+		return -1;
+	}
+	if (vm_instantiate(prog, cfg->repeat, vms, NULL) != cfg->repeat) {
+		printf("Failed to create vms for %s.\n", wl->name);
+		destroy_program(prog);
+		return -1;
+	}
+	
+	if ((cfg->profile != NULL) && (wl->funcs != NULL)) {
+		(void)vm_code_set_symbols(prog->code_seg, wl->funcs, wl->num_funcs);
+	}
+	
+	for (uint32_t idx = 0; idx < cfg->repeat; idx++) {
+		uint64_t start, elapsed, ret;
+	
+		prepare_vm(vms[idx], cfg->iterations);
+		start = vm_now_ns();
+		ret = run_ebpf_vm(vms[idx]);
+		elapsed = vm_now_ns() - start;
+	
+		/* every run computes the same value */
+		if ((idx != 0) && (ret != result)) {
+			ok = 0;
+		}
+		result = ret;
+		best_ns = (elapsed < best_ns) ? elapsed : best_ns;
+		total_ns += elapsed;
+		destroy_vm(vms[idx]);
+	}
+	write_profile(cfg, wl->name, prog);
+	destroy_program(prog);
+	
+	insns = wl->per_iter * cfg->iterations + wl->fixed;
+	/* one line per workload, key=value pairs for scripts */
+	printf("workload=%s iterations=%lu insns=%lu repeat=%u best_ns=%lu mean_ns=%lu ns_per_insn=%.3f minsns_per_sec=%.1f result=%lx check=%s\n",
+		wl->name, cfg->iterations, insns, cfg->repeat, best_ns, total_ns / cfg->repeat,
+		(double)best_ns / insns, (double)insns * 1000.0 / best_ns, result, ok ? "ok" : "failed");
+	return ok ? 0 : -1;
+}
+
+/* an ebpf_example object, its instruction count is unknown so only whole runs are timed */
+static int run_elf(struct bench_config *cfg)
+{
+	struct ebpf_vm *vms[BENCH_MAX_VMS];
+	struct ebpf_vm_program *prog = NULL;
+	uint64_t best_ns = UINT64_MAX, total_ns = 0;
+	
+	prog = create_program_from_elf(cfg->elf_file);
+	if (prog == NULL) {
+		return -1;
+	}
+	if (vm_instantiate(prog, cfg->repeat, vms, NULL) != cfg->repeat) {
+		printf("Failed to create vms for %s.\n", cfg->elf_file);
+		destroy_program(prog);
+		return -1;
+	}
+	
+	for (uint32_t idx = 0; idx < cfg->repeat; idx++) {
+		uint64_t start, elapsed;
+	
+		prepare_vm(vms[idx], cfg->iterations);
+		start = vm_now_ns();
+		run_ebpf_vm(vms[idx]);
+		elapsed = vm_now_ns() - start;
+		best_ns = (elapsed < best_ns) ? elapsed : best_ns;
+		total_ns += elapsed;
+		destroy_vm(vms[idx]);
+	}
+	write_profile(cfg, "elf", prog);
+	destroy_program(prog);
+	
+	printf("workload=elf file=%s arg=%lu repeat=%u best_ns=%lu mean_ns=%lu\n",
+		cfg->elf_file, cfg->iterations, cfg->repeat, best_ns, total_ns / cfg->repeat);
+	return 0;
+}
+
+/* vm_instantiate and destroy_vm cost, one vm per call and in batches */
+static int run_create(struct bench_config *cfg, uint32_t batch)
+{
+	struct ebpf_vm *vms[BENCH_CREATE_BATCH];
+	struct ebpf_vm_program *prog = NULL;
+	uint64_t create_ns = 0, destroy_ns = 0, start;
+	uint32_t done = 0;
+	
+	prog = create_program((const uint8_t *)code_alu, sizeof(code_alu), 0);
+	if (prog == NULL) {
+		return -1;
+	}
+	
+	while (done < cfg->creates) {
+		start = vm_now_ns();
+		if (vm_instantiate(prog, batch, vms, NULL) != batch) {
+			printf("Failed to create vms.\n");
+			destroy_program(prog);
+			return -1;
+		}
+		create_ns += vm_now_ns() - start;
+	
+		start = vm_now_ns();
+		for (uint32_t idx = 0; idx < batch; idx++) {
+			destroy_vm(vms[idx]);
+		}
+		destroy_ns += vm_now_ns() - start;
+		done += batch;
+	}
+	destroy_program(prog);
+	
+	printf("workload=create batch=%u vms=%u create_ns_per_vm=%.1f destroy_ns_per_vm=%.1f creates_per_sec=%.0f destroys_per_sec=%.0f\n",
+		batch, done, (double)create_ns / done, (double)destroy_ns / done,
+		(double)done * 1e9 / create_ns, (double)done * 1e9 / destroy_ns);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_config cfg = {.iterations = 10000000, .repeat = 5, .creates = 100000, .workload = NULL, .elf_file = NULL};
+	int ret = 0;
+	
+	if (parse_bench_config(&cfg, argc, argv) != 0) {
+		printf("usage: %s [-n iterations] [-r repeat] [-c creates] [-w alu|branch|memory|call|helper|create] [-f elf_file] [-P profile_prefix]\n", argv[0]);
+		return 1;
+	}
+	
+	if (cfg.elf_file != NULL) {
+		return (run_elf(&cfg) == 0) ? 0 : 1;
+	}
+	
+	if (register_bench_helper() != 0) {
+		return 1;
+	}
+	
+	for (uint32_t idx = 0; idx < sizeof(bench_workloads) / sizeof(bench_workloads[0]); idx++) {
+		if ((cfg.workload == NULL) || (strcmp(cfg.workload, bench_workloads[idx].name) == 0)) {
+			ret |= run_workload(&cfg, &bench_workloads[idx]);
+		}
+	}
+	
+	if ((cfg.creates != 0) && ((cfg.workload == NULL) || (strcmp(cfg.workload, "create") == 0))) {
+		ret |= run_create(&cfg, 1);
+		ret |= run_create(&cfg, BENCH_CREATE_BATCH);
+	}
+	
+	return (ret == 0) ? 0 : 1;
+}
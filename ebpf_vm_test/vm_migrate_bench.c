@@ -0,0 +1,500 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#define PKT_VM_EXECUTOR 1
+#include "ebpf_vm_simulator.h"
+#include "ebpf_vm_functions.h"
+
+/*
+ * End to end migration benchmark. All executors run in this process on
+ * 127.0.0.1 over the udp transport. Vms migrate around the ring of nodes,
+ * timing every hop with a host helper; the clock is shared since every node
+ * is in the same process.
+ */
+#define BENCH_MAX_NODES 16
+#define BENCH_MAX_SIZES 16
+#define BENCH_STALL_NS 3000000000ULL
+
+/* explicit indexes, every node has to agree on them */
+#define BENCH_HELPER_NOW 200
+#define BENCH_HELPER_RECORD 201
+#define BENCH_HELPER_DONE 202
+
+#define ALU64_IMM(OP, DST, IMM) EBPF_RAW_INSN(EBPF_CLS_ALU64 | (OP) | EBPF_SRC_IS_IMM, (DST), 0, 0, (IMM))
+#define ALU64_REG(OP, DST, SRC) EBPF_RAW_INSN(EBPF_CLS_ALU64 | (OP) | EBPF_SRC_IS_REG, (DST), (SRC), 0, 0)
+#define JMP_IMM(OP, DST, IMM, OFF) EBPF_RAW_INSN(EBPF_CLS_JMP | (OP) | EBPF_SRC_IS_IMM, (DST), 0, (OFF), (IMM))
+#define CALL(IMM) EBPF_RAW_INSN(EBPF_CLS_JMP | EBPF_JMP_OP_CALL, 0, 0, 0, (IMM))
+#define EXIT() EBPF_RAW_INSN(EBPF_CLS_JMP | EBPF_JMP_OP_EXIT, 0, 0, 0, 0)
+
+/* the ring of node addresses starts at data offset 0 */
+#define RING_ENTRY_SIZE ((int32_t)sizeof(struct ub_address))
+#define RING_END_PC 11
+
+/* r1: hops, r6: hops left, r7: offset of the next node, r8: send time */
+static struct ebpf_instruction code_ring[] = {
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_6, EBPF_REG_ARG1),
+	ALU64_IMM(EBPF_ALU_OP_MOV, EBPF_REG_7, RING_ENTRY_SIZE),
+	CALL(BENCH_HELPER_NOW),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_8, EBPF_REG_RETURN_RESULT),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_ARG1, EBPF_REG_7),
+	CALL(EBPF_FUNC_migrate_to),
+	CALL(BENCH_HELPER_NOW),
+	ALU64_REG(EBPF_ALU_OP_SUB, EBPF_REG_RETURN_RESULT, EBPF_REG_8),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_ARG1, EBPF_REG_RETURN_RESULT),
+	CALL(BENCH_HELPER_RECORD),
+	ALU64_IMM(EBPF_ALU_OP_ADD, EBPF_REG_7, RING_ENTRY_SIZE),
+	/* the immediate is patched with the ring size */
+	JMP_IMM(EBPF_JMP_OP_JNE, EBPF_REG_7, 0, 1),
+	ALU64_IMM(EBPF_ALU_OP_MOV, EBPF_REG_7, 0),
+	ALU64_IMM(EBPF_ALU_OP_SUB, EBPF_REG_6, 1),
+	JMP_IMM(EBPF_JMP_OP_JNE, EBPF_REG_6, 0, -13),
+	CALL(BENCH_HELPER_DONE),
+	ALU64_IMM(EBPF_ALU_OP_MOV, EBPF_REG_RETURN_RESULT, 0),
+	EXIT()
+};
+
+/* r1: number of clones, the clone targets start at data offset 0 */
+static const struct ebpf_instruction code_clone[] = {
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_7, EBPF_REG_ARG1),
+	CALL(BENCH_HELPER_NOW),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_6, EBPF_REG_RETURN_RESULT),
+	ALU64_IMM(EBPF_ALU_OP_MOV, EBPF_REG_ARG1, 0),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_ARG2, EBPF_REG_7),
+	CALL(EBPF_FUNC_clone_to),
+	/* the original gets the clone count back, the clones their index */
+	EBPF_RAW_INSN(EBPF_CLS_JMP | EBPF_JMP_OP_JEQ | EBPF_SRC_IS_REG, EBPF_REG_RETURN_RESULT, EBPF_REG_7, 4, 0),
+	CALL(BENCH_HELPER_NOW),
+	ALU64_REG(EBPF_ALU_OP_SUB, EBPF_REG_RETURN_RESULT, EBPF_REG_6),
+	ALU64_REG(EBPF_ALU_OP_MOV, EBPF_REG_ARG1, EBPF_REG_RETURN_RESULT),
+	CALL(BENCH_HELPER_RECORD),
+	CALL(BENCH_HELPER_DONE),
+	ALU64_IMM(EBPF_ALU_OP_MOV, EBPF_REG_RETURN_RESULT, 0),
+	EXIT()
+};
+
+struct bench_config {
+	uint32_t nodes;
+	uint32_t workers;
+	uint32_t hops;
+	uint32_t concurrency;
+	uint32_t clones;
+	uint32_t clone_rounds;
+	uint32_t clone_fanout;
+	uint16_t base_port;
+	uint32_t num_sizes;
+	uint32_t sizes[BENCH_MAX_SIZES];
+};
+
+struct bench_node {
+	struct ebpf_vm_executor *executor;
+	pthread_t thread;
+};
+
+/* filled by the helpers on the worker threads */
+static uint64_t *bench_samples;
+static uint64_t bench_num_samples;
+static uint64_t bench_max_samples;
+static uint64_t bench_done;
+
+static uint64_t bench_func_now(ARG_NOT_USED_5, struct ebpf_vm *vm)
+{
+	return vm_now_ns();
+}
+
+static uint64_t bench_func_record(uint64_t ns, ARG_NOT_USED_4, struct ebpf_vm *vm)
+{
+	uint64_t idx = __atomic_fetch_add(&bench_num_samples, 1, __ATOMIC_RELAXED);
+	
+	if (idx < bench_max_samples) {
+		bench_samples[idx] = ns;
+	}
+	return 0;
+}
+
+static uint64_t bench_func_done(ARG_NOT_USED_5, struct ebpf_vm *vm)
+{
+	__atomic_add_fetch(&bench_done, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int register_bench_helpers(void)
+{
+	struct ebpf_symbol helpers[] = {
+		{"bench_now", bench_func_now},
+		{"bench_record", bench_func_record, 1, {EBPF_ARG_SCALAR}},
+		{"bench_done", bench_func_done},
+	};
+	
+	for (uint32_t idx = 0; idx < sizeof(helpers) / sizeof(helpers[0]); idx++) {
+		if (ebpf_helper_register(NULL, BENCH_HELPER_NOW + idx, &helpers[idx]) < 0) {
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+static void node_address(struct bench_config *cfg, uint32_t node, struct ub_address *addr)
+{
+	struct node_url url = {htonl(INADDR_LOOPBACK), htons(cfg->base_port + node), 0};
+	
+	memset(addr, 0, sizeof(*addr));
+	memcpy(addr->url, &url, sizeof(url));
+}
+
+static void *node_run(void *arg)
+{
+	vm_executor_run(arg);
+	return NULL;
+}
+
+static int start_nodes(struct bench_config *cfg, struct bench_node *nodes)
+{
+	for (uint32_t idx = 0; idx < cfg->nodes; idx++) {
+		struct ebpf_vm_executor_config ecfg = {0};
+	
+		ecfg.transport.transport_type = PKT_VM_TRANSPORT_TYPE_UDP;
+		ecfg.transport.udp_cfg.self_url.ip = htonl(INADDR_LOOPBACK);
+		ecfg.transport.udp_cfg.self_url.port = htons(cfg->base_port + idx);
+		ecfg.num_workers = cfg->workers;
+		ecfg.clone_fanout = cfg->clone_fanout;
+		nodes[idx].executor = vm_executor_init(&ecfg);
+		if (nodes[idx].executor == NULL) {
+			printf("Failed to start node %u.\n", idx);
+			while (idx-- > 0) {
+				vm_executor_destroy(nodes[idx].executor);
+			}
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+static void run_nodes(struct bench_config *cfg, struct bench_node *nodes)
+{
+	for (uint32_t idx = 0; idx < cfg->nodes; idx++) {
+		pthread_create(&nodes[idx].thread, NULL, node_run, nodes[idx].executor);
+	}
+}
+
+static void stop_nodes(struct bench_config *cfg, struct bench_node *nodes)
+{
+	for (uint32_t idx = 0; idx < cfg->nodes; idx++) {
+		vm_executor_stop(nodes[idx].executor);
+	}
+	
+	for (uint32_t idx = 0; idx < cfg->nodes; idx++) {
+		pthread_join(nodes[idx].thread, NULL);
+		vm_executor_destroy(nodes[idx].executor);
+	}
+}
+
+/* waits until expected vms called bench_done, gives up when progress stalls */
+static int wait_done(uint64_t expected)
+{
+	uint64_t last = 0, last_change = vm_now_ns();
+	
+	while (1) {
+		uint64_t done = __atomic_load_n(&bench_done, __ATOMIC_ACQUIRE);
+		uint64_t samples = __atomic_load_n(&bench_num_samples, __ATOMIC_RELAXED);
+	
+		if (done >= expected) {
+			return 0;
+		}
+	
+		if (done + samples != last) {
+			last = done + samples;
+			last_change = vm_now_ns();
+		} else if (vm_now_ns() - last_change > BENCH_STALL_NS) {
+			return -1;
+		}
+		usleep(100);
+	}
+}
+
+static void reset_samples(uint64_t max)
+{
+	bench_num_samples = 0;
+	bench_max_samples = max;
+	bench_done = 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	
+	return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t *sorted, uint64_t num, double p)
+{
+	uint64_t idx = (uint64_t)(p * (num - 1) + 0.5);
+	
+	return (num == 0) ? 0 : sorted[idx];
+}
+
+static void print_latency(uint64_t *samples, uint64_t num)
+{
+	uint64_t sum = 0;
+	
+	qsort(samples, num, sizeof(*samples), cmp_u64);
+	for (uint64_t idx = 0; idx < num; idx++) {
+		sum += samples[idx];
+	}
+	
+	printf(" samples=%lu mean_ns=%lu p50_ns=%lu p90_ns=%lu p99_ns=%lu p999_ns=%lu max_ns=%lu",
+		num, (num == 0) ? 0 : sum / num, percentile(samples, num, 0.5), percentile(samples, num, 0.9),
+		percentile(samples, num, 0.99), percentile(samples, num, 0.999), (num == 0) ? 0 : samples[num - 1]);
+}
+
+static int run_ring(struct bench_config *cfg, uint32_t data_size)
+{
+	struct bench_node nodes[BENCH_MAX_NODES];
+	struct ebpf_vm *vms[cfg->concurrency];
+	struct ebpf_vm_program *prog = NULL;
+	uint32_t ring_size = cfg->nodes * RING_ENTRY_SIZE;
+	uint64_t total = (uint64_t)cfg->hops * cfg->concurrency, start, elapsed, num;
+	uint32_t image_size;
+	int ret = 0;
+	
+	code_ring[RING_END_PC].immediate = ring_size;
+	prog = create_program((const uint8_t *)code_ring, sizeof(code_ring), 0);
+	if (prog == NULL) {
+		return -1;
+	}
+	if ((program_set_data_size(prog, (data_size > ring_size) ? data_size : ring_size) != 0) ||
+		(vm_instantiate(prog, cfg->concurrency, vms, NULL) != cfg->concurrency)) {
+		printf("Failed to create vms of %u bytes.\n", data_size);
+		destroy_program(prog);
+		return -1;
+	}
+	destroy_program(prog);
+	
+	if (start_nodes(cfg, nodes) != 0) {
+		for (uint32_t idx = 0; idx < cfg->concurrency; idx++) {
+			destroy_vm(vms[idx]);
+		}
+		return -1;
+	}
+	
+	image_size = ebpf_vm_image_size(vms[0]);
+	reset_samples(total);
+	for (uint32_t idx = 0; idx < cfg->concurrency; idx++) {
+		struct ub_address *ring = (struct ub_address *)((uint8_t *)vms[idx] + vms[idx]->data);
+	
+		for (uint32_t node = 0; node < cfg->nodes; node++) {
+			node_address(cfg, node, &ring[node]);
+		}
+		vms[idx]->reg[EBPF_REG_ARG1] = cfg->hops;
+		add_vm(nodes[0].executor, vms[idx]);
+	}
+	
+	start = vm_now_ns();
+	run_nodes(cfg, nodes);
+	if (wait_done(cfg->concurrency) != 0) {
+		printf("Vms stalled, some were lost on the way.\n");
+		ret = -1;
+	}
+	elapsed = vm_now_ns() - start;
+	stop_nodes(cfg, nodes);
+	
+	num = (bench_num_samples < total) ? bench_num_samples : total;
+	printf("test=ring nodes=%u workers=%u data_size=%u image_size=%u vms=%u hops=%lu elapsed_ns=%lu hops_per_sec=%.0f",
+		cfg->nodes, cfg->workers, data_size, image_size, cfg->concurrency, num, elapsed, (double)num * 1e9 / elapsed);
+	print_latency(bench_samples, num);
+	printf(" check=%s\n", (ret == 0) ? "ok" : "failed");
+	return ret;
+}
+
+/* every round clones one vm from node 0 to the clones spread over the other nodes */
+static int run_clone(struct bench_config *cfg)
+{
+	struct bench_node nodes[BENCH_MAX_NODES];
+	struct ebpf_vm_program *prog = NULL;
+	uint64_t *fanout_ns = calloc(cfg->clone_rounds, sizeof(uint64_t));
+	uint64_t *first_ns = calloc(cfg->clone_rounds, sizeof(uint64_t));
+	uint32_t rounds = 0;
+	int ret = 0;
+	
+	prog = create_program((const uint8_t *)code_clone, sizeof(code_clone), 0);
+	if ((fanout_ns == NULL) || (first_ns == NULL) || (prog == NULL) ||
+		(program_set_data_size(prog, cfg->clones * RING_ENTRY_SIZE) != 0)) {
+		printf("Failed to create the clone program.\n");
+		ret = -1;
+		goto out;
+	}
+	
+	for (rounds = 0; rounds < cfg->clone_rounds; rounds++) {
+		struct ebpf_vm *vm = NULL;
+		struct ub_address *targets;
+	
+		if (vm_instantiate(prog, 1, &vm, NULL) != 1) {
+			ret = -1;
+			break;
+		}
+		if (start_nodes(cfg, nodes) != 0) {
+			destroy_vm(vm);
+			ret = -1;
+			break;
+		}
+	
+		targets = (struct ub_address *)((uint8_t *)vm + vm->data);
+		for (uint32_t idx = 0; idx < cfg->clones; idx++) {
+			node_address(cfg, 1 + idx % (cfg->nodes - 1), &targets[idx]);
+		}
+		vm->reg[EBPF_REG_ARG1] = cfg->clones;
+		reset_samples(cfg->clones);
+		add_vm(nodes[0].executor, vm);
+	
+		run_nodes(cfg, nodes);
+		if (wait_done(cfg->clones + 1) != 0) {
+			printf("Clones stalled, some were lost on the way.\n");
+			ret = -1;
+		}
+		stop_nodes(cfg, nodes);
+		if (ret != 0) {
+			break;
+		}
+	
+		qsort(bench_samples, cfg->clones, sizeof(uint64_t), cmp_u64);
+		first_ns[rounds] = bench_samples[0];
+		fanout_ns[rounds] = bench_samples[cfg->clones - 1];
+	}
+	
+	printf("test=clone nodes=%u workers=%u clones=%u fanout=%u rounds=%u", cfg->nodes, cfg->workers,
+		cfg->clones, cfg->clone_fanout, rounds);
+	if (rounds != 0) {
+		qsort(fanout_ns, rounds, sizeof(uint64_t), cmp_u64);
+		qsort(first_ns, rounds, sizeof(uint64_t), cmp_u64);
+		printf(" first_p50_ns=%lu all_p50_ns=%lu all_p99_ns=%lu all_max_ns=%lu", percentile(first_ns, rounds, 0.5),
+			percentile(fanout_ns, rounds, 0.5), percentile(fanout_ns, rounds, 0.99), fanout_ns[rounds - 1]);
+	}
+	printf(" check=%s\n", (ret == 0) ? "ok" : "failed");
+	
+out:
+	if (prog != NULL) {
+		destroy_program(prog);
+	}
+	free(fanout_ns);
+	free(first_ns);
+	return ret;
+}
+
+static int parse_sizes(struct bench_config *cfg, char *list)
+{
+	char *save = NULL;
+	
+	cfg->num_sizes = 0;
+	for (char *tok = strtok_r(list, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		if (cfg->num_sizes >= BENCH_MAX_SIZES) {
+			return -1;
+		}
+		cfg->sizes[cfg->num_sizes++] = strtoul(tok, NULL, 0);
+	}
+	
+	return 0;
+}
+
+static int parse_bench_config(struct bench_config *cfg, int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{.name = "nodes", .has_arg = 1, .val = 'n'},
+		{.name = "workers", .has_arg = 1, .val = 'w'},
+		{.name = "hops", .has_arg = 1, .val = 'h'},
+		{.name = "concurrency", .has_arg = 1, .val = 'c'},
+		{.name = "sizes", .has_arg = 1, .val = 's'},
+		{.name = "clones", .has_arg = 1, .val = 'k'},
+		{.name = "rounds", .has_arg = 1, .val = 'r'},
+		{.name = "fanout", .has_arg = 1, .val = 'F'},
+		{.name = "port", .has_arg = 1, .val = 'p'},
+		{}
+	};
+	
+	while (1) {
+		int c = getopt_long(argc, argv, "n:w:h:c:s:k:r:F:p:", long_options, NULL);
+		if (c == -1)
+			break;
+	
+		switch (c) {
+		case 'n':
+			cfg->nodes = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			cfg->workers = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+			cfg->hops = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			cfg->concurrency = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			if (parse_sizes(cfg, optarg) != 0) {
+				return -1;
+			}
+			break;
+		case 'k':
+			cfg->clones = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			cfg->clone_rounds = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			cfg->clone_fanout = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			cfg->base_port = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return -1;
+		}
+	}
+	
+	if ((cfg->nodes < 2) || (cfg->nodes > BENCH_MAX_NODES) || (cfg->hops == 0) || (cfg->concurrency == 0)) {
+		return -1;
+	}
+	
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_config cfg = {
+		.nodes = 2, .workers = 1, .hops = 10000, .concurrency = 1, .clones = 8, .clone_rounds = 20,
+		.clone_fanout = 0, .base_port = 17000, .num_sizes = 5, .sizes = {0, 1024, 4096, 16384, 32768}
+	};
+	uint64_t max_samples;
+	int ret = 0;
+	
+	if (parse_bench_config(&cfg, argc, argv) != 0) {
+		printf("usage: %s [-n nodes] [-w workers] [-h hops] [-c concurrent vms] [-s size,size,...] "
+			"[-k clones] [-r clone rounds] [-F clone fanout] [-p base port]\n", argv[0]);
+		return 1;
+	}
+	
+	max_samples = (uint64_t)cfg.hops * cfg.concurrency;
+	max_samples = (max_samples > cfg.clones) ? max_samples : cfg.clones;
+	bench_samples = malloc(max_samples * sizeof(uint64_t));
+	if ((bench_samples == NULL) || (register_bench_helpers() != 0)) {
+		printf("Failed to set up the benchmark.\n");
+		return 1;
+	}
+	
+	for (uint32_t idx = 0; idx < cfg.num_sizes; idx++) {
+		ret |= run_ring(&cfg, cfg.sizes[idx]);
+	}
+	
+	if ((cfg.clones != 0) && (cfg.clone_rounds != 0)) {
+		ret |= run_clone(&cfg);
+	}
+	
+	free(bench_samples);
+	return (ret == 0) ? 0 : 1;
+}
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "ebpf_vm_simulator.h"
+#include "ebpf_vm_packet.h"
+
+/*
+ * Runs a program over every packet of a pcap file or of a live interface
+ * and reports the packet rate. Without -f a built in filter counts the
+ * IPv4 TCP packets. -s gives every flow a vm of its own.
+ */
+#define ALU64_IMM(OP, DST, IMM) EBPF_RAW_INSN(EBPF_CLS_ALU64 | (OP) | EBPF_SRC_IS_IMM, (DST), 0, 0, (IMM))
+#define JMP_IMM(OP, DST, IMM, OFF) EBPF_RAW_INSN(EBPF_CLS_JMP | (OP) | EBPF_SRC_IS_IMM, (DST), 0, (OFF), (IMM))
+#define LDX(SIZE, DST, SRC, OFF) EBPF_RAW_INSN(EBPF_CLS_LDX | EBPF_MEM | (SIZE), (DST), (SRC), (OFF), 0)
+#define EXIT() EBPF_RAW_INSN(EBPF_CLS_JMP | EBPF_JMP_OP_EXIT, 0, 0, 0, 0)
+
+/* r0 = ethertype == IPv4 && protocol == TCP, the ethertype is read in host order */
+static const struct ebpf_instruction code_ipv4_tcp[] = {
+	ALU64_IMM(EBPF_ALU_OP_MOV, EBPF_REG_RETURN_RESULT, 0),
+	JMP_IMM(EBPF_JMP_OP_JLT, EBPF_REG_ARG2, 34, 5),
+	LDX(EBPF_H, EBPF_REG_ARG3, EBPF_REG_ARG1, 12),
+	JMP_IMM(EBPF_JMP_OP_JNE, EBPF_REG_ARG3, 0x0008, 3),
+	LDX(EBPF_B, EBPF_REG_ARG3, EBPF_REG_ARG1, 23),
+	JMP_IMM(EBPF_JMP_OP_JNE, EBPF_REG_ARG3, 6, 1),
+	ALU64_IMM(EBPF_ALU_OP_MOV, EBPF_REG_RETURN_RESULT, 1),
+	EXIT()
+};
+
+struct bench_config {
+	struct vm_packet_config pkt;
+	const char *prog_file;
+	uint32_t seconds;
+};
+
+static struct vm_packet_runner *bench_runner;
+
+static void stop_runner(int sig)
+{
+	if (bench_runner != NULL) {
+		vm_packet_stop(bench_runner);
+	}
+}
+
+static int parse_bench_config(struct bench_config *cfg, int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{.name = "ebpf-program", .has_arg = 1, .val = 'f'},
+		{.name = "pcap", .has_arg = 1, .val = 'r'},
+		{.name = "interface", .has_arg = 1, .val = 'i'},
+		{.name = "batch", .has_arg = 1, .val = 'b'},
+		{.name = "repeat", .has_arg = 1, .val = 'n'},
+		{.name = "count", .has_arg = 1, .val = 'c'},
+		{.name = "time", .has_arg = 1, .val = 't'},
+		{.name = "block-size", .has_arg = 1, .val = 'B'},
+		{.name = "blocks", .has_arg = 1, .val = 'N'},
+		{.name = "fanout", .has_arg = 1, .val = 'F'},
+		{.name = "flow-slots", .has_arg = 1, .val = 's'},
+		{.name = "flow-timeout", .has_arg = 1, .val = 'T'},
+		{}
+	};
+	
+	while (1) {
+		int c = getopt_long(argc, argv, "f:r:i:b:n:c:t:B:N:F:s:T:", long_options, NULL);
+		if (c == -1)
+			break;
+	
+		switch (c) {
+		case 'f':
+			cfg->prog_file = optarg;
+			break;
+		case 'r':
+			cfg->pkt.source = VM_PKT_SOURCE_PCAP;
+			cfg->pkt.name = optarg;
+			break;
+		case 'i':
+			cfg->pkt.source = VM_PKT_SOURCE_AF_PACKET;
+			cfg->pkt.name = optarg;
+			break;
+		case 'b':
+			cfg->pkt.batch_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			cfg->pkt.repeat = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			cfg->pkt.max_packets = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			cfg->seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			cfg->pkt.block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'N':
+			cfg->pkt.block_num = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			cfg->pkt.fanout_group = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			cfg->pkt.flow_slots = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			cfg->pkt.flow_timeout_ms = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return -1;
+		}
+	}
+	
+	return (cfg->pkt.name != NULL) ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_config cfg = {0};
+	struct ebpf_vm_program *prog = NULL;
+	
+	if (parse_bench_config(&cfg, argc, argv) != 0) {
+		printf("usage: %s (-r file.pcap [-n repeat] | -i interface [-B block size] [-N blocks] [-F fanout group]) "
+			"[-f program.o] [-b batch] [-c count] [-t seconds] [-s flow slots [-T flow timeout ms]]\n", argv[0]);
+		return 1;
+	}
+	
+	prog = (cfg.prog_file != NULL) ? create_program_from_elf(cfg.prog_file) :
+		create_program((const uint8_t *)code_ipv4_tcp, sizeof(code_ipv4_tcp), 0);
+	if (prog == NULL) {
+		printf("Failed to load the program.\n");
+		return 1;
+	}
+	
+	bench_runner = vm_packet_open(prog, &cfg.pkt);
+	if (bench_runner == NULL) {
+		destroy_program(prog);
+		return 1;
+	}
+	
+	signal(SIGINT, stop_runner);
+	if (cfg.seconds != 0) {
+		signal(SIGALRM, stop_runner);
+		alarm(cfg.seconds);
+	}
+	
+	(void)vm_packet_run(bench_runner);
+	vm_packet_report(bench_runner, stdout);
+	vm_packet_close(bench_runner);
+	destroy_program(prog);
+	return 0;
+}